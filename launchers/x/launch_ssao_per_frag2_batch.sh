@@ -0,0 +1,9 @@
+#!/bin/sh
+SHADER_PATH=$HOME/projects/ssao/src/shaders
+SHADING=ao
+VSHADER=$SHADER_PATH/ssao_trace_per_frag2_optimal.vert
+FSHADER=$SHADER_PATH/ssao_trace_per_frag2_optimal.frag
+# off-screen rendering of 120 frames orbiting around the model, written to frame_NNNN.png;
+# pass a camera path recorded with the 'z' key with -cameraPath saved_animation.path
+# headless: run under Xvfb, e.g. xvfb-run -s "-screen 0 1920x1080x24" ./launch_ssao_per_frag2_batch.sh model.osg
+./ssao -vert $VSHADER -frag $FSHADER -mrt -shade $SHADING -dRadius .06 -maxRadius 32 -stepMul 1.0 -maxNumSamples 16 -occFact 1 -batch 120 -outWidth 1920 -outHeight 1080 -out frame -outFormat png $1 $2
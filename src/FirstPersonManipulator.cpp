@@ -18,6 +18,8 @@
 
 #include <osg/io_utils>
 
+#include <cassert>
+
 #ifndef M_PI
 # define M_PI       3.14159265358979323846  /* pi */
 #endif
@@ -25,6 +27,7 @@
 using namespace osgGA;
 
 FirstPersonManipulator::FirstPersonManipulator(bool grounded):
+            _intersectTraversalMask(0xffffffff),
             _t0(0.0),
             _shift(false),
             _jump(false),
@@ -48,6 +51,7 @@ FirstPersonManipulator::FirstPersonManipulator(bool grounded):
     _homeUp = _upwardDirection;
     _x=0;
     _y=0;
+    _clearHitCache();
     _stop();
     home(0);
 }
@@ -58,6 +62,14 @@ FirstPersonManipulator::~FirstPersonManipulator()
 
 bool FirstPersonManipulator::intersect(const osg::Vec3d& start, const osg::Vec3d& end, osg::Vec3d& intersection) const
 {
+    if (_bvh.valid())
+    {
+        const SceneBVH::Hit hit = _bvh->Intersect(SceneBVH::Ray(start, end - start));
+        if (!hit.Valid()) return false;
+        intersection = start + (end - start) * hit.t;
+        return true;
+    }
+
     osg::ref_ptr<osgUtil::LineSegmentIntersector> lsi = new osgUtil::LineSegmentIntersector(start,end);
 
     osgUtil::IntersectionVisitor iv(lsi.get());
@@ -73,6 +85,63 @@ bool FirstPersonManipulator::intersect(const osg::Vec3d& start, const osg::Vec3d
     return false;
 }
 
+void FirstPersonManipulator::intersect(unsigned int numSegments, const osg::Vec3d* start, const osg::Vec3d* end,
+                                       osg::Vec3d* intersections, bool* hits, int* hitCache) const
+{
+    if (_bvh.valid())
+    {
+        std::vector<SceneBVH::Ray> rays(numSegments);
+        std::vector<SceneBVH::Hit> bvhHits(numSegments);
+        for (unsigned int i = 0; i < numSegments; ++i)
+            rays[i] = SceneBVH::Ray(start[i], end[i] - start[i]);
+        _bvh->Intersect(&rays[0], &bvhHits[0], int(numSegments), hitCache);
+        for (unsigned int i = 0; i < numSegments; ++i)
+        {
+            hits[i] = bvhHits[i].Valid();
+            if (hits[i])
+                intersections[i] = start[i] + (end[i] - start[i]) * bvhHits[i].t;
+            if (hitCache)
+                hitCache[i] = bvhHits[i].instance;
+        }
+    }
+    else
+    {
+        // one visitor for all the segments: a subgraph is skipped as soon as its
+        // bounding sphere misses every segment
+        osg::ref_ptr<osgUtil::IntersectorGroup> group = new osgUtil::IntersectorGroup;
+        std::vector< osg::ref_ptr<osgUtil::LineSegmentIntersector> > lsi(numSegments);
+        for (unsigned int i = 0; i < numSegments; ++i)
+        {
+            lsi[i] = new osgUtil::LineSegmentIntersector(start[i], end[i]);
+            group->addIntersector(lsi[i].get());
+        }
+
+        osgUtil::IntersectionVisitor iv(group.get());
+        iv.setTraversalMask(_intersectTraversalMask);
+
+        _node->accept(iv);
+
+        for (unsigned int i = 0; i < numSegments; ++i)
+        {
+            hits[i] = lsi[i]->containsIntersections();
+            if (hits[i])
+                intersections[i] = lsi[i]->getIntersections().begin()->getWorldIntersectPoint();
+        }
+    }
+
+#ifdef SCENE_BVH_VERIFY
+    // the batched query, hinted with the previous hits, must find what one
+    // unhinted query per segment finds
+    for (unsigned int i = 0; i < numSegments; ++i)
+    {
+        osg::Vec3d ip;
+        const bool hit = intersect(start[i], end[i], ip);
+        assert(hit == hits[i]);
+        assert(!hit || (ip - intersections[i]).length() <= 1e-5 * (end[i] - start[i]).length());
+    }
+#endif
+}
+
 void FirstPersonManipulator::setNode( osg::Node *node )
 {
     _node = node;
@@ -135,8 +204,8 @@ osg::Matrixd FirstPersonManipulator::getInverseMatrix() const
     return (_inverseMatrix );
 }
 
-bool
-FirstPersonManipulator::intersectDownWard(osg::Vec3d& intersection, bool atNodeCenter)
+void
+FirstPersonManipulator::downWardSegment(bool atNodeCenter, osg::Vec3& center, osg::Vec3& A, osg::Vec3& B) const
 {
     osg::BoundingSphere bs = _node->getBound();
 
@@ -146,38 +215,47 @@ FirstPersonManipulator::intersectDownWard(osg::Vec3d& intersection, bool atNodeC
        * horizontal center, that intersects the database closest to zero. */
 
 
-    osg::Vec3 center= _position;
+    center= _position;
     if(atNodeCenter)
         center = bs.center();
     else
         center[2]=bs.center()[2];
-    osg::Vec3 A = center + (_upwardDirection*(bs.radius()*2));
-    osg::Vec3 B = center + (-_upwardDirection*(bs.radius()*2));
+    A = center + (_upwardDirection*(bs.radius()*2));
+    B = center + (-_upwardDirection*(bs.radius()*2));
+}
+
+osg::Vec3d
+FirstPersonManipulator::groundPosition(const osg::Vec3& center, const osg::Vec3d& ip) const
+{
+    // start with it high
+    double ground = _node->getBound().radius() * 3;
+
+    double d = ip*_upwardDirection;
+    if( d < ground )
+        ground = d;
+
+    return osg::Vec3d(center + _upwardDirection*( ground + _minHeightAboveGround ) );
+}
+
+bool
+FirstPersonManipulator::intersectDownWard(osg::Vec3d& intersection, bool atNodeCenter)
+{
+    osg::Vec3 center, A, B;
+    downWardSegment(atNodeCenter, center, A, B);
 
     if( (B-A).length() == 0.0)
     {
         return false;
     }
 
-    // start with it high
-    double ground = bs.radius() * 3;
-
     osg::Vec3d ip;
-    if (intersect(A, B, ip))
-    {
-        double d = ip*_upwardDirection;
-        if( d < ground )
-            ground = d;
-    }
-    else
+    if (!intersect(A, B, ip))
     {
         //osg::notify(osg::WARN)<<"FirstPersonManipulator : I can't find the ground!"<<std::endl;
-        ground = 0.0;
         return false;
     }
 
-
-    intersection = osg::Vec3d(center + _upwardDirection*( ground + _minHeightAboveGround ) );
+    intersection = groundPosition(center, ip);
     return true;
 }
 
@@ -527,25 +605,50 @@ void FirstPersonManipulator::_frame( const osgGA::GUIEventAdapter &ea, osgGA::GU
     } 
 }
 
+void FirstPersonManipulator::_verticalSegments(osg::Vec3d* start, osg::Vec3d* end, osg::Vec3& groundCenter) const
+{
+    // below, above and the ground fallback, indexed from BELOW; the segment
+    // above is twice as long to cover the adjustment made by the check below
+    start[0] = _position;
+    end[0] = _position - _upwardDirection*_minHeightAboveGround*2.f;
+    start[1] = _position;
+    end[1] = _position + _upwardDirection*_minHeightAboveGround*2.f;
+    osg::Vec3 A, B;
+    downWardSegment(false, groundCenter, A, B);
+    start[2] = A;
+    end[2] = B;
+}
+
 void FirstPersonManipulator::_adjustPosition()
 {
     if( !_node.valid() )
         return;
 
-    // Forward line segment at 3 times our intersect distance
+    // All the collision segments are intersected in a single query. The
+    // vertical segments start from the position adjusted by the horizontal
+    // checks: they are queried again only if a horizontal check moved us.
+    osg::Vec3d start[NUM_COLLISION_SEGMENTS];
+    osg::Vec3d end[NUM_COLLISION_SEGMENTS];
+    osg::Vec3d ips[NUM_COLLISION_SEGMENTS];
+    bool hits[NUM_COLLISION_SEGMENTS];
 
+    osg::Vec3d bottomPosition = _position + _upwardDirection*0.8*_minHeightAboveGround;
+    start[FRONT] = start[BACK] = start[RIGHT] = start[LEFT] = bottomPosition;
+    end[FRONT] = bottomPosition + (_forwardDirection * (_minDistanceInFront * 1.1f));
+    end[BACK] = bottomPosition - (_forwardDirection * (_minDistanceInFront * 1.1f));
+    end[RIGHT] = bottomPosition + (_sideDirection * (_minDistanceAside * 1.f));
+    end[LEFT] = bottomPosition - (_sideDirection * (_minDistanceAside * 1.f));
+    osg::Vec3 groundCenter;
+    _verticalSegments(start + BELOW, end + BELOW, groundCenter);
 
-    typedef std::vector<osg::Vec3d> Intersections;
-    Intersections intersections;
+    intersect(NUM_COLLISION_SEGMENTS, start, end, ips, hits, _hitCache);
+
+    const osg::Vec3d horizontalStart = _position;
 
     // Check intersects infront.
-    osg::Vec3d ip;
-    osg::Vec3d bottomPosition = _position + _upwardDirection*0.8*_minHeightAboveGround;
-    if (intersect(bottomPosition, 
-                  bottomPosition + (_forwardDirection * (_minDistanceInFront * 1.1f)),
-                  ip ))
+    if (hits[FRONT])
     {
-        double d = (ip - bottomPosition).length();
+        double d = (ips[FRONT] - bottomPosition).length();
 
         if( d < _minDistanceInFront )
         {
@@ -556,11 +659,9 @@ void FirstPersonManipulator::_adjustPosition()
     }
     
     // Check intersects behind.
-    if (intersect(bottomPosition, 
-                  bottomPosition - (_forwardDirection * (_minDistanceInFront * 1.1f)),
-                  ip ))
+    if (hits[BACK])
     {
-        double d = (ip - bottomPosition).length();
+        double d = (ips[BACK] - bottomPosition).length();
 
         if( d < _minDistanceInFront )
         {
@@ -571,11 +672,9 @@ void FirstPersonManipulator::_adjustPosition()
     }
 
     // Check intersects right.
-    if (intersect(bottomPosition, 
-                  bottomPosition + (_sideDirection * (_minDistanceAside * 1.f)),
-                  ip ))
+    if (hits[RIGHT])
     {
-        double d = (ip - bottomPosition).length();
+        double d = (ips[RIGHT] - bottomPosition).length();
 
         if( d < _minDistanceAside )
         {
@@ -586,11 +685,9 @@ void FirstPersonManipulator::_adjustPosition()
     }
     
     // Check intersects left.
-    if (intersect(bottomPosition, 
-                  bottomPosition - (_sideDirection * (_minDistanceAside * 1.f)),
-                  ip ))
+    if (hits[LEFT])
     {
-        double d = (ip - bottomPosition).length();
+        double d = (ips[LEFT] - bottomPosition).length();
 
         if( d < _minDistanceAside )
         {
@@ -599,13 +696,19 @@ void FirstPersonManipulator::_adjustPosition()
                 _sideSpeed=0;
         }
     }
+
+    if (_position != horizontalStart)
+    {
+        _verticalSegments(start + BELOW, end + BELOW, groundCenter);
+        intersect(NUM_COLLISION_SEGMENTS - BELOW, start + BELOW, end + BELOW, ips + BELOW, hits + BELOW, _hitCache + BELOW);
+    }
     
     // Check intersects below.
 
-    if (intersect(_position, 
-                  _position - _upwardDirection*_minHeightAboveGround*2.f, 
-                  ip ))
+    bool lost=false;
+    if (hits[BELOW])
     {
+        osg::Vec3d ip = ips[BELOW];
         double d = (ip - _position).length();
 
         if( d <= _minHeightAboveGround*1 )
@@ -625,10 +728,10 @@ void FirstPersonManipulator::_adjustPosition()
     }
     else if(_grounded)
     {
-        osg::Vec3d pos;
         bool aboveGround=false;
-        if(intersectDownWard(pos,false))
+        if(hits[DOWNWARD] && (end[DOWNWARD]-start[DOWNWARD]).length() != 0.0)
         {
+            osg::Vec3d pos = groundPosition(groundCenter, ips[DOWNWARD]);
             double d=(_position-pos)*_upwardDirection;
             if(d>0)
             {
@@ -641,14 +744,22 @@ void FirstPersonManipulator::_adjustPosition()
         {
             std::cout<<"you are lost in space!"<<std::endl;
             home(0);
+            lost=true;
         }
     }
     
     // Check intersects above.
 
-    if (intersect(_position, 
-                  _position + _upwardDirection*_minHeightAboveGround*1.f, 
-                  ip ))
+    // the segment above starts where the check below left us: the hit found
+    // from the unadjusted position is valid only if it lies beyond that
+    const double lift = (_position - start[ABOVE])*_upwardDirection;
+    osg::Vec3d ip = ips[ABOVE];
+    bool hitAbove = hits[ABOVE];
+    if (lost || (hitAbove && (ip - start[ABOVE]).length() < lift))
+        hitAbove = intersect(_position, 
+                             _position + _upwardDirection*_minHeightAboveGround*1.f, 
+                             ip );
+    if (hitAbove)
     {
         double d = (ip - _position).length();
 
@@ -16,14 +16,19 @@
 
 #include <iostream>
 
-#include <osgGA/MatrixManipulator>
+#include <osgGA/CameraManipulator>
 #include <osg/Node>
 #include <osg/Matrix>
 
+#include "scene_bvh.h"
+
 /**
-   \class osgGA::FirstPersonManipulator
+   \class FirstPersonManipulator
    \brief A FirstPerson manipulator driven with keybindings.
 
+   Declared outside of the osgGA namespace: osgGA has its own, unrelated,
+   FirstPersonManipulator.
+
    The FirstPersonManipulator is better suited for applications that employ architectural walk-throughs.
    The camera control is done via keyboard arrows concerning the position and via mouse draging concerning the orientation.
    There are two modes : the GROUNDED and the FREE one. In the free one the translation direction is exactly aligned with the view
@@ -47,13 +52,7 @@
    \param PageDown         Switch between GROUNDED and FREE mode.
    \param DragMouse        Rotate the moving and looking direction.
 */
-#undef OSGGA_EXPORT
-#define OSGGA_EXPORT
-
-
-namespace osgGA {
-
-    class OSGGA_EXPORT FirstPersonManipulator : public osgGA::MatrixManipulator
+    class FirstPersonManipulator : public osgGA::CameraManipulator
     {
 
     public:
@@ -100,7 +99,7 @@ namespace osgGA {
         virtual void home(const osgGA::GUIEventAdapter&, osgGA::GUIActionAdapter&) ;
         void home(double);
 
-        virtual void init(const GUIEventAdapter& ,GUIActionAdapter&);
+        virtual void init(const osgGA::GUIEventAdapter& ,osgGA::GUIActionAdapter&);
 
         /** Handles incoming osgGA events */
         bool handle(const osgGA::GUIEventAdapter& ea,osgGA::GUIActionAdapter &aa);
@@ -124,6 +123,16 @@ namespace osgGA {
         void setSideSpeed( double in_ss ) { _sideSpeed = in_ss; }
         double getSideSpeed() const { return _sideSpeed; }
 
+        /** Answer collision queries with a bounding volume hierarchy of the
+          * manipulator node instead of traversing the scene graph; the
+          * hierarchy traversal mask replaces the intersect traversal mask. */
+        void setSceneBVH( SceneBVH* bvh ) { _bvh = bvh; _clearHitCache(); }
+        SceneBVH* getSceneBVH() const { return _bvh.get(); }
+
+        /** Mask of the nodes intersected when no hierarchy is set. */
+        void setIntersectTraversalMask( unsigned int mask ) { _intersectTraversalMask = mask; }
+        unsigned int getIntersectTraversalMask() const { return _intersectTraversalMask; }
+
 
 
     protected:
@@ -131,9 +140,20 @@ namespace osgGA {
         virtual ~FirstPersonManipulator();
 
         bool intersect(const osg::Vec3d& start, const osg::Vec3d& end, osg::Vec3d& intersection) const;
+        /** Intersect several segments in a single traversal of the scene (a
+          * single query of the bounding volume hierarchy, if set): hits[i]
+          * tells whether segment i intersects the scene. hitCache, if not null,
+          * holds per segment the instance hit by the previous query, tested
+          * first, and is updated with the instances hit by this query. */
+        void intersect(unsigned int numSegments, const osg::Vec3d* start, const osg::Vec3d* end,
+                       osg::Vec3d* intersections, bool* hits, int* hitCache=0) const;
         bool intersectDownWard(osg::Vec3d& intersection, bool atNodeCenter=true);
+        void downWardSegment(bool atNodeCenter, osg::Vec3& center, osg::Vec3& A, osg::Vec3& B) const;
+        osg::Vec3d groundPosition(const osg::Vec3& center, const osg::Vec3d& ip) const;
         
         osg::ref_ptr<osg::Node> _node;
+        osg::ref_ptr<SceneBVH> _bvh;
+        unsigned int _intersectTraversalMask;
         osg::Matrixd _matrix;
         osg::Matrixd _inverseMatrix;
 
@@ -169,6 +189,10 @@ namespace osgGA {
 
         bool _grounded;
 
+        /** Collision segments of _adjustPosition, all intersected at once. */
+        enum CollisionSegment { FRONT, BACK, RIGHT, LEFT, BELOW, ABOVE, DOWNWARD, NUM_COLLISION_SEGMENTS };
+        int _hitCache[NUM_COLLISION_SEGMENTS];
+
         void _stop();
         void _keyDown( const osgGA::GUIEventAdapter &ea, osgGA::GUIActionAdapter &);
         void _keyUp( const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter &);
@@ -176,8 +200,8 @@ namespace osgGA {
         void _frame(const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter &);
 
         void _adjustPosition();
+        void _verticalSegments(osg::Vec3d* start, osg::Vec3d* end, osg::Vec3& groundCenter) const;
+        void _clearHitCache() { for( int i = 0; i < NUM_COLLISION_SEGMENTS; ++i ) _hitCache[i] = -1; }
     };
 
-}
-
 #endif
@@ -0,0 +1,200 @@
+#include "ao_cache.h"
+
+#include <set>
+#include <cmath>
+#include <algorithm>
+
+#include <osg/NodeVisitor>
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/StateSet>
+#include <osg/Viewport>
+
+namespace
+{
+
+//------------------------------------------------------------------------------
+/// Assign consecutive cache ranges to the geometries; state sets shared by
+/// several geometries are copied so that each geometry gets its own offset.
+/// Geometries shared by several geodes are replaced with shallow copies,
+/// sharing the vertex data, so that each instance gets its own range; geodes
+/// reachable from the root through more than one path are not cached.
+class AOCacheOffsetVisitor : public osg::NodeVisitor
+{
+public:
+    AOCacheOffsetVisitor( osg::Node& root )
+        : osg::NodeVisitor( osg::NodeVisitor::TRAVERSE_ALL_CHILDREN ), numVertices( 0 ), root_( &root ) {}
+    void apply( osg::Geode& geode )
+    {
+        // one cache range per geometry, drawn with several transforms
+        if( geode.getParentalNodePaths( root_ ).size() > 1 ) return;
+        for( unsigned int i = 0; i != geode.getNumDrawables(); ++i )
+        {
+            osg::Geometry* g = geode.getDrawable( i )->asGeometry();
+            if( !g ) continue;
+            if( !geometries_.insert( g ).second )
+            {
+                // instance in another geode
+                osg::ref_ptr< osg::Geometry > copy = new osg::Geometry( *g, osg::CopyOp::SHALLOW_COPY );
+                geode.setDrawable( i, osg::get_pointer( copy ) );
+                g = osg::get_pointer( copy );
+                geometries_.insert( g );
+            }
+            if( !g->getVertexArray() || g->getVertexArray()->getNumElements() == 0 || !g->areFastPathsUsed() ) continue;
+            if( HasLines( *g ) ) continue;
+            osg::StateSet* ss = g->getStateSet();
+            if( ss && !stateSets_.insert( ss ).second )
+            {
+                g->setStateSet( new osg::StateSet( *ss, osg::CopyOp::SHALLOW_COPY ) );
+            }
+            g->getOrCreateStateSet()->addUniform( new osg::Uniform( "aoCacheOffset", numVertices ) );
+            stateSets_.insert( g->getStateSet() );
+            // gl_VertexID is undefined in display lists
+            g->setUseDisplayList( false );
+            g->setUseVertexBufferObjects( true );
+            numVertices += int( g->getVertexArray()->getNumElements() );
+        }
+        traverse( geode );
+    }
+    int numVertices;
+private:
+    // lines would be rasterized between the cache texels of their vertices
+    static bool HasLines( const osg::Geometry& g )
+    {
+        for( unsigned int i = 0; i != g.getNumPrimitiveSets(); ++i )
+        {
+            const GLenum mode = g.getPrimitiveSet( i )->getMode();
+            if( mode == GL_LINES || mode == GL_LINE_STRIP || mode == GL_LINE_LOOP ) return true;
+        }
+        return false;
+    }
+    osg::Node* root_;
+    std::set< osg::Geometry* > geometries_;
+    std::set< osg::StateSet* > stateSets_;
+};
+
+//------------------------------------------------------------------------------
+class TransformCollector : public osg::NodeVisitor
+{
+public:
+    TransformCollector() : osg::NodeVisitor( osg::NodeVisitor::TRAVERSE_ALL_CHILDREN ) {}
+    void apply( osg::Transform& t )
+    {
+        if( visited_.insert( &t ).second ) transforms.push_back( &t );
+        traverse( t );
+    }
+    std::vector< osg::ref_ptr< osg::Transform > > transforms;
+private:
+    std::set< osg::Transform* > visited_;
+};
+
+//------------------------------------------------------------------------------
+osg::Matrixd LocalMatrix( const osg::Transform& t )
+{
+    osg::Matrixd m;
+    t.computeLocalToWorldMatrix( m, 0 );
+    return m;
+}
+
+}
+
+//------------------------------------------------------------------------------
+int AssignAOCacheOffsets( osg::Node& root )
+{
+    AOCacheOffsetVisitor v( root );
+    root.accept( v );
+    return v.numVertices;
+}
+
+//------------------------------------------------------------------------------
+AOCacheSwitch::AOCacheSwitch( osg::Camera* mainCamera, osg::Camera* cacheCamera, osg::Node& model,
+                              const std::vector< osg::Camera* >& traceOnly, float threshold,
+                              const osg::Uniform* viewportUniform )
+    : mainCamera_( mainCamera ), cacheCamera_( cacheCamera ), traceOnly_( traceOnly.begin(), traceOnly.end() ),
+      threshold_( threshold ), radius_( std::max( model.getBound().radius(), 1e-6f ) ), valid_( false ),
+      width_( 0 ), height_( 0 ), viewportUniform_( viewportUniform )
+{
+    TransformCollector tc;
+    model.accept( tc );
+    transforms_ = tc.transforms;
+    matrices_.resize( transforms_.size() );
+}
+
+//------------------------------------------------------------------------------
+/// The uniform list is read at each frame: uniforms added or removed after
+/// construction make the cache stale too. The viewport uniform is set at
+/// every frame: viewport size is compared instead.
+bool AOCacheSwitch::UniformsChanged() const
+{
+    const osg::StateSet::UniformList& ul = mainCamera_->getOrCreateStateSet()->getUniformList();
+    size_t n = 0;
+    for( osg::StateSet::UniformList::const_iterator i = ul.begin(); i != ul.end(); ++i )
+    {
+        const osg::Uniform* u = osg::get_pointer( i->second.first );
+        if( u == osg::get_pointer( viewportUniform_ ) ) continue;
+        if( n == uniforms_.size() || uniforms_[ n ] != u || modifiedCounts_[ n ] != u->getModifiedCount() ) return true;
+        ++n;
+    }
+    return n != uniforms_.size();
+}
+
+//------------------------------------------------------------------------------
+void AOCacheSwitch::RecordUniforms()
+{
+    uniforms_.clear();
+    modifiedCounts_.clear();
+    const osg::StateSet::UniformList& ul = mainCamera_->getOrCreateStateSet()->getUniformList();
+    for( osg::StateSet::UniformList::const_iterator i = ul.begin(); i != ul.end(); ++i )
+    {
+        const osg::Uniform* u = osg::get_pointer( i->second.first );
+        if( u == osg::get_pointer( viewportUniform_ ) ) continue;
+        uniforms_.push_back( u );
+        modifiedCounts_.push_back( u->getModifiedCount() );
+    }
+}
+
+//------------------------------------------------------------------------------
+bool AOCacheSwitch::Changed( const osg::Matrixd& a, const osg::Matrixd& b ) const
+{
+    for( int r = 0; r != 4; ++r )
+    {
+        for( int c = 0; c != 4; ++c )
+        {
+            const double scale = r == 3 && c != 3 ? radius_ : 1.0;
+            if( std::fabs( a( r, c ) - b( r, c ) ) > threshold_ * scale ) return true;
+        }
+    }
+    return false;
+}
+
+//------------------------------------------------------------------------------
+void AOCacheSwitch::Enable( bool on )
+{
+    const osg::Node::NodeMask mask = on ? ~0u : 0u;
+    cacheCamera_->setNodeMask( mask );
+    for( size_t i = 0; i != traceOnly_.size(); ++i ) traceOnly_[ i ]->setNodeMask( mask );
+}
+
+//------------------------------------------------------------------------------
+void AOCacheSwitch::Update()
+{
+    const osg::Viewport* vp = mainCamera_->getViewport();
+    bool stale = !valid_
+                 || int( vp->width() ) != width_ || int( vp->height() ) != height_
+                 || Changed( mainCamera_->getViewMatrix(), view_ )
+                 || Changed( mainCamera_->getProjectionMatrix(), projection_ );
+    for( size_t i = 0; i != transforms_.size() && !stale; ++i ) stale = Changed( LocalMatrix( *transforms_[ i ] ), matrices_[ i ] );
+    stale = stale || UniformsChanged();
+    Enable( stale );
+    if( !stale ) return;
+    // the cache is traced in this frame with the current state
+    cacheCamera_->setViewMatrix( mainCamera_->getViewMatrix() );
+    cacheCamera_->setProjectionMatrix( mainCamera_->getProjectionMatrix() );
+    view_ = mainCamera_->getViewMatrix();
+    projection_ = mainCamera_->getProjectionMatrix();
+    width_ = int( vp->width() );
+    height_ = int( vp->height() );
+    for( size_t i = 0; i != transforms_.size(); ++i ) matrices_[ i ] = LocalMatrix( *transforms_[ i ] );
+    RecordUniforms();
+    valid_ = true;
+}
@@ -0,0 +1,74 @@
+#ifndef AO_CACHE_H_
+#define AO_CACHE_H_
+
+#include <vector>
+
+#include <osg/Referenced>
+#include <osg/Node>
+#include <osg/Camera>
+#include <osg/Transform>
+#include <osg/Uniform>
+#include <osg/Matrixd>
+
+/// Width of the per vertex occlusion cache texture: vertex i of a geometry
+/// whose 'aoCacheOffset' uniform is o is stored in texel
+/// ( ( o + i ) % AO_CACHE_WIDTH, ( o + i ) / AO_CACHE_WIDTH ).
+static const int AO_CACHE_WIDTH = 4096;
+
+//------------------------------------------------------------------------------
+/// Assign to each geometry under 'root' a range of texels in the per vertex
+/// occlusion cache through the int 'aoCacheOffset' uniform of its state set;
+/// returns the total number of cached vertices.
+/// Vertices are identified by gl_VertexID: geometries are switched to vertex
+/// buffer objects; geometries that cannot be drawn through vertex arrays
+/// (per primitive bindings, vertex indices) or containing lines are not
+/// cached and keep full visibility. Geometries shared by several geodes are
+/// replaced in all but one geode with shallow copies, each with its own
+/// range; geodes drawn through more than one path from 'root' (e.g. under
+/// several transforms) are not cached and keep full visibility.
+int AssignAOCacheOffsets( osg::Node& root );
+
+//------------------------------------------------------------------------------
+/// Enable the camera tracing per vertex occlusion into the cache only when the
+/// cached values are stale: the view or projection matrix or the matrix of a
+/// transform under the model (e.g. dragged with a manipulator) changed by
+/// more than 'threshold', the viewport changed size or one of the occlusion
+/// uniforms of the main camera state set was modified, added or removed; matrix
+/// translations are compared relative to the model radius.
+/// Cameras in 'traceOnly' (e.g. the depth pre-render camera when the shading
+/// pass does not read the G-buffer) are enabled together with the cache
+/// camera.
+/// Must be updated once per frame after the update traversal.
+class AOCacheSwitch
+{
+public:
+    AOCacheSwitch( osg::Camera* mainCamera, osg::Camera* cacheCamera, osg::Node& model,
+                   const std::vector< osg::Camera* >& traceOnly, float threshold,
+                   const osg::Uniform* viewportUniform );
+    void Update();
+    /// Force occlusion to be traced again in the next frame.
+    void Invalidate() { valid_ = false; }
+private:
+    bool Changed( const osg::Matrixd& a, const osg::Matrixd& b ) const;
+    bool UniformsChanged() const;
+    void RecordUniforms();
+    void Enable( bool on );
+    osg::ref_ptr< osg::Camera > mainCamera_;
+    osg::ref_ptr< osg::Camera > cacheCamera_;
+    std::vector< osg::ref_ptr< osg::Camera > > traceOnly_;
+    float threshold_;
+    float radius_;
+    bool valid_;
+    // state the cache was traced with
+    osg::Matrixd view_;
+    osg::Matrixd projection_;
+    int width_;
+    int height_;
+    std::vector< osg::ref_ptr< osg::Transform > > transforms_;
+    std::vector< osg::Matrixd > matrices_;
+    osg::ref_ptr< const osg::Uniform > viewportUniform_;
+    std::vector< osg::ref_ptr< const osg::Uniform > > uniforms_;
+    std::vector< unsigned int > modifiedCounts_;
+};
+
+#endif // AO_CACHE_H_
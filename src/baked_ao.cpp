@@ -0,0 +1,143 @@
+#include "baked_ao.h"
+
+#include <set>
+#include <fstream>
+#include <stdexcept>
+#include <cstring>
+
+#include <osg/NodeVisitor>
+#include <osg/Geode>
+#include <osg/Array>
+#include <osg/Transform>
+
+namespace
+{
+/// Sidecar file layout, native endianness: magic, number of geometries, then
+/// for each geometry the number of vertices followed by the visibility values.
+const char BAKED_AO_MAGIC[ 8 ] = { 'S', 'S', 'A', 'O', 'B', 'A', 'K', '1' };
+
+//------------------------------------------------------------------------------
+class BakedAOGeometryCollector : public osg::NodeVisitor
+{
+public:
+    BakedAOGeometryCollector( std::vector< osg::Matrixd >* m )
+        : osg::NodeVisitor( osg::NodeVisitor::TRAVERSE_ALL_CHILDREN ), matrices( m ) {}
+    void apply( osg::Geode& geode )
+    {
+        for( unsigned int i = 0; i != geode.getNumDrawables(); ++i )
+        {
+            osg::Geometry* g = geode.getDrawable( i )->asGeometry();
+            if( !g || !g->getVertexArray() || g->getVertexArray()->getNumElements() == 0 ) continue;
+            if( !visited_.insert( g ).second ) continue;
+            geometries.push_back( g );
+            if( matrices ) matrices->push_back( osg::computeLocalToWorld( getNodePath() ) );
+        }
+        traverse( geode );
+    }
+    std::vector< osg::Geometry* > geometries;
+    std::vector< osg::Matrixd >* matrices;
+private:
+    std::set< osg::Geometry* > visited_;
+};
+
+//------------------------------------------------------------------------------
+/// Check that the baked data was computed for the geometries of the scene.
+std::vector< osg::Geometry* > MatchGeometries( osg::Node& root, const BakedAO& ao )
+{
+    std::vector< osg::Geometry* > geometries = CollectBakedAOGeometries( root );
+    if( geometries.size() != ao.size() ) throw std::runtime_error( "Baked occlusion does not match the scene" );
+    for( size_t i = 0; i != geometries.size(); ++i )
+    {
+        if( geometries[ i ]->getVertexArray()->getNumElements() != ao[ i ].size() )
+            throw std::runtime_error( "Baked occlusion does not match the scene" );
+    }
+    return geometries;
+}
+
+osg::Vec4 Color( const osg::Geometry& g, size_t v )
+{
+    const osg::Vec4Array* c = dynamic_cast< const osg::Vec4Array* >( g.getColorArray() );
+    if( !c || c->empty() ) return osg::Vec4( 1.0f, 1.0f, 1.0f, 1.0f );
+    if( g.getColorBinding() == osg::Geometry::BIND_PER_VERTEX && v < c->size() ) return ( *c )[ v ];
+    return ( *c )[ 0 ];
+}
+}
+
+//------------------------------------------------------------------------------
+std::vector< osg::Geometry* > CollectBakedAOGeometries( osg::Node& root, std::vector< osg::Matrixd >* worldMatrices )
+{
+    BakedAOGeometryCollector c( worldMatrices );
+    root.accept( c );
+    return c.geometries;
+}
+
+//------------------------------------------------------------------------------
+void WriteBakedAO( const std::string& fileName, const BakedAO& ao )
+{
+    std::ofstream os( fileName.c_str(), std::ios::binary );
+    if( !os ) throw std::runtime_error( "Cannot open " + fileName );
+    os.write( BAKED_AO_MAGIC, sizeof( BAKED_AO_MAGIC ) );
+    const unsigned int numGeometries = static_cast< unsigned int >( ao.size() );
+    os.write( reinterpret_cast< const char* >( &numGeometries ), sizeof( numGeometries ) );
+    for( BakedAO::const_iterator i = ao.begin(); i != ao.end(); ++i )
+    {
+        const unsigned int numVertices = static_cast< unsigned int >( i->size() );
+        os.write( reinterpret_cast< const char* >( &numVertices ), sizeof( numVertices ) );
+        if( numVertices ) os.write( reinterpret_cast< const char* >( &( *i )[ 0 ] ), numVertices * sizeof( float ) );
+    }
+    if( !os ) throw std::runtime_error( "Error writing " + fileName );
+}
+
+//------------------------------------------------------------------------------
+BakedAO ReadBakedAO( const std::string& fileName )
+{
+    std::ifstream is( fileName.c_str(), std::ios::binary );
+    if( !is ) throw std::runtime_error( "Cannot open " + fileName );
+    char magic[ sizeof( BAKED_AO_MAGIC ) ];
+    unsigned int numGeometries = 0;
+    is.read( magic, sizeof( magic ) );
+    is.read( reinterpret_cast< char* >( &numGeometries ), sizeof( numGeometries ) );
+    if( !is || std::memcmp( magic, BAKED_AO_MAGIC, sizeof( magic ) ) != 0 )
+        throw std::runtime_error( "Not a baked occlusion file: " + fileName );
+    BakedAO ao;
+    for( unsigned int g = 0; g != numGeometries && is; ++g )
+    {
+        unsigned int numVertices = 0;
+        is.read( reinterpret_cast< char* >( &numVertices ), sizeof( numVertices ) );
+        if( !is ) break;
+        ao.push_back( std::vector< float >( numVertices ) );
+        if( numVertices ) is.read( reinterpret_cast< char* >( &ao.back()[ 0 ] ), numVertices * sizeof( float ) );
+    }
+    if( !is ) throw std::runtime_error( "Truncated baked occlusion file: " + fileName );
+    return ao;
+}
+
+//------------------------------------------------------------------------------
+void ApplyBakedAO( osg::Node& root, const BakedAO& ao )
+{
+    const std::vector< osg::Geometry* > geometries = MatchGeometries( root, ao );
+    for( size_t i = 0; i != geometries.size(); ++i )
+    {
+        osg::Geometry* g = geometries[ i ];
+        g->setVertexAttribArray( BAKED_AO_ATTRIBUTE, new osg::FloatArray( ao[ i ].begin(), ao[ i ].end() ) );
+        g->setVertexAttribBinding( BAKED_AO_ATTRIBUTE, osg::Geometry::BIND_PER_VERTEX );
+    }
+}
+
+//------------------------------------------------------------------------------
+void ApplyBakedAOToColors( osg::Node& root, const BakedAO& ao )
+{
+    const std::vector< osg::Geometry* > geometries = MatchGeometries( root, ao );
+    for( size_t i = 0; i != geometries.size(); ++i )
+    {
+        osg::Geometry* g = geometries[ i ];
+        osg::ref_ptr< osg::Vec4Array > colors = new osg::Vec4Array( ao[ i ].size() );
+        for( size_t v = 0; v != ao[ i ].size(); ++v )
+        {
+            const osg::Vec4 c = Color( *g, v );
+            ( *colors )[ v ] = osg::Vec4( c.r() * ao[ i ][ v ], c.g() * ao[ i ][ v ], c.b() * ao[ i ][ v ], c.a() );
+        }
+        g->setColorArray( osg::get_pointer( colors ) );
+        g->setColorBinding( osg::Geometry::BIND_PER_VERTEX );
+    }
+}
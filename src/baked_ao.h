@@ -0,0 +1,42 @@
+#ifndef BAKED_AO_H_
+#define BAKED_AO_H_
+
+#include <string>
+#include <vector>
+
+#include <osg/Node>
+#include <osg/Geometry>
+#include <osg/Matrixd>
+
+/// Generic vertex attribute index of the baked per vertex visibility; bound
+/// to the 'bakedVisibility' attribute of the shaders compiled with AO_BAKED.
+static const unsigned int BAKED_AO_ATTRIBUTE = 6;
+
+/// Per vertex visibility in [0,1] of each geometry, in the order returned by
+/// CollectBakedAOGeometries.
+typedef std::vector< std::vector< float > > BakedAO;
+
+//------------------------------------------------------------------------------
+/// Return the geometries with vertices under 'root' in traversal order,
+/// each one once; if 'worldMatrices' is not NULL it receives the local to
+/// world matrix of the first instance of each geometry.
+std::vector< osg::Geometry* > CollectBakedAOGeometries( osg::Node& root, std::vector< osg::Matrixd >* worldMatrices = 0 );
+
+/// Write baked visibility to a sidecar file; throws std::runtime_error on failure.
+void WriteBakedAO( const std::string& fileName, const BakedAO& ao );
+
+/// Read baked visibility from a sidecar file; throws std::runtime_error on failure.
+BakedAO ReadBakedAO( const std::string& fileName );
+
+//------------------------------------------------------------------------------
+/// Add baked visibility as vertex attribute BAKED_AO_ATTRIBUTE of each
+/// geometry; throws std::runtime_error if geometry or vertex counts do not
+/// match the scene.
+void ApplyBakedAO( osg::Node& root, const BakedAO& ao );
+
+/// Multiply the colors of each geometry by the baked visibility, colors
+/// become per vertex; used to export the result in formats without generic
+/// vertex attributes.
+void ApplyBakedAOToColors( osg::Node& root, const BakedAO& ao );
+
+#endif // BAKED_AO_H_
@@ -0,0 +1,226 @@
+#include <osg/GraphicsContext>
+#include <osg/BufferObject>
+#include <osg/Viewport>
+#include <osgDB/WriteFile>
+#include <osgDB/FileNameUtils>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+#include <cmath>
+#include <stdexcept>
+
+#include "batch.h"
+
+//------------------------------------------------------------------------------
+void SetupOffscreenCamera( osg::Camera& camera, int width, int height )
+{
+    osg::ref_ptr< osg::GraphicsContext::Traits > traits = new osg::GraphicsContext::Traits;
+    traits->readDISPLAY();
+    traits->setUndefinedScreenDetailsToDefaultScreen();
+    traits->x = 0;
+    traits->y = 0;
+    traits->width = width;
+    traits->height = height;
+    traits->red = 8;
+    traits->green = 8;
+    traits->blue = 8;
+    traits->alpha = 8;
+    traits->depth = 24;
+    traits->windowDecoration = false;
+    traits->doubleBuffer = false;
+    traits->pbuffer = true;
+    traits->sharedContext = 0;
+    osg::ref_ptr< osg::GraphicsContext > gc = osg::GraphicsContext::createGraphicsContext( osg::get_pointer( traits ) );
+    if( !gc.valid() ) throw std::runtime_error( "Cannot create pbuffer graphics context" );
+    camera.setGraphicsContext( osg::get_pointer( gc ) );
+    camera.setViewport( new osg::Viewport( 0, 0, width, height ) );
+    // same field of view as the default osgViewer window setup
+    camera.setProjectionMatrixAsPerspective( 30.0, double( width ) / height, 1.0, 10000.0 );
+    // single buffered: draw to and read from front buffer
+    camera.setDrawBuffer( GL_FRONT );
+    camera.setReadBuffer( GL_FRONT );
+}
+
+//------------------------------------------------------------------------------
+osg::AnimationPath* CreateBatchCameraPath( const std::string& fileName, const osg::BoundingSphere& bs )
+{
+    osg::ref_ptr< osg::AnimationPath > path = new osg::AnimationPath;
+    if( !fileName.empty() )
+    {
+        std::ifstream is( fileName.c_str() );
+        if( !is ) throw std::runtime_error( "Cannot open camera path file " + fileName );
+        path->read( is );
+        if( path->empty() ) throw std::runtime_error( "Empty camera path " + fileName );
+        path->setLoopMode( osg::AnimationPath::NO_LOOPING );
+        return path.release();
+    }
+    // orbit around z axis starting from the default trackball home position
+    const int STEPS = 36;
+    const double distance = 3.5 * bs.radius();
+    for( int i = 0; i <= STEPS; ++i )
+    {
+        const double a = 2.0 * osg::PI * i / STEPS;
+        const osg::Vec3d eye = osg::Vec3d( bs.center() ) + osg::Vec3d( std::sin( a ), -std::cos( a ), 0.0 ) * distance;
+        const osg::Matrixd m = osg::Matrixd::inverse( osg::Matrixd::lookAt( eye, bs.center(), osg::Vec3d( 0.0, 0.0, 1.0 ) ) );
+        path->insert( double( i ), osg::AnimationPath::ControlPoint( eye, m.getRotate() ) );
+    }
+    path->setLoopMode( osg::AnimationPath::LOOP );
+    return path.release();
+}
+
+//------------------------------------------------------------------------------
+osg::Matrixd GetCameraPathViewMatrix( const osg::AnimationPath& path, int frame, int frames )
+{
+    // looping paths: last control point is the same as the first one
+    const int intervals = path.getLoopMode() == osg::AnimationPath::LOOP ? frames : frames - 1;
+    const double t = intervals > 0 ? path.getFirstTime() + path.getPeriod() * frame / intervals : path.getFirstTime();
+    osg::AnimationPath::ControlPoint cp;
+    path.getInterpolatedControlPoint( t, cp );
+    osg::Matrixd view;
+    cp.getInverse( view );
+    return view;
+}
+
+//------------------------------------------------------------------------------
+ImageWriterThread::ImageWriterThread( unsigned int maxQueueSize )
+    : maxQueueSize_( maxQueueSize ), done_( false ) {}
+
+ImageWriterThread::~ImageWriterThread()
+{
+    if( isRunning() ) Finish();
+}
+
+void ImageWriterThread::Push( osg::Image* image, const std::string& fileName )
+{
+    if( !isRunning() ) start();
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex_ );
+    while( queue_.size() >= maxQueueSize_ ) condition_.wait( &mutex_ );
+    queue_.push_back( Item( image, fileName ) );
+    condition_.broadcast();
+}
+
+void ImageWriterThread::Finish()
+{
+    {
+        OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex_ );
+        done_ = true;
+        condition_.broadcast();
+    }
+    if( isRunning() ) join();
+}
+
+void ImageWriterThread::run()
+{
+    while( true )
+    {
+        Item item;
+        {
+            OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex_ );
+            while( queue_.empty() && !done_ ) condition_.wait( &mutex_ );
+            if( queue_.empty() ) return;
+            item = queue_.front();
+            queue_.pop_front();
+            condition_.broadcast();
+        }
+        const std::string& fileName = item.second;
+        bool ok = false;
+        if( osgDB::getLowerCaseFileExtension( fileName ) == "raw" )
+        {
+            std::ofstream os( fileName.c_str(), std::ios::binary );
+            ok = os.write( reinterpret_cast< const char* >( item.first->data() ),
+                           item.first->getTotalSizeInBytes() ).good();
+        }
+        else ok = osgDB::writeImageFile( *item.first, fileName );
+        if( !ok ) std::cerr << "Cannot write " << fileName << std::endl;
+    }
+}
+
+//------------------------------------------------------------------------------
+FrameRecorder::FrameRecorder( const BatchParameters& bp )
+    : params_( bp ), dataType_( bp.format == "exr" ? GL_FLOAT : GL_UNSIGNED_BYTE ),
+      frame_( -1 ), pboWidth_( 0 ), pboHeight_( 0 ), slot_( 0 )
+{
+    pbo_[ 0 ] = pbo_[ 1 ] = 0;
+    pboFrame_[ 0 ] = pboFrame_[ 1 ] = -1;
+}
+
+void FrameRecorder::operator()( osg::RenderInfo& renderInfo ) const
+{
+    if( frame_ < 0 ) return;
+    const osg::Viewport* vp = renderInfo.getCurrentCamera()->getViewport();
+    const int width = int( vp->width() );
+    const int height = int( vp->height() );
+    const unsigned int contextID = renderInfo.getState()->getContextID();
+    const osg::GLBufferObject::Extensions* ext = osg::GLBufferObject::getExtensions( contextID, true );
+    if( !ext->isPBOSupported() )
+    {
+        // synchronous fallback
+        osg::ref_ptr< osg::Image > image = new osg::Image;
+        image->readPixels( int( vp->x() ), int( vp->y() ), width, height, GL_RGBA, dataType_ );
+        writer_.Push( osg::get_pointer( image ), FrameFileName( frame_ ) );
+        return;
+    }
+    if( width != pboWidth_ || height != pboHeight_ )
+    {
+        // write out pending frame before resizing buffers
+        if( pboFrame_[ 1 - slot_ ] >= 0 ) MapAndWrite( contextID, 1 - slot_ );
+        if( pbo_[ 0 ] == 0 ) ext->glGenBuffers( 2, pbo_ );
+        const int size = width * height * 4 * ( dataType_ == GL_FLOAT ? sizeof( GLfloat ) : sizeof( GLubyte ) );
+        for( int i = 0; i != 2; ++i )
+        {
+            ext->glBindBuffer( GL_PIXEL_PACK_BUFFER_ARB, pbo_[ i ] );
+            ext->glBufferData( GL_PIXEL_PACK_BUFFER_ARB, size, 0, GL_STREAM_READ_ARB );
+        }
+        pboWidth_ = width;
+        pboHeight_ = height;
+    }
+    // start asynchronous transfer of current frame
+    ext->glBindBuffer( GL_PIXEL_PACK_BUFFER_ARB, pbo_[ slot_ ] );
+    glReadPixels( int( vp->x() ), int( vp->y() ), width, height, GL_RGBA, dataType_, 0 );
+    pboFrame_[ slot_ ] = frame_;
+    slot_ = 1 - slot_;
+    // previous frame has been transferred while rendering the current one
+    if( pboFrame_[ slot_ ] >= 0 ) MapAndWrite( contextID, slot_ );
+    // last frame: nothing left to overlap the transfer with
+    if( frame_ == params_.frames - 1 ) MapAndWrite( contextID, 1 - slot_ );
+    ext->glBindBuffer( GL_PIXEL_PACK_BUFFER_ARB, 0 );
+    // last frame: release the buffers while the context is current
+    if( frame_ == params_.frames - 1 )
+    {
+        ext->glDeleteBuffers( 2, pbo_ );
+        pbo_[ 0 ] = pbo_[ 1 ] = 0;
+        pboWidth_ = pboHeight_ = 0;
+    }
+}
+
+void FrameRecorder::Finish()
+{
+    writer_.Finish();
+}
+
+std::string FrameRecorder::FrameFileName( int frame ) const
+{
+    std::ostringstream os;
+    os << params_.outputPrefix << '_' << std::setw( 4 ) << std::setfill( '0' ) << frame << '.' << params_.format;
+    return os.str();
+}
+
+void FrameRecorder::MapAndWrite( unsigned int contextID, int slot ) const
+{
+    const osg::GLBufferObject::Extensions* ext = osg::GLBufferObject::getExtensions( contextID, true );
+    ext->glBindBuffer( GL_PIXEL_PACK_BUFFER_ARB, pbo_[ slot ] );
+    const void* src = ext->glMapBuffer( GL_PIXEL_PACK_BUFFER_ARB, GL_READ_ONLY_ARB );
+    if( src )
+    {
+        osg::ref_ptr< osg::Image > image = new osg::Image;
+        image->allocateImage( pboWidth_, pboHeight_, 1, GL_RGBA, dataType_ );
+        std::memcpy( image->data(), src, image->getTotalSizeInBytes() );
+        ext->glUnmapBuffer( GL_PIXEL_PACK_BUFFER_ARB );
+        writer_.Push( osg::get_pointer( image ), FrameFileName( pboFrame_[ slot ] ) );
+    }
+    else std::cerr << "Cannot map pixel buffer of frame " << pboFrame_[ slot ] << std::endl;
+    pboFrame_[ slot ] = -1;
+}
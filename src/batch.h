@@ -0,0 +1,97 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <string>
+#include <deque>
+
+#include <osg/Camera>
+#include <osg/Image>
+#include <osg/AnimationPath>
+#include <osg/BoundingSphere>
+#include <OpenThreads/Thread>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/Condition>
+
+/// Off-screen batch rendering parameters.
+struct BatchParameters
+{
+    BatchParameters() : frames( 0 ), width( 1024 ), height( 768 ), outputPrefix( "frame" ), format( "png" ) {}
+    /// number of frames to render; batch mode is disabled if <= 0
+    int frames;
+    int width;
+    int height;
+    /// camera path file in osg::AnimationPath format, as recorded by
+    /// osgViewer::RecordCameraPathHandler; orbit around the model if empty
+    std::string cameraPath;
+    /// frames are written to <outputPrefix>_<frame number>.<format>
+    std::string outputPrefix;
+    /// 'raw': RGBA8 rows stored bottom to top with no header; 'exr': float RGBA;
+    /// 'none': frames are not read back; any other osgDB image extension: RGBA8
+    std::string format;
+};
+
+//------------------------------------------------------------------------------
+/// Create a pbuffer graphics context of the requested size and attach it to
+/// the camera; on X11 a display is still required (e.g. Xvfb with Mesa llvmpipe).
+void SetupOffscreenCamera( osg::Camera& camera, int width, int height );
+
+/// Load camera path from file or, if fileName is empty, create a path
+/// orbiting around the bounding sphere.
+osg::AnimationPath* CreateBatchCameraPath( const std::string& fileName, const osg::BoundingSphere& bs );
+
+/// Return view matrix at frame 'frame' of 'frames' evenly spaced frames.
+osg::Matrixd GetCameraPathViewMatrix( const osg::AnimationPath& path, int frame, int frames );
+
+//------------------------------------------------------------------------------
+/// Writes images to disk on a separate thread; Push blocks if more than
+/// maxQueueSize images are waiting.
+class ImageWriterThread : public OpenThreads::Thread
+{
+public:
+    ImageWriterThread( unsigned int maxQueueSize = 4 );
+    ~ImageWriterThread();
+    void Push( osg::Image* image, const std::string& fileName );
+    /// Wait until all queued images are written and terminate thread.
+    void Finish();
+    void run();
+private:
+    typedef std::pair< osg::ref_ptr< osg::Image >, std::string > Item;
+    std::deque< Item > queue_;
+    OpenThreads::Mutex mutex_;
+    OpenThreads::Condition condition_;
+    unsigned int maxQueueSize_;
+    bool done_;
+};
+
+//------------------------------------------------------------------------------
+/// Final draw callback: reads back the color buffer asynchronously through two
+/// pixel buffer objects used in ping-pong fashion: the frame buffer of frame N
+/// is copied into one PBO while the PBO filled at frame N - 1 is mapped and
+/// handed to the writer thread, so glReadPixels never waits for the GPU to
+/// finish the current frame. The buffers are deleted after the last frame
+/// (BatchParameters::frames - 1) has been read back.
+class FrameRecorder : public osg::Camera::DrawCallback
+{
+public:
+    FrameRecorder( const BatchParameters& bp );
+    /// Set index of the frame about to be rendered, negative values disable recording.
+    void SetFrame( int frame ) { frame_ = frame; }
+    void operator()( osg::RenderInfo& renderInfo ) const;
+    /// Wait for all frames to be written to disk; call after the last frame
+    /// has been rendered.
+    void Finish();
+private:
+    std::string FrameFileName( int frame ) const;
+    void MapAndWrite( unsigned int contextID, int slot ) const;
+    BatchParameters params_;
+    GLenum dataType_;
+    int frame_;
+    mutable GLuint pbo_[ 2 ];
+    mutable int pboFrame_[ 2 ];
+    mutable int pboWidth_;
+    mutable int pboHeight_;
+    mutable int slot_;
+    mutable ImageWriterThread writer_;
+};
+
+#endif // BATCH_H_
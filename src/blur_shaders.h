@@ -0,0 +1,36 @@
+// Shaders used to blur the occlusion map: a 4 texel wide depth aware box
+// filter applied along BLUR_DIRECTION; two passes (horizontal and vertical)
+// cover the 4x4 blocks of the interleaved direction pattern.
+// The occlusion map stores visibility in x and eye space z in z; samples whose
+// depth differs from the center depth by more than BLUR_DEPTH_TOLERANCE (relative)
+// are ignored. Visibility and depth are written in the same layout.
+
+static const char BLUR_VERT[] =
+"void main(void)\n"
+"{\n"
+"  gl_Position = gl_Vertex;\n"
+"}\n";
+
+static const char BLUR_FRAG[] =
+"#extension GL_ARB_texture_rectangle : enable\n"
+"#ifndef BLUR_DEPTH_TOLERANCE\n"
+"#define BLUR_DEPTH_TOLERANCE 0.05\n"
+"#endif\n"
+"uniform sampler2DRect source;\n"
+"void main(void)\n"
+"{\n"
+"  vec4 c = texture2DRect( source, gl_FragCoord.xy );\n"
+"  float tol = BLUR_DEPTH_TOLERANCE * abs( c.z );\n"
+"  float v = 0.0;\n"
+"  float wsum = 0.0;\n"
+"  // texel offsets -2, -1, 0, 1: any 4 consecutive texels cover the pattern\n"
+"  for( int i = -2; i != 2; ++i )\n"
+"  {\n"
+"    vec4 s = texture2DRect( source, gl_FragCoord.xy + float( i ) * BLUR_DIRECTION );\n"
+"    float w = max( 0.0, 1.0 - abs( s.z - c.z ) / max( tol, 1.0e-6 ) );\n"
+"    v += w * s.x;\n"
+"    wsum += w;\n"
+"  }\n"
+"  v = wsum > 1.0e-6 ? v / wsum : c.x;\n"
+"  gl_FragColor = vec4( v, v, c.z, c.w );\n"
+"}\n";
@@ -0,0 +1,36 @@
+// Shaders used to reuse the depth written by the pre-render camera in the
+// main camera: the model must be transformed with the same expression in the
+// pre-render and in the shading programs, and gl_Position declared invariant
+// in all of them, for the GL_EQUAL depth test to pass; without 'invariant'
+// GLSL does not guarantee equal results across programs.
+
+// depth only pre-render without multiple render targets
+static const char DEPTH_ONLY_VERT[] =
+"#version 120\n"
+"invariant gl_Position;\n"
+"void main(void)\n"
+"{\n"
+"  gl_Position = gl_ProjectionMatrix * ( gl_ModelViewMatrix * gl_Vertex );\n"
+"}\n";
+
+static const char DEPTH_ONLY_FRAG[] =
+"void main(void)\n"
+"{\n"
+"  gl_FragColor = vec4( 1.0 );\n"
+"}\n";
+
+// copy of the pre-render depth texture into the depth buffer of the main
+// camera, drawn as a screen aligned quad before the model
+static const char DEPTH_COPY_VERT[] =
+"void main(void)\n"
+"{\n"
+"  gl_Position = gl_Vertex;\n"
+"}\n";
+
+static const char DEPTH_COPY_FRAG[] =
+"#extension GL_ARB_texture_rectangle : enable\n"
+"uniform sampler2DRect depthMap;\n"
+"void main(void)\n"
+"{\n"
+"  gl_FragDepth = texture2DRect( depthMap, gl_FragCoord.xy ).x;\n"
+"}\n";
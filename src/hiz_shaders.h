@@ -0,0 +1,32 @@
+// Shaders used to build the min/max depth pyramid: each level is rendered
+// as a screen aligned quad at half the resolution of the previous one.
+// HIZ_SOURCE selects the source of level 1: 'depth' texture (x component),
+// 'normals' texture with depth in w component (MRT) or previous level (xy).
+
+static const char HIZ_VERT[] =
+"void main(void)\n"
+"{\n"
+"  gl_Position = gl_Vertex;\n"
+"}\n";
+
+static const char HIZ_FRAG[] =
+"#extension GL_ARB_texture_rectangle : enable\n"
+"uniform sampler2DRect source;\n"
+"#if defined( HIZ_SOURCE_DEPTH )\n"
+"vec2 Fetch( vec2 p ) { return texture2DRect( source, p ).xx; }\n"
+"#elif defined( HIZ_SOURCE_NORMALS )\n"
+"vec2 Fetch( vec2 p ) { return texture2DRect( source, p ).ww; }\n"
+"#else\n"
+"vec2 Fetch( vec2 p ) { return texture2DRect( source, p ).xy; }\n"
+"#endif\n"
+"void main(void)\n"
+"{\n"
+"  // centers of the 2x2 source texels covered by this texel\n"
+"  vec2 c = floor( gl_FragCoord.xy ) * 2.0 + 0.5;\n"
+"  vec2 a = Fetch( c );\n"
+"  vec2 b = Fetch( c + vec2( 1.0, 0.0 ) );\n"
+"  vec2 d = Fetch( c + vec2( 0.0, 1.0 ) );\n"
+"  vec2 e = Fetch( c + vec2( 1.0, 1.0 ) );\n"
+"  gl_FragColor = vec4( min( min( a.x, b.x ), min( d.x, e.x ) ),\n"
+"                       max( max( a.y, b.y ), max( d.y, e.y ) ), 0.0, 1.0 );\n"
+"}\n";
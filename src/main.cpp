@@ -5,13 +5,17 @@
 #include <osg/Geometry>
 #include <osg/ShapeDrawable>
 #include <osg/Shape>
-#include <osgUtil/SmoothingVisitor>
 #include <osg/MatrixTransform>
+#include <osg/PolygonMode>
+#include <osg/Point>
+#include <osg/Depth>
+#include <osg/ColorMask>
+#include <osg/observer_ptr>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
 #include <osgManipulator/TabBoxDragger>
 #include <osgManipulator/TranslateAxisDragger>
 
-#include <osgDB/ReadFile>
-
 #include <osgGA/TrackballManipulator>
 
 #include <iostream>
@@ -20,20 +24,52 @@
 #include <sstream>
 #include <fstream>
 #include <set>
+#include <vector>
 #include <stdexcept>
+#include <algorithm>
+#include <memory>
 
 #include "ssao.h"
-#include "texture_preprocess.h"
 #include "manipulator.h"
 #include "posnormal_mrt_shaders.h"
+#include "batch.h"
+#include "program_cache.h"
+#include "hiz_shaders.h"
+#include "blur_shaders.h"
+#include "profiler.h"
+#include "scene_bvh.h"
+#include "ao_cache.h"
+#include "scene_loader.h"
+#include "baked_ao.h"
+#include "depth_prepass_shaders.h"
+#include "quality_controller.h"
+#include "ray_stats.h"
+#include "FirstPersonManipulator.h"
 
 #ifdef WIN32
 static const std::string SHADER_PATH="C:/projects/ssao/src/shaders";
 #else
 static const std::string SHADER_PATH="/home/uvaretto/projects/ssao/src/shaders";
 #endif
-static const int MAX_FBO_WIDTH = 2048;
-static const int MAX_FBO_HEIGHT = 2048;
+
+// node mask of the model in deferred mode: culled by the main camera, which
+// draws a full-screen quad instead, but drawn into the G-buffer by the
+// pre-render camera
+static const osg::Node::NodeMask GBUFFER_ONLY_MASK = 0x80000000;
+
+// GL_ARB_texture_rg formats used by the compact G-buffer
+#ifndef GL_RG
+#define GL_RG 0x8227
+#endif
+#ifndef GL_RG16
+#define GL_RG16 0x822C
+#endif
+#ifndef GL_R32F
+#define GL_R32F 0x822E
+#endif
+#ifndef GL_DEPTH_COMPONENT24
+#define GL_DEPTH_COMPONENT24 0x81A6
+#endif
 
 //------------------------------------------------------------------------------
 osg::TextureRectangle* GenerateDepthTextureRectangle()
@@ -48,12 +84,14 @@ osg::TextureRectangle* GenerateDepthTextureRectangle()
 }
 
 //------------------------------------------------------------------------------
-osg::TextureRectangle* GenerateColorTextureRectangle()
+osg::TextureRectangle* GenerateColorTextureRectangle( GLint internalFormat = GL_RGBA32F_ARB,
+                                                      GLenum sourceFormat = GL_RGBA,
+                                                      GLenum sourceType = GL_FLOAT )
 {
     osg::ref_ptr< osg::TextureRectangle > tr = new osg::TextureRectangle;
-    tr->setSourceFormat( GL_RGBA );
-    tr->setSourceType( GL_FLOAT );
-    tr->setInternalFormat( GL_RGBA32F_ARB );
+    tr->setSourceFormat( sourceFormat );
+    tr->setSourceType( sourceType );
+    tr->setInternalFormat( internalFormat );
 	tr->setFilter( osg::Texture::MIN_FILTER, osg::Texture::NEAREST );
 	tr->setFilter( osg::Texture::MAG_FILTER, osg::Texture::NEAREST );
 	tr->setWrap( osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE );
@@ -62,10 +100,16 @@ osg::TextureRectangle* GenerateColorTextureRectangle()
 }
 
 //------------------------------------------------------------------------------
-// Attach depth or positions & normals textures to pre-render camera
+// Attach depth or positions & normals textures to pre-render camera;
+// compact: linear depth and octahedral normals are written instead of
+// positions and normals; albedo: material color is written into a third
+// target; impostors: sphere impostors are ray cast
 osg::Camera* CreatePreRenderCamera( osg::Texture* depth,
                                     osg::Texture* positions,
-                                    osg::Texture* normals )
+                                    osg::Texture* normals,
+                                    osg::Texture* albedo = 0,
+                                    bool compact = false,
+                                    bool impostors = false )
 {
 	osg::ref_ptr< osg::Camera > camera = new osg::Camera;
 	camera->setReferenceFrame( osg::Transform::ABSOLUTE_RF );
@@ -74,38 +118,418 @@ osg::Camera* CreatePreRenderCamera( osg::Texture* depth,
 	camera->setClearMask( GL_DEPTH_BUFFER_BIT );
 	// ATTACH DEPTH TEXTURE TO CAMERA
 	if( depth != 0 ) camera->attach( osg::Camera::DEPTH_BUFFER, depth ); 
-  
-	camera->setViewport( 0, 0, MAX_FBO_WIDTH, MAX_FBO_HEIGHT );
+	// viewport and render target size are set by SyncCameraNode before the first frame
 	// ATTACH TEXTURE TO STORE WORLD SPACE POSITIONS AND NORMALS WITH OPTIONAL DEPTH
     // STORED AS W COMPONENT
     if( positions ) camera->attach( osg::Camera::BufferComponent( osg::Camera::COLOR_BUFFER0 ), positions );
     if( normals   ) camera->attach( osg::Camera::BufferComponent( osg::Camera::COLOR_BUFFER0 + 1 ), normals );
+    // material color for the deferred resolve pass
+    if( albedo    ) camera->attach( osg::Camera::BufferComponent( osg::Camera::COLOR_BUFFER0 + 2 ), albedo );
     if( positions || normals )
     {
         camera->setClearMask( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
+        // background: linear depth beyond any object
+        if( compact ) camera->setClearColor( osg::Vec4( 1.0e30f, 1.0e30f, 1.0e30f, 1.0e30f ) );
+        // background: depth at far plane, detected by the deferred resolve pass
+        // and by adaptive ray selection
+        else camera->setClearColor( osg::Vec4( 0.f, 0.f, 0.f, 1.f ) );
         // ATTACH SHADERS TO CAMERA
         osg::ref_ptr< osg::StateSet > set = camera->getOrCreateStateSet();
         assert( osg::get_pointer( set ) );
         osg::ref_ptr< osg::Program > program = new osg::Program;
 	    program->setName( "Positions and Normals" );
-		program->addShader( new osg::Shader( osg::Shader::FRAGMENT, POSNORMALSDEPTH_FRAG_MRT ) );
-		program->addShader( new osg::Shader( osg::Shader::VERTEX,   POSNORMALS_VERT_MRT ) );
+        const std::string albedoPrefix = albedo ? "#define GBUFFER_ALBEDO\n" : "";
+        if( impostors )
+        {
+            std::ostringstream prefix;
+            prefix << "#define ATOM_TEXTURE_WIDTH " << ATOM_TEXTURE_WIDTH << ".0\n" << albedoPrefix;
+            if( compact ) prefix << "#define GBUFFER_COMPACT\n";
+            program->addShader( new osg::Shader( osg::Shader::FRAGMENT, prefix.str() + POSNORMALS_FRAG_IMPOSTORS_MRT ) );
+            program->addShader( new osg::Shader( osg::Shader::VERTEX,   prefix.str() + POSNORMALS_VERT_IMPOSTORS_MRT ) );
+        }
+        else
+        {
+		    program->addShader( new osg::Shader( osg::Shader::FRAGMENT, albedoPrefix + ( compact ? POSNORMALS_FRAG_COMPACT_MRT : POSNORMALSDEPTH_FRAG_MRT ) ) );
+		    program->addShader( new osg::Shader( osg::Shader::VERTEX,   POSNORMALS_VERT_MRT ) );
+        }
         set->setAttributeAndModes( program.get(), osg::StateAttribute::ON );
 	}
     return camera.release();
 }
 
+//------------------------------------------------------------------------------
+// Screen aligned quads drawn with this state are rasterized at depth 1 and
+// pass the GL_GREATER test only where the depth buffer holds the depth of the
+// model: background pixels, cleared to 1, are rejected before shading
+void CullBackground( osg::StateSet* set )
+{
+    set->setAttributeAndModes( new osg::Depth( osg::Depth::GREATER, 1.0, 1.0, false ), osg::StateAttribute::ON );
+}
+
+//------------------------------------------------------------------------------
+// Create cameras building min/max depth pyramid levels 1 to 'levels'
+// from depth texture or from w component of normals texture; level k is
+// rendered at 1/2^k resolution into the k-th texture
+std::vector< osg::ref_ptr< osg::Camera > > CreateHiZCameras( osg::Texture* depth,
+                                                             osg::Texture* normals,
+                                                             int levels,
+                                                             std::vector< osg::ref_ptr< osg::TextureRectangle > >& textures )
+{
+    std::vector< osg::ref_ptr< osg::Camera > > cameras;
+    // screen aligned quad: vertices are passed unchanged to the rasterizer
+    osg::ref_ptr< osg::Geode > quad = new osg::Geode;
+    quad->addDrawable( osg::createTexturedQuadGeometry( osg::Vec3( -1.f, -1.f, 0.f ),
+                                                        osg::Vec3(  2.f,  0.f, 0.f ),
+                                                        osg::Vec3(  0.f,  2.f, 0.f ) ) );
+    quad->setCullingActive( false );
+    osg::Texture* source = depth ? depth : normals;
+    for( int l = 1; l <= levels; ++l )
+    {
+        osg::ref_ptr< osg::TextureRectangle > level = GenerateColorTextureRectangle();
+        osg::ref_ptr< osg::Camera > camera = new osg::Camera;
+        camera->setReferenceFrame( osg::Transform::ABSOLUTE_RF );
+        camera->setRenderTargetImplementation( osg::Camera::FRAME_BUFFER_OBJECT );
+        camera->setRenderOrder( osg::Camera::PRE_RENDER, 1 + l );
+        camera->setComputeNearFarMode( osg::Camera::DO_NOT_COMPUTE_NEAR_FAR );
+        camera->setClearMask( 0 );
+        camera->attach( osg::Camera::COLOR_BUFFER, osg::get_pointer( level ) );
+        std::string prefix;
+        if( l == 1 ) prefix = depth ? "#define HIZ_SOURCE_DEPTH\n" : "#define HIZ_SOURCE_NORMALS\n";
+        osg::ref_ptr< osg::Program > program = new osg::Program;
+        program->setName( "HiZ" );
+        program->addShader( new osg::Shader( osg::Shader::FRAGMENT, prefix + HIZ_FRAG ) );
+        program->addShader( new osg::Shader( osg::Shader::VERTEX, HIZ_VERT ) );
+        osg::ref_ptr< osg::StateSet > set = camera->getOrCreateStateSet();
+        set->setAttributeAndModes( osg::get_pointer( program ), osg::StateAttribute::ON | osg::StateAttribute::OVERRIDE );
+        set->setTextureAttributeAndModes( 0, source );
+        set->addUniform( new osg::Uniform( "source", 0 ) );
+        set->setMode( GL_DEPTH_TEST, osg::StateAttribute::OFF );
+        camera->addChild( osg::get_pointer( quad ) );
+        cameras.push_back( camera );
+        textures.push_back( level );
+        source = osg::get_pointer( level );
+    }
+    return cameras;
+}
+
+//------------------------------------------------------------------------------
+// Create horizontal and vertical depth aware blur cameras filtering 'aoMap'
+// into 'blurred'; rendered after the occlusion pass at its resolution;
+// 'depth': depth attachment of the occlusion pass, background texels are not
+// filtered and keep the clear value of the occlusion pass
+std::vector< osg::ref_ptr< osg::Camera > > CreateBlurCameras( osg::Texture* aoMap,
+                                                              osg::Texture* blurred,
+                                                              int downsample,
+                                                              osg::Texture* depth = 0 )
+{
+    std::vector< osg::ref_ptr< osg::Camera > > cameras;
+    osg::ref_ptr< osg::Geode > quad = new osg::Geode;
+    quad->addDrawable( osg::createTexturedQuadGeometry( osg::Vec3( -1.f, -1.f, 0.f ),
+                                                        osg::Vec3(  2.f,  0.f, 0.f ),
+                                                        osg::Vec3(  0.f,  2.f, 0.f ) ) );
+    quad->setCullingActive( false );
+    // intermediate texture: horizontally blurred occlusion
+    osg::ref_ptr< osg::TextureRectangle > tmp = GenerateColorTextureRectangle();
+    osg::Texture* sources[] = { aoMap, osg::get_pointer( tmp ) };
+    osg::Texture* targets[] = { osg::get_pointer( tmp ), blurred };
+    const char* directions[] = { "#define BLUR_DIRECTION vec2( 1.0, 0.0 )\n", "#define BLUR_DIRECTION vec2( 0.0, 1.0 )\n" };
+    for( int i = 0; i != 2; ++i )
+    {
+        osg::ref_ptr< osg::Camera > camera = new osg::Camera;
+        camera->setReferenceFrame( osg::Transform::ABSOLUTE_RF );
+        camera->setRenderTargetImplementation( osg::Camera::FRAME_BUFFER_OBJECT );
+        // after occlusion pass
+        camera->setRenderOrder( osg::Camera::PRE_RENDER, 9 + i );
+        camera->setComputeNearFarMode( osg::Camera::DO_NOT_COMPUTE_NEAR_FAR );
+        camera->setClearMask( 0 );
+        camera->attach( osg::Camera::COLOR_BUFFER, targets[ i ] );
+        if( depth )
+        {
+            // read only: the occlusion pass clears and writes it
+            camera->attach( osg::Camera::DEPTH_BUFFER, depth );
+            camera->setClearColor( osg::Vec4( 1.f, 1.f, 1.f, 1.f ) );
+            camera->setClearMask( GL_COLOR_BUFFER_BIT );
+        }
+        osg::ref_ptr< osg::Program > program = new osg::Program;
+        program->setName( "Blur" );
+        program->addShader( new osg::Shader( osg::Shader::FRAGMENT, std::string( directions[ i ] ) + BLUR_FRAG ) );
+        program->addShader( new osg::Shader( osg::Shader::VERTEX, BLUR_VERT ) );
+        osg::ref_ptr< osg::StateSet > set = camera->getOrCreateStateSet();
+        set->setAttributeAndModes( osg::get_pointer( program ), osg::StateAttribute::ON | osg::StateAttribute::OVERRIDE );
+        set->setTextureAttributeAndModes( 0, sources[ i ] );
+        set->addUniform( new osg::Uniform( "source", 0 ) );
+        if( depth ) CullBackground( osg::get_pointer( set ) );
+        else set->setMode( GL_DEPTH_TEST, osg::StateAttribute::OFF );
+        camera->addChild( osg::get_pointer( quad ) );
+        cameras.push_back( camera );
+    }
+    return cameras;
+}
+
+//------------------------------------------------------------------------------
+// Full-screen quad drawn by the main camera in deferred mode instead of the
+// model: the program compiled with DEFERRED passes the vertices unchanged to
+// the rasterizer and shades each covered pixel once from the G-buffer;
+// cullBackground: background pixels are rejected by the depth test, the
+// depth of the G-buffer being copied first into the depth buffer
+osg::Geode* CreateDeferredResolveQuad( bool cullBackground = false )
+{
+    osg::ref_ptr< osg::Geode > quad = new osg::Geode;
+    quad->addDrawable( osg::createTexturedQuadGeometry( osg::Vec3( -1.f, -1.f, 0.f ),
+                                                        osg::Vec3(  2.f,  0.f, 0.f ),
+                                                        osg::Vec3(  0.f,  2.f, 0.f ) ) );
+    quad->setCullingActive( false );
+    osg::StateSet* set = quad->getOrCreateStateSet();
+    if( cullBackground ) CullBackground( set );
+    else set->setMode( GL_DEPTH_TEST, osg::StateAttribute::OFF );
+    set->setMode( GL_CULL_FACE, osg::StateAttribute::OFF );
+    return quad.release();
+}
+
+//------------------------------------------------------------------------------
+// Screen aligned quad copying 'depth' into the depth buffer of the main camera
+// without touching colors; drawn before the model through render bin -1
+osg::Geode* CreateDepthCopyQuad( osg::Texture* depth )
+{
+    osg::ref_ptr< osg::Geode > quad = new osg::Geode;
+    quad->addDrawable( osg::createTexturedQuadGeometry( osg::Vec3( -1.f, -1.f, 0.f ),
+                                                        osg::Vec3(  2.f,  0.f, 0.f ),
+                                                        osg::Vec3(  0.f,  2.f, 0.f ) ) );
+    quad->setCullingActive( false );
+    osg::ref_ptr< osg::Program > program = new osg::Program;
+    program->setName( "Depth copy" );
+    program->addShader( new osg::Shader( osg::Shader::FRAGMENT, DEPTH_COPY_FRAG ) );
+    program->addShader( new osg::Shader( osg::Shader::VERTEX, DEPTH_COPY_VERT ) );
+    osg::StateSet* set = quad->getOrCreateStateSet();
+    set->setAttributeAndModes( osg::get_pointer( program ), osg::StateAttribute::ON );
+    set->setTextureAttributeAndModes( 0, depth );
+    set->addUniform( new osg::Uniform( "depthMap", 0 ) );
+    set->setAttributeAndModes( new osg::Depth( osg::Depth::ALWAYS, 0.0, 1.0, true ), osg::StateAttribute::ON );
+    set->setAttributeAndModes( new osg::ColorMask( false, false, false, false ), osg::StateAttribute::ON );
+    set->setMode( GL_CULL_FACE, osg::StateAttribute::OFF );
+    set->setRenderBinDetails( -1, "RenderBin" );
+    return quad.release();
+}
+
+//------------------------------------------------------------------------------
+// Render occlusion of the subgraph at reduced resolution into 'aoMap';
+// rendered after the depth/position/normal pre-render camera whose output is
+// read by the occlusion program
+osg::Camera* CreateLowResAOCamera( osg::Texture* aoMap, osg::Program* program, int downsample )
+{
+    osg::ref_ptr< osg::Camera > camera = new osg::Camera;
+    camera->setReferenceFrame( osg::Transform::ABSOLUTE_RF );
+    camera->setRenderTargetImplementation( osg::Camera::FRAME_BUFFER_OBJECT );
+    // after depth pre-render and depth pyramid cameras
+    camera->setRenderOrder( osg::Camera::PRE_RENDER, 8 );
+    // background: no occlusion
+    camera->setClearColor( osg::Vec4( 1.f, 1.f, 1.f, 1.f ) );
+    camera->setClearMask( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
+    camera->attach( osg::Camera::COLOR_BUFFER, aoMap );
+    if( program ) camera->getOrCreateStateSet()->setAttributeAndModes( program, osg::StateAttribute::ON );
+    return camera.release();
+}
+
+//------------------------------------------------------------------------------
+// Trace per vertex occlusion of the subgraph into 'aoCache': each vertex is
+// drawn as a single point at its cache texel (see ao_cache.h); rendered after
+// the depth/position/normal pre-render camera whose output is read by the
+// program; view and projection matrices are set by AOCacheSwitch
+osg::Camera* CreateAOCacheCamera( osg::TextureRectangle* aoCache, osg::Program* program )
+{
+    osg::ref_ptr< osg::Camera > camera = new osg::Camera;
+    camera->setReferenceFrame( osg::Transform::ABSOLUTE_RF );
+    camera->setRenderTargetImplementation( osg::Camera::FRAME_BUFFER_OBJECT );
+    // after depth pre-render camera
+    camera->setRenderOrder( osg::Camera::PRE_RENDER, 8 );
+    camera->setComputeNearFarMode( osg::Camera::DO_NOT_COMPUTE_NEAR_FAR );
+    // not cached vertices: no occlusion
+    camera->setClearColor( osg::Vec4( 1.f, 1.f, 1.f, 1.f ) );
+    camera->setClearMask( GL_COLOR_BUFFER_BIT );
+    camera->setViewport( 0, 0, aoCache->getTextureWidth(), aoCache->getTextureHeight() );
+    camera->attach( osg::Camera::COLOR_BUFFER, aoCache );
+    osg::ref_ptr< osg::StateSet > set = camera->getOrCreateStateSet();
+    if( program ) set->setAttributeAndModes( program, osg::StateAttribute::ON );
+    set->setAttributeAndModes( new osg::PolygonMode( osg::PolygonMode::FRONT_AND_BACK, osg::PolygonMode::POINT ),
+                               osg::StateAttribute::ON | osg::StateAttribute::OVERRIDE );
+    set->setAttributeAndModes( new osg::Point( 1.0f ), osg::StateAttribute::ON | osg::StateAttribute::OVERRIDE );
+    set->setMode( GL_DEPTH_TEST, osg::StateAttribute::OFF | osg::StateAttribute::OVERRIDE );
+    set->setMode( GL_CULL_FACE, osg::StateAttribute::OFF | osg::StateAttribute::OVERRIDE );
+    set->setMode( GL_BLEND, osg::StateAttribute::OFF | osg::StateAttribute::OVERRIDE );
+    return camera.release();
+}
 
+//------------------------------------------------------------------------------
+/// Forward events to a handler except the keys moving the walk-through
+/// manipulator: arrows and Page Up/Down would change the SSAO parameters
+/// while walking.
+class NavigationKeyFilter : public osgGA::GUIEventHandler
+{
+public:
+    NavigationKeyFilter( osgGA::GUIEventHandler* handler ) : handler_( handler ) {}
+    bool handle( const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa )
+    {
+        if( ea.getEventType() == osgGA::GUIEventAdapter::KEYDOWN || ea.getEventType() == osgGA::GUIEventAdapter::KEYUP )
+        {
+            switch( ea.getKey() )
+            {
+            case osgGA::GUIEventAdapter::KEY_Up:
+            case osgGA::GUIEventAdapter::KEY_Down:
+            case osgGA::GUIEventAdapter::KEY_Left:
+            case osgGA::GUIEventAdapter::KEY_Right:
+            case osgGA::GUIEventAdapter::KEY_Page_Up:
+            case osgGA::GUIEventAdapter::KEY_Page_Down:
+                return false;
+            default:
+                break;
+            }
+        }
+        return handler_->handle( ea, aa );
+    }
+private:
+    osg::ref_ptr< osgGA::GUIEventHandler > handler_;
+};
 
 //------------------------------------------------------------------------------
 // Synchronize
 
-// sync viewer's camera with pre-render camera
+// Size of the full resolution render targets: follows the main camera
+// viewport; grows with 25% headroom in the dimension which does not fit and
+// shrinks only after the viewport has used less than half of the area for
+// 'shrinkDelay' consecutive frames, so that resizing a window does not
+// reallocate the targets at every frame
+class RenderTargetSize : public osg::Referenced
+{
+public:
+    RenderTargetSize( int shrinkDelay = 60 )
+        : width_( 0 ), height_( 0 ), generation_( 0 ), shrinkDelay_( shrinkDelay ), smallFrames_( 0 ) {}
+    /// Call once per frame with the main camera viewport size.
+    void Update( int width, int height )
+    {
+        if( width > width_ || height > height_ )
+        {
+            // the other dimension keeps its headroom
+            Resize( width > width_ ? Padded( width ) : width_, height > height_ ? Padded( height ) : height_ );
+            return;
+        }
+        smallFrames_ = 2 * width * height < width_ * height_ ? smallFrames_ + 1 : 0;
+        if( smallFrames_ > shrinkDelay_ ) Resize( Padded( width ), Padded( height ) );
+    }
+    int Width() const { return width_; }
+    int Height() const { return height_; }
+    /// Incremented at each reallocation.
+    unsigned int Generation() const { return generation_; }
+private:
+    // 25% headroom rounded up to a multiple of 64 pixels
+    static int Padded( int size ) { return ( size + size / 4 + 63 ) & ~63; }
+    void Resize( int width, int height )
+    {
+        width_ = width;
+        height_ = height;
+        ++generation_;
+        smallFrames_ = 0;
+    }
+    int width_;
+    int height_;
+    unsigned int generation_;
+    int shrinkDelay_;
+    int smallFrames_;
+};
+
+/// Pre-draw callback used to set the viewport uniform: the uniform is changed
+/// by the draw thread, after the previous frame has been drawn.
+class SetViewportUniformCBack : public osg::Camera::DrawCallback 
+{
+public:
+	SetViewportUniformCBack( const osg::Camera* observedCamera, osg::Uniform* vp )
+		: observedCamera_( observedCamera ), uniform_( vp ) {}
+	void operator()( osg::Node* , osg::NodeVisitor* )
+    {
+        SetUniform();
+    }
+	void operator() ( osg::RenderInfo& /*renderInfo*/ ) const
+    {
+        SetUniform();
+	}
+    void SetUniform() const 
+    {
+        if( observedCamera_ != 0 && observedCamera_->getViewport() != 0 )
+        {
+            if( uniform_ ) uniform_->set( osg::Vec2( observedCamera_->getViewport()->width(), observedCamera_->getViewport()->height() ) );
+        }
+    }
+private:
+	osg::ref_ptr< const osg::Camera > observedCamera_;
+	osg::ref_ptr< osg::Uniform > uniform_;
+};
+
+// Initial draw callback reallocating the textures attached to the camera with
+// the size requested during the update traversal: it runs in the draw thread
+// after the previous frame has been drawn and before the frame buffer object
+// of the camera is set up, which is recreated since the attachments are marked
+// as modified. Textures shared with other cameras are reallocated only once.
+class ResizeTargetsCallback : public osg::Camera::DrawCallback
+{
+public:
+    ResizeTargetsCallback( osg::Camera* camera )
+        : camera_( camera ), width_( 0 ), height_( 0 ), pending_( false ) {}
+    /// Called from the update traversal.
+    void Request( int width, int height )
+    {
+        OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex_ );
+        width_ = width;
+        height_ = height;
+        pending_ = true;
+    }
+    void operator()( osg::RenderInfo& /*renderInfo*/ ) const
+    {
+        int w = 0;
+        int h = 0;
+        {
+            OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex_ );
+            if( !pending_ ) return;
+            pending_ = false;
+            w = width_;
+            h = height_;
+        }
+        osg::ref_ptr< osg::Camera > camera;
+        if( !camera_.lock( camera ) ) return;
+        osg::Camera::BufferAttachmentMap& bam = camera->getBufferAttachmentMap();
+        for( osg::Camera::BufferAttachmentMap::iterator i = bam.begin(); i != bam.end(); ++i )
+        {
+            osg::TextureRectangle* t = dynamic_cast< osg::TextureRectangle* >( osg::get_pointer( i->second._texture ) );
+            if( !t || ( t->getTextureWidth() == w && t->getTextureHeight() == h ) ) continue;
+            t->setTextureSize( w, h );
+            t->dirtyTextureObject();
+        }
+        camera->dirtyAttachmentMap();
+    }
+private:
+    osg::observer_ptr< osg::Camera > camera_;
+    mutable OpenThreads::Mutex mutex_;
+    int width_;
+    int height_;
+    mutable bool pending_;
+};
+
+// sync viewer's camera with pre-render camera; if a render target size is
+// given the textures attached to the camera are reallocated at 1/downsample
+// of the target size whenever the target size changes, through an initial
+// draw callback set on the camera; at full resolution the viewport uniform
+// is set through a pre-draw callback
 class SyncCameraNode : public osg::Camera::DrawCallback //osg::NodeCallback
 {
 public:
-	SyncCameraNode( const osg::Camera* observedCamera, osg::Camera* cameraToUpdate, osg::Uniform* vp )
-		: observedCamera_( observedCamera ), cameraToUpdate_( cameraToUpdate ), uniform_( vp ), init_( true ) {}
+	SyncCameraNode( const osg::Camera* observedCamera, osg::Camera* cameraToUpdate, osg::Uniform* vp, int downsample = 1,
+                    const RenderTargetSize* targetSize = 0 )
+		: observedCamera_( observedCamera ), cameraToUpdate_( cameraToUpdate ), downsample_( downsample ),
+          targetSize_( targetSize ), generation_( 0 )
+    {
+        if( vp && downsample <= 1 ) cameraToUpdate->setPreDrawCallback( new SetViewportUniformCBack( observedCamera, vp ) );
+        if( !targetSize ) return;
+        resize_ = new ResizeTargetsCallback( cameraToUpdate );
+        cameraToUpdate->setInitialDrawCallback( osg::get_pointer( resize_ ) );
+    }
 	void operator()( osg::Node* n, osg::NodeVisitor* )
     {
         SyncCameras();
@@ -114,41 +538,242 @@ public:
     {
         SyncCameras();
 	}
-    void SyncCameras() const 
+    void SyncCameras() const
     {
         osg::Camera* sc = cameraToUpdate_; //static_cast< osg::Camera* >( n );
 		sc->setProjectionMatrix( observedCamera_->getProjectionMatrix() );
 		sc->setViewMatrix( observedCamera_->getViewMatrix() );
-		// first update: do nothing; RenderStage::draw() method will set up FBO attached
-		// to camera viewport to match the size of the attached FBO
-		// subsequent updates: set viewport to be the same as main camera viewport
-		if( init_ )
+		if( targetSize_.valid() && targetSize_->Generation() != generation_ ) ResizeTargets();
+		if( downsample_ > 1 )
 		{
-			sc->setViewport( 0, 0, MAX_FBO_WIDTH, MAX_FBO_HEIGHT );
-			init_ = false;
+		    // a new viewport object is created instead of modifying the current one
+		    // which may still be in use by the draw thread of the previous frame
+		    const osg::Viewport* vp = observedCamera_->getViewport();
+		    const int w = std::max( 1, int( vp->width() ) / downsample_ );
+		    const int h = std::max( 1, int( vp->height() ) / downsample_ );
+		    const osg::Viewport* cur = sc->getViewport();
+		    if( !cur || int( cur->width() ) != w || int( cur->height() ) != h ) sc->setViewport( new osg::Viewport( 0, 0, w, h ) );
 		}
 		else
 		{
 		    sc->setViewport( const_cast< osg::Camera* >( osg::get_pointer( observedCamera_ ) )->getViewport() );
-         	if( uniform_ ) uniform_->set( osg::Vec2( observedCamera_->getViewport()->width(), observedCamera_->getViewport()->height() ) );
-        }		
+        }
     }
 private:
+    // request the reallocation of the attached textures at the next draw
+    void ResizeTargets() const
+    {
+        generation_ = targetSize_->Generation();
+        const int w = std::max( 1, ( targetSize_->Width() + downsample_ - 1 ) / downsample_ );
+        const int h = std::max( 1, ( targetSize_->Height() + downsample_ - 1 ) / downsample_ );
+        resize_->Request( w, h );
+    }
 	osg::ref_ptr< const osg::Camera > observedCamera_;
     osg::ref_ptr< osg::Camera > cameraToUpdate_;
-	osg::ref_ptr< osg::Uniform > uniform_;
-	mutable int init_;
+	int downsample_;
+    osg::ref_ptr< const RenderTargetSize > targetSize_;
+    osg::ref_ptr< ResizeTargetsCallback > resize_;
+    mutable unsigned int generation_;
 };
 
+typedef std::vector< osg::ref_ptr< SyncCameraNode > > SyncCameraNodes;
+
+void SyncCameras( const SyncCameraNodes& nodes )
+{
+    for( SyncCameraNodes::const_iterator i = nodes.begin(); i != nodes.end(); ++i ) ( *i )->SyncCameras();
+}
 
 
-void SetCameraCallback( osg::Camera* cameraToUpdate, osg::Camera* observedCamera, osg::Uniform* vp )
+//------------------------------------------------------------------------------
+// Double buffered state: two groups sharing the same children are traversed in
+// alternate frames, each one with its own state set; with a multithreaded
+// viewer the state set of the frame being prepared can be modified during the
+// update phase while the draw thread is still rendering the previous frame
+// with the other one
+class DoubleBufferedGroup : public osg::Group
 {
-    
-	cameraToUpdate->setPreDrawCallback(  new SyncCameraNode( observedCamera, cameraToUpdate, vp ) );
-	//cameraToUpdate->setPostDrawCallback( new NodeMaskCBack( dragger, 0xffffffff ) );
-    //camera->setPostDrawCallback(  new SyncCameraNode( mc, camera, vp ) );
-    //camera->setUpdateCallback( new SyncCameraNode( mc, vp ) );
+public:
+    DoubleBufferedGroup()
+    {
+        for( int i = 0; i != 2; ++i )
+        {
+            buffers_[ i ] = new osg::Group;
+            osg::Group::addChild( osg::get_pointer( buffers_[ i ] ) );
+        }
+        Select( 0 );
+    }
+    /// Move the children of 'parent' under both buffers and add this group to 'parent'.
+    void Adopt( osg::Group& parent )
+    {
+        for( unsigned int i = 0; i != parent.getNumChildren(); ++i ) AddSharedChild( parent.getChild( i ) );
+        parent.removeChildren( 0, parent.getNumChildren() );
+        parent.addChild( this );
+    }
+    void AddSharedChild( osg::Node* node )
+    {
+        for( int i = 0; i != 2; ++i ) buffers_[ i ]->addChild( node );
+    }
+    osg::StateSet* GetOrCreateStateSet( int buffer ) { return buffers_[ buffer ]->getOrCreateStateSet(); }
+    /// Traverse 'buffer' only; call during the update phase.
+    void Select( int buffer )
+    {
+        buffers_[ buffer ]->setNodeMask( ~0 );
+        buffers_[ 1 - buffer ]->setNodeMask( 0 );
+    }
+private:
+    osg::ref_ptr< osg::Group > buffers_[ 2 ];
+};
+
+//------------------------------------------------------------------------------
+// Temporal accumulation of occlusion: two occlusion cameras render in
+// alternate frames, each one writing its own texture and reading the texture
+// written in the previous frame by the other one as history; the texture
+// written in the current frame is read through buffer 0 or 1 of
+// 'aoMapReader' (main scene or blur pass) at 'aoMapUnit'.
+// Per frame uniforms are owned by each camera: the uniforms of the camera
+// rendering the next frame are set while the other camera may still be drawn.
+// Must be updated before the cameras are synchronized with the main camera
+class TemporalAOSwitch
+{
+public:
+    TemporalAOSwitch( osg::Camera* mainCamera, osg::Camera* aoCamera0, osg::Camera* aoCamera1,
+                      osg::TextureRectangle* aoMap0, osg::TextureRectangle* aoMap1,
+                      int historyUnit, DoubleBufferedGroup* aoMapReader, int aoMapUnit, int subsets,
+                      const RenderTargetSize* targetSize )
+        : mainCamera_( mainCamera ), aoMapReader_( aoMapReader ), subsets_( subsets ), frame_( 0 ),
+          targetSize_( targetSize ), generation_( 0 ), width_( 0 ), height_( 0 )
+    {
+        cameras_[ 0 ] = aoCamera0;
+        cameras_[ 1 ] = aoCamera1;
+        aoMaps_[ 0 ] = aoMap0;
+        aoMaps_[ 1 ] = aoMap1;
+        for( int i = 0; i != 2; ++i )
+        {
+            reprojection_[ i ] = new osg::Uniform( "reprojection", osg::Matrixf() );
+            reprojectionEye_[ i ] = new osg::Uniform( "reprojectionEye", osg::Matrixf() );
+            frameIndex_[ i ] = new osg::Uniform( "frameIndex", 0.f );
+            historyValid_[ i ] = new osg::Uniform( "historyValid", 0 );
+            osg::StateSet* set = cameras_[ i ]->getOrCreateStateSet();
+            set->setTextureAttributeAndModes( historyUnit, osg::get_pointer( aoMaps_[ 1 - i ] ) );
+            set->addUniform( new osg::Uniform( "aoHistory", historyUnit ) );
+            set->addUniform( osg::get_pointer( reprojection_[ i ] ) );
+            set->addUniform( osg::get_pointer( reprojectionEye_[ i ] ) );
+            set->addUniform( osg::get_pointer( frameIndex_[ i ] ) );
+            set->addUniform( osg::get_pointer( historyValid_[ i ] ) );
+            aoMapReader_->GetOrCreateStateSet( i )->setTextureAttributeAndModes( aoMapUnit, osg::get_pointer( aoMaps_[ i ] ) );
+        }
+    }
+    void Update()
+    {
+        const int current = frame_ % 2;
+        cameras_[ current ]->setNodeMask( ~0 );
+        cameras_[ 1 - current ]->setNodeMask( 0 );
+        aoMapReader_->Select( current );
+        // history is valid if written by the previous frame with the same viewport
+        // into render targets that have not been reallocated since
+        const osg::Viewport* vp = mainCamera_->getViewport();
+        const bool sameViewport = int( vp->width() ) == width_ && int( vp->height() ) == height_;
+        const bool sameTargets = targetSize_->Generation() == generation_;
+        historyValid_[ current ]->set( frame_ > 0 && sameViewport && sameTargets ? 1 : 0 );
+        width_ = int( vp->width() );
+        height_ = int( vp->height() );
+        generation_ = targetSize_->Generation();
+        // current eye space -> previous eye space -> previous clip space
+        const osg::Matrixd view = mainCamera_->getViewMatrix();
+        const osg::Matrixd toPrevEye = osg::Matrixd::inverse( view ) * prevView_;
+        reprojectionEye_[ current ]->set( osg::Matrixf( toPrevEye ) );
+        reprojection_[ current ]->set( osg::Matrixf( toPrevEye * prevProjection_ ) );
+        prevView_ = view;
+        prevProjection_ = mainCamera_->getProjectionMatrix();
+        frameIndex_[ current ]->set( float( frame_ % subsets_ ) );
+        ++frame_;
+    }
+private:
+    osg::ref_ptr< osg::Camera > mainCamera_;
+    osg::ref_ptr< osg::Camera > cameras_[ 2 ];
+    osg::ref_ptr< osg::TextureRectangle > aoMaps_[ 2 ];
+    osg::ref_ptr< DoubleBufferedGroup > aoMapReader_;
+    int subsets_;
+    int frame_;
+    osg::ref_ptr< const RenderTargetSize > targetSize_;
+    unsigned int generation_;
+    osg::ref_ptr< osg::Uniform > reprojection_[ 2 ];
+    osg::ref_ptr< osg::Uniform > reprojectionEye_[ 2 ];
+    osg::ref_ptr< osg::Uniform > frameIndex_[ 2 ];
+    osg::ref_ptr< osg::Uniform > historyValid_[ 2 ];
+    osg::Matrixd prevView_;
+    osg::Matrixd prevProjection_;
+    int width_;
+    int height_;
+};
+
+//------------------------------------------------------------------------------
+// Near and far planes of 'camera' fitted to the bounding sphere of 'scene'
+// in the update phase; used when the cull traversals must not compute near
+// and far planes independently, e.g. when the main camera reuses the depth
+// written by the pre-render camera and both must produce the same depth values.
+// Must be updated before the temporal and cache switches, which read the
+// projection, and before the cameras are synchronized with the main camera
+class NearFarFit
+{
+public:
+    NearFarFit( osg::Camera* camera, const osg::Node* scene, double nearFarRatio = 1.0e-3 )
+        : camera_( camera ), scene_( scene ), nearFarRatio_( nearFarRatio )
+    {
+        camera_->setComputeNearFarMode( osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR );
+    }
+    void Update()
+    {
+        const osg::BoundingSphere& bs = scene_->getBound();
+        if( !bs.valid() ) return;
+        // distance of the center along the view direction
+        const double d = -( bs.center() * camera_->getViewMatrix() ).z();
+        const double r = bs.radius();
+        double left, right, bottom, top, zNear, zFar;
+        if( camera_->getProjectionMatrix()( 3, 3 ) == 0.0 )
+        {
+            // perspective: scene behind the viewer, nothing to fit
+            if( d + r <= 0.0 || !camera_->getProjectionMatrixAsFrustum( left, right, bottom, top, zNear, zFar ) ) return;
+            const double n = std::max( d - r, ( d + r ) * nearFarRatio_ );
+            const double s = n / zNear;
+            camera_->setProjectionMatrixAsFrustum( left * s, right * s, bottom * s, top * s, n, d + r );
+        }
+        else if( camera_->getProjectionMatrixAsOrtho( left, right, bottom, top, zNear, zFar ) )
+        {
+            camera_->setProjectionMatrixAsOrtho( left, right, bottom, top, d - r, d + r );
+        }
+    }
+private:
+    osg::ref_ptr< osg::Camera > camera_;
+    osg::ref_ptr< const osg::Node > scene_;
+    double nearFarRatio_;
+};
+
+//------------------------------------------------------------------------------
+// Render one frame; render targets are resized and cameras rendering to
+// textures are synchronized with the main camera after the update traversal
+void RenderFrame( osgViewer::Viewer& viewer, RenderTargetSize& targetSize, const SyncCameraNodes& syncNodes,
+                  TemporalAOSwitch* temporalAO, AOCacheSwitch* aoCache, NearFarFit* nearFar, FrameProfiler* profiler )
+{
+    viewer.advance();
+    if( profiler ) profiler->StartFrame( viewer.getFrameStamp()->getFrameNumber() );
+    viewer.eventTraversal();
+    if( profiler ) profiler->Lap( FrameProfiler::EVENT );
+    viewer.updateTraversal();
+    if( profiler ) profiler->Lap( FrameProfiler::UPDATE );
+    const osg::Viewport* vp = viewer.getCamera()->getViewport();
+    targetSize.Update( int( vp->width() ), int( vp->height() ) );
+    if( nearFar ) nearFar->Update();
+    if( temporalAO ) temporalAO->Update();
+    if( aoCache ) aoCache->Update();
+    SyncCameras( syncNodes );
+    if( profiler ) profiler->Lap( FrameProfiler::SYNC );
+    viewer.renderingTraversals();
+    if( profiler )
+    {
+        profiler->Lap( FrameProfiler::RENDER );
+        profiler->EndFrame();
+    }
 }
 
 //------------------------------------------------------------------------------
@@ -179,37 +804,11 @@ osg::Node* CreateDefaultModel()
     return group.release();
 }
 
-/// Pre-draw callback used to set the viewport uniform. 
-class SetViewportUniformCBack : public osg::Camera::DrawCallback 
-{
-public:
-	SetViewportUniformCBack( const osg::Camera* observedCamera, osg::Uniform* vp )
-		: observedCamera_( observedCamera ), uniform_( vp ) {}
-	void operator()( osg::Node* , osg::NodeVisitor* )
-    {
-        SetUniform();
-    }
-	void operator() ( osg::RenderInfo& /*renderInfo*/ ) const
-    {
-        SetUniform();
-	}
-    void SetUniform() const 
-    {
-        if( observedCamera_ != 0 && observedCamera_->getViewport() != 0 )
-        {
-            if( uniform_ ) uniform_->set( osg::Vec2( observedCamera_->getViewport()->width(), observedCamera_->getViewport()->height() ) );
-        }
-    }
-private:
-	osg::ref_ptr< const osg::Camera > observedCamera_;
-	osg::ref_ptr< osg::Uniform > uniform_;
-};
-
 /// Returns command line parser
 osg::ArgumentParser GetCmdLineParser( int* argc, char** argv )
 {
     osg::ArgumentParser arguments( argc, argv );
-    arguments.getApplicationUsage()->addCommandLineOption( "--options", "Pass options to loader(s)" );
+    AddSceneLoadUsage( *arguments.getApplicationUsage() );
    
     arguments.getApplicationUsage()->addCommandLineOption( "-s",        "[simple] Simple, no automatic computation of kernel width" );
     arguments.getApplicationUsage()->addCommandLineOption( "-hw",       "[simple] Half window width in # of steps" );
@@ -225,19 +824,117 @@ osg::ArgumentParser GetCmdLineParser( int* argc, char** argv )
     arguments.getApplicationUsage()->addCommandLineOption( "-dRadius", "[advanced] fraction of object radius used as max length of rays" );
 	//arguments.getApplicationUsage()->addCommandLineOption( "-steps", "Max number of marching steps per ray" );
 	arguments.getApplicationUsage()->addCommandLineOption( "-maxNumSamples",  "[advanced] Maximum number of rays" );
-    arguments.getApplicationUsage()->addCommandLineOption( "-normals",  "[all] Compute normals" );
     arguments.getApplicationUsage()->addCommandLineOption( "-mrt",  "[all] Multiple render targets: save depth, position and normals in pre-rendering step" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-gbuffer",
+                                                           "[all] G-buffer layout: 'full' RGBA32F positions and normals, 'compact'\n"
+                                                           "      R32F linear depth and RG16 octahedral normals; compact implies -mrt\n"
+                                                           "      and is supported by ssao_trace_per_frag2_optimal shaders" );
     arguments.getApplicationUsage()->addCommandLineOption( "-shade", 
                                                            "[all] Shading style: 'ao' ambient occlusion only\n"
                                                            "                     'ao_flat' ambient occlusion with flat shading\n"
                                                            "                     'ao_lambert' ambient occlusion with lambert shading\n"
                                                            "                     'ao_sph_harm' spherical harmonics" ); 
+    arguments.getApplicationUsage()->addCommandLineOption( "-hiz",
+                                                           "[advanced] Number of min/max depth pyramid levels (1-4) used to trace\n"
+                                                           "           distant samples at coarser resolution; supported by\n"
+                                                           "           ssao_trace_per_frag2_optimal shaders" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-aoRes",
+                                                           "[advanced] Ambient occlusion resolution: 'full', 'half' or 'quarter';\n"
+                                                           "           reduced resolution occlusion is upsampled with a depth aware filter;\n"
+                                                           "           supported by ssao_trace_per_frag2_optimal shaders" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-temporal",
+                                                           "[advanced] Number of frames N over which rays are distributed: each frame\n"
+                                                           "           traces 1/N of the rays and accumulates occlusion reprojected\n"
+                                                           "           from previous frames; supported by ssao_trace_per_frag2_optimal shaders" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-interleave",
+                                                           "[advanced] Rotate directions per pixel in a 4x4 pattern, trace 1/4 of the\n"
+                                                           "           directions per pixel and blur occlusion with a depth aware 4x4 filter;\n"
+                                                           "           supported by ssao_trace_per_frag2_optimal shaders" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-aoCache",
+                                                           "[advanced] Trace per vertex occlusion into a cache only when the view,\n"
+                                                           "           projection, a dragged transform or a parameter changes; other\n"
+                                                           "           frames only shade; supported by ssao_trace_per_vert2_optimal shaders" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-aoCacheThreshold",
+                                                           "[advanced] With -aoCache: maximum change of a matrix element, relative to the\n"
+                                                           "           model radius for translations, before occlusion is traced again\n"
+                                                           "           (default 1e-4)" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-deferred",
+                                                           "[advanced] Write material color into the G-buffer and shade with a single\n"
+                                                           "           full-screen pass instead of drawing the model again: occlusion\n"
+                                                           "           is computed once per visible pixel; implies -mrt, textures not\n"
+                                                           "           supported; supported by ssao_trace_per_frag2_optimal shaders" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-reuseDepth",
+                                                           "[advanced] Copy the depth written by the pre-render camera into the main\n"
+                                                           "           camera and draw the model with GL_EQUAL depth test and no depth\n"
+                                                           "           writes: occlusion is computed once per visible pixel; ignored with\n"
+                                                           "           -deferred, -aoCache, -bakedAO and sphere impostors; supported by\n"
+                                                           "           ssao_trace_per_frag2_optimal shaders" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-aoBudget",
+                                                           "[advanced] GPU time budget in milliseconds of the occlusion and shading\n"
+                                                           "           passes: number of rays, max radius in pixels and step multiplier\n"
+                                                           "           are adjusted every few frames to hold it, -maxNumSamples,\n"
+                                                           "           -maxRadius and -stepMul being the highest quality; requires\n"
+                                                           "           timer queries, ignored with -s, -aoCache and -bakedAO" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-minQuality",
+                                                           "[advanced] With -aoBudget: lowest cost relative to the highest quality\n"
+                                                           "           (default 0.1)" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-adaptiveRays",
+                                                           "[advanced] Select the number of rays per pixel from the elevation above\n"
+                                                           "           the tangent plane of 8 neighbors within the kernel radius: no rays\n"
+                                                           "           on flat, convex and background pixels, 1/4, 1/2 or all the rays\n"
+                                                           "           elsewhere; supported by ssao_trace_per_frag2_optimal shaders" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-rayThresholds",
+                                                           "[advanced] With -adaptiveRays: 'a,b,c' elevation sines below which none,\n"
+                                                           "           1/4 and 1/2 of the rays are traced (default 0.1,0.3,0.5)" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-rayStats",
+                                                           "[advanced] Print the histogram of the number of rays per pixel every 100\n"
+                                                           "           frames, computed at quarter resolution; reading it back\n"
+                                                           "           stalls rendering; supported by ssao_trace_per_frag2_optimal shaders" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-cullBackground",
+                                                           "[advanced] Reject background pixels with an early depth test before the\n"
+                                                           "           full-screen passes of -deferred and -interleave and shade\n"
+                                                           "           manipulators without occlusion" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-bakedAO",
+                                                           "[advanced] Read per vertex occlusion baked by ssao_bake from file instead of\n"
+                                                           "           tracing it; the model must be loaded with the same options;\n"
+                                                           "           supported by ssao_trace_per_vert2_optimal and\n"
+                                                           "           ssao_trace_per_frag2_optimal shaders" );
     arguments.getApplicationUsage()->addCommandLineOption( "-textures",  "[advanced] enable textures" );
     arguments.getApplicationUsage()->addCommandLineOption( "-manip",  "[all] enable manipulators; select manipulator with 1-7 keys" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-walk",  "[all] walk through the model with arrow keys and mouse drag, colliding with\n"
+                                                                     "the model triangles, instead of orbiting around it; arrows and Page Up/Down\n"
+                                                                     "do not change the SSAO parameters" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-threading",
+                                                           "[all] Viewer threading model: 'single', 'draw' (draw thread per context),\n"
+                                                           "      'cull' (cull thread per camera, draw thread per context) or 'auto'\n"
+                                                           "      (default); batch mode is always single threaded" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-programCache",  "[all] Directory where linked shader program binaries are stored" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-profile",  "[all] Write per frame CPU traversal and GPU pass times to file;\n"
+                                                                        "       '.json': array of objects, any other extension: CSV" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-batch",  "[batch] Render N frames off-screen, write them to disk and exit" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-cameraPath",  "[batch] Camera path file recorded with the 'z' key; default: orbit around model" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-out",  "[batch] Output file prefix; frames are written to <prefix>_<frame>.<format>" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-outFormat",  "[batch] 'png', 'exr' (float), 'raw' (RGBA8, no header), 'none' (no readback)\n"
+                                                                          "        or any image extension supported by osgDB" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-outWidth",  "[batch] Frame width" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-outHeight",  "[batch] Frame height" );
 
     return arguments;
 }
 
+/// Parse viewer threading model; default: selected by osgViewer from the
+/// number of processors and graphics contexts.
+osgViewer::Viewer::ThreadingModel ParseThreadingModel( osg::ArgumentParser& arguments )
+{
+    std::string m;
+    if( !arguments.read( "-threading", m ) ) return osgViewer::Viewer::AutomaticSelection;
+    if( m == "single" ) return osgViewer::Viewer::SingleThreaded;
+    if( m == "draw" ) return osgViewer::Viewer::DrawThreadPerContext;
+    if( m == "cull" ) return osgViewer::Viewer::CullThreadPerCameraDrawThreadPerContext;
+    if( m == "auto" ) return osgViewer::Viewer::AutomaticSelection;
+    throw std::runtime_error( "Invalid threading model " + m );
+}
+
 /// Parse SSAO parameters
 SSAOParameters ParseSSAOParameters( osg::ArgumentParser& arguments )
 {
@@ -312,8 +1009,105 @@ SSAOParameters ParseSSAOParameters( osg::ArgumentParser& arguments )
         }
         else throw std::runtime_error( "Invalid shading model: " + cmdParStr );
     }
+    if( arguments.read( "-hiz", cmdParStr ) )
+    {
+        std::istringstream is( cmdParStr );
+		is >> p.hizLevels;
+        if( p.hizLevels < 0 || p.hizLevels > 4 ) throw std::runtime_error( "Invalid number of depth pyramid levels: " + cmdParStr );
+    }
+    if( arguments.read( "-aoRes", cmdParStr ) )
+    {
+        if( cmdParStr == "full" )
+        {
+            p.aoResolution = SSAOParameters::AO_FULL_RESOLUTION;
+        }
+        else if( cmdParStr == "half" )
+        {
+            p.aoResolution = SSAOParameters::AO_HALF_RESOLUTION;
+        }
+        else if( cmdParStr == "quarter" )
+        {
+            p.aoResolution = SSAOParameters::AO_QUARTER_RESOLUTION;
+        }
+        else throw std::runtime_error( "Invalid ambient occlusion resolution: " + cmdParStr );
+    }
+    if( arguments.read( "-temporal", cmdParStr ) )
+    {
+        std::istringstream is( cmdParStr );
+		is >> p.temporalSubsets;
+        if( p.temporalSubsets < 0 ) throw std::runtime_error( "Invalid number of temporal subsets: " + cmdParStr );
+    }
+    p.interleaved = arguments.read( "-interleave" );
+    p.aoCache = arguments.read( "-aoCache" );
+    if( arguments.read( "-aoCacheThreshold", cmdParStr ) )
+    {
+        std::istringstream is( cmdParStr );
+        is >> p.aoCacheThreshold;
+        if( p.aoCacheThreshold < 0.f ) throw std::runtime_error( "Invalid AO cache threshold: " + cmdParStr );
+    }
     p.mrt = arguments.read( "-mrt" );
+    if( arguments.read( "-gbuffer", cmdParStr ) )
+    {
+        if( cmdParStr == "full" ) p.gbufferLayout = SSAOParameters::GBUFFER_FULL;
+        else if( cmdParStr == "compact" ) p.gbufferLayout = SSAOParameters::GBUFFER_COMPACT;
+        else throw std::runtime_error( "Invalid G-buffer layout: " + cmdParStr );
+        p.mrt = p.mrt || p.gbufferLayout == SSAOParameters::GBUFFER_COMPACT;
+    }
+    // the resolve pass reads positions, normals and material color from the G-buffer
+    p.deferred = arguments.read( "-deferred" );
+    p.mrt = p.mrt || p.deferred;
+    p.reuseDepth = arguments.read( "-reuseDepth" );
+    if( arguments.read( "-aoBudget", cmdParStr ) )
+    {
+        std::istringstream is( cmdParStr );
+        is >> p.aoBudget;
+        if( p.aoBudget < 0.f ) throw std::runtime_error( "Invalid GPU time budget: " + cmdParStr );
+    }
+    p.adaptiveRays = arguments.read( "-adaptiveRays" );
+    if( arguments.read( "-rayThresholds", cmdParStr ) )
+    {
+        std::istringstream is( cmdParStr );
+        char c0 = 0, c1 = 0;
+        is >> p.rayThresholds[ 0 ] >> c0 >> p.rayThresholds[ 1 ] >> c1 >> p.rayThresholds[ 2 ];
+        if( !is || c0 != ',' || c1 != ',' ) throw std::runtime_error( "Invalid ray thresholds: " + cmdParStr );
+    }
+    p.rayStats = arguments.read( "-rayStats" );
+    p.cullBackground = arguments.read( "-cullBackground" );
+    if( arguments.read( "-minQuality", cmdParStr ) )
+    {
+        std::istringstream is( cmdParStr );
+        is >> p.minQuality;
+        if( p.minQuality <= 0.f || p.minQuality > 1.f ) throw std::runtime_error( "Invalid minimum quality: " + cmdParStr );
+    }
     p.enableTextures = arguments.read( "-textures" );
+    if( p.deferred && p.enableTextures ) throw std::runtime_error( "Textures are not supported in deferred mode" );
+    return p;
+}
+
+/// Parse off-screen batch rendering parameters
+BatchParameters ParseBatchParameters( osg::ArgumentParser& arguments )
+{
+    BatchParameters p;
+    std::string cmdParStr;
+    if( arguments.read( "-batch", cmdParStr ) )
+    {
+        std::istringstream is( cmdParStr );
+        is >> p.frames;
+    }
+    if( arguments.read( "-outWidth", cmdParStr ) )
+    {
+        std::istringstream is( cmdParStr );
+        is >> p.width;
+    }
+    if( arguments.read( "-outHeight", cmdParStr ) )
+    {
+        std::istringstream is( cmdParStr );
+        is >> p.height;
+    }
+    if( p.width <= 0 || p.height <= 0 ) throw std::runtime_error( "Invalid output size" );
+    arguments.read( "-cameraPath", p.cameraPath );
+    arguments.read( "-out", p.outputPrefix );
+    arguments.read( "-outFormat", p.format );
     return p;
 }
 
@@ -326,73 +1120,80 @@ int main( int argc, char **argv )
 	
 	try
 	{
-        /// *** I/O *** ///
-        // ADD EXTENSIONS //
-		// Add OB extensions
-		osgDB::Registry* r = osgDB::Registry::instance();
-		assert( r );
-		r->addFileExtensionAlias( "pdb",  "chem" );
-		r->addFileExtensionAlias( "ent",  "chem" );
-		r->addFileExtensionAlias( "hin",  "chem" );
-		r->addFileExtensionAlias( "xyz",  "chem" );
-		r->addFileExtensionAlias( "mol",  "chem" );
-		r->addFileExtensionAlias( "mol2", "chem" );
-		r->addFileExtensionAlias( "cube", "chem" );
-		r->addFileExtensionAlias( "g03",  "chem" );
-		r->addFileExtensionAlias( "g98",  "chem" );
-		r->addFileExtensionAlias( "gam",  "chem" );
-		r->addFileExtensionAlias( "coor", "chem" );
-		r->addFileExtensionAlias( "ref",  "chem" );
-
         // READ PARAMETERS //
 		// read and parse ssao parameters
 		osg::ArgumentParser arguments = GetCmdLineParser(&argc,argv);
 	    SSAOParameters ssaoParams = ParseSSAOParameters( arguments );
-	    // read additional options to pass to reader
-        std::string options;
-        arguments.read( "--options", options );
-       	
+        const BatchParameters batchParams = ParseBatchParameters( arguments );
+        std::string profileFile;
+        arguments.read( "-profile", profileFile );
+        // read before loading the model: any argument left is a model file
+        std::string programCacheDir;
+        arguments.read( "-programCache", programCacheDir );
+        GetDefaultProgramCache().SetDirectory( programCacheDir );
+        const bool manipulators = arguments.read( "-manip" );
+        const bool walk = arguments.read( "-walk" );
+        SceneLoadParameters loadParams = ParseSceneLoadParameters( arguments );
+        // texture units used by SSAO: depth/positions, normals, occlusion map,
+        // depth pyramid levels, occlusion history and per vertex occlusion cache
+        // or material color
+        const int aoCacheUnit = ssaoParams.texUnit + 3 + ssaoParams.hizLevels + ( ssaoParams.temporalSubsets > 1 ? 1 : 0 );
+        // G-buffer material color, exclusive with the occlusion cache
+        const int albedoUnit = aoCacheUnit;
+        loadParams.enableTextures = ssaoParams.enableTextures;
+        loadParams.texUnit = ssaoParams.texUnit;
+        loadParams.reservedTexUnits = aoCacheUnit - ssaoParams.texUnit + ( ssaoParams.aoCache || ssaoParams.deferred ? 1 : 0 );
+        const osgViewer::Viewer::ThreadingModel threadingModel = ParseThreadingModel( arguments );
+        std::string bakedAOFile;
+        arguments.read( "-bakedAO", bakedAOFile );
+
+        /// *** I/O *** ///
         // LOAD MODEL //
-	    osg::ref_ptr<osg::Node> model = osgDB::readNodeFiles( arguments, new osgDB::ReaderWriter::Options( options ) );
-	    if( model != 0 && arguments.read( "-normals" ) )
-	    {
-		    osgUtil::SmoothingVisitor tsv;
-		    model->accept( tsv );
-	    }
-        if( model == 0 ) model = CreateDefaultModel();
-   
-        // add group: useful for adding transform in case mainpulator requested
-        if( !model->asGroup() )
+        bool sphereImpostors = false;
+        osg::ref_ptr< osg::Node > defaultModel = CreateDefaultModel();
+        osg::ref_ptr<osg::Node> model = LoadScene( arguments, loadParams, osg::get_pointer( defaultModel ), &sphereImpostors );
+        // sphere impostors are written into the G-buffer: multiple render targets required
+        if( sphereImpostors )
         {
-            osg::ref_ptr< osg::Group > group = new osg::Group;
-            group->addChild( osg::get_pointer( model ) );
-            model = group;
+            ssaoParams.sphereImpostors = true;
+            ssaoParams.mrt = true;
         }
-
-        // PROCESS TEXTURES//
-        // enable or remove textures
-        if( model != 0 )
+        // BAKED OCCLUSION
+        // per vertex visibility computed offline by ssao_bake: no tracing
+        if( !bakedAOFile.empty() )
         {
-            if( ssaoParams.enableTextures )
-            {
-                // create reserved texture unit list
-                std::vector< int > tu( 3 );
-                tu[ 0 ] = ssaoParams.texUnit;
-                tu[ 1 ] = tu[ 0 ] + 1;
-                tu[ 2 ] = tu[ 1 ] + 1;
-                // make textures in scenegraph accessible from shaders
-                TextureToUniform( *model, "textureUnit", "tex", tu.begin(), tu.end() );
-            }
-            else RemoveTextures( *model );
+            if( ssaoParams.sphereImpostors ) throw std::runtime_error( "Baked occlusion not supported with sphere impostors" );
+            ApplyBakedAO( *model, ReadBakedAO( bakedAOFile ) );
+            ssaoParams.bakedAO = true;
+            // nothing left to compute per pixel
+            ssaoParams.deferred = false;
+        }
+        // PER VERTEX OCCLUSION CACHE
+        // one texel per vertex, impostors have no vertices to cache
+        osg::ref_ptr< osg::TextureRectangle > aoCache;
+        if( ssaoParams.aoCache && !ssaoParams.bakedAO && !ssaoParams.deferred && !ssaoParams.sphereImpostors && !ssaoParams.vertShader.empty() )
+        {
+            const int numVertices = std::max( 1, AssignAOCacheOffsets( *model ) );
+            const int width = std::min( numVertices, AO_CACHE_WIDTH );
+            const int height = ( numVertices + AO_CACHE_WIDTH - 1 ) / AO_CACHE_WIDTH;
+            if( height > AO_CACHE_WIDTH ) throw std::runtime_error( "Too many vertices for the occlusion cache" );
+            aoCache = GenerateColorTextureRectangle( GL_R32F, GL_RED, GL_FLOAT );
+            aoCache->setTextureSize( width, height );
         }
-      
-        InsertTransform( osg::get_pointer( model ) );
+        ssaoParams.aoCache = aoCache.valid();
+        // DEPTH PRE-PASS REUSE
+        // only when the main camera draws the model with the per pixel tracing program
+        ssaoParams.reuseDepth = ssaoParams.reuseDepth && !ssaoParams.deferred && !ssaoParams.aoCache &&
+                                !ssaoParams.bakedAO && !ssaoParams.sphereImpostors;
 
         /// *** CREATE VIEWER *** ///
         // construct the viewer.
 		osgViewer::Viewer viewer;
+        if( batchParams.frames > 0 ) SetupOffscreenCamera( *viewer.getCamera(), batchParams.width, batchParams.height );
 		// add the stats handler
 		viewer.addEventHandler( new osgViewer::StatsHandler );
+        // record camera path for batch mode with the 'z' key
+        viewer.addEventHandler( new osgViewer::RecordCameraPathHandler );
 
         /// *** SSAO *** ///
         // CREATE TEXTURES 
@@ -401,56 +1202,284 @@ int main( int argc, char **argv )
         osg::ref_ptr< osg::TextureRectangle > positions;
         osg::ref_ptr< osg::TextureRectangle > normals;
         // if multiple render targets enabled z component will be available in 
-        // w component of positions or normals
+        // w component of positions or normals; compact layout: linear depth in
+        // positions texture and two component normals
+        const bool compact = ssaoParams.mrt && ssaoParams.gbufferLayout == SSAOParameters::GBUFFER_COMPACT;
         if( ssaoParams.mrt )
         {
-            positions = GenerateColorTextureRectangle();
-            normals   = GenerateColorTextureRectangle();
+            if( compact )
+            {
+                positions = GenerateColorTextureRectangle( GL_R32F, GL_RED, GL_FLOAT );
+                normals   = GenerateColorTextureRectangle( GL_RG16, GL_RG, GL_UNSIGNED_SHORT );
+            }
+            else
+            {
+                positions = GenerateColorTextureRectangle();
+                normals   = GenerateColorTextureRectangle();
+            }
         }
         else depth = GenerateDepthTextureRectangle();
+        // material color read by the deferred resolve pass
+        osg::ref_ptr< osg::TextureRectangle > albedo;
+        if( ssaoParams.deferred ) albedo = GenerateColorTextureRectangle( GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE );
+        // depth copied into the main camera; with multiple render targets it is
+        // attached to the pre-render camera only to be reused
+        osg::ref_ptr< osg::TextureRectangle > prepassDepth = depth;
+        if( ssaoParams.reuseDepth || ( ssaoParams.deferred && ssaoParams.cullBackground ) )
+        {
+            if( !prepassDepth.valid() ) prepassDepth = GenerateDepthTextureRectangle();
+            // same precision as the depth buffer of the main camera
+            prepassDepth->setInternalFormat( GL_DEPTH_COMPONENT24 );
+        }
         
         // CREATE PRE-RENDER CAMERA
         osg::ref_ptr< osg::Camera > preRenderCamera = 
-            CreatePreRenderCamera( osg::get_pointer( depth ),
+            CreatePreRenderCamera( osg::get_pointer( prepassDepth ),
                                    osg::get_pointer( positions ),
-                                   osg::get_pointer( normals ) );
+                                   osg::get_pointer( normals ),
+                                   osg::get_pointer( albedo ),
+                                   compact,
+                                   ssaoParams.sphereImpostors );
         // model to pre-render: used to generate depth map or depth-position-normal data
         preRenderCamera->addChild( osg::get_pointer( model ) ); 
+        // baked occlusion: the depth map is not read
+        if( ssaoParams.bakedAO && !ssaoParams.mrt ) preRenderCamera->setNodeMask( 0 );
+        // depth only: the model must be transformed as in the shading program
+        if( ssaoParams.reuseDepth && !ssaoParams.mrt )
+        {
+            osg::ref_ptr< osg::Program > program = new osg::Program;
+            program->setName( "Depth" );
+            program->addShader( new osg::Shader( osg::Shader::FRAGMENT, DEPTH_ONLY_FRAG ) );
+            program->addShader( new osg::Shader( osg::Shader::VERTEX, DEPTH_ONLY_VERT ) );
+            preRenderCamera->getOrCreateStateSet()->setAttributeAndModes( osg::get_pointer( program ), osg::StateAttribute::ON );
+        }
+
+        // DEPTH PYRAMID
+        std::vector< osg::ref_ptr< osg::TextureRectangle > > hiZTextures;
+        std::vector< osg::ref_ptr< osg::Camera > > hiZCameras =
+            CreateHiZCameras( compact ? osg::get_pointer( positions ) : osg::get_pointer( depth ),
+                              osg::get_pointer( normals ), ssaoParams.bakedAO ? 0 : ssaoParams.hizLevels, hiZTextures );
               
         // setup camera callback
 	    osg::ref_ptr< osg::Uniform > vp = new osg::Uniform( ssaoParams.viewportUniform.c_str(),
-                                                            osg::Vec2( MAX_FBO_WIDTH, MAX_FBO_HEIGHT ) );
+                                                            osg::Vec2( 1.f, 1.f ) );
         preRenderCamera->getOrCreateStateSet()->addUniform( osg::get_pointer( vp ) );
-	    // sync depth camera with main camera
-        SetCameraCallback( osg::get_pointer( preRenderCamera ), viewer.getCamera(), osg::get_pointer( vp ) );
+	    // depth camera matrices and viewport are synchronized with the main camera
+        // in the update phase; the viewport uniform is set by the draw thread
+        preRenderCamera->setPreDrawCallback( new SetViewportUniformCBack( viewer.getCamera(), osg::get_pointer( vp ) ) );
 
         // SETUP MAIN CAMERA & SSAO EVENT HANDLER
         osg::ref_ptr< osg::Program > ssaoProgram = CreateSSAOProgram( ssaoParams, SHADER_PATH );
         osg::ref_ptr< osg::Camera > mainCamera = viewer.getCamera();
+        // REDUCED RESOLUTION, TEMPORALLY ACCUMULATED OR INTERLEAVED OCCLUSION
+        // occlusion-only pass rendered into a downsampled texture, upsampled by the main program;
+        // with temporal accumulation two passes render in alternate frames reading each other's output;
+        // interleaved occlusion is blurred before being read by the main program
+        const bool temporal = ssaoParams.temporalSubsets > 1;
+        // size of all the render targets, follows the main camera viewport
+        osg::ref_ptr< RenderTargetSize > targetSize = new RenderTargetSize;
+        osg::ref_ptr< osg::TextureRectangle > aoMap;
+        osg::ref_ptr< osg::Camera > aoCamera;
+        osg::ref_ptr< osg::TextureRectangle > aoMap2;
+        osg::ref_ptr< osg::Camera > aoCamera2;
+        std::auto_ptr< TemporalAOSwitch > temporalAO;
+        osg::ref_ptr< DoubleBufferedGroup > aoMapReader;
+        std::vector< osg::ref_ptr< osg::Camera > > blurCameras;
+        osg::ref_ptr< osg::TextureRectangle > aoBlurred;
+        osg::ref_ptr< osg::TextureRectangle > aoDepth;
+        if( ssaoProgram != 0 && !ssaoParams.aoCache && !ssaoParams.bakedAO &&
+            ( ssaoParams.aoResolution != SSAOParameters::AO_FULL_RESOLUTION || temporal || ssaoParams.interleaved ) )
+        {
+            aoMap = GenerateColorTextureRectangle();
+            aoCamera = CreateLowResAOCamera( osg::get_pointer( aoMap ),
+                                             CreateSSAOLowResProgram( ssaoParams, SHADER_PATH ),
+                                             ssaoParams.aoResolution );
+            aoCamera->addChild( osg::get_pointer( model ) );
+            if( ssaoParams.interleaved )
+            {
+                // depth of the occlusion pass tested by the blur passes
+                if( ssaoParams.cullBackground )
+                {
+                    aoDepth = GenerateDepthTextureRectangle();
+                    aoCamera->attach( osg::Camera::DEPTH_BUFFER, osg::get_pointer( aoDepth ) );
+                }
+                aoBlurred = GenerateColorTextureRectangle();
+                blurCameras = CreateBlurCameras( osg::get_pointer( aoMap ), osg::get_pointer( aoBlurred ),
+                                                 ssaoParams.aoResolution, osg::get_pointer( aoDepth ) );
+            }
+        }
+        if( aoCamera.valid() && temporal )
+        {
+            aoMap2 = GenerateColorTextureRectangle();
+            aoCamera2 = CreateLowResAOCamera( osg::get_pointer( aoMap2 ),
+                                              CreateSSAOLowResProgram( ssaoParams, SHADER_PATH ),
+                                              ssaoParams.aoResolution );
+            aoCamera2->addChild( osg::get_pointer( model ) );
+            if( aoDepth.valid() ) aoCamera2->attach( osg::Camera::DEPTH_BUFFER, osg::get_pointer( aoDepth ) );
+            // occlusion written in the current frame is read by the blur pass or by the
+            // main camera through a double buffered group; the main scene is added below
+            aoMapReader = new DoubleBufferedGroup;
+            if( !blurCameras.empty() ) aoMapReader->Adopt( *blurCameras[ 0 ] );
+            // history: texture unit following the depth pyramid levels
+            temporalAO.reset( new TemporalAOSwitch( osg::get_pointer( mainCamera ),
+                                                    osg::get_pointer( aoCamera ), osg::get_pointer( aoCamera2 ),
+                                                    osg::get_pointer( aoMap ), osg::get_pointer( aoMap2 ),
+                                                    ssaoParams.texUnit + 3 + ssaoParams.hizLevels,
+                                                    osg::get_pointer( aoMapReader ),
+                                                    blurCameras.empty() ? ssaoParams.texUnit + 2 : 0,
+                                                    ssaoParams.temporalSubsets,
+                                                    osg::get_pointer( targetSize ) ) );
+        }
+        // RAY STATISTICS
+        // number of rays selected per pixel rendered at quarter resolution and
+        // read back into a histogram
+        osg::ref_ptr< osg::Camera > rayStatsCamera;
+        osg::ref_ptr< RayHistogram > rayHistogram;
+        if( ssaoParams.rayStats && ssaoProgram != 0 && !ssaoParams.simple && !ssaoParams.aoCache && !ssaoParams.bakedAO )
+        {
+            osg::ref_ptr< osg::TextureRectangle > rayCounts = GenerateColorTextureRectangle( GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE );
+            rayStatsCamera = CreateLowResAOCamera( osg::get_pointer( rayCounts ),
+                                                   CreateSSAORayStatsProgram( ssaoParams, SHADER_PATH ),
+                                                   SSAOParameters::AO_QUARTER_RESOLUTION );
+            rayStatsCamera->addChild( osg::get_pointer( model ) );
+            rayHistogram = new RayHistogram( osg::get_pointer( rayCounts ) );
+            rayStatsCamera->setPostDrawCallback( osg::get_pointer( rayHistogram ) );
+        }
         if( ssaoProgram != 0 )
         {
             mainCamera->getOrCreateStateSet()->setAttributeAndModes( osg::get_pointer( ssaoProgram ) );
+            // link active programs at realization time and the other shading styles,
+            // cycled with the 'c' key, on a shared compile context
+            CreateSSAOProgramPermutations( ssaoParams, SHADER_PATH );
+            ProgramCache::Programs active;
+            active.push_back( ssaoProgram );
+            if( aoCamera.valid() ) active.push_back( CreateSSAOLowResProgram( ssaoParams, SHADER_PATH ) );
+            if( aoCache.valid() ) active.push_back( CreateSSAOCacheProgram( ssaoParams, SHADER_PATH ) );
+            if( rayStatsCamera.valid() ) active.push_back( CreateSSAORayStatsProgram( ssaoParams, SHADER_PATH ) );
+            viewer.setRealizeOperation( GetDefaultProgramCache().CreateRealizeOperation( active ) );
+            viewer.addEventHandler( CreateShadingStyleHandler( *mainCamera->getOrCreateStateSet(), ssaoParams, SHADER_PATH ) );
         }
         osg::ref_ptr< osgGA::GUIEventHandler > uniformHandler = 
             CreateSSAOUniformsAndHandler( *model, *mainCamera->getOrCreateStateSet(), ssaoParams,
-                    osg::get_pointer( depth ), osg::get_pointer( positions ), osg::get_pointer( normals ) );
+                    osg::get_pointer( depth ), osg::get_pointer( positions ), osg::get_pointer( normals ),
+                    aoBlurred.valid() ? osg::get_pointer( aoBlurred ) : osg::get_pointer( aoMap ) );
+        // walk-through: the arrows and Page Up/Down move the camera
+        if( walk && uniformHandler.valid() ) uniformHandler = new NavigationKeyFilter( osg::get_pointer( uniformHandler ) );
         viewer.addEventHandler( osg::get_pointer( uniformHandler ) );
+        // uniforms and program of the main camera, inherited by the cameras
+        // rendering to textures, are changed by event handlers: with a
+        // multithreaded viewer the next frame does not start until all the
+        // drawables using them have been drawn
+        mainCamera->getOrCreateStateSet()->setDataVariance( osg::Object::DYNAMIC );
+        // depth pyramid levels: texture units following the ones reserved for depth/positions/normals/occlusion
+        for( unsigned int i = 0; i != hiZTextures.size(); ++i )
+        {
+            std::ostringstream os;
+            os << "hiZ" << ( i + 1 );
+            mainCamera->getOrCreateStateSet()->setTextureAttributeAndModes( ssaoParams.texUnit + 3 + i, osg::get_pointer( hiZTextures[ i ] ) );
+            mainCamera->getOrCreateStateSet()->addUniform( new osg::Uniform( os.str().c_str(), int( ssaoParams.texUnit + 3 + i ) ) );
+        }
         // set up uniform
         osg::ref_ptr< osg::Uniform > vpu = new  osg::Uniform( ssaoParams.viewportUniform.c_str(),
-                                                 osg::Vec2( MAX_FBO_WIDTH, MAX_FBO_HEIGHT ) );
+                                                 osg::Vec2( 1.f, 1.f ) );
         mainCamera->setPreDrawCallback( 
             new SetViewportUniformCBack( osg::get_pointer( mainCamera ), osg::get_pointer( vpu ) ) );
         mainCamera->getOrCreateStateSet()->addUniform( osg::get_pointer( vpu ) );
+        // per vertex occlusion cache: traced only when stale, read by the main program
+        osg::ref_ptr< osg::Camera > aoCacheCamera;
+        std::auto_ptr< AOCacheSwitch > aoCacheSwitch;
+        if( aoCache.valid() && ssaoProgram != 0 )
+        {
+            aoCacheCamera = CreateAOCacheCamera( osg::get_pointer( aoCache ), CreateSSAOCacheProgram( ssaoParams, SHADER_PATH ) );
+            aoCacheCamera->addChild( osg::get_pointer( model ) );
+            osg::ref_ptr< osg::Uniform > vpc = new osg::Uniform( ssaoParams.viewportUniform.c_str(), osg::Vec2( 1.f, 1.f ) );
+            aoCacheCamera->getOrCreateStateSet()->addUniform( osg::get_pointer( vpc ) );
+            aoCacheCamera->setPreDrawCallback( new SetViewportUniformCBack( osg::get_pointer( mainCamera ), osg::get_pointer( vpc ) ) );
+            osg::StateSet* set = mainCamera->getOrCreateStateSet();
+            set->setTextureAttributeAndModes( aoCacheUnit, osg::get_pointer( aoCache ) );
+            set->addUniform( new osg::Uniform( "aoCache", aoCacheUnit ) );
+            set->addUniform( new osg::Uniform( "aoCacheSize", osg::Vec2( float( aoCache->getTextureWidth() ),
+                                                                         float( aoCache->getTextureHeight() ) ) ) );
+            // not cached geometries
+            set->addUniform( new osg::Uniform( "aoCacheOffset", -1 ) );
+            // the shading pass reads the G-buffer only with multiple render targets
+            std::vector< osg::Camera* > traceOnly;
+            if( !ssaoParams.mrt ) traceOnly.push_back( osg::get_pointer( preRenderCamera ) );
+            aoCacheSwitch.reset( new AOCacheSwitch( osg::get_pointer( mainCamera ), osg::get_pointer( aoCacheCamera ), *model,
+                                                    traceOnly, ssaoParams.aoCacheThreshold, osg::get_pointer( vpu ) ) );
+        }
+
+        // deferred resolve: material color read from the G-buffer
+        if( albedo.valid() && ssaoProgram != 0 )
+        {
+            osg::StateSet* set = mainCamera->getOrCreateStateSet();
+            set->setTextureAttributeAndModes( albedoUnit, osg::get_pointer( albedo ) );
+            set->addUniform( new osg::Uniform( "albedo", albedoUnit ) );
+        }
+        else ssaoParams.deferred = false;
+        // fixed function shading is not guaranteed to produce the same depth
+        if( ssaoProgram == 0 ) ssaoParams.reuseDepth = false;
 
         /// *** ADD TO VIEWER *** ///
         osg::ref_ptr< osg::Group > root = new osg::Group;
+        std::auto_ptr< NearFarFit > nearFarFit;
         root->addChild( osg::get_pointer( preRenderCamera ) );
-        root->addChild( osg::get_pointer( model ) );
-        viewer.setSceneData( osg::get_pointer( root ) );
+        for( unsigned int i = 0; i != hiZCameras.size(); ++i ) root->addChild( osg::get_pointer( hiZCameras[ i ] ) );
+        if( aoCamera.valid() ) root->addChild( osg::get_pointer( aoCamera ) );
+        if( aoCamera2.valid() ) root->addChild( osg::get_pointer( aoCamera2 ) );
+        if( aoCacheCamera.valid() ) root->addChild( osg::get_pointer( aoCacheCamera ) );
+        if( rayStatsCamera.valid() ) root->addChild( osg::get_pointer( rayStatsCamera ) );
+        for( unsigned int i = 0; i != blurCameras.size(); ++i ) root->addChild( osg::get_pointer( blurCameras[ i ] ) );
+        if( ssaoParams.deferred )
+        {
+            // model drawn only into the G-buffer, still reachable for intersections
+            // and home position; the resolve quad does not depend on near and far
+            // planes, computed by the cameras drawing the model
+            osg::ref_ptr< osg::Group > gbufferOnly = new osg::Group;
+            gbufferOnly->setNodeMask( GBUFFER_ONLY_MASK );
+            gbufferOnly->addChild( osg::get_pointer( model ) );
+            root->addChild( osg::get_pointer( gbufferOnly ) );
+            if( ssaoParams.cullBackground ) root->addChild( CreateDepthCopyQuad( osg::get_pointer( prepassDepth ) ) );
+            root->addChild( CreateDeferredResolveQuad( ssaoParams.cullBackground ) );
+            mainCamera->setCullMask( ~GBUFFER_ONLY_MASK );
+            mainCamera->setComputeNearFarMode( osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR );
+            preRenderCamera->setComputeNearFarMode( osg::CullSettings::COMPUTE_NEAR_FAR_USING_BOUNDING_VOLUMES );
+            if( aoCamera.valid() ) aoCamera->setComputeNearFarMode( osg::CullSettings::COMPUTE_NEAR_FAR_USING_BOUNDING_VOLUMES );
+            if( aoCamera2.valid() ) aoCamera2->setComputeNearFarMode( osg::CullSettings::COMPUTE_NEAR_FAR_USING_BOUNDING_VOLUMES );
+        }
+        else if( ssaoParams.reuseDepth )
+        {
+            // pre-render depth is copied first, then the model is shaded only
+            // where its depth equals the copied one: one shaded fragment per pixel;
+            // both cameras use the same near and far planes, fitted to the model
+            // since the bound of the quad is not meaningful
+            osg::ref_ptr< osg::Group > equalDepth = new osg::Group;
+            equalDepth->getOrCreateStateSet()->setAttributeAndModes( new osg::Depth( osg::Depth::EQUAL, 0.0, 1.0, false ),
+                                                                     osg::StateAttribute::ON );
+            equalDepth->addChild( osg::get_pointer( model ) );
+            root->addChild( CreateDepthCopyQuad( osg::get_pointer( prepassDepth ) ) );
+            root->addChild( osg::get_pointer( equalDepth ) );
+            preRenderCamera->setComputeNearFarMode( osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR );
+            nearFarFit.reset( new NearFarFit( osg::get_pointer( mainCamera ), osg::get_pointer( model ) ) );
+        }
+        else root->addChild( osg::get_pointer( model ) );
+        if( aoMapReader.valid() && blurCameras.empty() )
+        {
+            aoMapReader->AddSharedChild( osg::get_pointer( root ) );
+            viewer.setSceneData( osg::get_pointer( aoMapReader ) );
+        }
+        else viewer.setSceneData( osg::get_pointer( root ) );
         if( !ssaoParams.enableTextures ) root->getOrCreateStateSet()->addUniform( new osg::Uniform( "textureUnit", -1 ) );
+        // set by molecules only
+        if( ssaoParams.sphereImpostors ) root->getOrCreateStateSet()->addUniform( new osg::Uniform( "sphereImpostors", false ) );
          
+        // picking and walk-through collision go through a hierarchy of the
+        // model triangles, refitted when the transforms are dragged
+        osg::ref_ptr< SceneBVH > bvh;
+        if( manipulators || walk ) bvh = new SceneBVH( *model );
+
         /// *** MANIPULATOR *** ///
-        if( arguments.read( "-manip" ) )
+        if( manipulators )
         {
             //osg::ref_ptr< osgManipulator::Dragger > manip = CreateManipulator( "TranslateAxisDragger" );
             //if( !manip ) throw std::runtime_error( "Cannot create manipulator" );
@@ -459,32 +1488,127 @@ int main( int argc, char **argv )
             //model = InsertTransform( osg::get_pointer( model ) ); // insert transform node above each child node 
             root->addChild( osg::get_pointer( manipGroup ) );
             preRenderCamera->addChild( CreatePreRenderManipulatorTree( osg::get_pointer( manipGroup ) ) );
+            // deferred: draggers are not in the G-buffer, drawn with fixed
+            // function on top of the resolved image; culled background: no
+            // occlusion traced for their pixels either; baked: draggers have
+            // no baked visibility attribute
+            if( ssaoParams.deferred || ssaoParams.cullBackground || ssaoParams.bakedAO ) manipGroup->getOrCreateStateSet()->setAttributeAndModes( new osg::Program );
             // add picker to select manipulator transform: selected transform
             // is the the parent of the selected node
-            viewer.addEventHandler( CreateObjectToManipulatorTransformPicker( osg::get_pointer( manipGroup ) ) );
+            viewer.addEventHandler( CreateObjectToManipulatorTransformPicker( osg::get_pointer( manipGroup ), osg::get_pointer( bvh ) ) );
             viewer.addEventHandler( CreateDraggerSelectorHandler( osg::get_pointer( manipGroup ) ) );
         }
      
         /// *** RENDERING LOOP ***///
         //return viewer.run();
         
-        // since the pre render camera needs to be synchronized with the main camera
-        // we need to perform the synchronization before the actual rendering takes place
-        // Fixed by properly setting a pre-draw callback to update both pre-render and
-        // main camera
-        viewer.setThreadingModel( osgViewer::Viewer::SingleThreaded );     
-		viewer.setCameraManipulator(new osgGA::TrackballManipulator());
+        // cameras rendering to textures are synchronized with the main camera in
+        // the update phase, render targets are reallocated and viewport uniforms
+        // set by the draw thread, temporal state is double buffered and the
+        // main camera state set, changed by the event handlers, is dynamic:
+        // any threading model can be used; batch mode is single threaded
+        // because the frame recorder is driven by the frame loop
+        viewer.setThreadingModel( batchParams.frames > 0 ? osgViewer::Viewer::SingleThreaded : threadingModel );
+        // cameras rendering to textures follow the main camera
+        SyncCameraNodes syncNodes;
+        // and reallocate their render targets when the viewport outgrows them
+        const RenderTargetSize* ts = osg::get_pointer( targetSize );
+        syncNodes.push_back( new SyncCameraNode( mainCamera, osg::get_pointer( preRenderCamera ), 0, 1, ts ) );
+        for( unsigned int i = 0; i != hiZCameras.size(); ++i )
+        {
+            syncNodes.push_back( new SyncCameraNode( mainCamera, osg::get_pointer( hiZCameras[ i ] ), 0, 1 << ( i + 1 ), ts ) );
+        }
+        if( aoCamera.valid() ) syncNodes.push_back( new SyncCameraNode( mainCamera, osg::get_pointer( aoCamera ), 0, ssaoParams.aoResolution, ts ) );
+        if( aoCamera2.valid() ) syncNodes.push_back( new SyncCameraNode( mainCamera, osg::get_pointer( aoCamera2 ), 0, ssaoParams.aoResolution, ts ) );
+        for( unsigned int i = 0; i != blurCameras.size(); ++i )
+        {
+            syncNodes.push_back( new SyncCameraNode( mainCamera, osg::get_pointer( blurCameras[ i ] ), 0, ssaoParams.aoResolution, ts ) );
+        }
+        if( rayStatsCamera.valid() )
+        {
+            syncNodes.push_back( new SyncCameraNode( mainCamera, osg::get_pointer( rayStatsCamera ), 0, SSAOParameters::AO_QUARTER_RESOLUTION, ts ) );
+        }
+        osg::ref_ptr< FrameRecorder > recorder;
+        // 'none' format: frames are rendered but not read back (benchmarks)
+        if( batchParams.frames > 0 && batchParams.format != "none" )
+        {
+            recorder = new FrameRecorder( batchParams );
+            mainCamera->setFinalDrawCallback( osg::get_pointer( recorder ) );
+        }
+        // PROFILING
+        // GPU time of each render pass, frame readback timed separately;
+        // the budget controller reads GPU times from the profiler, used
+        // without output file if no profile is requested
+        const bool budget = ssaoParams.aoBudget > 0.f && ssaoProgram != 0 && !ssaoParams.simple &&
+                            !ssaoParams.aoCache && !ssaoParams.bakedAO;
+        osg::ref_ptr< FrameProfiler > profiler;
+        if( !profileFile.empty() || budget )
+        {
+            profiler = new FrameProfiler( profileFile );
+            profiler->AddCamera( *preRenderCamera, "gbuffer" );
+            for( unsigned int i = 0; i != hiZCameras.size(); ++i ) profiler->AddCamera( *hiZCameras[ i ], "hiz" );
+            if( aoCamera.valid() ) profiler->AddCamera( *aoCamera, "ao" );
+            if( aoCamera2.valid() ) profiler->AddCamera( *aoCamera2, "ao" );
+            if( aoCacheCamera.valid() ) profiler->AddCamera( *aoCacheCamera, "aocache" );
+            for( unsigned int i = 0; i != blurCameras.size(); ++i ) profiler->AddCamera( *blurCameras[ i ], "blur" );
+            profiler->AddCamera( *mainCamera, "shading", "readback" );
+            profiler->SetMainCamera( osg::get_pointer( mainCamera ) );
+            // parameters changed at run-time through the keyboard handlers
+            const char* uniforms[] = { "numSamples", "hwMax", "dstep", "occlusionFactor" };
+            for( int i = 0; i != sizeof( uniforms ) / sizeof( uniforms[ 0 ] ); ++i )
+            {
+                profiler->AddUniform( mainCamera->getOrCreateStateSet()->getUniform( uniforms[ i ] ) );
+            }
+        }
+        // ADAPTIVE QUALITY
+        // tracing cost held within the budget: occlusion, blur and shading passes
+        if( budget )
+        {
+            std::vector< std::string > passes;
+            passes.push_back( "ao" );
+            passes.push_back( "blur" );
+            passes.push_back( "shading" );
+            osg::StateSet* set = mainCamera->getOrCreateStateSet();
+            viewer.addEventHandler( new QualityController( *profiler, passes, ssaoParams.aoBudget, ssaoParams.minQuality,
+                                                           set->getUniform( "numSamples" ),
+                                                           set->getUniform( "hwMax" ),
+                                                           set->getUniform( "dstep" ) ) );
+        }
+        if( batchParams.frames > 0 )
+        {
+            // no camera manipulator: view matrix is set from camera path
+            osg::ref_ptr< osg::AnimationPath > path = CreateBatchCameraPath( batchParams.cameraPath, model->getBound() );
+            viewer.setReleaseContextAtEndOfFrameHint( false );
+            viewer.realize();
+            if( !viewer.isRealized() ) throw std::runtime_error( "Cannot realize off-screen viewer" );
+            // frame -1 is not recorded: render targets are allocated and programs
+            // are compiled in the first frame
+            for( int f = -1; f != batchParams.frames; ++f )
+            {
+                mainCamera->setViewMatrix( GetCameraPathViewMatrix( *path, std::max( f, 0 ), batchParams.frames ) );
+                if( recorder.valid() ) recorder->SetFrame( f );
+                RenderFrame( viewer, *targetSize, syncNodes, temporalAO.get(), aoCacheSwitch.get(), nearFarFit.get(), osg::get_pointer( profiler ) );
+            }
+            if( recorder.valid() ) recorder->Finish();
+            if( profiler.valid() ) profiler->Finish();
+            if( rayHistogram.valid() ) rayHistogram->Print();
+            return 0;
+        }
+        if( walk )
+        {
+            osg::ref_ptr< FirstPersonManipulator > fpm = new FirstPersonManipulator;
+            fpm->setSceneBVH( osg::get_pointer( bvh ) );
+            viewer.setCameraManipulator( osg::get_pointer( fpm ) );
+        }
+		else viewer.setCameraManipulator(new osgGA::TrackballManipulator());
         viewer.setReleaseContextAtEndOfFrameHint( false );
         viewer.realize();
-        SyncCameraNode sn( mainCamera, osg::get_pointer( preRenderCamera ), 0 );
         while( !viewer.done() ) 
         {
-            viewer.advance();
-            viewer.eventTraversal();
-            viewer.updateTraversal();
-            sn.SyncCameras();
-            viewer.renderingTraversals();
+            RenderFrame( viewer, *targetSize, syncNodes, temporalAO.get(), aoCacheSwitch.get(), nearFarFit.get(), osg::get_pointer( profiler ) );
         }
+        if( profiler.valid() ) profiler->Finish();
+        if( rayHistogram.valid() ) rayHistogram->Print();
         return 0;
 	}
 	catch( const std::exception& e )
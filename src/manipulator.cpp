@@ -8,6 +8,8 @@
 #include <map>
 #include <stdexcept>
 
+#include "scene_bvh.h"
+
 static const char PASSTHROUGH_VERT[] =
 "varying vec4 color;"
 "void main(void)\n"
@@ -64,7 +66,8 @@ class PickHandler : public osgGA::GUIEventHandler
 public: 
 
     /// @param d group whose first child is a dragger
-    PickHandler( osg::Group* d ) : draggerGroup_( d ), transform_( 0 ) {}
+    /// @param bvh optional hierarchy of the pickable objects
+    PickHandler( osg::Group* d, SceneBVH* bvh = 0 ) : draggerGroup_( d ), transform_( 0 ), bvh_( bvh ) {}
             
     bool handle( const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa )
     {
@@ -83,44 +86,33 @@ public:
     }
     virtual void pick( osgViewer::View* view, const osgGA::GUIEventAdapter& ea )
     {
-        osgUtil::LineSegmentIntersector::Intersections intersections;
-        const float x = ea.getX();
-        const float y = ea.getY();
-        if( view->computeIntersections( x, y, intersections ) )
+        osg::NodePath path;
+        if( Intersect( view, ea.getX(), ea.getY(), path ) )
         {
-            for( osgUtil::LineSegmentIntersector::Intersections::iterator hitr = intersections.begin();
-                 hitr != intersections.end();
-                 ++hitr )
+            if( !path.empty() )
             {
-                if( !hitr->nodePath.empty() )
+                // find first matrix transform above picked geode
+                osg::ref_ptr< osg::MatrixTransform > t;
+                osg::NodePath::const_reverse_iterator rit = path.rbegin();
+                for( ; rit != path.rend(); ++rit )
                 {
-                    // if parent is dragger break
-                    if( dynamic_cast< osgManipulator::Dragger* >( hitr->nodePath.back()->getParent( 0 ) ) ) break;
-                    
-                    // find first matrix transform above picked geode
-                    osg::ref_ptr< osg::MatrixTransform > t;
-                    osg::NodePath::const_reverse_iterator rit = hitr->nodePath.rbegin();
-                    for( ; rit != hitr->nodePath.rend(); ++rit )
-                    {
-                        t = dynamic_cast< osg::MatrixTransform* >( *rit );
-                        if( t ) break;
-                    }
-                    if( t )
-                    {
-                        osg::ref_ptr< osgManipulator::Dragger > dragger = draggerGroup_->getNumChildren() > 0 ?
-                            dynamic_cast< osgManipulator::Dragger* >( draggerGroup_->getChild( 0 ) ) 
-                            : 0;
-                        if( !dragger ) break;
-                        float scale = t->getBound().radius() * 1.5f;
-	                    dragger->setMatrix( osg::Matrix::scale( scale, scale, scale ) *
-                                             osg::Matrix::translate( t->getBound().center() ) );
-                        dragger->setHandleEvents( true );
-                        dragger->removeTransformUpdating( osg::get_pointer(transform_ ) );
-                        transform_ = t;
-                        dragger->addTransformUpdating( osg::get_pointer( transform_ ) );
-                        dragger->setNodeMask( 0xffffffff );
-                    }
-                    break;
+                    t = dynamic_cast< osg::MatrixTransform* >( *rit );
+                    if( t ) break;
+                }
+                if( t )
+                {
+                    osg::ref_ptr< osgManipulator::Dragger > dragger = draggerGroup_->getNumChildren() > 0 ?
+                        dynamic_cast< osgManipulator::Dragger* >( draggerGroup_->getChild( 0 ) ) 
+                        : 0;
+                    if( !dragger ) return;
+                    float scale = t->getBound().radius() * 1.5f;
+	                dragger->setMatrix( osg::Matrix::scale( scale, scale, scale ) *
+                                         osg::Matrix::translate( t->getBound().center() ) );
+                    dragger->setHandleEvents( true );
+                    dragger->removeTransformUpdating( osg::get_pointer(transform_ ) );
+                    transform_ = t;
+                    dragger->addTransformUpdating( osg::get_pointer( transform_ ) );
+                    dragger->setNodeMask( 0xffffffff );
                 }
             }
         }
@@ -137,9 +129,51 @@ public:
             }            
         }
     }
-    private:
+private:
+    /// Returns false if nothing is hit, true with the node path of the nearest
+    /// picked geode, or an empty path if the nearest hit is a dragger.
+    bool Intersect( osgViewer::View* view, float x, float y, osg::NodePath& path )
+    {
+        osgUtil::LineSegmentIntersector::Intersections intersections;
+        if( !bvh_.valid() )
+        {
+            if( !view->computeIntersections( x, y, intersections ) ) return false;
+            for( osgUtil::LineSegmentIntersector::Intersections::iterator hitr = intersections.begin();
+                 hitr != intersections.end();
+                 ++hitr )
+            {
+                if( hitr->nodePath.empty() ) continue;
+                // if parent is dragger the dragger handles the event
+                if( !dynamic_cast< osgManipulator::Dragger* >( hitr->nodePath.back()->getParent( 0 ) ) ) path = hitr->nodePath;
+                break;
+            }
+            return true;
+        }
+        // pick ray from near to far plane through the window position
+        float lx = 0.f;
+        float ly = 0.f;
+        const osg::Camera* camera = view->getCameraContainingPosition( x, y, lx, ly );
+        if( !camera ) return false;
+        osg::Matrixd m = camera->getViewMatrix() * camera->getProjectionMatrix();
+        if( camera->getViewport() ) m.postMult( camera->getViewport()->computeWindowMatrix() );
+        const osg::Matrixd inv = osg::Matrixd::inverse( m );
+        const osg::Vec3d start = osg::Vec3d( lx, ly, 0.0 ) * inv;
+        const osg::Vec3d end = osg::Vec3d( lx, ly, 1.0 ) * inv;
+        const SceneBVH::Hit hit = bvh_->Intersect( SceneBVH::Ray( start, end - start ) );
+        // draggers are not part of the hierarchy; hidden draggers have a null node mask
+        const osg::NodePath draggerPath( 1, osg::get_pointer( draggerGroup_ ) );
+        if( view->computeIntersections( x, y, draggerPath, intersections ) )
+        {
+            const osg::Vec3d d = intersections.begin()->getWorldIntersectPoint() - start;
+            if( !hit.Valid() || d * ( end - start ) <= hit.t * ( end - start ).length2() ) return true;
+        }
+        if( !hit.Valid() ) return false;
+        path = bvh_->GetNodePath( hit.instance );
+        return true;
+    }
         osg::ref_ptr< osg::Group > draggerGroup_;
         osg::ref_ptr< osg::MatrixTransform > transform_;
+        osg::ref_ptr< SceneBVH > bvh_;
 
 };
 
@@ -147,9 +181,9 @@ public:
 
 /// Creates an event handler which sets the manipulator transform to the parent transform
 /// of the picked object
-osgGA::GUIEventHandler* CreateObjectToManipulatorTransformPicker( osg::Group* d )
+osgGA::GUIEventHandler* CreateObjectToManipulatorTransformPicker( osg::Group* d, SceneBVH* bvh )
 {
-    return new PickHandler( d );
+    return new PickHandler( d, bvh );
 }
 
 
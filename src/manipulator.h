@@ -14,11 +14,15 @@ namespace osgManipulator
     class Dragger;
 }
 
+class SceneBVH;
+
 /// @param dg group whose first child is a Dragger.
 osg::Group* CreatePreRenderManipulatorTree( osg::Group* dg );
 
 /// @param dg group whose first child is a Dragger.
-osgGA::GUIEventHandler* CreateObjectToManipulatorTransformPicker( osg::Group* dg );
+/// @param bvh if not NULL hierarchy of the pickable objects, used instead of
+///        intersecting the whole scene; draggers are intersected separately
+osgGA::GUIEventHandler* CreateObjectToManipulatorTransformPicker( osg::Group* dg, SceneBVH* bvh = 0 );
 
 osgManipulator::Dragger* CreateManipulator( const std::string& type );
 
@@ -0,0 +1,516 @@
+#include "molecule.h"
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+
+#include <osg/Group>
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/Image>
+#include <osg/Texture>
+#include <osg/TextureRectangle>
+#include <osg/Uniform>
+#include <osgDB/FileNameUtils>
+#include <osgDB/FileUtils>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+//------------------------------------------------------------------------------
+/// Read only memory mapped file.
+class MappedFile
+{
+public:
+    MappedFile( const std::string& fileName ) : data_( 0 ), size_( 0 )
+    {
+#ifdef _WIN32
+        mapping_ = 0;
+        file_ = CreateFileA( fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0 );
+        if( file_ == INVALID_HANDLE_VALUE ) throw std::runtime_error( "Cannot open " + fileName );
+        LARGE_INTEGER size;
+        if( !GetFileSizeEx( file_, &size ) )
+        {
+            Close();
+            throw std::runtime_error( "Cannot read size of " + fileName );
+        }
+        size_ = size_t( size.QuadPart );
+        if( size_ == 0 ) return;
+        mapping_ = CreateFileMappingA( file_, 0, PAGE_READONLY, 0, 0, 0 );
+        if( mapping_ ) data_ = static_cast< const char* >( MapViewOfFile( mapping_, FILE_MAP_READ, 0, 0, 0 ) );
+#else
+        fd_ = open( fileName.c_str(), O_RDONLY );
+        if( fd_ < 0 ) throw std::runtime_error( "Cannot open " + fileName );
+        struct stat st;
+        if( fstat( fd_, &st ) != 0 )
+        {
+            Close();
+            throw std::runtime_error( "Cannot read size of " + fileName );
+        }
+        size_ = size_t( st.st_size );
+        if( size_ == 0 ) return;
+        void* p = mmap( 0, size_, PROT_READ, MAP_PRIVATE, fd_, 0 );
+        if( p != MAP_FAILED )
+        {
+            data_ = static_cast< const char* >( p );
+            // all the pages are read by the parser threads
+            madvise( p, size_, MADV_WILLNEED );
+        }
+#endif
+        if( !data_ )
+        {
+            Close();
+            throw std::runtime_error( "Cannot map " + fileName );
+        }
+    }
+    ~MappedFile() { Close(); }
+    const char* Begin() const { return data_; }
+    const char* End() const { return data_ + size_; }
+private:
+    void Close()
+    {
+#ifdef _WIN32
+        if( data_ ) UnmapViewOfFile( data_ );
+        if( mapping_ ) CloseHandle( mapping_ );
+        if( file_ != INVALID_HANDLE_VALUE ) CloseHandle( file_ );
+        mapping_ = 0;
+        file_ = INVALID_HANDLE_VALUE;
+#else
+        if( data_ ) munmap( const_cast< char* >( data_ ), size_ );
+        if( fd_ >= 0 ) close( fd_ );
+        fd_ = -1;
+#endif
+        data_ = 0;
+    }
+    MappedFile( const MappedFile& );
+    MappedFile& operator=( const MappedFile& );
+#ifdef _WIN32
+    HANDLE file_;
+    HANDLE mapping_;
+#else
+    int fd_;
+#endif
+    const char* data_;
+    size_t size_;
+};
+
+//------------------------------------------------------------------------------
+/// Van der Waals radius (Angstrom) and CPK color.
+struct Element
+{
+    const char* symbol;
+    float radius;
+    unsigned char color[ 3 ];
+};
+
+/// Element 0 is used for unknown symbols.
+const Element ELEMENTS[] = {
+    { "X",  1.70f, { 255,  20, 147 } },
+    { "H",  1.20f, { 255, 255, 255 } },
+    { "C",  1.70f, { 144, 144, 144 } },
+    { "N",  1.55f, {  48,  80, 248 } },
+    { "O",  1.52f, { 255,  13,  13 } },
+    { "S",  1.80f, { 255, 255,  48 } },
+    { "P",  1.80f, { 255, 128,   0 } },
+    { "B",  1.92f, { 255, 181, 181 } },
+    { "F",  1.47f, { 144, 224,  80 } },
+    { "CL", 1.75f, {  31, 240,  31 } },
+    { "BR", 1.85f, { 166,  41,  41 } },
+    { "I",  1.98f, { 148,   0, 148 } },
+    { "SI", 2.10f, { 240, 200, 160 } },
+    { "SE", 1.90f, { 255, 161,   0 } },
+    { "NA", 2.27f, { 171,  92, 242 } },
+    { "K",  2.75f, { 143,  64, 212 } },
+    { "MG", 1.73f, { 138, 255,   0 } },
+    { "CA", 2.31f, {  61, 255,   0 } },
+    { "FE", 2.00f, { 224, 102,  51 } },
+    { "CU", 1.40f, { 200, 128,  51 } },
+    { "ZN", 1.39f, { 125, 128, 176 } }
+};
+
+const int NUM_ELEMENTS = sizeof( ELEMENTS ) / sizeof( ELEMENTS[ 0 ] );
+
+/// Return index of element with symbol [b,e) (case insensitive), 0 if not found.
+int LookupElement( const char* b, const char* e )
+{
+    while( b != e && std::isspace( static_cast< unsigned char >( *b ) ) ) ++b;
+    while( e != b && std::isspace( static_cast< unsigned char >( *( e - 1 ) ) ) ) --e;
+    if( e - b < 1 || e - b > 2 ) return 0;
+    char s[ 3 ] = { '\0', '\0', '\0' };
+    for( int i = 0; i != e - b; ++i ) s[ i ] = char( std::toupper( static_cast< unsigned char >( b[ i ] ) ) );
+    for( int i = 1; i != NUM_ELEMENTS; ++i ) if( std::strcmp( s, ELEMENTS[ i ].symbol ) == 0 ) return i;
+    return 0;
+}
+
+/// Element from atom name: first letter not preceded by other letters,
+/// e.g. 'CA' (alpha carbon) -> C, '1HB' -> H.
+int ElementFromName( const char* b, const char* e )
+{
+    while( b != e && !std::isalpha( static_cast< unsigned char >( *b ) ) ) ++b;
+    return b == e ? 0 : LookupElement( b, b + 1 );
+}
+
+//------------------------------------------------------------------------------
+/// Parse decimal number with optional exponent starting at the first non
+/// blank character in [p,e); returns pointer past the number or 0 if no number.
+/// Not locale dependent, unlike strtod.
+const char* ParseFloat( const char* p, const char* e, float& value )
+{
+    while( p != e && ( *p == ' ' || *p == '\t' ) ) ++p;
+    bool negative = false;
+    if( p != e && ( *p == '-' || *p == '+' ) ) negative = *p++ == '-';
+    const char* digits = p;
+    double v = 0.0;
+    while( p != e && *p >= '0' && *p <= '9' ) v = 10.0 * v + ( *p++ - '0' );
+    if( p != e && *p == '.' )
+    {
+        ++p;
+        double s = 0.1;
+        for( ; p != e && *p >= '0' && *p <= '9'; ++p, s *= 0.1 ) v += s * ( *p - '0' );
+    }
+    if( p == digits ) return 0;
+    if( p != e && ( *p == 'e' || *p == 'E' ) )
+    {
+        const char* q = p + 1;
+        bool negExp = false;
+        if( q != e && ( *q == '-' || *q == '+' ) ) negExp = *q++ == '-';
+        int x = 0;
+        const char* expDigits = q;
+        while( q != e && *q >= '0' && *q <= '9' ) x = 10 * x + ( *q++ - '0' );
+        if( q != expDigits )
+        {
+            double m = 1.0;
+            for( int i = 0; i != x; ++i ) m *= 10.0;
+            v = negExp ? v / m : v * m;
+            p = q;
+        }
+    }
+    value = float( negative ? -v : v );
+    return p;
+}
+
+/// Return [b,e) of the next whitespace separated token starting at p.
+const char* NextToken( const char* p, const char* e, const char*& b )
+{
+    while( p != e && std::isspace( static_cast< unsigned char >( *p ) ) ) ++p;
+    b = p;
+    while( p != e && !std::isspace( static_cast< unsigned char >( *p ) ) ) ++p;
+    return p;
+}
+
+/// Find first occurrence of 's' at the beginning of a line in [b,e).
+const char* FindLine( const char* b, const char* e, const char* s )
+{
+    const size_t n = std::strlen( s );
+    for( const char* p = b; size_t( e - p ) >= n; )
+    {
+        if( std::memcmp( p, s, n ) == 0 ) return p;
+        p = static_cast< const char* >( std::memchr( p, '\n', e - p ) );
+        if( !p ) break;
+        ++p;
+    }
+    return e;
+}
+
+//------------------------------------------------------------------------------
+struct Atom
+{
+    float x, y, z;
+    int element;
+};
+
+/// Atoms parsed from a contiguous range of lines.
+struct Chunk
+{
+    Chunk() : endModel( false ) {}
+    std::vector< Atom > atoms;
+    osg::BoundingBox bounds;
+    /// PDB: chunk contains the end of the first model; following chunks are ignored
+    bool endModel;
+};
+
+enum Format { PDB, MOL2 };
+
+//------------------------------------------------------------------------------
+/// Parse the lines starting in each chunk.
+class ParseTask : public ParallelTask
+{
+public:
+    ParseTask( Format format, const std::vector< const char* >& bounds, std::vector< Chunk >& chunks )
+        : format_( format ), bounds_( bounds ), chunks_( chunks ) {}
+    void Run( int c, int )
+    {
+        Chunk& chunk = chunks_[ c ];
+        const char* e = bounds_[ c + 1 ];
+        // a line has on average more than 40 characters in both formats
+        chunk.atoms.reserve( ( e - bounds_[ c ] ) / 40 );
+        for( const char* b = bounds_[ c ]; b < e; )
+        {
+            const char* eol = static_cast< const char* >( std::memchr( b, '\n', e - b ) );
+            if( !eol ) eol = e;
+            const char* le = eol;
+            if( le != b && *( le - 1 ) == '\r' ) --le;
+            Atom a;
+            if( format_ == PDB )
+            {
+                if( le - b >= 6 && std::memcmp( b, "ENDMDL", 6 ) == 0 )
+                {
+                    chunk.endModel = true;
+                    return;
+                }
+                if( ParsePDB( b, le, a ) ) Add( chunk, a );
+            }
+            else if( ParseMol2( b, le, a ) ) Add( chunk, a );
+            b = eol + 1;
+        }
+    }
+private:
+    static void Add( Chunk& chunk, const Atom& a )
+    {
+        chunk.atoms.push_back( a );
+        chunk.bounds.expandBy( a.x, a.y, a.z );
+    }
+    /// ATOM/HETATM fixed column record: coordinates in columns 31-54, element
+    /// symbol in columns 77-78 or first letter of atom name (13-16).
+    static bool ParsePDB( const char* b, const char* e, Atom& a )
+    {
+        if( e - b < 54 ) return false;
+        if( std::memcmp( b, "ATOM  ", 6 ) != 0 && std::memcmp( b, "HETATM", 6 ) != 0 ) return false;
+        if( !ParseFloat( b + 30, b + 38, a.x ) || !ParseFloat( b + 38, b + 46, a.y ) || !ParseFloat( b + 46, b + 54, a.z ) ) return false;
+        a.element = e - b >= 78 ? LookupElement( b + 76, b + 78 ) : 0;
+        if( a.element == 0 ) a.element = ElementFromName( b + 12, b + 16 );
+        return true;
+    }
+    /// atom_id atom_name x y z atom_type ...; element is the part of the SYBYL
+    /// atom type preceding '.'.
+    static bool ParseMol2( const char* b, const char* e, Atom& a )
+    {
+        const char* t;
+        const char* p = NextToken( b, e, t );
+        if( t == p ) return false;
+        const char* name;
+        const char* nameEnd = NextToken( p, e, name );
+        p = ParseFloat( nameEnd, e, a.x );
+        if( p ) p = ParseFloat( p, e, a.y );
+        if( p ) p = ParseFloat( p, e, a.z );
+        if( !p ) return false;
+        const char* typeEnd = NextToken( p, e, t );
+        a.element = LookupElement( t, std::find( t, typeEnd, '.' ) );
+        if( a.element == 0 ) a.element = ElementFromName( name, nameEnd );
+        return true;
+    }
+    Format format_;
+    const std::vector< const char* >& bounds_;
+    std::vector< Chunk >& chunks_;
+};
+
+//------------------------------------------------------------------------------
+/// Write the atoms of each chunk into the texture images starting at 'offsets[ chunk ]'.
+class FillTask : public ParallelTask
+{
+public:
+    FillTask( const std::vector< Chunk >& chunks, const std::vector< size_t >& offsets,
+              float radiusScale, float* centers, unsigned char* colors )
+        : chunks_( chunks ), offsets_( offsets ), radiusScale_( radiusScale ), centers_( centers ), colors_( colors ) {}
+    void Run( int c, int )
+    {
+        const std::vector< Atom >& atoms = chunks_[ c ].atoms;
+        float* p = centers_ + 4 * offsets_[ c ];
+        unsigned char* q = colors_ + 4 * offsets_[ c ];
+        for( std::vector< Atom >::const_iterator a = atoms.begin(); a != atoms.end(); ++a, p += 4, q += 4 )
+        {
+            const Element& el = ELEMENTS[ a->element ];
+            p[ 0 ] = a->x;
+            p[ 1 ] = a->y;
+            p[ 2 ] = a->z;
+            p[ 3 ] = radiusScale_ * el.radius;
+            q[ 0 ] = el.color[ 0 ];
+            q[ 1 ] = el.color[ 1 ];
+            q[ 2 ] = el.color[ 2 ];
+            q[ 3 ] = 255;
+        }
+    }
+private:
+    const std::vector< Chunk >& chunks_;
+    const std::vector< size_t >& offsets_;
+    float radiusScale_;
+    float* centers_;
+    unsigned char* colors_;
+};
+
+//------------------------------------------------------------------------------
+/// Bounding box of the spheres: the vertex array only contains the corners
+/// of the unit quad expanded by the vertex shader.
+class AtomsBoundingBox : public osg::Drawable::ComputeBoundingBoxCallback
+{
+public:
+    AtomsBoundingBox( const osg::BoundingBox& bb = osg::BoundingBox() ) : bb_( bb ) {}
+    AtomsBoundingBox( const AtomsBoundingBox& other, const osg::CopyOp& op )
+        : osg::Drawable::ComputeBoundingBoxCallback( other, op ), bb_( other.bb_ ) {}
+    META_Object( ssao, AtomsBoundingBox );
+    osg::BoundingBox computeBound( const osg::Drawable& ) const { return bb_; }
+private:
+    osg::BoundingBox bb_;
+};
+
+osg::TextureRectangle* CreateAtomTexture( osg::Image* image )
+{
+    osg::ref_ptr< osg::TextureRectangle > tr = new osg::TextureRectangle( image );
+    tr->setFilter( osg::Texture::MIN_FILTER, osg::Texture::NEAREST );
+    tr->setFilter( osg::Texture::MAG_FILTER, osg::Texture::NEAREST );
+    tr->setWrap( osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE );
+    tr->setWrap( osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE );
+    // data is only needed for the upload: multi-million atom structures
+    // would otherwise be kept in memory twice
+    tr->setUnRefImageDataAfterApply( true );
+    return tr.release();
+}
+
+} // namespace
+
+//------------------------------------------------------------------------------
+osg::Node* ReadMolecule( const std::string& fileName, int textureUnit, float radiusScale, ThreadPool& pool )
+{
+    const Format format = osgDB::getLowerCaseFileExtension( fileName ) == "mol2" ? MOL2 : PDB;
+    MappedFile file( fileName );
+    const char* begin = file.Begin();
+    const char* end = file.End();
+    if( format == MOL2 )
+    {
+        // atom section of the first molecule
+        begin = FindLine( begin, end, "@<TRIPOS>ATOM" );
+        if( begin == end ) throw std::runtime_error( "No @<TRIPOS>ATOM section in " + fileName );
+        begin = static_cast< const char* >( std::memchr( begin, '\n', end - begin ) );
+        begin = begin ? begin + 1 : end;
+        end = FindLine( begin, end, "@<TRIPOS>" );
+    }
+
+    // one chunk per MB, at least as many chunks as threads for large files;
+    // chunk boundaries are moved to the beginning of the next line
+    const size_t size = end - begin;
+    const int numChunks = int( std::max( size_t( 1 ), std::min( size / ( 1 << 20 ) + 1, size_t( 4 * pool.NumThreads() ) ) ) );
+    std::vector< const char* > bounds( numChunks + 1, end );
+    bounds[ 0 ] = begin;
+    for( int c = 1; c < numChunks; ++c )
+    {
+        const char* b = begin + size * c / numChunks;
+        b = std::max( b, bounds[ c - 1 ] );
+        const char* eol = static_cast< const char* >( std::memchr( b, '\n', end - b ) );
+        bounds[ c ] = eol ? eol + 1 : end;
+    }
+    std::vector< Chunk > chunks( numChunks );
+    ParseTask parse( format, bounds, chunks );
+    pool.ParallelFor( numChunks, parse );
+
+    // PDB: chunks following the end of the first model are ignored
+    int usedChunks = 0;
+    while( usedChunks != numChunks && !chunks[ usedChunks++ ].endModel );
+    std::vector< size_t > offsets( usedChunks + 1, 0 );
+    osg::BoundingBox bb;
+    float maxRadius = 0.f;
+    for( int c = 0; c != usedChunks; ++c )
+    {
+        offsets[ c + 1 ] = offsets[ c ] + chunks[ c ].atoms.size();
+        bb.expandBy( chunks[ c ].bounds );
+    }
+    const size_t numAtoms = offsets[ usedChunks ];
+    if( numAtoms == 0 ) throw std::runtime_error( "No atoms in " + fileName );
+    for( int i = 0; i != NUM_ELEMENTS; ++i ) maxRadius = std::max( maxRadius, radiusScale * ELEMENTS[ i ].radius );
+    const int rows = int( ( numAtoms + ATOM_TEXTURE_WIDTH - 1 ) / ATOM_TEXTURE_WIDTH );
+    // minimum GL_MAX_RECTANGLE_TEXTURE_SIZE of current hardware
+    if( rows > 8192 )
+    {
+        std::ostringstream os;
+        os << fileName << ": " << numAtoms << " atoms exceed the maximum of " << 8192 * ATOM_TEXTURE_WIDTH;
+        throw std::runtime_error( os.str() );
+    }
+
+    // per atom data
+    osg::ref_ptr< osg::Image > centers = new osg::Image;
+    centers->allocateImage( ATOM_TEXTURE_WIDTH, rows, 1, GL_RGBA, GL_FLOAT );
+    centers->setInternalTextureFormat( GL_RGBA32F_ARB );
+    osg::ref_ptr< osg::Image > colors = new osg::Image;
+    colors->allocateImage( ATOM_TEXTURE_WIDTH, rows, 1, GL_RGBA, GL_UNSIGNED_BYTE );
+    colors->setInternalTextureFormat( GL_RGBA8 );
+    FillTask fill( chunks, offsets, radiusScale,
+                   reinterpret_cast< float* >( centers->data() ), colors->data() );
+    pool.ParallelFor( usedChunks, fill );
+
+    // unit quad instanced once per atom
+    osg::ref_ptr< osg::Vec3Array > corners = new osg::Vec3Array;
+    corners->push_back( osg::Vec3( -1.f, -1.f, 0.f ) );
+    corners->push_back( osg::Vec3(  1.f, -1.f, 0.f ) );
+    corners->push_back( osg::Vec3(  1.f,  1.f, 0.f ) );
+    corners->push_back( osg::Vec3( -1.f,  1.f, 0.f ) );
+    osg::ref_ptr< osg::Geometry > geometry = new osg::Geometry;
+    geometry->setVertexArray( osg::get_pointer( corners ) );
+    geometry->addPrimitiveSet( new osg::DrawArrays( GL_QUADS, 0, 4, int( numAtoms ) ) );
+    geometry->setUseDisplayList( false );
+    geometry->setUseVertexBufferObjects( true );
+    bb.expandBy( bb.corner( 0 ) - osg::Vec3( maxRadius, maxRadius, maxRadius ) );
+    bb.expandBy( bb.corner( 7 ) + osg::Vec3( maxRadius, maxRadius, maxRadius ) );
+    geometry->setComputeBoundingBoxCallback( new AtomsBoundingBox( bb ) );
+    osg::ref_ptr< osg::Geode > geode = new osg::Geode;
+    geode->addDrawable( osg::get_pointer( geometry ) );
+
+    // textures are bound to a group: model textures are looked up and removed
+    // in geode and drawable state sets only
+    osg::ref_ptr< osg::Group > group = new osg::Group;
+    group->setName( osgDB::getSimpleFileName( fileName ) );
+    group->addChild( osg::get_pointer( geode ) );
+    osg::StateSet* set = group->getOrCreateStateSet();
+    set->setTextureAttributeAndModes( textureUnit, CreateAtomTexture( osg::get_pointer( centers ) ) );
+    set->setTextureAttributeAndModes( textureUnit + 1, CreateAtomTexture( osg::get_pointer( colors ) ) );
+    set->addUniform( new osg::Uniform( "atoms", textureUnit ) );
+    set->addUniform( new osg::Uniform( "atomColors", textureUnit + 1 ) );
+    set->addUniform( new osg::Uniform( "sphereImpostors", true ) );
+    return group.release();
+}
+
+//------------------------------------------------------------------------------
+MoleculeReaderWriter::MoleculeReaderWriter( int textureUnit ) : textureUnit_( textureUnit ), loaded_( 0 )
+{
+    supportsExtension( "pdb", "Protein Data Bank format" );
+    supportsExtension( "ent", "Protein Data Bank format" );
+    supportsExtension( "mol2", "Tripos mol2 format" );
+}
+
+osgDB::ReaderWriter::ReadResult MoleculeReaderWriter::readNode( const std::string& fileName, const Options* options ) const
+{
+    if( !acceptsExtension( osgDB::getLowerCaseFileExtension( fileName ) ) ) return ReadResult::FILE_NOT_HANDLED;
+    const std::string path = osgDB::findDataFile( fileName, options );
+    if( path.empty() ) return ReadResult::FILE_NOT_FOUND;
+    float radiusScale = 1.0f;
+    if( options )
+    {
+        std::istringstream is( options->getOptionString() );
+        std::string opt;
+        while( is >> opt )
+        {
+            if( opt.compare( 0, 12, "radiusScale=" ) == 0 ) ParseFloat( opt.c_str() + 12, opt.c_str() + opt.size(), radiusScale );
+        }
+    }
+    try
+    {
+        osg::Node* node = ReadMolecule( path, textureUnit_, radiusScale );
+        ++loaded_;
+        return node;
+    }
+    catch( const std::exception& e )
+    {
+        return ReadResult( e.what() );
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef MOLECULE_H_
+#define MOLECULE_H_
+
+#include <string>
+
+#include <osg/Node>
+#include <osgDB/ReaderWriter>
+
+#include "thread_pool.h"
+
+/// Width of the textures storing per atom data: atom i is stored in texel
+/// ( i % ATOM_TEXTURE_WIDTH, i / ATOM_TEXTURE_WIDTH ).
+static const int ATOM_TEXTURE_WIDTH = 2048;
+
+//------------------------------------------------------------------------------
+/// Load atoms from PDB (ATOM/HETATM records of the first model) or Tripos
+/// mol2 (@<TRIPOS>ATOM section) file; the file is memory mapped and records
+/// are parsed in parallel chunks.
+/// Returned subgraph renders all the atoms as ray cast sphere impostors with a
+/// single instanced draw: one quad per atom, atom center and radius read by
+/// the vertex shader from the 'atoms' RGBA32F texture and color from the
+/// 'atomColors' RGBA8 texture, bound to units 'textureUnit' and
+/// 'textureUnit' + 1 of the root node state set together with the
+/// 'sphereImpostors' uniform set to true; shaders are compiled with
+/// SPHERE_IMPOSTORS defined.
+/// Spheres have the van der Waals radius of the element times 'radiusScale'.
+osg::Node* ReadMolecule( const std::string& fileName, int textureUnit,
+                         float radiusScale = 1.0f, ThreadPool& pool = GetDefaultThreadPool() );
+
+//------------------------------------------------------------------------------
+/// Reader for .pdb, .ent and .mol2 files through ReadMolecule; takes
+/// precedence over the aliased 'chem' plugin once added to the osgDB registry.
+/// Reader option 'radiusScale=<value>' scales atom radii.
+class MoleculeReaderWriter : public osgDB::ReaderWriter
+{
+public:
+    MoleculeReaderWriter( int textureUnit );
+    const char* className() const { return "Sphere impostor molecule reader"; }
+    ReadResult readNode( const std::string& fileName, const Options* options ) const;
+    /// Number of molecules successfully read.
+    int NumLoaded() const { return loaded_; }
+private:
+    int textureUnit_;
+    mutable int loaded_;
+};
+
+#endif // MOLECULE_H_
@@ -0,0 +1,473 @@
+#include "normals.h"
+
+#include <vector>
+#include <set>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/NodeVisitor>
+#include <osg/TriangleIndexFunctor>
+#include <osgUtil/SmoothingVisitor>
+
+namespace
+{
+//------------------------------------------------------------------------------
+/// Bump allocator for plain data. Reset() releases all the allocations at
+/// once and merges the blocks into one, so that after the first few uses the
+/// same block is reused without any heap allocation.
+class Arena
+{
+public:
+    Arena() : current_( 0 ) {}
+    ~Arena() { Free(); }
+    template < class T > T* Allocate( size_t n )
+    {
+        const size_t bytes = ( n * sizeof( T ) + 15 ) & ~size_t( 15 );
+        while( current_ != blocks_.size() && blocks_[ current_ ].size - blocks_[ current_ ].used < bytes ) ++current_;
+        if( current_ == blocks_.size() ) AddBlock( std::max( bytes, size_t( 1 ) << 20 ) );
+        Block& b = blocks_[ current_ ];
+        T* p = reinterpret_cast< T* >( b.data + b.used );
+        b.used += bytes;
+        return p;
+    }
+    void Reset()
+    {
+        if( blocks_.size() > 1 )
+        {
+            size_t size = 0;
+            for( size_t i = 0; i != blocks_.size(); ++i ) size += blocks_[ i ].size;
+            Free();
+            AddBlock( size );
+        }
+        if( !blocks_.empty() ) blocks_[ 0 ].used = 0;
+        current_ = 0;
+    }
+private:
+    struct Block
+    {
+        char* data;
+        size_t size;
+        size_t used;
+    };
+    void AddBlock( size_t size )
+    {
+        Block b;
+        b.data = new char[ size ];
+        b.size = size;
+        b.used = 0;
+        blocks_.push_back( b );
+    }
+    void Free()
+    {
+        for( size_t i = 0; i != blocks_.size(); ++i ) delete [] blocks_[ i ].data;
+        blocks_.clear();
+    }
+    Arena( const Arena& );
+    Arena& operator=( const Arena& );
+    std::vector< Block > blocks_;
+    size_t current_;
+};
+
+//------------------------------------------------------------------------------
+/// Hash of exact position; -0 and +0 hash to the same value.
+inline unsigned long long PositionHash( const osg::Vec3& p )
+{
+    unsigned long long h = 0;
+    for( int i = 0; i != 3; ++i )
+    {
+        const float f = p[ i ] == 0.f ? 0.f : p[ i ];
+        unsigned int u;
+        std::memcpy( &u, &f, sizeof( u ) );
+        h = ( h ^ u ) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+inline void Normalize( const float* n, osg::Vec3& out )
+{
+    const float l = std::sqrt( n[ 0 ] * n[ 0 ] + n[ 1 ] * n[ 1 ] + n[ 2 ] * n[ 2 ] );
+    out = l > 0.f ? osg::Vec3( n[ 0 ] / l, n[ 1 ] / l, n[ 2 ] / l ) : osg::Vec3( 0.f, 0.f, 0.f );
+}
+
+/// Counts or stores the vertex indices of the triangles of a geometry;
+/// triangles referencing missing vertices are dropped.
+struct TriangleCollector
+{
+    TriangleCollector() : numVertices( 0 ), indices( 0 ), count( 0 ) {}
+    void operator()( unsigned int i1, unsigned int i2, unsigned int i3 )
+    {
+        if( i1 >= numVertices || i2 >= numVertices || i3 >= numVertices ) return;
+        if( indices )
+        {
+            indices[ 3 * count     ] = i1;
+            indices[ 3 * count + 1 ] = i2;
+            indices[ 3 * count + 2 ] = i3;
+        }
+        ++count;
+    }
+    unsigned int numVertices;
+    unsigned int* indices;
+    size_t count;
+};
+
+//------------------------------------------------------------------------------
+/// Normals of one geometry.
+/// Vertices and triangle corners are bucketed by partition (position hash)
+/// with a parallel counting sort over chunks; each partition then welds its
+/// vertices and sums the face normals of its corners independently.
+/// Phases must be executed in order, each one over all chunks or partitions:
+/// HashVertices, Scatter (after CountVertices), ScatterCorners (after
+/// CountCorners), ComputeNormals.
+/// Shared arrays are allocated from 'arena', per partition scratch memory
+/// from the arena passed to ComputeNormals.
+class GeometryNormals
+{
+public:
+    GeometryNormals( osg::Geometry& g, double creaseAngle, int numChunks, int numPartitions, Arena& arena )
+        : geometry_( g ), vertices_( static_cast< const osg::Vec3Array& >( *g.getVertexArray() ) ),
+          numVertices_( vertices_.size() ), numTriangles_( 0 ), numChunks_( numChunks ), numPartitions_( numPartitions ),
+          cosCrease_( float( std::cos( creaseAngle ) ) ), smooth_( creaseAngle >= osg::PI - 1e-6 )
+    {
+        // triangle list, counted first to allocate exactly
+        osg::TriangleIndexFunctor< TriangleCollector > tc;
+        tc.numVertices = numVertices_;
+        g.accept( tc );
+        numTriangles_ = tc.count;
+        tris_ = arena.Allocate< unsigned int >( 3 * numTriangles_ );
+        tc.indices = tris_;
+        tc.count = 0;
+        g.accept( tc );
+
+        hash_ = arena.Allocate< unsigned long long >( numVertices_ );
+        vertexList_ = arena.Allocate< unsigned int >( numVertices_ );
+        local_ = arena.Allocate< unsigned int >( numVertices_ );
+        faceNormals_ = arena.Allocate< float >( 3 * numTriangles_ );
+        cornerList_ = arena.Allocate< unsigned int >( 3 * numTriangles_ );
+        const size_t n = size_t( numChunks_ ) * numPartitions_;
+        vertexOffsets_ = arena.Allocate< size_t >( n );
+        cornerOffsets_ = arena.Allocate< size_t >( n );
+        vertexStart_ = arena.Allocate< size_t >( numPartitions_ + 1 );
+        cornerStart_ = arena.Allocate< size_t >( numPartitions_ + 1 );
+        std::fill( vertexOffsets_, vertexOffsets_ + n, size_t( 0 ) );
+        std::fill( cornerOffsets_, cornerOffsets_ + n, size_t( 0 ) );
+        if( numTriangles_ ) normals_ = new osg::Vec3Array( numVertices_ );
+    }
+    bool Empty() const { return numTriangles_ == 0; }
+    /// Compute vertex hashes and count vertices per partition.
+    void HashVertices( int chunk )
+    {
+        size_t* count = vertexOffsets_ + size_t( chunk ) * numPartitions_;
+        for( size_t v = Begin( numVertices_, chunk ), e = Begin( numVertices_, chunk + 1 ); v != e; ++v )
+        {
+            hash_[ v ] = PositionHash( vertices_[ v ] );
+            ++count[ Partition( v ) ];
+        }
+    }
+    void CountVertices() { PrefixSum( vertexOffsets_, vertexStart_ ); }
+    /// Bucket vertices by partition, compute face normals and count corners per partition.
+    void Scatter( int chunk )
+    {
+        size_t* offset = vertexOffsets_ + size_t( chunk ) * numPartitions_;
+        for( size_t v = Begin( numVertices_, chunk ), e = Begin( numVertices_, chunk + 1 ); v != e; ++v )
+        {
+            vertexList_[ offset[ Partition( v ) ]++ ] = (unsigned int)( v );
+        }
+        size_t* count = cornerOffsets_ + size_t( chunk ) * numPartitions_;
+        for( size_t t = Begin( numTriangles_, chunk ), e = Begin( numTriangles_, chunk + 1 ); t != e; ++t )
+        {
+            const unsigned int* i = tris_ + 3 * t;
+            const osg::Vec3 n = ( vertices_[ i[ 1 ] ] - vertices_[ i[ 0 ] ] ) ^ ( vertices_[ i[ 2 ] ] - vertices_[ i[ 0 ] ] );
+            faceNormals_[ 3 * t     ] = n.x();
+            faceNormals_[ 3 * t + 1 ] = n.y();
+            faceNormals_[ 3 * t + 2 ] = n.z();
+            for( int k = 0; k != 3; ++k ) ++count[ Partition( i[ k ] ) ];
+        }
+    }
+    void CountCorners() { PrefixSum( cornerOffsets_, cornerStart_ ); }
+    /// Bucket corners (indices into the triangle list) by partition of their vertex.
+    void ScatterCorners( int chunk )
+    {
+        size_t* offset = cornerOffsets_ + size_t( chunk ) * numPartitions_;
+        for( size_t c = 3 * Begin( numTriangles_, chunk ), e = 3 * Begin( numTriangles_, chunk + 1 ); c != e; ++c )
+        {
+            cornerList_[ offset[ Partition( tris_[ c ] ) ]++ ] = (unsigned int)( c );
+        }
+    }
+    /// Weld the vertices of partition and compute their normals.
+    void ComputeNormals( int partition, Arena& scratch );
+    /// Assign normals to geometry.
+    void Finish()
+    {
+        geometry_.setNormalArray( osg::get_pointer( normals_ ) );
+        geometry_.setNormalIndices( 0 );
+        geometry_.setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
+        geometry_.dirtyDisplayList();
+    }
+    /// Run all the phases in the calling thread; requires one chunk and one partition.
+    void Compute( Arena& scratch )
+    {
+        HashVertices( 0 );
+        CountVertices();
+        Scatter( 0 );
+        CountCorners();
+        ScatterCorners( 0 );
+        ComputeNormals( 0, scratch );
+        Finish();
+    }
+private:
+    size_t Begin( size_t n, int chunk ) const { return n * chunk / numChunks_; }
+    int Partition( size_t v ) const { return int( ( hash_[ v ] >> 40 ) % numPartitions_ ); }
+    /// Turn per chunk, per partition counts into write offsets: partitions are
+    /// stored one after the other, chunks in order inside each partition.
+    void PrefixSum( size_t* offsets, size_t* start ) const
+    {
+        size_t s = 0;
+        for( int p = 0; p != numPartitions_; ++p )
+        {
+            start[ p ] = s;
+            for( int c = 0; c != numChunks_; ++c )
+            {
+                const size_t n = offsets[ size_t( c ) * numPartitions_ + p ];
+                offsets[ size_t( c ) * numPartitions_ + p ] = s;
+                s += n;
+            }
+        }
+        start[ numPartitions_ ] = s;
+    }
+    osg::Geometry& geometry_;
+    const osg::Vec3Array& vertices_;
+    unsigned int numVertices_;
+    size_t numTriangles_;
+    int numChunks_;
+    int numPartitions_;
+    float cosCrease_;
+    bool smooth_;
+    unsigned int* tris_;
+    unsigned long long* hash_;
+    unsigned int* vertexList_;
+    unsigned int* local_;
+    float* faceNormals_;
+    unsigned int* cornerList_;
+    size_t* vertexOffsets_;
+    size_t* cornerOffsets_;
+    size_t* vertexStart_;
+    size_t* cornerStart_;
+    osg::ref_ptr< osg::Vec3Array > normals_;
+};
+
+void GeometryNormals::ComputeNormals( int partition, Arena& scratch )
+{
+    const unsigned int* vertices = vertexList_ + vertexStart_[ partition ];
+    const size_t n = vertexStart_[ partition + 1 ] - vertexStart_[ partition ];
+    const unsigned int* corners = cornerList_ + cornerStart_[ partition ];
+    const size_t m = cornerStart_[ partition + 1 ] - cornerStart_[ partition ];
+    if( n == 0 ) return;
+    scratch.Reset();
+
+    // weld: vertices are visited in index order, the first vertex at each
+    // position starts a new group
+    size_t tableSize = 1;
+    while( tableSize < 2 * n ) tableSize <<= 1;
+    const size_t mask = tableSize - 1;
+    unsigned int* table = scratch.Allocate< unsigned int >( tableSize );
+    const unsigned int EMPTY = ~0u;
+    std::fill( table, table + tableSize, EMPTY );
+    unsigned int* group = scratch.Allocate< unsigned int >( n );
+    unsigned int numGroups = 0;
+    for( size_t l = 0; l != n; ++l )
+    {
+        const unsigned int v = vertices[ l ];
+        size_t slot = size_t( hash_[ v ] ) & mask;
+        while( table[ slot ] != EMPTY && vertices_[ vertices[ table[ slot ] ] ] != vertices_[ v ] ) slot = ( slot + 1 ) & mask;
+        if( table[ slot ] == EMPTY )
+        {
+            table[ slot ] = (unsigned int)( l );
+            group[ l ] = numGroups++;
+        }
+        else group[ l ] = group[ table[ slot ] ];
+        local_[ v ] = (unsigned int)( l );
+    }
+
+    osg::Vec3Array& normals = *normals_;
+    if( smooth_ )
+    {
+        // sum of all the face normals at each position
+        float* sum = scratch.Allocate< float >( 3 * numGroups );
+        std::fill( sum, sum + 3 * numGroups, 0.f );
+        for( size_t c = 0; c != m; ++c )
+        {
+            const float* fn = faceNormals_ + 3 * ( corners[ c ] / 3 );
+            float* s = sum + 3 * group[ local_[ tris_[ corners[ c ] ] ] ];
+            s[ 0 ] += fn[ 0 ]; s[ 1 ] += fn[ 1 ]; s[ 2 ] += fn[ 2 ];
+        }
+        for( size_t l = 0; l != n; ++l ) Normalize( sum + 3 * group[ l ], normals[ vertices[ l ] ] );
+        return;
+    }
+
+    // corners grouped by position
+    unsigned int* groupStart = scratch.Allocate< unsigned int >( numGroups + 1 );
+    std::fill( groupStart, groupStart + numGroups + 1, 0u );
+    for( size_t c = 0; c != m; ++c ) ++groupStart[ group[ local_[ tris_[ corners[ c ] ] ] ] + 1 ];
+    for( unsigned int g = 0; g != numGroups; ++g ) groupStart[ g + 1 ] += groupStart[ g ];
+    unsigned int* fill = scratch.Allocate< unsigned int >( numGroups );
+    std::copy( groupStart, groupStart + numGroups, fill );
+    unsigned int* groupCorners = scratch.Allocate< unsigned int >( m );
+    for( size_t c = 0; c != m; ++c ) groupCorners[ fill[ group[ local_[ tris_[ corners[ c ] ] ] ] ]++ ] = corners[ c ];
+
+    for( size_t l = 0; l != n; ++l )
+    {
+        const unsigned int v = vertices[ l ];
+        const unsigned int* gc = groupCorners + groupStart[ group[ l ] ];
+        const unsigned int* ge = groupCorners + groupStart[ group[ l ] + 1 ];
+        // average normal of the faces referencing the vertex
+        float own[ 3 ] = { 0.f, 0.f, 0.f };
+        for( const unsigned int* c = gc; c != ge; ++c )
+        {
+            if( tris_[ *c ] != v ) continue;
+            const float* fn = faceNormals_ + 3 * ( *c / 3 );
+            own[ 0 ] += fn[ 0 ]; own[ 1 ] += fn[ 1 ]; own[ 2 ] += fn[ 2 ];
+        }
+        const float ownLength = std::sqrt( own[ 0 ] * own[ 0 ] + own[ 1 ] * own[ 1 ] + own[ 2 ] * own[ 2 ] );
+        // plus faces of the other vertices at the same position within the crease angle
+        float sum[ 3 ] = { own[ 0 ], own[ 1 ], own[ 2 ] };
+        for( const unsigned int* c = gc; c != ge; ++c )
+        {
+            if( tris_[ *c ] == v ) continue;
+            const float* fn = faceNormals_ + 3 * ( *c / 3 );
+            const float d = fn[ 0 ] * own[ 0 ] + fn[ 1 ] * own[ 1 ] + fn[ 2 ] * own[ 2 ];
+            const float fnLength = std::sqrt( fn[ 0 ] * fn[ 0 ] + fn[ 1 ] * fn[ 1 ] + fn[ 2 ] * fn[ 2 ] );
+            if( d < cosCrease_ * fnLength * ownLength ) continue;
+            sum[ 0 ] += fn[ 0 ]; sum[ 1 ] += fn[ 1 ]; sum[ 2 ] += fn[ 2 ];
+        }
+        Normalize( sum, normals[ v ] );
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Phase of large geometry executed over all chunks or partitions.
+class GeometryPhaseTask : public ParallelTask
+{
+public:
+    enum Phase { HASH, SCATTER, SCATTER_CORNERS, NORMALS };
+    GeometryPhaseTask( GeometryNormals& gn, std::vector< Arena* >& arenas )
+        : gn_( gn ), arenas_( arenas ), phase_( HASH ) {}
+    void SetPhase( Phase p ) { phase_ = p; }
+    void Run( int i, int thread )
+    {
+        switch( phase_ )
+        {
+        case HASH: gn_.HashVertices( i ); break;
+        case SCATTER: gn_.Scatter( i ); break;
+        case SCATTER_CORNERS: gn_.ScatterCorners( i ); break;
+        case NORMALS: gn_.ComputeNormals( i, *arenas_[ thread ] ); break;
+        }
+    }
+private:
+    GeometryNormals& gn_;
+    std::vector< Arena* >& arenas_;
+    Phase phase_;
+};
+
+//------------------------------------------------------------------------------
+/// Small geometries, one per task.
+class SmallGeometriesTask : public ParallelTask
+{
+public:
+    SmallGeometriesTask( const std::vector< osg::Geometry* >& geometries, double creaseAngle,
+                         std::vector< Arena* >& data, std::vector< Arena* >& scratch )
+        : geometries_( geometries ), creaseAngle_( creaseAngle ), data_( data ), scratch_( scratch ) {}
+    void Run( int i, int thread )
+    {
+        data_[ thread ]->Reset();
+        GeometryNormals gn( *geometries_[ i ], creaseAngle_, 1, 1, *data_[ thread ] );
+        if( !gn.Empty() ) gn.Compute( *scratch_[ thread ] );
+    }
+private:
+    const std::vector< osg::Geometry* >& geometries_;
+    double creaseAngle_;
+    std::vector< Arena* >& data_;
+    std::vector< Arena* >& scratch_;
+};
+
+//------------------------------------------------------------------------------
+/// Collects each geometry once.
+class GeometryCollector : public osg::NodeVisitor
+{
+public:
+    GeometryCollector() : osg::NodeVisitor( osg::NodeVisitor::TRAVERSE_ALL_CHILDREN ) {}
+    void apply( osg::Geode& geode )
+    {
+        for( unsigned int i = 0; i != geode.getNumDrawables(); ++i )
+        {
+            osg::Geometry* g = geode.getDrawable( i )->asGeometry();
+            if( g && visited_.insert( g ).second ) geometries.push_back( g );
+        }
+        traverse( geode );
+    }
+    std::vector< osg::Geometry* > geometries;
+private:
+    std::set< osg::Geometry* > visited_;
+};
+
+/// Minimum number of vertices of geometries processed by all threads.
+const unsigned int LARGE_GEOMETRY = 1 << 16;
+
+struct DeleteArena
+{
+    void operator()( Arena* a ) const { delete a; }
+};
+} // namespace
+
+//------------------------------------------------------------------------------
+void GenerateNormals( osg::Node& root, double creaseAngle, ThreadPool& pool )
+{
+    GeometryCollector gc;
+    root.accept( gc );
+    std::vector< osg::Geometry* > small;
+    std::vector< osg::Geometry* > large;
+    for( std::vector< osg::Geometry* >::iterator i = gc.geometries.begin(); i != gc.geometries.end(); ++i )
+    {
+        osg::Geometry* g = *i;
+        const osg::Vec3Array* v = dynamic_cast< const osg::Vec3Array* >( g->getVertexArray() );
+        if( !v || g->getVertexIndices() ) osgUtil::SmoothingVisitor::smooth( *g, creaseAngle );
+        else if( v->size() >= LARGE_GEOMETRY && pool.NumThreads() > 1 ) large.push_back( g );
+        else if( !v->empty() ) small.push_back( g );
+    }
+
+    std::vector< Arena* > data( pool.NumThreads() );
+    std::vector< Arena* > scratch( pool.NumThreads() );
+    for( int t = 0; t != pool.NumThreads(); ++t )
+    {
+        data[ t ] = new Arena;
+        scratch[ t ] = new Arena;
+    }
+    SmallGeometriesTask smallTask( small, creaseAngle, data, scratch );
+    pool.ParallelFor( int( small.size() ), smallTask );
+
+    // partitions are processed by the work stealing pool: use more than
+    // threads to balance uneven partition sizes
+    const int numChunks = 4 * pool.NumThreads();
+    for( std::vector< osg::Geometry* >::iterator i = large.begin(); i != large.end(); ++i )
+    {
+        data[ 0 ]->Reset();
+        GeometryNormals gn( **i, creaseAngle, numChunks, numChunks, *data[ 0 ] );
+        if( gn.Empty() ) continue;
+        GeometryPhaseTask task( gn, scratch );
+        pool.ParallelFor( numChunks, task );
+        gn.CountVertices();
+        task.SetPhase( GeometryPhaseTask::SCATTER );
+        pool.ParallelFor( numChunks, task );
+        gn.CountCorners();
+        task.SetPhase( GeometryPhaseTask::SCATTER_CORNERS );
+        pool.ParallelFor( numChunks, task );
+        task.SetPhase( GeometryPhaseTask::NORMALS );
+        pool.ParallelFor( numChunks, task );
+        gn.Finish();
+    }
+    std::for_each( data.begin(), data.end(), DeleteArena() );
+    std::for_each( scratch.begin(), scratch.end(), DeleteArena() );
+}
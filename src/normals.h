@@ -0,0 +1,28 @@
+#ifndef NORMALS_H_
+#define NORMALS_H_
+
+#include <osg/Node>
+#include <osg/Math>
+
+#include "thread_pool.h"
+
+//------------------------------------------------------------------------------
+/// Replacement for osgUtil::SmoothingVisitor: compute per vertex normals of
+/// all the geometries in the graph as the area weighted sum of the normals of
+/// the triangles sharing the vertex position.
+/// Vertices with the same position are welded through a hash table partitioned
+/// by position hash; face normals are computed in parallel chunks and
+/// accumulated per partition, so that no two threads write the same vertex.
+/// Geometries with many vertices are processed one at a time by all threads,
+/// the others are processed in parallel, one per thread.
+/// Scratch memory is taken from per thread arenas reused across geometries.
+/// Faces of a welded vertex are included only if their normal is within
+/// 'creaseAngle' radians of the average normal of the triangles referencing
+/// that vertex directly: vertices are never split, edges are hard only where
+/// the mesh already has separate vertices. With the default angle all the
+/// faces are included.
+/// Geometries with indexed or non Vec3Array vertices are handed to
+/// osgUtil::SmoothingVisitor.
+void GenerateNormals( osg::Node& root, double creaseAngle = osg::PI, ThreadPool& pool = GetDefaultThreadPool() );
+
+#endif // NORMALS_H_
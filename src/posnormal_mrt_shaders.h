@@ -1,4 +1,7 @@
 static const char POSNORMALS_VERT_MRT[] =
+"#version 120\n"
+"// invariant: depth can be reused with GL_EQUAL by the shading programs\n"
+"invariant gl_Position;\n"
 "varying vec3 worldNormal;\n"
 "varying vec4 worldPosition;\n"
 "void main(void)\n"
@@ -6,7 +9,8 @@ static const char POSNORMALS_VERT_MRT[] =
 "  worldPosition = gl_ModelViewMatrix * gl_Vertex;\n"
 "  worldNormal   = gl_NormalMatrix * gl_Normal;\n"
 "  //worldNormal   = faceforward( -worldNormal, vec3( 0., 0., 1.0 ), worldNormal );\n"
-"  gl_Position = ftransform();\n"
+"  // same transform as the shading programs: depth can be reused with GL_EQUAL\n"
+"  gl_Position = gl_ProjectionMatrix * worldPosition;\n"
 "}\n";
 
 static const char POSNORMALS_FRAG_MRT[] =
@@ -26,4 +30,125 @@ static const char POSNORMALSDEPTH_FRAG_MRT[] =
 "  gl_FragData[0].xyz = worldPosition.xyz;\n"
 "  gl_FragData[1].xyz = normalize( worldNormal );\n"
 "  gl_FragData[1].w   = gl_FragCoord.z;\n"
+"#ifdef GBUFFER_ALBEDO\n"
+"  gl_FragData[2] = gl_FrontMaterial.diffuse;\n"
+"#endif\n"
+"}\n";
+
+// compact layout: linear depth in target 0 (R32F), octahedral encoded
+// normal mapped to [0,1] in target 1 (RG16)
+// GBUFFER_ALBEDO: material diffuse color in target 2, read by the deferred
+// resolve pass
+static const char POSNORMALS_FRAG_COMPACT_MRT[] =
+"varying vec3 worldNormal;\n"
+"varying vec4 worldPosition;\n"
+"vec2 OctEncode( vec3 n )\n"
+"{\n"
+"  n /= abs( n.x ) + abs( n.y ) + abs( n.z );\n"
+"  vec2 s = vec2( n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0 );\n"
+"  return n.z >= 0.0 ? n.xy : ( 1.0 - abs( n.yx ) ) * s;\n"
+"}\n"
+"void main(void)\n"
+"{\n"
+"  gl_FragData[0] = vec4( -worldPosition.z );\n"
+"  gl_FragData[1] = vec4( OctEncode( normalize( worldNormal ) ) * 0.5 + 0.5, 0.0, 0.0 );\n"
+"#ifdef GBUFFER_ALBEDO\n"
+"  gl_FragData[2] = gl_FrontMaterial.diffuse;\n"
+"#endif\n"
+"}\n";
+
+// sphere impostors (see ssao_trace_per_frag2_optimal.vert): drawables with
+// 'sphereImpostors' set are ray cast spheres, others are rendered as in the
+// shaders above; GBUFFER_COMPACT selects the compact layout,
+// ATOM_TEXTURE_WIDTH must be defined; gl_Position is not declared invariant:
+// depth is never reused with GL_EQUAL when impostors are enabled (-reuseDepth
+// is ignored)
+static const char POSNORMALS_VERT_IMPOSTORS_MRT[] =
+"#extension GL_ARB_texture_rectangle : enable\n"
+"#extension GL_ARB_draw_instanced : enable\n"
+"uniform bool sphereImpostors;\n"
+"uniform sampler2DRect atoms;\n"
+"varying vec3 worldNormal;\n"
+"varying vec4 worldPosition;\n"
+"varying vec4 impostorSphere;\n"
+"#ifdef GBUFFER_ALBEDO\n"
+"uniform sampler2DRect atomColors;\n"
+"varying vec4 albedo;\n"
+"#endif\n"
+"void main(void)\n"
+"{\n"
+"#ifdef GBUFFER_ALBEDO\n"
+"  albedo = gl_FrontMaterial.diffuse;\n"
+"#endif\n"
+"  if( sphereImpostors )\n"
+"  {\n"
+"    float i = float( gl_InstanceIDARB );\n"
+"    vec2 atomCoord = vec2( mod( i, ATOM_TEXTURE_WIDTH ), floor( i / ATOM_TEXTURE_WIDTH ) ) + 0.5;\n"
+"    vec4 a = texture2DRect( atoms, atomCoord );\n"
+"#ifdef GBUFFER_ALBEDO\n"
+"    albedo = texture2DRect( atomColors, atomCoord );\n"
+"#endif\n"
+"    vec3 c = ( gl_ModelViewMatrix * vec4( a.xyz, 1.0 ) ).xyz;\n"
+"    float r = a.w * length( gl_ModelViewMatrix[ 0 ].xyz );\n"
+"    impostorSphere = vec4( c, r );\n"
+"    float d = length( c );\n"
+"    vec3 z = -c / d;\n"
+"    vec3 x = normalize( cross( abs( z.y ) < 0.99 ? vec3( 0.0, 1.0, 0.0 ) : vec3( 1.0, 0.0, 0.0 ), z ) );\n"
+"    vec3 y = cross( z, x );\n"
+"    float h = r * d / sqrt( max( d * d - r * r, 1.0e-4 * d * d ) );\n"
+"    worldPosition = vec4( c + h * ( gl_Vertex.x * x + gl_Vertex.y * y ), 1.0 );\n"
+"    worldNormal = z;\n"
+"  }\n"
+"  else\n"
+"  {\n"
+"    worldPosition = gl_ModelViewMatrix * gl_Vertex;\n"
+"    worldNormal   = gl_NormalMatrix * gl_Normal;\n"
+"  }\n"
+"  gl_Position = gl_ProjectionMatrix * worldPosition;\n"
+"}\n";
+
+static const char POSNORMALS_FRAG_IMPOSTORS_MRT[] =
+"uniform bool sphereImpostors;\n"
+"varying vec3 worldNormal;\n"
+"varying vec4 worldPosition;\n"
+"varying vec4 impostorSphere;\n"
+"#ifdef GBUFFER_ALBEDO\n"
+"varying vec4 albedo;\n"
+"#endif\n"
+"vec2 OctEncode( vec3 n )\n"
+"{\n"
+"  n /= abs( n.x ) + abs( n.y ) + abs( n.z );\n"
+"  vec2 s = vec2( n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0 );\n"
+"  return n.z >= 0.0 ? n.xy : ( 1.0 - abs( n.yx ) ) * s;\n"
+"}\n"
+"void main(void)\n"
+"{\n"
+"  vec3 p = worldPosition.xyz;\n"
+"  vec3 n = normalize( worldNormal );\n"
+"  float depth = gl_FragCoord.z;\n"
+"  if( sphereImpostors )\n"
+"  {\n"
+"    // view ray through the fragment intersected with the sphere\n"
+"    vec3 d = normalize( p );\n"
+"    vec3 c = impostorSphere.xyz;\n"
+"    float b = dot( d, c );\n"
+"    float disc = b * b - dot( c, c ) + impostorSphere.w * impostorSphere.w;\n"
+"    if( disc < 0.0 ) discard;\n"
+"    p = d * ( b - sqrt( disc ) );\n"
+"    n = ( p - c ) / impostorSphere.w;\n"
+"    vec4 clip = gl_ProjectionMatrix * vec4( p, 1.0 );\n"
+"    depth = 0.5 * ( gl_DepthRange.diff * clip.z / clip.w + gl_DepthRange.near + gl_DepthRange.far );\n"
+"  }\n"
+"  gl_FragDepth = depth;\n"
+"#ifdef GBUFFER_COMPACT\n"
+"  gl_FragData[0] = vec4( -p.z );\n"
+"  gl_FragData[1] = vec4( OctEncode( n ) * 0.5 + 0.5, 0.0, 0.0 );\n"
+"#else\n"
+"  gl_FragData[0].xyz = p;\n"
+"  gl_FragData[1].xyz = n;\n"
+"  gl_FragData[1].w   = depth;\n"
+"#endif\n"
+"#ifdef GBUFFER_ALBEDO\n"
+"  gl_FragData[2] = albedo;\n"
+"#endif\n"
 "}\n";
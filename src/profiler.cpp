@@ -0,0 +1,336 @@
+#include <osg/Drawable>
+#include <osg/FrameStamp>
+#include <osg/Stats>
+#include <osgDB/FileNameUtils>
+#include <OpenThreads/ScopedLock>
+
+#include <stdexcept>
+#include <iomanip>
+#include <algorithm>
+
+#include "profiler.h"
+
+#ifndef GL_TIME_ELAPSED
+#define GL_TIME_ELAPSED 0x88BF
+#endif
+
+typedef OpenThreads::ScopedLock< OpenThreads::Mutex > ScopedLock;
+
+namespace
+{
+const char* PHASE_NAMES[] = { "event", "update", "sync", "render" };
+}
+
+//------------------------------------------------------------------------------
+/// Ring of GL_TIME_ELAPSED queries of one camera.
+class FrameProfiler::GPUPassTimer : public osg::Referenced
+{
+public:
+    GPUPassTimer( FrameProfiler& profiler, int pass, unsigned int ringSize )
+        : profiler_( profiler ), pass_( pass ), queries_( ringSize ), frames_( ringSize, -1 ),
+          next_( 0 ), active_( false ) {}
+    void Begin( osg::RenderInfo& renderInfo )
+    {
+        active_ = false;
+        const osg::Drawable::Extensions* ext = osg::Drawable::getExtensions( renderInfo.getState()->getContextID(), true );
+        if( !ext->isTimerQuerySupported() ) return;
+        if( queries_[ 0 ] == 0 ) ext->glGenQueries( GLsizei( queries_.size() ), &queries_[ 0 ] );
+        Poll( *ext );
+        // ring full: skip this frame rather than wait
+        if( frames_[ next_ ] >= 0 ) return;
+        frames_[ next_ ] = renderInfo.getState()->getFrameStamp()->getFrameNumber();
+        ext->glBeginQuery( GL_TIME_ELAPSED, queries_[ next_ ] );
+        active_ = true;
+    }
+    void End( osg::RenderInfo& renderInfo )
+    {
+        if( !active_ ) return;
+        const osg::Drawable::Extensions* ext = osg::Drawable::getExtensions( renderInfo.getState()->getContextID(), true );
+        ext->glEndQuery( GL_TIME_ELAPSED );
+        next_ = ( next_ + 1 ) % queries_.size();
+        active_ = false;
+    }
+private:
+    void Poll( const osg::Drawable::Extensions& ext )
+    {
+        for( unsigned int i = 0; i != queries_.size(); ++i )
+        {
+            if( frames_[ i ] < 0 ) continue;
+            GLint available = 0;
+            ext.glGetQueryObjectiv( queries_[ i ], GL_QUERY_RESULT_AVAILABLE, &available );
+            if( !available ) continue;
+            GLuint64EXT ns = 0;
+            ext.glGetQueryObjectui64v( queries_[ i ], GL_QUERY_RESULT, &ns );
+            profiler_.SetGPUTime( frames_[ i ], pass_, double( ns ) * 1.0e-6 );
+            frames_[ i ] = -1;
+        }
+    }
+    FrameProfiler& profiler_;
+    int pass_;
+    std::vector< GLuint > queries_;
+    std::vector< int > frames_;
+    unsigned int next_;
+    bool active_;
+};
+
+namespace
+{
+//------------------------------------------------------------------------------
+/// Start timer after the initial draw callback already set on the camera.
+class BeginPassCallback : public osg::Camera::DrawCallback
+{
+public:
+    BeginPassCallback( FrameProfiler::GPUPassTimer* timer, osg::Camera::DrawCallback* previous )
+        : timer_( timer ), previous_( previous ) {}
+    void operator()( osg::RenderInfo& renderInfo ) const
+    {
+        if( previous_.valid() ) ( *previous_ )( renderInfo );
+        timer_->Begin( renderInfo );
+    }
+private:
+    osg::ref_ptr< FrameProfiler::GPUPassTimer > timer_;
+    osg::ref_ptr< osg::Camera::DrawCallback > previous_;
+};
+
+/// Stop timer before the post draw callback already set on the camera.
+class EndPassCallback : public osg::Camera::DrawCallback
+{
+public:
+    EndPassCallback( FrameProfiler::GPUPassTimer* timer, osg::Camera::DrawCallback* previous )
+        : timer_( timer ), previous_( previous ) {}
+    void operator()( osg::RenderInfo& renderInfo ) const
+    {
+        timer_->End( renderInfo );
+        if( previous_.valid() ) ( *previous_ )( renderInfo );
+    }
+private:
+    osg::ref_ptr< FrameProfiler::GPUPassTimer > timer_;
+    osg::ref_ptr< osg::Camera::DrawCallback > previous_;
+};
+
+/// Time wrapped draw callback.
+class TimedPassCallback : public osg::Camera::DrawCallback
+{
+public:
+    TimedPassCallback( FrameProfiler::GPUPassTimer* timer, osg::Camera::DrawCallback* wrapped )
+        : timer_( timer ), wrapped_( wrapped ) {}
+    void operator()( osg::RenderInfo& renderInfo ) const
+    {
+        timer_->Begin( renderInfo );
+        ( *wrapped_ )( renderInfo );
+        timer_->End( renderInfo );
+    }
+private:
+    osg::ref_ptr< FrameProfiler::GPUPassTimer > timer_;
+    osg::ref_ptr< osg::Camera::DrawCallback > wrapped_;
+};
+}
+
+//------------------------------------------------------------------------------
+FrameProfiler::FrameProfiler( const std::string& fileName, unsigned int queryRingSize )
+    : json_( osgDB::getLowerCaseFileExtension( fileName ) == "json" ),
+      headerWritten_( false ), ringSize_( std::max( 1u, queryRingSize ) ), lapStart_( 0 ), firstPending_( 0 )
+{
+    if( fileName.empty() ) return;
+    os_.open( fileName.c_str() );
+    if( !os_ ) throw std::runtime_error( "Cannot open profile file " + fileName );
+    os_ << std::fixed << std::setprecision( 4 );
+}
+
+FrameProfiler::~FrameProfiler()
+{
+    if( os_.is_open() ) Finish();
+}
+
+//------------------------------------------------------------------------------
+int FrameProfiler::PassIndex( const std::string& pass )
+{
+    std::vector< std::string >::iterator i = std::find( passes_.begin(), passes_.end(), pass );
+    if( i != passes_.end() ) return int( i - passes_.begin() );
+    passes_.push_back( pass );
+    return int( passes_.size() ) - 1;
+}
+
+void FrameProfiler::AddCamera( osg::Camera& camera, const std::string& pass, const std::string& finalPass )
+{
+    osg::ref_ptr< GPUPassTimer > timer = new GPUPassTimer( *this, PassIndex( pass ), ringSize_ );
+    camera.setInitialDrawCallback( new BeginPassCallback( osg::get_pointer( timer ), camera.getInitialDrawCallback() ) );
+    camera.setPostDrawCallback( new EndPassCallback( osg::get_pointer( timer ), camera.getPostDrawCallback() ) );
+    if( !finalPass.empty() && camera.getFinalDrawCallback() )
+    {
+        camera.setFinalDrawCallback(
+            new TimedPassCallback( new GPUPassTimer( *this, PassIndex( finalPass ), ringSize_ ),
+                                   camera.getFinalDrawCallback() ) );
+    }
+}
+
+void FrameProfiler::AddUniform( const osg::Uniform* uniform )
+{
+    if( uniform ) uniforms_.push_back( uniform );
+}
+
+void FrameProfiler::AddListener( Listener* listener )
+{
+    if( listener ) listeners_.push_back( listener );
+}
+
+void FrameProfiler::SetMainCamera( osg::Camera* camera )
+{
+    mainCamera_ = camera;
+    // cull and draw times are recorded by the renderer into the camera stats
+    if( camera && camera->getStats() ) camera->getStats()->collectStats( "rendering", true );
+}
+
+//------------------------------------------------------------------------------
+void FrameProfiler::StartFrame( int frameNumber )
+{
+    current_ = Record();
+    current_.frame = frameNumber;
+    current_.gpuMs.resize( passes_.size(), -1.0 );
+    lapStart_ = timer_.tick();
+}
+
+void FrameProfiler::Lap( Phase phase )
+{
+    const osg::Timer_t t = timer_.tick();
+    current_.cpuMs[ phase ] = timer_.delta_m( lapStart_, t );
+    lapStart_ = t;
+}
+
+void FrameProfiler::EndFrame()
+{
+    if( mainCamera_.valid() )
+    {
+        if( const osg::Viewport* vp = mainCamera_->getViewport() )
+        {
+            current_.width = int( vp->width() );
+            current_.height = int( vp->height() );
+        }
+        if( osg::Stats* stats = mainCamera_->getStats() )
+        {
+            double s = 0.0;
+            if( stats->getAttribute( current_.frame, "Cull traversal time taken", s ) ) current_.cullMs = s * 1000.0;
+            if( stats->getAttribute( current_.frame, "Draw traversal time taken", s ) ) current_.drawMs = s * 1000.0;
+        }
+    }
+    for( std::vector< osg::ref_ptr< const osg::Uniform > >::const_iterator u = uniforms_.begin(); u != uniforms_.end(); ++u )
+    {
+        float f = 0.f;
+        int i = 0;
+        if( ( *u )->getType() == osg::Uniform::FLOAT && ( *u )->get( f ) ) current_.uniforms.push_back( f );
+        else if( ( *u )->getType() == osg::Uniform::INT && ( *u )->get( i ) ) current_.uniforms.push_back( i );
+        else current_.uniforms.push_back( 0.0 );
+    }
+    std::vector< Record > done;
+    {
+        ScopedLock lock( mutex_ );
+        // GPU times may have been set while recording the frame
+        Record& r = pending_[ current_.frame ];
+        current_.gpuMs = r.gpuMs.empty() ? current_.gpuMs : r.gpuMs;
+        r = current_;
+        r.ended = true;
+        while( !pending_.empty() && pending_.begin()->first + int( ringSize_ ) < current_.frame )
+        {
+            firstPending_ = pending_.begin()->first + 1;
+            if( pending_.begin()->second.ended ) done.push_back( pending_.begin()->second );
+            pending_.erase( pending_.begin() );
+        }
+    }
+    for( std::vector< Record >::const_iterator i = done.begin(); i != done.end(); ++i )
+    {
+        Write( *i );
+        for( std::vector< osg::ref_ptr< Listener > >::const_iterator l = listeners_.begin(); l != listeners_.end(); ++l )
+        {
+            ( *l )->FrameCompleted( i->frame, passes_, i->gpuMs );
+        }
+    }
+}
+
+void FrameProfiler::SetGPUTime( int frameNumber, int pass, double ms )
+{
+    ScopedLock lock( mutex_ );
+    // frame already written out: result is dropped
+    if( frameNumber < firstPending_ ) return;
+    Record& r = pending_[ frameNumber ];
+    r.gpuMs.resize( passes_.size(), -1.0 );
+    // cameras sharing a pass name are summed
+    r.gpuMs[ pass ] = r.gpuMs[ pass ] < 0.0 ? ms : r.gpuMs[ pass ] + ms;
+}
+
+void FrameProfiler::Finish()
+{
+    if( !os_.is_open() ) return;
+    std::map< int, Record > pending;
+    {
+        ScopedLock lock( mutex_ );
+        pending.swap( pending_ );
+    }
+    for( std::map< int, Record >::const_iterator i = pending.begin(); i != pending.end(); ++i )
+    {
+        // records of frames never ended contain only GPU times
+        if( i->second.ended ) Write( i->second );
+    }
+    if( json_ ) os_ << ( headerWritten_ ? "\n]\n" : "[]\n" );
+    os_.close();
+}
+
+//------------------------------------------------------------------------------
+void FrameProfiler::WriteHeader()
+{
+    headerWritten_ = true;
+    if( json_ )
+    {
+        os_ << '[';
+        return;
+    }
+    os_ << "frame,width,height";
+    for( int p = 0; p != NUM_PHASES; ++p ) os_ << ',' << PHASE_NAMES[ p ] << "_ms";
+    os_ << ",cull_ms,draw_ms";
+    for( unsigned int i = 0; i != passes_.size(); ++i ) os_ << ",gpu_" << passes_[ i ] << "_ms";
+    for( unsigned int i = 0; i != uniforms_.size(); ++i ) os_ << ',' << uniforms_[ i ]->getName();
+    os_ << '\n';
+}
+
+namespace
+{
+/// Negative values are unavailable measures.
+void WriteValue( std::ostream& os, double v, bool json )
+{
+    if( v >= 0.0 ) os << v;
+    else if( json ) os << "null";
+}
+
+void WriteField( std::ostream& os, const std::string& name, double v, bool json, bool first = false )
+{
+    if( !first ) os << ',';
+    if( json ) os << '"' << name << "\":";
+    WriteValue( os, v, json );
+}
+}
+
+void FrameProfiler::Write( const Record& r )
+{
+    if( !os_.is_open() ) return;
+    const bool firstRecord = !headerWritten_;
+    if( !headerWritten_ ) WriteHeader();
+    if( json_ ) os_ << ( firstRecord ? "\n{" : ",\n{" );
+    if( json_ ) os_ << "\"frame\":" << r.frame << ",\"width\":" << r.width << ",\"height\":" << r.height;
+    else os_ << r.frame << ',' << r.width << ',' << r.height;
+    for( int p = 0; p != NUM_PHASES; ++p ) WriteField( os_, std::string( PHASE_NAMES[ p ] ) + "_ms", r.cpuMs[ p ], json_ );
+    WriteField( os_, "cull_ms", r.cullMs, json_ );
+    WriteField( os_, "draw_ms", r.drawMs, json_ );
+    for( unsigned int i = 0; i != passes_.size(); ++i )
+    {
+        WriteField( os_, "gpu_" + passes_[ i ] + "_ms", i < r.gpuMs.size() ? r.gpuMs[ i ] : -1.0, json_ );
+    }
+    for( unsigned int i = 0; i != uniforms_.size(); ++i )
+    {
+        // uniform values can be negative: always written
+        os_ << ',';
+        if( json_ ) os_ << '"' << uniforms_[ i ]->getName() << "\":";
+        os_ << r.uniforms[ i ];
+    }
+    if( json_ ) os_ << '}';
+    else os_ << '\n';
+    os_.flush();
+}
@@ -0,0 +1,104 @@
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+
+#include <osg/Referenced>
+#include <osg/Camera>
+#include <osg/Uniform>
+#include <osg/Timer>
+#include <OpenThreads/Mutex>
+
+//------------------------------------------------------------------------------
+/// Per frame instrumentation: CPU time of the viewer traversals and GPU time
+/// of each camera pass measured with GL_TIME_ELAPSED queries.
+/// Each pass owns a ring of queries; results are polled at the beginning of the
+/// next draw of the same pass and a pass is not timed when its ring is full,
+/// so the CPU never waits for the GPU. A frame is written out once all its
+/// queries have had the time to complete (ring size frames later); late or
+/// missing results are written as empty values.
+/// Output format is selected by file extension: '.json' writes an array of one
+/// object per frame, any other extension writes comma separated values with
+/// a header line. Each record is flushed as soon as it is written; with an
+/// empty file name nothing is written and times are only sent to listeners.
+class FrameProfiler : public osg::Referenced
+{
+public:
+    /// CPU phases timed between calls to Lap().
+    enum Phase { EVENT, UPDATE, SYNC, RENDER, NUM_PHASES };
+    /// Receives the GPU times of each frame when its record is complete.
+    class Listener : public osg::Referenced
+    {
+    public:
+        /// Called from EndFrame(); 'gpuMs' has one entry per element of
+        /// 'passes', negative if the pass was not timed in the frame.
+        virtual void FrameCompleted( int frameNumber, const std::vector< std::string >& passes,
+                                     const std::vector< double >& gpuMs ) = 0;
+    };
+    FrameProfiler( const std::string& fileName, unsigned int queryRingSize = 4 );
+    /// Time the GPU work of camera from the initial to the post draw callback;
+    /// if 'finalPass' is not empty the final draw callback already set on the
+    /// camera (e.g. frame readback) is timed as a separate pass; initial and
+    /// post draw callbacks already set on the camera are kept, not timed.
+    /// Cameras added with the same pass name are summed.
+    void AddCamera( osg::Camera& camera, const std::string& pass, const std::string& finalPass = "" );
+    /// Record value of float or int uniform at each frame.
+    void AddUniform( const osg::Uniform* uniform );
+    void AddListener( Listener* listener );
+    /// Main camera: source of viewport size and cull/draw times.
+    void SetMainCamera( osg::Camera* camera );
+    /// Start CPU timer of frame; call after osgViewer::Viewer::advance().
+    void StartFrame( int frameNumber );
+    /// Record time elapsed since previous call or StartFrame as 'phase'.
+    void Lap( Phase phase );
+    /// Queue record of current frame and write out completed ones.
+    void EndFrame();
+    /// Write out all queued records and close file.
+    void Finish();
+    /// Called from draw callbacks.
+    void SetGPUTime( int frameNumber, int pass, double ms );
+    class GPUPassTimer;
+protected:
+    ~FrameProfiler();
+private:
+    struct Record
+    {
+        Record() : frame( 0 ), width( 0 ), height( 0 ), cullMs( -1.0 ), drawMs( -1.0 ), ended( false )
+        {
+            for( int p = 0; p != NUM_PHASES; ++p ) cpuMs[ p ] = -1.0;
+        }
+        int frame;
+        int width;
+        int height;
+        double cpuMs[ NUM_PHASES ];
+        double cullMs;
+        double drawMs;
+        std::vector< double > gpuMs;
+        std::vector< double > uniforms;
+        /// false if only GPU times are available
+        bool ended;
+    };
+    int PassIndex( const std::string& pass );
+    void Write( const Record& r );
+    void WriteHeader();
+    std::ofstream os_;
+    bool json_;
+    bool headerWritten_;
+    unsigned int ringSize_;
+    std::vector< std::string > passes_;
+    std::vector< osg::ref_ptr< const osg::Uniform > > uniforms_;
+    std::vector< osg::ref_ptr< Listener > > listeners_;
+    osg::ref_ptr< osg::Camera > mainCamera_;
+    osg::Timer timer_;
+    osg::Timer_t lapStart_;
+    Record current_;
+    std::map< int, Record > pending_;
+    /// GPU times of frames before this one are dropped
+    int firstPending_;
+    OpenThreads::Mutex mutex_;
+};
+
+#endif // PROFILER_H_
@@ -0,0 +1,344 @@
+#include "program_cache.h"
+
+#include <osg/GraphicsContext>
+#include <osg/State>
+#include <osgDB/FileUtils>
+#include <OpenThreads/ScopedLock>
+
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <iterator>
+#include <cstdio>
+#include <algorithm>
+#include <utility>
+
+typedef OpenThreads::ScopedLock< OpenThreads::Mutex > ScopedLock;
+
+namespace
+{
+//------------------------------------------------------------------------------
+/// 64 bit FNV-1a hash.
+unsigned long long Hash( const std::string& s, unsigned long long h = 14695981039346656037ULL )
+{
+    for( std::string::const_iterator i = s.begin(); i != s.end(); ++i )
+    {
+        h ^= static_cast< unsigned char >( *i );
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+std::string ToHex( unsigned long long h )
+{
+    std::ostringstream os;
+    os << std::hex << std::setw( 16 ) << std::setfill( '0' ) << h;
+    return os.str();
+}
+
+//------------------------------------------------------------------------------
+/// Prepend prefix to shader source; a '#version' directive starting the
+/// source is kept before the prefix since it must precede any other token.
+std::string Prefixed( const std::string& prefix, const std::string& source )
+{
+    const std::string::size_type b = source.find_first_not_of( " \t\r\n" );
+    if( b == std::string::npos || source.compare( b, 8, "#version" ) != 0 ) return prefix + source;
+    const std::string::size_type e = source.find( '\n', b );
+    if( e == std::string::npos ) return source + '\n' + prefix;
+    return source.substr( 0, e + 1 ) + prefix + source.substr( e + 1 );
+}
+
+const char* GetGLString( GLenum name )
+{
+    const char* s = reinterpret_cast< const char* >( glGetString( name ) );
+    return s ? s : "";
+}
+
+//------------------------------------------------------------------------------
+/// Binary file layout: GLenum binary format followed by binary data.
+osg::ProgramBinary* ReadProgramBinary( const std::string& fileName )
+{
+    std::ifstream is( fileName.c_str(), std::ios::binary );
+    if( !is ) return 0;
+    unsigned int format = 0;
+    is.read( reinterpret_cast< char* >( &format ), sizeof( format ) );
+    std::vector< char > data( ( std::istreambuf_iterator< char >( is ) ), std::istreambuf_iterator< char >() );
+    if( data.empty() ) return 0;
+    osg::ref_ptr< osg::ProgramBinary > pb = new osg::ProgramBinary;
+    pb->setFormat( GLenum( format ) );
+    pb->assign( data.size(), reinterpret_cast< const unsigned char* >( &data[ 0 ] ) );
+    return pb.release();
+}
+
+bool WriteProgramBinary( const osg::ProgramBinary& pb, const std::string& fileName )
+{
+    // write to temporary file first: concurrent instances never see a partial file
+    const std::string tmp = fileName + ".tmp";
+    {
+        std::ofstream os( tmp.c_str(), std::ios::binary );
+        const unsigned int format = pb.getFormat();
+        os.write( reinterpret_cast< const char* >( &format ), sizeof( format ) );
+        os.write( reinterpret_cast< const char* >( pb.getData() ), pb.getSize() );
+        if( !os ) return false;
+    }
+    std::remove( fileName.c_str() );
+    return std::rename( tmp.c_str(), fileName.c_str() ) == 0;
+}
+
+//------------------------------------------------------------------------------
+/// Compiles pending programs on the compile context.
+class CompileOperation : public osg::GraphicsOperation
+{
+public:
+    CompileOperation( ProgramCache& cache )
+        : osg::GraphicsOperation( "ProgramCacheCompile", false ), cache_( cache ) {}
+    void operator()( osg::GraphicsContext* gc ) { cache_.CompilePending( *gc->getState() ); }
+private:
+    ProgramCache& cache_;
+};
+
+//------------------------------------------------------------------------------
+/// Saves the binaries of programs linked on first use; kept in the operation
+/// queue of the graphics context, run after the cameras are drawn.
+class SaveOperation : public osg::GraphicsOperation
+{
+public:
+    SaveOperation( ProgramCache& cache )
+        : osg::GraphicsOperation( "ProgramCacheSave", true ), cache_( cache ) {}
+    void operator()( osg::GraphicsContext* gc ) { cache_.SaveLinked( *gc->getState() ); }
+private:
+    ProgramCache& cache_;
+};
+
+//------------------------------------------------------------------------------
+class RealizeOperation : public osg::GraphicsOperation
+{
+public:
+    RealizeOperation( ProgramCache& cache, const ProgramCache::Programs& active )
+        : osg::GraphicsOperation( "ProgramCacheRealize", false ), cache_( cache ), active_( active ) {}
+    void operator()( osg::GraphicsContext* gc );
+private:
+    ProgramCache& cache_;
+    ProgramCache::Programs active_;
+};
+
+void RealizeOperation::operator()( osg::GraphicsContext* gc )
+{
+    osg::State& state = *gc->getState();
+    cache_.LoadBinaries( state );
+    gc->add( new SaveOperation( cache_ ) );
+    for( ProgramCache::Programs::iterator p = active_.begin(); p != active_.end(); ++p )
+    {
+        if( p->valid() ) cache_.Compile( state, osg::get_pointer( *p ) );
+    }
+    // objects created on a shared compile context have the same context id
+    // and are used directly by the main context
+    osg::GraphicsContext* cc = osg::GraphicsContext::getOrCreateCompileContext( state.getContextID() );
+    if( !cc )
+    {
+        cache_.CompilePending( state );
+        return;
+    }
+    if( !cc->getGraphicsThread() )
+    {
+        cc->createGraphicsThread();
+        cc->getGraphicsThread()->startThread();
+    }
+    cc->getGraphicsThread()->add( new CompileOperation( cache_ ) );
+}
+}
+
+//------------------------------------------------------------------------------
+void ProgramCache::SetDirectory( const std::string& dir )
+{
+    ScopedLock lock( mutex_ );
+    directory_ = dir;
+}
+
+//------------------------------------------------------------------------------
+std::string ProgramCache::GetDirectory() const
+{
+    ScopedLock lock( mutex_ );
+    return directory_;
+}
+
+//------------------------------------------------------------------------------
+osg::Program* ProgramCache::GetProgram( const std::string& name,
+                                        const std::string& vertSource,
+                                        const std::string& fragSource,
+                                        const std::string& prefix )
+{
+    if( vertSource.empty() && fragSource.empty() ) return 0;
+    const std::string key = ToHex( Hash( fragSource, Hash( vertSource, Hash( prefix ) ) ) );
+    ScopedLock lock( mutex_ );
+    Entry& e = entries_[ key ];
+    if( !e.program.valid() )
+    {
+        e.program = new osg::Program;
+        e.program->setName( name );
+        if( !vertSource.empty() ) e.program->addShader( new osg::Shader( osg::Shader::VERTEX, Prefixed( prefix, vertSource ) ) );
+        if( !fragSource.empty() ) e.program->addShader( new osg::Shader( osg::Shader::FRAGMENT, Prefixed( prefix, fragSource ) ) );
+        // created before realization: compiled on the compile context;
+        // after realization: linked on first use, from binary if available
+        e.pending = driverId_.empty();
+        if( !e.pending && !directory_.empty() )
+        {
+            osg::ref_ptr< osg::ProgramBinary > pb = ReadProgramBinary( BinaryFileName( key ) );
+            if( pb.valid() ) e.program->setProgramBinary( osg::get_pointer( pb ) );
+        }
+    }
+    return osg::get_pointer( e.program );
+}
+
+//------------------------------------------------------------------------------
+std::string ProgramCache::BinaryFileName( const std::string& key ) const
+{
+    return directory_ + '/' + ToHex( Hash( driverId_, Hash( key ) ) ) + ".bin";
+}
+
+//------------------------------------------------------------------------------
+void ProgramCache::LoadBinaries( osg::State& /*state*/ )
+{
+    ScopedLock lock( mutex_ );
+    driverId_ = std::string( GetGLString( GL_VENDOR ) ) + '\n' + GetGLString( GL_RENDERER ) + '\n' + GetGLString( GL_VERSION );
+    if( directory_.empty() ) return;
+    for( Entries::iterator i = entries_.begin(); i != entries_.end(); ++i )
+    {
+        if( i->second.program->getProgramBinary() ) continue;
+        osg::ref_ptr< osg::ProgramBinary > pb = ReadProgramBinary( BinaryFileName( i->first ) );
+        if( pb.valid() ) i->second.program->setProgramBinary( osg::get_pointer( pb ) );
+    }
+}
+
+//------------------------------------------------------------------------------
+void ProgramCache::Compile( osg::State& state, osg::Program* program )
+{
+    // empty if not cached or without disk cache
+    std::string fileName;
+    std::string dir;
+    {
+        ScopedLock lock( mutex_ );
+        dir = directory_;
+        for( Entries::const_iterator i = entries_.begin(); i != entries_.end(); ++i )
+        {
+            if( i->second.program == program && !dir.empty() ) fileName = BinaryFileName( i->first );
+        }
+    }
+    const unsigned int contextID = state.getContextID();
+    program->compileGLObjects( state );
+    osg::Program::PerContextProgram* pcp = program->getPCP( contextID );
+    if( ( !pcp || !pcp->isLinked() ) && program->getProgramBinary() )
+    {
+        // stale or corrupted binary: link from source
+        program->setProgramBinary( 0 );
+        if( !fileName.empty() ) std::remove( fileName.c_str() );
+        program->dirtyProgram();
+        program->compileGLObjects( state );
+        pcp = program->getPCP( contextID );
+    }
+    if( !pcp || !pcp->isLinked() ) return;
+    {
+        ScopedLock lock( mutex_ );
+        for( Entries::iterator i = entries_.begin(); i != entries_.end(); ++i )
+        {
+            if( i->second.program == program ) i->second.saved = true;
+        }
+    }
+    if( !fileName.empty() && !program->getProgramBinary() ) SaveBinary( state, program, fileName, dir );
+}
+
+//------------------------------------------------------------------------------
+bool ProgramCache::SaveBinary( osg::State& state, osg::Program* program, const std::string& fileName, const std::string& dir )
+{
+    osg::Program::PerContextProgram* pcp = program->getPCP( state.getContextID() );
+    if( !pcp || !pcp->isLinked() ) return false;
+    osg::ref_ptr< osg::ProgramBinary > pb = pcp->compileProgramBinary( state );
+    if( !pb.valid() || pb->getSize() == 0 ) return false;
+    if( !osgDB::fileExists( dir ) ) osgDB::makeDirectory( dir );
+    if( !WriteProgramBinary( *pb, fileName ) ) return false;
+    program->setProgramBinary( osg::get_pointer( pb ) );
+    return true;
+}
+
+//------------------------------------------------------------------------------
+void ProgramCache::SaveLinked( osg::State& state )
+{
+    std::vector< std::pair< osg::ref_ptr< osg::Program >, std::string > > linked;
+    std::string dir;
+    {
+        ScopedLock lock( mutex_ );
+        if( directory_.empty() ) return;
+        dir = directory_;
+        for( Entries::iterator i = entries_.begin(); i != entries_.end(); ++i )
+        {
+            Entry& e = i->second;
+            if( e.pending || e.saved ) continue;
+            if( e.program->getProgramBinary() )
+            {
+                e.saved = true;
+                continue;
+            }
+            osg::Program::PerContextProgram* pcp = e.program->getPCP( state.getContextID() );
+            if( !pcp || !pcp->isLinked() ) continue;
+            // attempted once
+            e.saved = true;
+            linked.push_back( std::make_pair( e.program, BinaryFileName( i->first ) ) );
+        }
+    }
+    for( unsigned int i = 0; i != linked.size(); ++i )
+    {
+        SaveBinary( state, osg::get_pointer( linked[ i ].first ), linked[ i ].second, dir );
+    }
+}
+
+//------------------------------------------------------------------------------
+void ProgramCache::CompilePending( osg::State& state )
+{
+    std::vector< osg::ref_ptr< osg::Program > > programs;
+    {
+        ScopedLock lock( mutex_ );
+        for( Entries::const_iterator i = entries_.begin(); i != entries_.end(); ++i )
+        {
+            if( i->second.pending ) programs.push_back( i->second.program );
+        }
+    }
+    for( std::vector< osg::ref_ptr< osg::Program > >::iterator p = programs.begin(); p != programs.end(); ++p )
+    {
+        Compile( state, osg::get_pointer( *p ) );
+        ScopedLock lock( mutex_ );
+        for( Entries::iterator i = entries_.begin(); i != entries_.end(); ++i )
+        {
+            if( i->second.program == *p ) i->second.pending = false;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+bool ProgramCache::IsPending( const osg::Program* program ) const
+{
+    ScopedLock lock( mutex_ );
+    for( Entries::const_iterator i = entries_.begin(); i != entries_.end(); ++i )
+    {
+        if( i->second.program == program ) return i->second.pending;
+    }
+    return false;
+}
+
+//------------------------------------------------------------------------------
+osg::GraphicsOperation* ProgramCache::CreateRealizeOperation( const Programs& active )
+{
+    ScopedLock lock( mutex_ );
+    for( Entries::iterator i = entries_.begin(); i != entries_.end(); ++i )
+    {
+        if( std::find( active.begin(), active.end(), i->second.program ) != active.end() ) i->second.pending = false;
+    }
+    return new RealizeOperation( *this, active );
+}
+
+//------------------------------------------------------------------------------
+ProgramCache& GetDefaultProgramCache()
+{
+    static ProgramCache cache;
+    return cache;
+}
@@ -0,0 +1,78 @@
+#ifndef PROGRAM_CACHE_H_
+#define PROGRAM_CACHE_H_
+
+#include <string>
+#include <map>
+#include <vector>
+
+#include <osg/Program>
+#include <osg/GraphicsThread>
+#include <OpenThreads/Mutex>
+
+//------------------------------------------------------------------------------
+/// Cache of shader programs keyed on (shader sources, source prefix).
+/// Programs requested with the same sources and prefix are returned from
+/// memory; if a cache directory is set, linked program binaries retrieved
+/// through GL_ARB_get_program_binary are stored on disk in files named after
+/// a hash of the program key and of the GL vendor, renderer and version
+/// strings, so that a driver update invalidates them. Binaries that fail to
+/// load are discarded and the program is linked from source.
+/// Programs created after realization are linked by OSG on first use; their
+/// binaries are saved by an operation run on the graphics context after each
+/// frame once they are linked.
+class ProgramCache
+{
+public:
+    ProgramCache() {}
+    /// Directory where program binaries are stored; empty: no disk cache.
+    void SetDirectory( const std::string& dir );
+    std::string GetDirectory() const;
+    /// Return cached program built from vertex and fragment sources with the
+    /// prefix prepended, after a leading '#version' directive, or create a new
+    /// one; NULL if both sources are empty.
+    osg::Program* GetProgram( const std::string& name,
+                              const std::string& vertSource,
+                              const std::string& fragSource,
+                              const std::string& prefix );
+    /// Assign binaries stored on disk for the current driver to cached programs;
+    /// must be called from a thread with a current context.
+    void LoadBinaries( osg::State& state );
+    /// Compile and link program and save its binary if linked from source.
+    void Compile( osg::State& state, osg::Program* program );
+    /// Compile all programs marked as pending.
+    void CompilePending( osg::State& state );
+    /// Save the binaries of the programs linked on first use; must be called
+    /// from the thread drawing on the context of 'state'.
+    void SaveLinked( osg::State& state );
+    /// True if program is waiting to be compiled on the compile context:
+    /// it must not be applied to a graphics context in the meantime.
+    bool IsPending( const osg::Program* program ) const;
+    typedef std::vector< osg::ref_ptr< osg::Program > > Programs;
+    /// Operation to be set as the viewer realize operation: loads binaries,
+    /// links the 'active' programs on the main context and all the other
+    /// cached programs on a shared compile context in a separate thread;
+    /// it also adds to the context the operation calling SaveLinked().
+    osg::GraphicsOperation* CreateRealizeOperation( const Programs& active );
+private:
+    /// Called with mutex_ locked.
+    std::string BinaryFileName( const std::string& key ) const;
+    bool SaveBinary( osg::State& state, osg::Program* program, const std::string& fileName, const std::string& dir );
+    struct Entry
+    {
+        Entry() : pending( false ), saved( false ) {}
+        osg::ref_ptr< osg::Program > program;
+        bool pending;
+        /// binary loaded or saved, or saving failed: not saved again
+        bool saved;
+    };
+    typedef std::map< std::string, Entry > Entries;
+    Entries entries_;
+    std::string directory_;
+    std::string driverId_;
+    mutable OpenThreads::Mutex mutex_;
+};
+
+/// Process wide program cache.
+ProgramCache& GetDefaultProgramCache();
+
+#endif // PROGRAM_CACHE_H_
@@ -0,0 +1,134 @@
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+
+#include <osg/View>
+#include <osg/FrameStamp>
+#include <osg/StateSet>
+
+#include "quality_controller.h"
+
+//------------------------------------------------------------------------------
+/// Sum of the GPU times of the controlled passes averaged over the frames
+/// rendered since the last reset; frames in which one of the passes was not
+/// timed are ignored.
+class QualityController::GPUTimes : public FrameProfiler::Listener
+{
+public:
+    GPUTimes( const std::vector< std::string >& passes )
+        : passes_( passes ), firstFrame_( 0 ), sum_( 0.0 ), count_( 0 ) {}
+    void FrameCompleted( int frameNumber, const std::vector< std::string >& passes, const std::vector< double >& gpuMs )
+    {
+        // rendered before the last adjustment
+        if( frameNumber < firstFrame_ ) return;
+        double ms = 0.0;
+        bool timed = false;
+        for( unsigned int i = 0; i != passes.size(); ++i )
+        {
+            if( std::find( passes_.begin(), passes_.end(), passes[ i ] ) == passes_.end() ) continue;
+            if( i >= gpuMs.size() || gpuMs[ i ] < 0.0 ) return;
+            ms += gpuMs[ i ];
+            timed = true;
+        }
+        if( !timed ) return;
+        sum_ += ms;
+        ++count_;
+    }
+    /// Discard the times of the frames before 'firstFrame'.
+    void Reset( int firstFrame )
+    {
+        firstFrame_ = firstFrame;
+        sum_ = 0.0;
+        count_ = 0;
+    }
+    int Count() const { return count_; }
+    double Average() const { return count_ > 0 ? sum_ / count_ : 0.0; }
+private:
+    std::vector< std::string > passes_;
+    int firstFrame_;
+    double sum_;
+    int count_;
+};
+
+namespace
+{
+//------------------------------------------------------------------------------
+/// Uniform changed from the event traversal: with a multithreaded viewer the
+/// state sets holding it must have been drawn before the next frame starts.
+void SetDynamic( osg::Uniform* uniform )
+{
+    if( !uniform ) return;
+    uniform->setDataVariance( osg::Object::DYNAMIC );
+    for( unsigned int i = 0; i != uniform->getNumParents(); ++i )
+    {
+        uniform->getParent( i )->setDataVariance( osg::Object::DYNAMIC );
+    }
+}
+}
+
+//------------------------------------------------------------------------------
+QualityController::QualityController( FrameProfiler& profiler,
+                                      const std::vector< std::string >& passes,
+                                      double budgetMs,
+                                      float minQuality,
+                                      osg::Uniform* numSamples,
+                                      osg::Uniform* hwMax,
+                                      osg::Uniform* dstep,
+                                      double hysteresis,
+                                      int minFrames )
+    : times_( new GPUTimes( passes ) ), budgetMs_( budgetMs ),
+      minQuality_( std::min( 1.f, std::max( 1.0e-3f, minQuality ) ) ), hysteresis_( hysteresis ),
+      minFrames_( std::max( 1, minFrames ) ), quality_( 1.f ),
+      numSamples_( numSamples ), hwMax_( hwMax ), dstep_( dstep ),
+      maxNumSamples_( 8.f ), maxRadius_( 32.f ), stepMul_( 1.f )
+{
+    if( numSamples ) numSamples->get( maxNumSamples_ );
+    if( hwMax ) hwMax->get( maxRadius_ );
+    if( dstep ) dstep->get( stepMul_ );
+    SetDynamic( numSamples );
+    SetDynamic( hwMax );
+    SetDynamic( dstep );
+    profiler.AddListener( osg::get_pointer( times_ ) );
+}
+
+//------------------------------------------------------------------------------
+bool QualityController::handle( const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa )
+{
+    if( ea.getEventType() != osgGA::GUIEventAdapter::FRAME ) return false;
+    if( times_->Count() < minFrames_ ) return false;
+    const double ms = times_->Average();
+    const osg::View* view = aa.asView();
+    const int frame = view && view->getFrameStamp() ? view->getFrameStamp()->getFrameNumber() : 0;
+    const bool overBudget = ms > budgetMs_ * ( 1.0 + hysteresis_ );
+    const bool underBudget = ms < budgetMs_ * ( 1.0 - hysteresis_ ) && quality_ < 1.f;
+    if( ( !overBudget && !underBudget ) || ms <= 0.0 )
+    {
+        // keep averaging over a sliding window of frames
+        times_->Reset( 0 );
+        return false;
+    }
+    // square root: half of the correction per adjustment, damps oscillations
+    // due to the non linear cost of the parameters
+    const float q = std::min( 1.f, std::max( minQuality_, float( quality_ * std::sqrt( budgetMs_ / ms ) ) ) );
+    if( q == quality_ )
+    {
+        times_->Reset( 0 );
+        return false;
+    }
+    quality_ = q;
+    Apply();
+    // parameters take effect in the frame being prepared
+    times_->Reset( frame );
+    std::clog << "SSAO quality: " << quality_ << "  GPU time: " << ms << " ms  budget: " << budgetMs_ << " ms\n";
+    return false;
+}
+
+//------------------------------------------------------------------------------
+void QualityController::Apply()
+{
+    const float q2 = std::sqrt( quality_ );
+    const float q4 = std::sqrt( q2 );
+    if( numSamples_.valid() ) numSamples_->set( std::max( 1.f, std::floor( maxNumSamples_ * q2 + 0.5f ) ) );
+    if( hwMax_.valid() ) hwMax_->set( std::max( 1.f, maxRadius_ * q4 ) );
+    if( dstep_.valid() ) dstep_->set( stepMul_ / q4 );
+}
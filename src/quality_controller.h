@@ -0,0 +1,63 @@
+#ifndef QUALITY_CONTROLLER_H_
+#define QUALITY_CONTROLLER_H_
+
+#include <string>
+#include <vector>
+
+#include <osg/Uniform>
+#include <osgGA/GUIEventHandler>
+
+#include "profiler.h"
+
+//------------------------------------------------------------------------------
+/// Closed loop controller holding the GPU time of the occlusion passes within
+/// a budget, so that the same scene runs at the same frame rate on different
+/// hardware without tuning.
+/// GPU times of the passes are received from a FrameProfiler. At each frame
+/// event the average time of the frames rendered since the last adjustment is
+/// compared with the budget; outside of the hysteresis band the quality q in
+/// [minQuality, 1] is scaled by the square root of budget / time.
+/// Cost is assumed proportional to q: the number of rays scales with q^1/2,
+/// the maximum radius in pixels with q^1/4 and the step multiplier with
+/// q^-1/4, so that the number of steps along each ray also scales with q^1/2.
+/// q = 1 maps to the values of the uniforms at construction time.
+/// Parameters changed from the keyboard are overridden at the next adjustment.
+/// The uniforms and the state sets holding them at construction time are
+/// marked DYNAMIC, since they are changed while the previous frame may still
+/// be drawn.
+class QualityController : public osgGA::GUIEventHandler
+{
+public:
+    /// @param passes names of the profiler passes whose times are summed
+    /// @param hysteresis relative distance from the budget within which
+    ///        quality is not changed
+    /// @param minFrames minimum number of timed frames between adjustments
+    QualityController( FrameProfiler& profiler,
+                       const std::vector< std::string >& passes,
+                       double budgetMs,
+                       float minQuality,
+                       osg::Uniform* numSamples,
+                       osg::Uniform* hwMax,
+                       osg::Uniform* dstep,
+                       double hysteresis = 0.1,
+                       int minFrames = 8 );
+    bool handle( const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa );
+    float Quality() const { return quality_; }
+    class GPUTimes;
+private:
+    void Apply();
+    osg::ref_ptr< GPUTimes > times_;
+    double budgetMs_;
+    float minQuality_;
+    double hysteresis_;
+    int minFrames_;
+    float quality_;
+    osg::ref_ptr< osg::Uniform > numSamples_;
+    osg::ref_ptr< osg::Uniform > hwMax_;
+    osg::ref_ptr< osg::Uniform > dstep_;
+    float maxNumSamples_;
+    float maxRadius_;
+    float stepMul_;
+};
+
+#endif // QUALITY_CONTROLLER_H_
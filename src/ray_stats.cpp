@@ -0,0 +1,71 @@
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+#include <osg/State>
+#include <OpenThreads/ScopedLock>
+
+#include "ray_stats.h"
+
+typedef OpenThreads::ScopedLock< OpenThreads::Mutex > ScopedLock;
+
+//------------------------------------------------------------------------------
+RayHistogram::RayHistogram( osg::TextureRectangle* counts, int printInterval )
+    : counts_( counts ), printInterval_( std::max( 1, printInterval ) ), histogram_( 256, 0.0 ), frames_( 0 )
+{}
+
+//------------------------------------------------------------------------------
+void RayHistogram::operator()( osg::RenderInfo& renderInfo ) const
+{
+    const osg::Camera* camera = renderInfo.getCurrentCamera();
+    const osg::Viewport* vp = camera ? camera->getViewport() : 0;
+    const int tw = counts_->getTextureWidth();
+    const int th = counts_->getTextureHeight();
+    if( !vp || tw <= 0 || th <= 0 ) return;
+    // whole texture read back, histogram of the viewport region only
+    osg::State& state = *renderInfo.getState();
+    state.setActiveTextureUnit( 0 );
+    state.applyTextureAttribute( 0, osg::get_pointer( counts_ ) );
+    buffer_.resize( tw * th );
+    glPixelStorei( GL_PACK_ALIGNMENT, 1 );
+    glGetTexImage( counts_->getTextureTarget(), 0, GL_RED, GL_UNSIGNED_BYTE, &buffer_[ 0 ] );
+    const int w = std::min( tw, int( vp->width() ) );
+    const int h = std::min( th, int( vp->height() ) );
+    bool print = false;
+    {
+        ScopedLock lock( mutex_ );
+        for( int y = 0; y != h; ++y )
+        {
+            const unsigned char* row = &buffer_[ y * tw ];
+            for( int x = 0; x != w; ++x ) histogram_[ row[ x ] ] += 1.0;
+        }
+        print = ++frames_ % printInterval_ == 0;
+    }
+    if( print ) Print();
+}
+
+//------------------------------------------------------------------------------
+void RayHistogram::Print() const
+{
+    ScopedLock lock( mutex_ );
+    // 255: pixels not covered by the model
+    double pixels = 0.0;
+    double rays = 0.0;
+    for( int i = 0; i != 255; ++i )
+    {
+        pixels += histogram_[ i ];
+        rays += i * histogram_[ i ];
+    }
+    if( pixels == 0.0 ) return;
+    const std::streamsize precision = std::clog.precision();
+    std::clog << "Rays per pixel (" << frames_ << " frames): " << std::fixed << std::setprecision( 1 );
+    for( int i = 0; i != 255; ++i )
+    {
+        if( histogram_[ i ] > 0.0 ) std::clog << i << ": " << 100.0 * histogram_[ i ] / pixels << "%  ";
+    }
+    std::clog << "average: " << rays / pixels << '\n';
+    std::clog.unsetf( std::ios::floatfield );
+    std::clog.precision( precision );
+    std::fill( histogram_.begin(), histogram_.end(), 0.0 );
+    frames_ = 0;
+}
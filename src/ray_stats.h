@@ -0,0 +1,34 @@
+#ifndef RAY_STATS_H_
+#define RAY_STATS_H_
+
+#include <vector>
+
+#include <osg/Camera>
+#include <osg/TextureRectangle>
+#include <OpenThreads/Mutex>
+
+//------------------------------------------------------------------------------
+/// Histogram of the number of rays per pixel written as normalized bytes into
+/// 'counts' by the programs compiled with RAY_STATS (255 = not covered).
+/// Set as the post draw callback of the camera rendering into 'counts': the
+/// texture is read back after each draw, within the camera viewport, and the
+/// histogram is printed to std::clog every 'printInterval' frames.
+/// Reading back stalls the draw thread: GPU times are not representative
+/// while statistics are collected.
+class RayHistogram : public osg::Camera::DrawCallback
+{
+public:
+    RayHistogram( osg::TextureRectangle* counts, int printInterval = 100 );
+    void operator()( osg::RenderInfo& renderInfo ) const;
+    /// Print accumulated histogram and reset it.
+    void Print() const;
+private:
+    osg::ref_ptr< osg::TextureRectangle > counts_;
+    int printInterval_;
+    mutable std::vector< unsigned char > buffer_;
+    mutable std::vector< double > histogram_;
+    mutable int frames_;
+    mutable OpenThreads::Mutex mutex_;
+};
+
+#endif // RAY_STATS_H_
@@ -0,0 +1,832 @@
+#include "scene_bvh.h"
+
+#include <set>
+#include <map>
+#include <limits>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <cassert>
+
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/NodeVisitor>
+#include <osg/TriangleIndexFunctor>
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#include <emmintrin.h>
+#define SCENE_BVH_SSE
+#endif
+
+namespace
+{
+typedef SceneBVH::Node Node;
+
+const int NUM_BINS = 16;
+const unsigned int MAX_LEAF_SIZE = 8;
+/// Deeper ranges are turned into leaves; bounds the traversal stack.
+const int MAX_DEPTH = 60;
+
+//------------------------------------------------------------------------------
+/// Axis aligned box.
+struct Box
+{
+    Box()
+    {
+        min[ 0 ] = min[ 1 ] = min[ 2 ] = std::numeric_limits< float >::max();
+        max[ 0 ] = max[ 1 ] = max[ 2 ] = -std::numeric_limits< float >::max();
+    }
+    void Expand( const float* p )
+    {
+        for( int i = 0; i != 3; ++i )
+        {
+            min[ i ] = std::min( min[ i ], p[ i ] );
+            max[ i ] = std::max( max[ i ], p[ i ] );
+        }
+    }
+    void Expand( const Box& b )
+    {
+        for( int i = 0; i != 3; ++i )
+        {
+            min[ i ] = std::min( min[ i ], b.min[ i ] );
+            max[ i ] = std::max( max[ i ], b.max[ i ] );
+        }
+    }
+    /// Half surface area.
+    float Area() const
+    {
+        const float dx = max[ 0 ] - min[ 0 ];
+        const float dy = max[ 1 ] - min[ 1 ];
+        const float dz = max[ 2 ] - min[ 2 ];
+        return dx < 0.f ? 0.f : dx * dy + dy * dz + dz * dx;
+    }
+    float min[ 3 ];
+    float max[ 3 ];
+};
+
+Box NodeBox( const Node& n )
+{
+    Box b;
+    b.Expand( n.min );
+    b.Expand( n.max );
+    return b;
+}
+
+void SetNodeBox( Node& n, const Box& b )
+{
+    std::copy( b.min, b.min + 3, n.min );
+    std::copy( b.max, b.max + 3, n.max );
+}
+
+//------------------------------------------------------------------------------
+/// Range of items [begin, end) to be built into the subtree rooted at 'node'.
+struct Job
+{
+    Job( unsigned int n = 0, unsigned int b = 0, unsigned int e = 0, int d = 0 ) : node( n ), begin( b ), end( e ), depth( d ) {}
+    unsigned int node;
+    unsigned int begin;
+    unsigned int end;
+    int depth;
+};
+
+/// Orders items by centroid bin.
+struct BinLess
+{
+    BinLess( const float* c, int a, float m, float s, int b ) : centroids( c ), axis( a ), min( m ), scale( s ), bin( b ) {}
+    bool operator()( unsigned int id ) const
+    {
+        return std::min( NUM_BINS - 1, int( ( centroids[ 3 * id + axis ] - min ) * scale ) ) < bin;
+    }
+    const float* centroids;
+    int axis;
+    float min;
+    float scale;
+    int bin;
+};
+
+/// Choose split of ids[begin, end) with binned SAH, reorder ids and return
+/// the index of the first item of the right child; 'begin' if leaf is cheaper.
+unsigned int Split( const Box* boxes, const float* centroids, unsigned int* ids,
+                    unsigned int begin, unsigned int end, const Box& bounds, const Box& cbounds )
+{
+    const unsigned int count = end - begin;
+    if( count <= 2 ) return begin;
+    int axis = 0;
+    for( int i = 1; i != 3; ++i )
+    {
+        if( cbounds.max[ i ] - cbounds.min[ i ] > cbounds.max[ axis ] - cbounds.min[ axis ] ) axis = i;
+    }
+    const float extent = cbounds.max[ axis ] - cbounds.min[ axis ];
+    // all centroids at the same position: halve large ranges in any order
+    if( !( extent > 0.f ) ) return count <= MAX_LEAF_SIZE ? begin : begin + count / 2;
+    const float scale = NUM_BINS / extent * 0.9999f;
+    Box binBoxes[ NUM_BINS ];
+    unsigned int binCounts[ NUM_BINS ] = { 0 };
+    for( unsigned int i = begin; i != end; ++i )
+    {
+        const unsigned int id = ids[ i ];
+        const int b = std::min( NUM_BINS - 1, int( ( centroids[ 3 * id + axis ] - cbounds.min[ axis ] ) * scale ) );
+        ++binCounts[ b ];
+        binBoxes[ b ].Expand( boxes[ id ] );
+    }
+    // sweep from the right then from the left
+    float rightAreas[ NUM_BINS ];
+    unsigned int rightCounts[ NUM_BINS ];
+    Box acc;
+    unsigned int c = 0;
+    for( int b = NUM_BINS - 1; b > 0; --b )
+    {
+        acc.Expand( binBoxes[ b ] );
+        c += binCounts[ b ];
+        rightAreas[ b ] = acc.Area();
+        rightCounts[ b ] = c;
+    }
+    acc = Box();
+    c = 0;
+    float bestCost = std::numeric_limits< float >::max();
+    int bestBin = 0;
+    for( int b = 1; b != NUM_BINS; ++b )
+    {
+        acc.Expand( binBoxes[ b - 1 ] );
+        c += binCounts[ b - 1 ];
+        if( c == 0 || rightCounts[ b ] == 0 ) continue;
+        const float cost = acc.Area() * c + rightAreas[ b ] * rightCounts[ b ];
+        if( cost < bestCost )
+        {
+            bestCost = cost;
+            bestBin = b;
+        }
+    }
+    if( bestBin == 0 ) return count <= MAX_LEAF_SIZE ? begin : begin + count / 2;
+    // cost relative to intersecting all the items, traversal step costs one item
+    const float area = bounds.Area();
+    const float splitCost = area > 0.f ? 1.0f + bestCost / area : 1.0f;
+    if( splitCost >= float( count ) && count <= MAX_LEAF_SIZE ) return begin;
+    return (unsigned int)( std::partition( ids + begin, ids + end,
+                                           BinLess( centroids, axis, cbounds.min[ axis ], scale, bestBin ) ) - ids );
+}
+
+/// Build tree over ids[begin, end) rooted at the node 'root.node' already in
+/// 'nodes'. If 'jobs' is not NULL ranges of up to 'jobSize' items are not
+/// built but added to 'jobs' and their node is left as a placeholder.
+void Build( const Box* boxes, const float* centroids, unsigned int* ids, const Job& root,
+            std::vector< Node >& nodes, std::vector< Job >* jobs, unsigned int jobSize )
+{
+    std::vector< Job > stack( 1, root );
+    while( !stack.empty() )
+    {
+        const Job j = stack.back();
+        stack.pop_back();
+        if( jobs && j.end - j.begin <= jobSize )
+        {
+            jobs->push_back( j );
+            continue;
+        }
+        Box bounds;
+        Box cbounds;
+        for( unsigned int i = j.begin; i != j.end; ++i )
+        {
+            bounds.Expand( boxes[ ids[ i ] ] );
+            cbounds.Expand( centroids + 3 * ids[ i ] );
+        }
+        const unsigned int mid = j.depth < MAX_DEPTH ? Split( boxes, centroids, ids, j.begin, j.end, bounds, cbounds ) : j.begin;
+        Node n;
+        SetNodeBox( n, bounds );
+        if( mid == j.begin || mid == j.end )
+        {
+            n.first = j.begin;
+            n.count = j.end - j.begin;
+            nodes[ j.node ] = n;
+            continue;
+        }
+        n.first = (unsigned int)( nodes.size() );
+        n.count = 0;
+        nodes[ j.node ] = n;
+        nodes.resize( nodes.size() + 2 );
+        stack.push_back( Job( n.first + 1, mid, j.end, j.depth + 1 ) );
+        stack.push_back( Job( n.first, j.begin, mid, j.depth + 1 ) );
+    }
+}
+
+/// Replace placeholder node of job with subtree built separately.
+void Attach( std::vector< Node >& nodes, const Job& job, const std::vector< Node >& subtree )
+{
+    const unsigned int offset = (unsigned int)( nodes.size() ) - 1;
+    for( size_t i = 0; i != subtree.size(); ++i )
+    {
+        Node n = subtree[ i ];
+        if( n.count == 0 ) n.first += offset;
+        if( i == 0 ) nodes[ job.node ] = n;
+        else nodes.push_back( n );
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Geometry triangles being built into a mesh.
+struct MeshInput
+{
+    const osg::Geometry* geometry;
+    std::vector< float > vertices;
+    std::vector< Box > boxes;
+    std::vector< float > centroids;
+    std::vector< unsigned int > ids;
+};
+
+struct TriangleCollector
+{
+    TriangleCollector() : vertices( 0 ), out( 0 ) {}
+    void operator()( unsigned int i1, unsigned int i2, unsigned int i3 )
+    {
+        if( i1 >= vertices->size() || i2 >= vertices->size() || i3 >= vertices->size() ) return;
+        const unsigned int i[ 3 ] = { i1, i2, i3 };
+        for( int k = 0; k != 3; ++k )
+        {
+            const osg::Vec3& v = ( *vertices )[ i[ k ] ];
+            out->push_back( v.x() );
+            out->push_back( v.y() );
+            out->push_back( v.z() );
+        }
+    }
+    const osg::Vec3Array* vertices;
+    std::vector< float >* out;
+};
+
+class ExtractTask : public ParallelTask
+{
+public:
+    ExtractTask( std::vector< MeshInput >& inputs ) : inputs_( inputs ) {}
+    void Run( int i, int )
+    {
+        MeshInput& in = inputs_[ i ];
+        osg::TriangleIndexFunctor< TriangleCollector > tc;
+        tc.vertices = static_cast< const osg::Vec3Array* >( in.geometry->getVertexArray() );
+        tc.out = &in.vertices;
+        in.geometry->accept( tc );
+        const size_t n = in.vertices.size() / 9;
+        in.boxes.resize( n );
+        in.centroids.resize( 3 * n );
+        in.ids.resize( n );
+        for( size_t t = 0; t != n; ++t )
+        {
+            const float* v = &in.vertices[ 9 * t ];
+            for( int k = 0; k != 3; ++k ) in.boxes[ t ].Expand( v + 3 * k );
+            for( int a = 0; a != 3; ++a ) in.centroids[ 3 * t + a ] = 0.5f * ( in.boxes[ t ].min[ a ] + in.boxes[ t ].max[ a ] );
+            in.ids[ t ] = (unsigned int)( t );
+        }
+    }
+private:
+    std::vector< MeshInput >& inputs_;
+};
+
+struct MeshJob
+{
+    int mesh;
+    Job job;
+    std::vector< Node > nodes;
+};
+
+class SubtreeTask : public ParallelTask
+{
+public:
+    SubtreeTask( std::vector< MeshInput >& inputs, std::vector< MeshJob >& jobs ) : inputs_( inputs ), jobs_( jobs ) {}
+    void Run( int i, int )
+    {
+        MeshJob& mj = jobs_[ i ];
+        MeshInput& in = inputs_[ mj.mesh ];
+        mj.nodes.resize( 1 );
+        Build( &in.boxes[ 0 ], &in.centroids[ 0 ], &in.ids[ 0 ],
+               Job( 0, mj.job.begin, mj.job.end, mj.job.depth ), mj.nodes, 0, 0 );
+    }
+private:
+    std::vector< MeshInput >& inputs_;
+    std::vector< MeshJob >& jobs_;
+};
+
+/// Store triangles as first vertex and two edges in leaf order.
+class PackTask : public ParallelTask
+{
+public:
+    PackTask( std::vector< MeshInput >& inputs, std::vector< SceneBVH::Mesh >& meshes ) : inputs_( inputs ), meshes_( meshes ) {}
+    void Run( int i, int )
+    {
+        const MeshInput& in = inputs_[ i ];
+        SceneBVH::Mesh& m = meshes_[ i ];
+        m.ids = in.ids;
+        m.triangles.resize( 9 * in.ids.size() );
+        for( size_t t = 0; t != in.ids.size(); ++t )
+        {
+            const float* v = &in.vertices[ 9 * in.ids[ t ] ];
+            float* o = &m.triangles[ 9 * t ];
+            for( int a = 0; a != 3; ++a )
+            {
+                o[ a ]     = v[ a ];
+                o[ 3 + a ] = v[ 3 + a ] - v[ a ];
+                o[ 6 + a ] = v[ 6 + a ] - v[ a ];
+            }
+        }
+    }
+private:
+    std::vector< MeshInput >& inputs_;
+    std::vector< SceneBVH::Mesh >& meshes_;
+};
+
+//------------------------------------------------------------------------------
+/// Collects geodes instances of each geometry with their node path.
+class InstanceCollector : public osg::NodeVisitor
+{
+public:
+    InstanceCollector( unsigned int mask ) : osg::NodeVisitor( osg::NodeVisitor::TRAVERSE_ACTIVE_CHILDREN )
+    {
+        setTraversalMask( mask );
+    }
+    void apply( osg::Geode& geode )
+    {
+        for( unsigned int i = 0; i != geode.getNumDrawables(); ++i )
+        {
+            const osg::Geometry* g = geode.getDrawable( i )->asGeometry();
+            if( !g || !Supported( *g ) ) continue;
+            std::map< const osg::Geometry*, int >::iterator m = meshes.find( g );
+            if( m == meshes.end() )
+            {
+                m = meshes.insert( std::make_pair( g, int( geometries.size() ) ) ).first;
+                geometries.push_back( g );
+            }
+            instances.push_back( std::make_pair( m->second, getNodePath() ) );
+        }
+        for( osg::NodePath::const_iterator n = getNodePath().begin(); n != getNodePath().end(); ++n )
+        {
+            osg::Transform* t = ( *n )->asTransform();
+            if( t ) transforms.insert( t );
+        }
+    }
+    std::vector< const osg::Geometry* > geometries;
+    std::vector< std::pair< int, osg::NodePath > > instances;
+    std::set< osg::Transform* > transforms;
+private:
+    static bool Supported( const osg::Geometry& g )
+    {
+        if( !dynamic_cast< const osg::Vec3Array* >( g.getVertexArray() ) || g.getVertexIndices() ) return false;
+        // instanced geometry is positioned by shaders
+        for( unsigned int i = 0; i != g.getNumPrimitiveSets(); ++i )
+        {
+            if( g.getPrimitiveSet( i )->getNumInstances() > 1 ) return false;
+        }
+        return true;
+    }
+    std::map< const osg::Geometry*, int > meshes;
+};
+
+//------------------------------------------------------------------------------
+// four wide float vectors and lane masks
+#ifdef SCENE_BVH_SSE
+struct Float4
+{
+    Float4() {}
+    Float4( __m128 x ) : v( x ) {}
+    explicit Float4( float f ) : v( _mm_set1_ps( f ) ) {}
+    static Float4 Load( const float* p ) { return _mm_loadu_ps( p ); }
+    void Store( float* p ) const { _mm_storeu_ps( p, v ); }
+    __m128 v;
+};
+inline Float4 operator+( Float4 a, Float4 b ) { return _mm_add_ps( a.v, b.v ); }
+inline Float4 operator-( Float4 a, Float4 b ) { return _mm_sub_ps( a.v, b.v ); }
+inline Float4 operator*( Float4 a, Float4 b ) { return _mm_mul_ps( a.v, b.v ); }
+inline Float4 operator/( Float4 a, Float4 b ) { return _mm_div_ps( a.v, b.v ); }
+inline Float4 Min( Float4 a, Float4 b ) { return _mm_min_ps( a.v, b.v ); }
+inline Float4 Max( Float4 a, Float4 b ) { return _mm_max_ps( a.v, b.v ); }
+inline Float4 operator<( Float4 a, Float4 b ) { return _mm_cmplt_ps( a.v, b.v ); }
+inline Float4 operator<=( Float4 a, Float4 b ) { return _mm_cmple_ps( a.v, b.v ); }
+inline Float4 operator>=( Float4 a, Float4 b ) { return _mm_cmpge_ps( a.v, b.v ); }
+inline Float4 operator!=( Float4 a, Float4 b ) { return _mm_cmpneq_ps( a.v, b.v ); }
+inline Float4 operator&( Float4 a, Float4 b ) { return _mm_and_ps( a.v, b.v ); }
+/// Lanes of 'a' where mask is set, of 'b' elsewhere.
+inline Float4 Select( Float4 mask, Float4 a, Float4 b ) { return _mm_or_ps( _mm_and_ps( mask.v, a.v ), _mm_andnot_ps( mask.v, b.v ) ); }
+/// Bit i set if lane i of mask is set.
+inline int Mask( Float4 mask ) { return _mm_movemask_ps( mask.v ); }
+#else
+struct Float4
+{
+    Float4() {}
+    explicit Float4( float f ) { v[ 0 ] = v[ 1 ] = v[ 2 ] = v[ 3 ] = f; }
+    static Float4 Load( const float* p ) { Float4 r; std::copy( p, p + 4, r.v ); return r; }
+    void Store( float* p ) const { std::copy( v, v + 4, p ); }
+    float v[ 4 ];
+};
+inline float FromBits( unsigned int u ) { float f; std::memcpy( &f, &u, sizeof( f ) ); return f; }
+inline unsigned int ToBits( float f ) { unsigned int u; std::memcpy( &u, &f, sizeof( u ) ); return u; }
+#define SCENE_BVH_OP( OP, EXPR ) \
+inline Float4 OP( Float4 a, Float4 b ) { Float4 r; for( int i = 0; i != 4; ++i ) r.v[ i ] = EXPR; return r; }
+#define SCENE_BVH_CMP( OP, CMP ) SCENE_BVH_OP( OP, FromBits( a.v[ i ] CMP b.v[ i ] ? ~0u : 0u ) )
+SCENE_BVH_OP( operator+, a.v[ i ] + b.v[ i ] )
+SCENE_BVH_OP( operator-, a.v[ i ] - b.v[ i ] )
+SCENE_BVH_OP( operator*, a.v[ i ] * b.v[ i ] )
+SCENE_BVH_OP( operator/, a.v[ i ] / b.v[ i ] )
+SCENE_BVH_OP( Min, a.v[ i ] < b.v[ i ] ? a.v[ i ] : b.v[ i ] )
+SCENE_BVH_OP( Max, a.v[ i ] > b.v[ i ] ? a.v[ i ] : b.v[ i ] )
+SCENE_BVH_OP( operator&, FromBits( ToBits( a.v[ i ] ) & ToBits( b.v[ i ] ) ) )
+SCENE_BVH_CMP( operator<, < )
+SCENE_BVH_CMP( operator<=, <= )
+SCENE_BVH_CMP( operator>=, >= )
+SCENE_BVH_CMP( operator!=, != )
+#undef SCENE_BVH_CMP
+#undef SCENE_BVH_OP
+inline Float4 Select( Float4 mask, Float4 a, Float4 b )
+{
+    Float4 r;
+    for( int i = 0; i != 4; ++i ) r.v[ i ] = ToBits( mask.v[ i ] ) ? a.v[ i ] : b.v[ i ];
+    return r;
+}
+inline int Mask( Float4 mask )
+{
+    int m = 0;
+    for( int i = 0; i != 4; ++i ) m |= ToBits( mask.v[ i ] ) >> 31 << i;
+    return m;
+}
+#endif
+
+//------------------------------------------------------------------------------
+/// Four rays, structure of arrays; lanes with negative tMax are inactive.
+struct Packet
+{
+    Packet()
+    {
+        float* arrays[] = { ox, oy, oz, dx, dy, dz, ix, iy, iz };
+        for( int a = 0; a != 9; ++a ) std::fill( arrays[ a ], arrays[ a ] + 4, 0.f );
+        std::fill( tMax, tMax + 4, -1.0f );
+        std::fill( instance, instance + 4, -1 );
+        std::fill( triangle, triangle + 4, 0u );
+    }
+    void SetRay( int lane, const osg::Vec3& o, const osg::Vec3& d, float tmax )
+    {
+        float* origin[ 3 ] = { ox, oy, oz };
+        float* dir[ 3 ] = { dx, dy, dz };
+        float* inv[ 3 ] = { ix, iy, iz };
+        for( int a = 0; a != 3; ++a )
+        {
+            origin[ a ][ lane ] = o[ a ];
+            dir[ a ][ lane ] = d[ a ];
+            // no infinities: 0 * inf would be NaN in the slab test
+            const float da = std::fabs( d[ a ] ) < 1e-30f ? ( d[ a ] < 0.f ? -1e-30f : 1e-30f ) : d[ a ];
+            inv[ a ][ lane ] = 1.0f / da;
+        }
+        tMax[ lane ] = tmax;
+    }
+    float ox[ 4 ], oy[ 4 ], oz[ 4 ];
+    float dx[ 4 ], dy[ 4 ], dz[ 4 ];
+    float ix[ 4 ], iy[ 4 ], iz[ 4 ];
+    float tMax[ 4 ];
+    int instance[ 4 ];
+    unsigned int triangle[ 4 ];
+};
+
+/// Packet loaded in registers.
+struct Rays
+{
+    Rays( const Packet& p )
+        : ox( Float4::Load( p.ox ) ), oy( Float4::Load( p.oy ) ), oz( Float4::Load( p.oz ) ),
+          dx( Float4::Load( p.dx ) ), dy( Float4::Load( p.dy ) ), dz( Float4::Load( p.dz ) ),
+          ix( Float4::Load( p.ix ) ), iy( Float4::Load( p.iy ) ), iz( Float4::Load( p.iz ) ) {}
+    Float4 ox, oy, oz, dx, dy, dz, ix, iy, iz;
+};
+
+/// Returns mask of the rays entering the box before tMax and their entry distance.
+inline int IntersectBox( const Node& n, const Rays& r, Float4 tMax, Float4& tNear )
+{
+    const Float4 t0x = ( Float4( n.min[ 0 ] ) - r.ox ) * r.ix;
+    const Float4 t1x = ( Float4( n.max[ 0 ] ) - r.ox ) * r.ix;
+    const Float4 t0y = ( Float4( n.min[ 1 ] ) - r.oy ) * r.iy;
+    const Float4 t1y = ( Float4( n.max[ 1 ] ) - r.oy ) * r.iy;
+    const Float4 t0z = ( Float4( n.min[ 2 ] ) - r.oz ) * r.iz;
+    const Float4 t1z = ( Float4( n.max[ 2 ] ) - r.oz ) * r.iz;
+    tNear = Max( Max( Min( t0x, t1x ), Min( t0y, t1y ) ), Max( Min( t0z, t1z ), Float4( 0.f ) ) );
+    const Float4 tFar = Min( Min( Max( t0x, t1x ), Max( t0y, t1y ) ), Min( Max( t0z, t1z ), tMax ) );
+    return Mask( tNear <= tFar );
+}
+
+inline int BitCount( int m )
+{
+    return ( m & 1 ) + ( ( m >> 1 ) & 1 ) + ( ( m >> 2 ) & 1 ) + ( ( m >> 3 ) & 1 );
+}
+
+/// Depth first traversal, nearest child first; calls leaf( node, packet ) for
+/// each leaf hit by at least one ray.
+template < class LeafT >
+void Traverse( const std::vector< Node >& nodes, Packet& p, LeafT& leaf )
+{
+    if( nodes.empty() ) return;
+    const Rays r( p );
+    Float4 tNear;
+    if( !IntersectBox( nodes[ 0 ], r, Float4::Load( p.tMax ), tNear ) ) return;
+    unsigned int stack[ 2 * MAX_DEPTH + 4 ];
+    int top = 0;
+    stack[ top++ ] = 0;
+    while( top )
+    {
+        const Node& n = nodes[ stack[ --top ] ];
+        if( n.count )
+        {
+            leaf( n, p, r );
+            continue;
+        }
+        const Float4 tMax = Float4::Load( p.tMax );
+        Float4 tLeft, tRight;
+        const int left = IntersectBox( nodes[ n.first ], r, tMax, tLeft );
+        const int right = IntersectBox( nodes[ n.first + 1 ], r, tMax, tRight );
+        if( left && right )
+        {
+            // nearer child for most rays on top of the stack
+            const int both = left & right;
+            const bool leftNearer = 2 * BitCount( Mask( tLeft <= tRight ) & both ) >= BitCount( both );
+            stack[ top++ ] = leftNearer ? n.first + 1 : n.first;
+            stack[ top++ ] = leftNearer ? n.first : n.first + 1;
+        }
+        else if( left ) stack[ top++ ] = n.first;
+        else if( right ) stack[ top++ ] = n.first + 1;
+    }
+}
+
+/// Intersect rays with the triangles of a bottom level leaf.
+struct TriangleLeaf
+{
+    TriangleLeaf( const SceneBVH::Mesh& m, int inst ) : mesh( m ), instance( inst ) {}
+    void operator()( const Node& n, Packet& p, const Rays& r ) const
+    {
+        Float4 tMax = Float4::Load( p.tMax );
+        const Float4 zero( 0.f );
+        const Float4 one( 1.f );
+        for( unsigned int k = n.first; k != n.first + n.count; ++k )
+        {
+            const float* tri = &mesh.triangles[ 9 * k ];
+            const Float4 e1x( tri[ 3 ] ), e1y( tri[ 4 ] ), e1z( tri[ 5 ] );
+            const Float4 e2x( tri[ 6 ] ), e2y( tri[ 7 ] ), e2z( tri[ 8 ] );
+            // Moller-Trumbore, both sides
+            const Float4 px = r.dy * e2z - r.dz * e2y;
+            const Float4 py = r.dz * e2x - r.dx * e2z;
+            const Float4 pz = r.dx * e2y - r.dy * e2x;
+            const Float4 det = e1x * px + e1y * py + e1z * pz;
+            const Float4 inv = one / det;
+            const Float4 sx = r.ox - Float4( tri[ 0 ] );
+            const Float4 sy = r.oy - Float4( tri[ 1 ] );
+            const Float4 sz = r.oz - Float4( tri[ 2 ] );
+            const Float4 u = ( sx * px + sy * py + sz * pz ) * inv;
+            const Float4 qx = sy * e1z - sz * e1y;
+            const Float4 qy = sz * e1x - sx * e1z;
+            const Float4 qz = sx * e1y - sy * e1x;
+            const Float4 v = ( r.dx * qx + r.dy * qy + r.dz * qz ) * inv;
+            const Float4 t = ( e2x * qx + e2y * qy + e2z * qz ) * inv;
+            const Float4 hit = ( det != zero ) & ( u >= zero ) & ( v >= zero ) & ( u + v <= one )
+                               & ( t >= zero ) & ( t < tMax );
+            const int mask = Mask( hit );
+            if( !mask ) continue;
+            tMax = Select( hit, t, tMax );
+            for( int l = 0; l != 4; ++l )
+            {
+                if( !( mask & ( 1 << l ) ) ) continue;
+                p.instance[ l ] = instance;
+                p.triangle[ l ] = mesh.ids[ k ];
+            }
+        }
+        tMax.Store( p.tMax );
+    }
+    const SceneBVH::Mesh& mesh;
+    int instance;
+};
+} // namespace
+
+//------------------------------------------------------------------------------
+/// Intersect rays with the instances of a top level leaf: rays are transformed
+/// into the local space of each instance, where ray parameters are unchanged.
+struct SceneBVH::InstanceLeaf
+{
+    InstanceLeaf( const SceneBVH& bvh ) : bvh_( bvh ) {}
+    void operator()( const Node& n, Packet& p, const Rays& ) const
+    {
+        for( unsigned int k = n.first; k != n.first + n.count; ++k )
+        {
+            Intersect( int( bvh_.topIds_[ k ] ), p );
+        }
+    }
+    void Intersect( int i, Packet& p ) const
+    {
+        const Instance& instance = bvh_.instances_[ i ];
+        const osg::Matrixd& m = instance.worldToLocal;
+        Packet local;
+        for( int l = 0; l != 4; ++l )
+        {
+            if( p.tMax[ l ] < 0.f ) continue;
+            const osg::Vec3d o( p.ox[ l ], p.oy[ l ], p.oz[ l ] );
+            const osg::Vec3d d( p.dx[ l ], p.dy[ l ], p.dz[ l ] );
+            local.SetRay( l, o * m, osg::Matrixd::transform3x3( d, m ), p.tMax[ l ] );
+        }
+        const Mesh& mesh = bvh_.meshes_[ instance.mesh ];
+        TriangleLeaf leaf( mesh, i );
+        Traverse( mesh.nodes, local, leaf );
+        for( int l = 0; l != 4; ++l )
+        {
+            if( local.instance[ l ] < 0 ) continue;
+            p.tMax[ l ] = local.tMax[ l ];
+            p.instance[ l ] = local.instance[ l ];
+            p.triangle[ l ] = local.triangle[ l ];
+        }
+    }
+    const SceneBVH& bvh_;
+};
+
+//------------------------------------------------------------------------------
+SceneBVH::SceneBVH( osg::Node& root, unsigned int traversalMask, ThreadPool& pool )
+{
+    InstanceCollector ic( traversalMask );
+    root.accept( ic );
+
+    // triangles of each geometry
+    std::vector< MeshInput > inputs( ic.geometries.size() );
+    for( size_t i = 0; i != inputs.size(); ++i ) inputs[ i ].geometry = ic.geometries[ i ];
+    ExtractTask extract( inputs );
+    pool.ParallelFor( int( inputs.size() ), extract );
+
+    // upper levels of each tree built serially, subtrees in parallel
+    size_t numTriangles = 0;
+    for( size_t i = 0; i != inputs.size(); ++i ) numTriangles += inputs[ i ].ids.size();
+    const unsigned int jobSize = (unsigned int)( std::max( size_t( 1024 ), numTriangles / ( 8 * pool.NumThreads() ) ) );
+    meshes_.resize( inputs.size() );
+    std::vector< MeshJob > jobs;
+    for( size_t i = 0; i != inputs.size(); ++i )
+    {
+        MeshInput& in = inputs[ i ];
+        if( in.ids.empty() ) continue;
+        std::vector< Job > meshJobs;
+        meshes_[ i ].nodes.resize( 1 );
+        Build( &in.boxes[ 0 ], &in.centroids[ 0 ], &in.ids[ 0 ], Job( 0, 0, (unsigned int)( in.ids.size() ), 0 ),
+               meshes_[ i ].nodes, &meshJobs, jobSize );
+        for( std::vector< Job >::iterator j = meshJobs.begin(); j != meshJobs.end(); ++j )
+        {
+            jobs.push_back( MeshJob() );
+            jobs.back().mesh = int( i );
+            jobs.back().job = *j;
+        }
+    }
+    SubtreeTask subtrees( inputs, jobs );
+    pool.ParallelFor( int( jobs.size() ), subtrees );
+    for( std::vector< MeshJob >::iterator j = jobs.begin(); j != jobs.end(); ++j )
+    {
+        Attach( meshes_[ j->mesh ].nodes, j->job, j->nodes );
+        std::vector< Node >().swap( j->nodes );
+    }
+    PackTask pack( inputs, meshes_ );
+    pool.ParallelFor( int( inputs.size() ), pack );
+
+    for( size_t i = 0; i != ic.instances.size(); ++i )
+    {
+        if( meshes_[ ic.instances[ i ].first ].ids.empty() ) continue;
+        instances_.push_back( Instance() );
+        instances_.back().mesh = ic.instances[ i ].first;
+        instances_.back().path = ic.instances[ i ].second;
+    }
+    for( std::set< osg::Transform* >::iterator t = ic.transforms.begin(); t != ic.transforms.end(); ++t )
+    {
+        transforms_.push_back( *t );
+        osg::Matrixd m;
+        ( *t )->computeLocalToWorldMatrix( m, 0 );
+        matrices_.push_back( m );
+    }
+    UpdateInstances();
+
+    // top level tree
+    if( instances_.empty() ) return;
+    std::vector< Box > boxes( instances_.size() );
+    std::vector< float > centroids( 3 * instances_.size() );
+    topIds_.resize( instances_.size() );
+    for( size_t i = 0; i != instances_.size(); ++i )
+    {
+        boxes[ i ].Expand( instances_[ i ].min );
+        boxes[ i ].Expand( instances_[ i ].max );
+        for( int a = 0; a != 3; ++a ) centroids[ 3 * i + a ] = 0.5f * ( instances_[ i ].min[ a ] + instances_[ i ].max[ a ] );
+        topIds_[ i ] = (unsigned int)( i );
+    }
+    topNodes_.resize( 1 );
+    Build( &boxes[ 0 ], &centroids[ 0 ], &topIds_[ 0 ], Job( 0, 0, (unsigned int)( instances_.size() ), 0 ), topNodes_, 0, 0 );
+}
+
+//------------------------------------------------------------------------------
+void SceneBVH::UpdateInstances()
+{
+    for( std::vector< Instance >::iterator i = instances_.begin(); i != instances_.end(); ++i )
+    {
+        const osg::Matrixd localToWorld = osg::computeLocalToWorld( i->path );
+        i->worldToLocal = osg::Matrixd::inverse( localToWorld );
+        const Node& root = meshes_[ i->mesh ].nodes[ 0 ];
+        Box b;
+        for( int c = 0; c != 8; ++c )
+        {
+            const osg::Vec3d p = osg::Vec3d( c & 1 ? root.max[ 0 ] : root.min[ 0 ],
+                                             c & 2 ? root.max[ 1 ] : root.min[ 1 ],
+                                             c & 4 ? root.max[ 2 ] : root.min[ 2 ] ) * localToWorld;
+            const float f[ 3 ] = { float( p.x() ), float( p.y() ), float( p.z() ) };
+            b.Expand( f );
+        }
+        std::copy( b.min, b.min + 3, i->min );
+        std::copy( b.max, b.max + 3, i->max );
+    }
+}
+
+//------------------------------------------------------------------------------
+void SceneBVH::Refit()
+{
+    bool changed = false;
+    for( size_t i = 0; i != transforms_.size(); ++i )
+    {
+        osg::Matrixd m;
+        transforms_[ i ]->computeLocalToWorldMatrix( m, 0 );
+        if( m == matrices_[ i ] ) continue;
+        matrices_[ i ] = m;
+        changed = true;
+    }
+    if( !changed ) return;
+    UpdateInstances();
+    // children are stored after their parent
+    for( size_t i = topNodes_.size(); i-- != 0; )
+    {
+        Node& n = topNodes_[ i ];
+        Box b;
+        if( n.count )
+        {
+            for( unsigned int k = n.first; k != n.first + n.count; ++k )
+            {
+                b.Expand( instances_[ topIds_[ k ] ].min );
+                b.Expand( instances_[ topIds_[ k ] ].max );
+            }
+        }
+        else
+        {
+            b.Expand( NodeBox( topNodes_[ n.first ] ) );
+            b.Expand( NodeBox( topNodes_[ n.first + 1 ] ) );
+        }
+        SetNodeBox( n, b );
+    }
+}
+
+//------------------------------------------------------------------------------
+void SceneBVH::Intersect( const Ray* rays, Hit* hits, int numRays, const int* hints )
+{
+    Refit();
+    const InstanceLeaf leaf( *this );
+    const int numInstances = int( instances_.size() );
+    for( int first = 0; first < numRays; first += 4 )
+    {
+        const int n = std::min( 4, numRays - first );
+        Packet p;
+        for( int l = 0; l != n; ++l ) p.SetRay( l, rays[ first + l ].origin, rays[ first + l ].direction, rays[ first + l ].tMax );
+        // hinted instances first: a hit shortens the rays and culls most of
+        // the top level tree
+        if( hints )
+        {
+            for( int l = 0; l != n; ++l )
+            {
+                const int h = hints[ first + l ];
+                if( h < 0 || h >= numInstances ) continue;
+                bool tested = false;
+                for( int j = 0; j != l && !tested; ++j ) tested = hints[ first + j ] == h;
+                if( !tested ) leaf.Intersect( h, p );
+            }
+        }
+        Traverse( topNodes_, p, leaf );
+        for( int l = 0; l != n; ++l )
+        {
+            Hit& h = hits[ first + l ];
+            h = Hit();
+            if( p.instance[ l ] < 0 ) continue;
+            h.t = p.tMax[ l ];
+            h.instance = p.instance[ l ];
+            h.triangle = p.triangle[ l ];
+        }
+    }
+#ifdef SCENE_BVH_VERIFY
+    // hints only change the traversal order: the nearest hits must not change;
+    // the instance may differ only when two instances are hit at the same t
+    if( hints && numRays > 0 )
+    {
+        std::vector< Hit > unhinted( numRays );
+        Intersect( rays, &unhinted[ 0 ], numRays );
+        for( int i = 0; i != numRays; ++i )
+        {
+            assert( hits[ i ].Valid() == unhinted[ i ].Valid() );
+            assert( !hits[ i ].Valid() || hits[ i ].t == unhinted[ i ].t );
+        }
+    }
+#endif
+}
+
+SceneBVH::Hit SceneBVH::Intersect( const Ray& ray )
+{
+    Hit h;
+    Intersect( &ray, &h, 1 );
+    return h;
+}
+
+//------------------------------------------------------------------------------
+int SceneBVH::NumTriangles() const
+{
+    size_t n = 0;
+    for( std::vector< Mesh >::const_iterator m = meshes_.begin(); m != meshes_.end(); ++m ) n += m->ids.size();
+    return int( n );
+}
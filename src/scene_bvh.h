@@ -0,0 +1,109 @@
+#ifndef SCENE_BVH_H_
+#define SCENE_BVH_H_
+
+#include <vector>
+
+#include <osg/Referenced>
+#include <osg/Node>
+#include <osg/Transform>
+#include <osg/Matrixd>
+#include <osg/Vec3>
+#include <osg/BoundingBox>
+
+#include "thread_pool.h"
+
+//------------------------------------------------------------------------------
+/// Two level bounding volume hierarchy over the triangles of a scene graph,
+/// used in place of osgUtil::LineSegmentIntersector for picking and collision.
+/// Bottom level: one SAH (surface area heuristic, binned) tree per geometry in
+/// object space; the upper levels of large trees are split serially and the
+/// remaining subtrees are built in parallel on the thread pool.
+/// Top level: SAH tree over the world space bounds of each geode instance of a
+/// geometry. When the matrix of a transform above the geometries changes
+/// (e.g. dragged with a manipulator) instance bounds are recomputed and the
+/// top level tree is refitted at the next query; the bottom level trees are
+/// never rebuilt.
+/// Rays are traced in packets of four with SSE (scalar code where SSE2 is not
+/// available): each node box and triangle is tested against all the rays of
+/// the packet at once.
+/// Only Vec3Array vertices without vertex indices and non instanced primitive
+/// sets are considered.
+class SceneBVH : public osg::Referenced
+{
+public:
+    /// Points origin + t * direction, t in [0, tMax].
+    struct Ray
+    {
+        Ray() : tMax( 1.0f ) {}
+        Ray( const osg::Vec3& o, const osg::Vec3& d, float tmax = 1.0f ) : origin( o ), direction( d ), tMax( tmax ) {}
+        osg::Vec3 origin;
+        osg::Vec3 direction;
+        float tMax;
+    };
+    struct Hit
+    {
+        Hit() : t( -1.0f ), instance( -1 ), triangle( 0 ) {}
+        bool Valid() const { return instance >= 0; }
+        /// ray parameter of the hit point
+        float t;
+        /// geode instance, see GetNodePath()
+        int instance;
+        /// index of triangle in the geometry, in TriangleIndexFunctor order
+        unsigned int triangle;
+    };
+    /// Build hierarchy of the geodes under 'root' whose node path matches
+    /// 'traversalMask'.
+    SceneBVH( osg::Node& root, unsigned int traversalMask = ~0u, ThreadPool& pool = GetDefaultThreadPool() );
+    /// Compute nearest hit of each ray; rays are traced four at a time.
+    /// 'hints', if not null, holds for each ray an instance likely to be hit
+    /// (e.g. the one hit by the same ray in the previous frame) or -1: the
+    /// hinted instances are tested before traversing the tree.
+    void Intersect( const Ray* rays, Hit* hits, int numRays, const int* hints = 0 );
+    Hit Intersect( const Ray& ray );
+    /// Path from the root node to the geode of an instance.
+    const osg::NodePath& GetNodePath( int instance ) const { return instances_[ instance ].path; }
+    /// Refit top level tree if any transform changed; called by Intersect.
+    void Refit();
+    int NumTriangles() const;
+
+    /// Node of a tree: inner node if count == 0, with children at index
+    /// 'first' and 'first' + 1, leaf with 'count' items starting at 'first'
+    /// otherwise.
+    struct Node
+    {
+        float min[ 3 ];
+        unsigned int first;
+        float max[ 3 ];
+        unsigned int count;
+    };
+    /// Bottom level tree and triangles stored in leaf order as vertex and two
+    /// edges.
+    struct Mesh
+    {
+        std::vector< Node > nodes;
+        std::vector< float > triangles;
+        std::vector< unsigned int > ids;
+    };
+private:
+    struct Instance
+    {
+        int mesh;
+        osg::NodePath path;
+        osg::Matrixd worldToLocal;
+        // world space bounds
+        float min[ 3 ];
+        float max[ 3 ];
+    };
+    struct InstanceLeaf;
+    friend struct InstanceLeaf;
+    void UpdateInstances();
+    std::vector< Mesh > meshes_;
+    std::vector< Instance > instances_;
+    std::vector< Node > topNodes_;
+    std::vector< unsigned int > topIds_;
+    // transforms above the instances and their last seen local matrices
+    std::vector< osg::ref_ptr< osg::Transform > > transforms_;
+    std::vector< osg::Matrixd > matrices_;
+};
+
+#endif // SCENE_BVH_H_
@@ -0,0 +1,116 @@
+#include "scene_cache.h"
+
+#include <osg/Version>
+#include <osgDB/Registry>
+#include <osgDB/FileUtils>
+#include <osgDB/FileNameUtils>
+
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <cstdio>
+
+namespace
+{
+//------------------------------------------------------------------------------
+/// 64 bit FNV-1a hash.
+unsigned long long Hash( const char* data, size_t size, unsigned long long h = 14695981039346656037ULL )
+{
+    const unsigned char* p = reinterpret_cast< const unsigned char* >( data );
+    for( const unsigned char* e = p + size; p != e; ++p )
+    {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+unsigned long long Hash( const std::string& s, unsigned long long h )
+{
+    return Hash( s.data(), s.size(), h );
+}
+
+/// Hash file contents read in large blocks; returns false if file cannot be read.
+bool HashFile( const std::string& fileName, unsigned long long& h )
+{
+    std::ifstream is( fileName.c_str(), std::ios::binary );
+    if( !is ) return false;
+    std::vector< char > block( 1 << 20 );
+    while( is )
+    {
+        is.read( &block[ 0 ], block.size() );
+        h = Hash( &block[ 0 ], size_t( is.gcount() ), h );
+    }
+    return is.eof();
+}
+
+osgDB::ReaderWriter* GetNativeReaderWriter()
+{
+    return osgDB::Registry::instance()->getReaderWriterForExtension( "osgb" );
+}
+}
+
+//------------------------------------------------------------------------------
+std::string SceneCache::Key( const std::vector< std::string >& files, const std::string& settings ) const
+{
+    if( files.empty() ) return "";
+    unsigned long long h = Hash( settings, Hash( std::string( osgGetVersion() ), 14695981039346656037ULL ) );
+    for( std::vector< std::string >::const_iterator f = files.begin(); f != files.end(); ++f )
+    {
+        const std::string path = osgDB::findDataFile( *f );
+        if( path.empty() ) return "";
+        // extension selects the reader
+        h = Hash( osgDB::getLowerCaseFileExtension( path ) + '\n', h );
+        if( !HashFile( path, h ) ) return "";
+    }
+    std::ostringstream os;
+    os << std::hex << std::setw( 16 ) << std::setfill( '0' ) << h;
+    return os.str();
+}
+
+//------------------------------------------------------------------------------
+osg::Node* SceneCache::Read( const std::string& key ) const
+{
+    osgDB::ReaderWriter* rw = GetNativeReaderWriter();
+    if( !rw || key.empty() ) return 0;
+    std::ifstream is( FileName( key ).c_str(), std::ios::binary );
+    if( !is ) return 0;
+    // scene is streamed from file: no intermediate copy of the whole file
+    std::vector< char > buffer( 1 << 20 );
+    is.rdbuf()->pubsetbuf( &buffer[ 0 ], buffer.size() );
+    osgDB::ReaderWriter::ReadResult rr = rw->readNode( is, 0 );
+    return rr.success() ? rr.takeNode() : 0;
+}
+
+//------------------------------------------------------------------------------
+bool SceneCache::Write( const std::string& key, const osg::Node& node ) const
+{
+    osgDB::ReaderWriter* rw = GetNativeReaderWriter();
+    if( !rw || key.empty() || !osgDB::makeDirectory( directory_ ) ) return false;
+    // write to temporary file first: concurrent instances never see a partial file
+    const std::string fileName = FileName( key );
+    const std::string tmp = fileName + ".tmp";
+    {
+        std::ofstream os( tmp.c_str(), std::ios::binary );
+        if( !os ) return false;
+        // textures are stored inside the cache entry, not as references to
+        // the original image files
+        osg::ref_ptr< osgDB::ReaderWriter::Options > options =
+            new osgDB::ReaderWriter::Options( "WriteImageHint=IncludeData" );
+        if( !rw->writeNode( node, os, osg::get_pointer( options ) ).success() || !os )
+        {
+            os.close();
+            std::remove( tmp.c_str() );
+            return false;
+        }
+    }
+    std::remove( fileName.c_str() );
+    return std::rename( tmp.c_str(), fileName.c_str() ) == 0;
+}
+
+//------------------------------------------------------------------------------
+std::string SceneCache::FileName( const std::string& key ) const
+{
+    return osgDB::concatPaths( directory_, key + ".osgb" );
+}
@@ -0,0 +1,34 @@
+#ifndef SCENE_CACHE_H_
+#define SCENE_CACHE_H_
+
+#include <string>
+#include <vector>
+
+#include <osg/Node>
+
+//------------------------------------------------------------------------------
+/// On disk cache of preprocessed scene graphs stored in the OSG native binary
+/// format (.osgb).
+/// Entries are content addressed: the key is a hash of the contents and
+/// extensions of the input files, of the settings that affect loading and
+/// preprocessing (reader options, normal generation, texture processing...)
+/// and of the OpenSceneGraph version; editing a model or changing any of the
+/// settings results in a new entry, stale entries are never read.
+class SceneCache
+{
+public:
+    /// Directory where scene graphs are stored.
+    SceneCache( const std::string& dir ) : directory_( dir ) {}
+    /// Key of the scene loaded from 'files' with 'settings'; empty if there
+    /// are no files or one of them cannot be found.
+    std::string Key( const std::vector< std::string >& files, const std::string& settings ) const;
+    /// Read scene graph stored under 'key'; NULL if missing or unreadable.
+    osg::Node* Read( const std::string& key ) const;
+    /// Store scene graph under 'key', images included; returns false on failure.
+    bool Write( const std::string& key, const osg::Node& node ) const;
+private:
+    std::string FileName( const std::string& key ) const;
+    std::string directory_;
+};
+
+#endif // SCENE_CACHE_H_
@@ -0,0 +1,155 @@
+#include "scene_loader.h"
+
+#include <vector>
+#include <sstream>
+#include <cassert>
+#include <stdexcept>
+
+#include <osg/Group>
+#include <osgDB/Registry>
+#include <osgDB/ReadFile>
+
+#include "texture_preprocess.h"
+#include "manipulator.h"
+#include "molecule.h"
+#include "scene_cache.h"
+#include "normals.h"
+
+//------------------------------------------------------------------------------
+void AddSceneLoadUsage( osg::ApplicationUsage& usage )
+{
+    usage.addCommandLineOption( "--options", "Pass options to loader(s)" );
+    usage.addCommandLineOption( "-normals",  "[all] Compute normals" );
+    usage.addCommandLineOption( "-creaseAngle",  "[all] With -normals: faces at a shared position are averaged only within\n"
+                                                 "       this angle in degrees; vertices are not split (default 180)" );
+    usage.addCommandLineOption( "-chemPlugin",
+                                "[all] Read .pdb, .ent and .mol2 files with the 'chem' plugin instead of the\n"
+                                "      built-in reader rendering atoms as sphere impostors (implies -mrt;\n"
+                                "      supported by ssao_trace_per_frag2_optimal shaders); built-in reader\n"
+                                "      option: --options radiusScale=<scale>" );
+    usage.addCommandLineOption( "-sceneCache",  "[all] Directory where preprocessed scene graphs are stored, keyed on a hash\n"
+                                                "       of the model files, reader options and preprocessing flags" );
+    usage.addCommandLineOption( "-rebuildSceneCache",  "[all] Load and preprocess model files even if cached, then update cache" );
+}
+
+//------------------------------------------------------------------------------
+SceneLoadParameters ParseSceneLoadParameters( osg::ArgumentParser& arguments )
+{
+    SceneLoadParameters p;
+    p.chemPlugin = arguments.read( "-chemPlugin" );
+    // read additional options to pass to reader
+    arguments.read( "--options", p.options );
+    p.computeNormals = arguments.read( "-normals" );
+    arguments.read( "-creaseAngle", p.creaseAngle );
+    arguments.read( "-sceneCache", p.sceneCacheDir );
+    p.rebuildSceneCache = arguments.read( "-rebuildSceneCache" );
+    return p;
+}
+
+//------------------------------------------------------------------------------
+osg::Node* LoadScene( osg::ArgumentParser& arguments,
+                      const SceneLoadParameters& params,
+                      osg::Node* defaultModel,
+                      bool* sphereImpostors )
+{
+    // all the non option arguments are read as model files and hashed into
+    // the scene cache key: options read later would be taken as files
+    for( int i = 1; i < arguments.argc(); ++i )
+    {
+        if( !arguments.isOption( i ) ) continue;
+        const std::string option = arguments[ i ];
+        // read by osgDB::readNodeFiles with the following file name
+        if( option == "--image" || option == "--movie" || option == "--dem" )
+        {
+            ++i;
+            continue;
+        }
+        throw std::runtime_error( "Option not read before loading the scene: " + option );
+    }
+    // ADD EXTENSIONS //
+    // Add OB extensions
+    osgDB::Registry* r = osgDB::Registry::instance();
+    assert( r );
+    r->addFileExtensionAlias( "pdb",  "chem" );
+    r->addFileExtensionAlias( "ent",  "chem" );
+    r->addFileExtensionAlias( "hin",  "chem" );
+    r->addFileExtensionAlias( "xyz",  "chem" );
+    r->addFileExtensionAlias( "mol",  "chem" );
+    r->addFileExtensionAlias( "mol2", "chem" );
+    r->addFileExtensionAlias( "cube", "chem" );
+    r->addFileExtensionAlias( "g03",  "chem" );
+    r->addFileExtensionAlias( "g98",  "chem" );
+    r->addFileExtensionAlias( "gam",  "chem" );
+    r->addFileExtensionAlias( "coor", "chem" );
+    r->addFileExtensionAlias( "ref",  "chem" );
+    // built-in molecule reader takes precedence over the 'chem' plugin;
+    // atom data textures are bound to the units following the reserved ones
+    osg::ref_ptr< MoleculeReaderWriter > moleculeReader;
+    if( !params.chemPlugin )
+    {
+        moleculeReader = new MoleculeReaderWriter( params.texUnit + params.reservedTexUnits );
+        r->addReaderWriter( osg::get_pointer( moleculeReader ) );
+    }
+    // preprocessed scene cache: options must be consumed before reading
+    // the model files, all the remaining non option arguments are files
+    std::string sceneKey;
+    if( !params.sceneCacheDir.empty() )
+    {
+        std::vector< std::string > files;
+        for( int i = 1; i < arguments.argc(); ++i )
+        {
+            if( !arguments.isOption( i ) ) files.push_back( arguments[ i ] );
+        }
+        // everything that changes the preprocessed scene graph
+        std::ostringstream settings;
+        settings << "options=" << params.options
+                 << ";normals=" << params.computeNormals
+                 << ";creaseAngle=" << params.creaseAngle
+                 << ";chemPlugin=" << params.chemPlugin
+                 << ";textures=" << params.enableTextures
+                 << ";texUnit=" << params.texUnit
+                 << ";reservedTexUnits=" << params.reservedTexUnits;
+        sceneKey = SceneCache( params.sceneCacheDir ).Key( files, settings.str() );
+    }
+
+    // LOAD MODEL //
+    osg::ref_ptr<osg::Node> model;
+    if( !sceneKey.empty() && !params.rebuildSceneCache ) model = SceneCache( params.sceneCacheDir ).Read( sceneKey );
+    if( model == 0 )
+    {
+        model = osgDB::readNodeFiles( arguments, new osgDB::ReaderWriter::Options( params.options ) );
+        // scenes read by the built-in molecule reader are not cached: they
+        // are already read in parallel from mapped files and rely on a
+        // bounding box callback that is not serialized
+        const bool cacheable = model != 0 && !sceneKey.empty()
+                               && !( moleculeReader.valid() && moleculeReader->NumLoaded() > 0 );
+        if( model != 0 && params.computeNormals ) GenerateNormals( *model, osg::DegreesToRadians( params.creaseAngle ) );
+        if( model == 0 ) model = defaultModel;
+        if( model == 0 ) return 0;
+
+        // add group: useful for adding transform in case mainpulator requested
+        if( !model->asGroup() )
+        {
+            osg::ref_ptr< osg::Group > group = new osg::Group;
+            group->addChild( osg::get_pointer( model ) );
+            model = group;
+        }
+
+        // PROCESS TEXTURES//
+        // enable or remove textures
+        if( params.enableTextures )
+        {
+            // create reserved texture unit list
+            std::vector< int > tu( params.reservedTexUnits );
+            for( unsigned int i = 0; i != tu.size(); ++i ) tu[ i ] = params.texUnit + i;
+            // make textures in scenegraph accessible from shaders
+            TextureToUniform( *model, "textureUnit", "tex", tu.begin(), tu.end() );
+        }
+        else RemoveTextures( *model );
+
+        InsertTransform( osg::get_pointer( model ) );
+        if( cacheable ) SceneCache( params.sceneCacheDir ).Write( sceneKey, *model );
+    }
+    if( sphereImpostors ) *sphereImpostors = moleculeReader.valid() && moleculeReader->NumLoaded() > 0;
+    return model.release();
+}
@@ -0,0 +1,63 @@
+#ifndef SCENE_LOADER_H_
+#define SCENE_LOADER_H_
+
+#include <string>
+
+#include <osg/Node>
+#include <osg/ArgumentParser>
+#include <osg/ApplicationUsage>
+
+//------------------------------------------------------------------------------
+/// Model loading and preprocessing options shared by the ssao and ssao_bake
+/// executables.
+struct SceneLoadParameters
+{
+    SceneLoadParameters() :
+        computeNormals( false ),
+        creaseAngle( 180.0 ),
+        chemPlugin( false ),
+        rebuildSceneCache( false ),
+        enableTextures( false ),
+        texUnit( 2 ),
+        reservedTexUnits( 3 )
+    {}
+    /// options passed to the readers
+    std::string options;
+    bool computeNormals;
+    /// degrees; default: all faces sharing a position are smoothed
+    double creaseAngle;
+    /// read molecules with the 'chem' plugin instead of the built-in reader
+    bool chemPlugin;
+    /// preprocessed scene cache directory, empty: no cache
+    std::string sceneCacheDir;
+    bool rebuildSceneCache;
+    /// textures are made accessible from shaders if enabled, removed otherwise
+    bool enableTextures;
+    /// texture units reserved by SSAO: textures of the scene and molecule
+    /// data are bound to the other units
+    int texUnit;
+    int reservedTexUnits;
+};
+
+/// Add usage of the options read by ParseSceneLoadParameters.
+void AddSceneLoadUsage( osg::ApplicationUsage& usage );
+
+/// Read loading and preprocessing options; texture settings are left to the
+/// caller.
+SceneLoadParameters ParseSceneLoadParameters( osg::ArgumentParser& arguments );
+
+//------------------------------------------------------------------------------
+/// Load the model files in 'arguments' or read the preprocessed scene from
+/// the scene cache, then preprocess: normals, textures and transforms above
+/// each child (see InsertTransform); all the options must have been read:
+/// std::runtime_error is thrown if an option other than the ones read by
+/// osgDB::readNodeFiles is left in 'arguments'.
+/// If no model is loaded 'defaultModel' is preprocessed and returned, or NULL
+/// if not given. 'sphereImpostors', if not NULL, is set to true if the scene
+/// was read by the built-in molecule reader.
+osg::Node* LoadScene( osg::ArgumentParser& arguments,
+                      const SceneLoadParameters& params,
+                      osg::Node* defaultModel = 0,
+                      bool* sphereImpostors = 0 );
+
+#endif // SCENE_LOADER_H_
@@ -34,16 +34,75 @@ varying vec3 worldPosition;
 #endif
 
 
+#ifdef DEFERRED
+// DEFERRED: full-screen pass, radii computed per pixel from the G-buffer
+// position as done per vertex by the vertex shader
+uniform float radius; // object or scene radius
+uniform float dhwidth; // percentage of radius used as width of convolution kernel
+float R;
+float pixelRadius;
+#else
 varying float R; // radius in world coordinates
 varying float pixelRadius; //radius in screen coordinates (=pixels)
+#endif
 
 uniform vec2 viewport;
 
 float width = viewport.x;
 float height = viewport.y;
 
+// AO_LOW_RES: occlusion only pass rendered at 1/AO_LOW_RES of the viewport
+// resolution; fragment coordinates are mapped to full resolution coordinates
+// in the depth/position/normal maps
+#ifdef AO_LOW_RES
+#define fragCoord vec3( gl_FragCoord.xy * AO_LOW_RES, gl_FragCoord.z )
+#else
+#define fragCoord gl_FragCoord.xyz
+#endif
+
 vec3 screenPosition;
 
+#ifdef SPHERE_IMPOSTORS
+//------------------------------------------------------------------------------
+// SPHERE_IMPOSTORS: drawables with 'sphereImpostors' set are quads in front of
+// spheres (see vertex shader): the view ray through the fragment is
+// intersected with the sphere, fragments missing it are discarded and depth is
+// replaced by the depth of the intersection; positions and normals are read
+// from the G-buffer written with the same intersection. Depth is written by
+// all the fragments, the others keep the rasterized depth.
+uniform bool sphereImpostors;
+varying vec4 impostorSphere; // eye space center and radius
+varying vec3 impostorPosition; // eye space position on the quad
+
+void ImpostorFragment()
+{
+  if( !sphereImpostors )
+  {
+    gl_FragDepth = gl_FragCoord.z;
+    return;
+  }
+  vec3 d = normalize( impostorPosition );
+  vec3 c = impostorSphere.xyz;
+  float b = dot( d, c );
+  float disc = b * b - dot( c, c ) + impostorSphere.w * impostorSphere.w;
+  if( disc < 0.0 ) discard;
+  vec4 p = gl_ProjectionMatrix * vec4( d * ( b - sqrt( disc ) ), 1.0 );
+  gl_FragDepth = 0.5 * ( gl_DepthRange.diff * p.z / p.w + gl_DepthRange.near + gl_DepthRange.far );
+}
+
+#endif
+
+#if defined( DEFERRED )
+// material color written into the G-buffer by the pre-render camera
+uniform sampler2DRect albedo;
+vec4 MaterialDiffuse() { return texture2DRect( albedo, gl_FragCoord.xy ); }
+#elif defined( SPHERE_IMPOSTORS )
+// per sphere color instead of material
+vec4 MaterialDiffuse() { return sphereImpostors ? color : gl_FrontMaterial.diffuse; }
+#else
+vec4 MaterialDiffuse() { return gl_FrontMaterial.diffuse; }
+#endif
+
 //-----------------------------------------------------------------------------
 #ifndef MRT_ENABLED
 vec3 ssUnproject( vec3 v )
@@ -59,6 +118,77 @@ vec3 ssUnproject( vec3 v )
 }
 #endif
 
+//------------------------------------------------------------------------------
+// G-buffer access. GBUFFER_COMPACT: 'positions' stores linear depth (-eye z)
+// in x and 'normals' the octahedral encoded normal in xy; eye space positions
+// are reconstructed by inverting the (perspective) projection of the pixel
+// coordinates, and depth values compared while tracing are linear depths.
+#ifdef MRT_ENABLED
+#ifdef GBUFFER_COMPACT
+float GBufferDepth( vec2 p )
+{
+  return texture2DRect( positions, p ).x;
+}
+
+vec3 GBufferPosition( vec2 p )
+{
+  float d = texture2DRect( positions, p ).x;
+  vec2 ndc = p / viewport * 2.0 - 1.0;
+  // clip.xy = P00 * x + P20 * z, P11 * y + P21 * z; clip.w = -z = d
+  return vec3( ( ndc + vec2( gl_ProjectionMatrix[ 2 ][ 0 ], gl_ProjectionMatrix[ 2 ][ 1 ] ) ) * d
+               / vec2( gl_ProjectionMatrix[ 0 ][ 0 ], gl_ProjectionMatrix[ 1 ][ 1 ] ), -d );
+}
+
+vec3 GBufferNormal( vec2 p )
+{
+  vec2 e = texture2DRect( normals, p ).xy * 2.0 - 1.0;
+  vec3 n = vec3( e, 1.0 - abs( e.x ) - abs( e.y ) );
+  if( n.z < 0.0 )
+  {
+    n.xy = ( 1.0 - abs( n.yx ) ) * vec2( n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0 );
+  }
+  return normalize( n );
+}
+#else
+float GBufferDepth( vec2 p )
+{
+  return texture2DRect( normals, p ).w;
+}
+
+vec3 GBufferPosition( vec2 p )
+{
+  return texture2DRect( positions, p ).xyz;
+}
+
+vec3 GBufferNormal( vec2 p )
+{
+  return texture2DRect( normals, p ).xyz;
+}
+#endif
+
+//------------------------------------------------------------------------------
+// pixels not covered by the model keep the clear value: far plane depth or,
+// with the compact layout, a linear depth of 1.0e30
+bool GBufferBackground( vec2 p )
+{
+#ifdef GBUFFER_COMPACT
+  return GBufferDepth( p ) > 1.0e29;
+#else
+  return GBufferDepth( p ) >= 1.0;
+#endif
+}
+
+#ifdef DEFERRED
+// screen space length of a segment of length r at eye space position pos
+float ProjectedRadius( vec3 pos, float r )
+{
+  vec4 a = gl_ProjectionMatrix * vec4( pos, 1.0 );
+  vec4 b = gl_ProjectionMatrix * vec4( pos + vec3( r, 0.0, 0.0 ), 1.0 );
+  return distance( 0.5 * viewport * a.xy / a.w, 0.5 * viewport * b.xy / b.w );
+}
+#endif
+#endif
+
 //------------------------------------------------------------------------------
 //cosine of mininum angle used for angle occlusion computation (~30 deg. best)
 uniform float minCosAngle; // = 0.2; // ~78 deg. from normal, ~22 deg from tangent plane
@@ -94,7 +224,7 @@ float hocclusion( float ds )
   // each point visible from current fragment (i.e. with z < current z)
   // will contribute to the occlusion factor
   int occSteps = 0;  // number of occlusion rays 
-  vec3 p = gl_FragCoord.xyz;
+  vec3 p = screenPosition;
   float occl = 0.0; // occlusion
   float z = 1.0; // z in depth map
   float dz = 0.; //
@@ -106,7 +236,7 @@ float hocclusion( float ds )
   {
       p.x += ds;
 #ifdef MRT_ENABLED
-    z = texture2DRect( normals, p.xy ).w;
+    z = GBufferDepth( p.xy );
 #else
     z = texture2DRect( depthMap, p.xy ).x;
 #endif   
@@ -124,7 +254,7 @@ float hocclusion( float ds )
       // occlusion is being computed
 #ifdef MRT_ENABLED // when Multiple Render Targets is enabled the world position
                    // of each pixel is available in 'positions' texture
-      I = texture2DRect( positions, p.xy ).xyz - worldPosition.xyz;
+      I = GBufferPosition( p.xy ) - worldPosition.xyz;
 #else
       I = ssUnproject( p ) - worldPosition.xyz;
 #endif
@@ -155,7 +285,7 @@ float vocclusion( float ds )
   // each point visible from current fragment (i.e. with z < current z)
   // will contribute to the occlusion factor
   int occSteps = 0;  // number of occlusion rays 
-  vec3 p = gl_FragCoord.xyz;
+  vec3 p = screenPosition;
   float occl = 0.0; // occlusion
   float z = 1.0; // z in depth map
   float dz = 0.; //
@@ -167,7 +297,7 @@ float vocclusion( float ds )
   {
     p.y += ds; 
 #ifdef MRT_ENABLED
-    z = texture2DRect( normals, p.xy ).w;
+    z = GBufferDepth( p.xy );
 #else
     z = texture2DRect( depthMap, p.xy ).x;
 #endif    
@@ -185,7 +315,7 @@ float vocclusion( float ds )
       // occlusion is being computed
 #ifdef MRT_ENABLED // when Multiple Render Targets is enabled the world position
                    // of each pixel is available in 'positions' texture
-      I = texture2DRect( positions, p.xy ).xyz - worldPosition.xyz;
+      I = GBufferPosition( p.xy ) - worldPosition.xyz;
 #else
       I = ssUnproject( p ) - worldPosition.xyz;
 #endif
@@ -205,37 +335,33 @@ float vocclusion( float ds )
 }
 
 //------------------------------------------------------------------------------
-// occlusion function for non degenerate (i.e. lines not paralles to x or y axis) lines
-float occlusion( vec2 dir )
+// occlusion function for lines stepped by u * dstep pixels: u = ( +-1, m ) for
+// lines y = m * ( x - x0 ) + y0, u = ( m, +-1 ) for lines x = m * ( y - y0 ) + x0
+float stepOcclusion( vec2 u )
 {
-  // compute angular coefficient and steps
-  float m = dir.y / dir.x;
-  
-  // follow line y = m * ( x - x0 ) + y0 in screen space
+  // follow line through ( x0, y0 ) in screen space
   // where:
-  //    m = dir.y / dir.x
   //    x0 = screenPosition.x
   //    y0 = screenPosition.y  
   // each point visible from current fragment (i.e. with z < current z)
   // will contribute to the occlusion factor
   int occSteps = 0;  // number of occlusion rays 
-  vec3 p = gl_FragCoord.xyz;
-  // compute number of i (x) steps
-  // size of radius = sqrt( (num x steps)^2 + (ang. coeff. * num x steps)^2 )
-  int upperI = int( PR * inversesqrt( 1.0 + m * m ) / abs( dstep ) );
+  vec3 p = screenPosition;
+  // compute number of i steps
+  // size of radius = num steps * |u| * dstep
+  int upperI = int( PR / ( length( u ) * abs( dstep ) ) );
   float occl = 0.0; // occlusion
   float z = 1.0; // z in depth map
   float dz = 0.; //
   float dist = 1.; // distance between current point and shaded point 
   float prev = 0.; // previous angular coefficient 
   vec3 I; // vector from point in depth map to shaded point
-  float ds = sign( dir.x ) * dstep;
+  vec2 ds = u * dstep;
   for( int i = 0; i != upperI; ++i )
   {
-    p.x += ds;
-    p.y += ds * m;
+    p.xy += ds;
 #ifdef MRT_ENABLED
-    z = texture2DRect( normals, p.xy ).w;
+    z = GBufferDepth( p.xy );
 #else
     z = texture2DRect( depthMap, p.xy ).x;
 #endif   
@@ -253,7 +379,7 @@ float occlusion( vec2 dir )
       // occlusion is being computed
 #ifdef MRT_ENABLED // when Multiple Render Targets is enabled the world position
                    // of each pixel is available in 'positions' texture
-      I = texture2DRect( positions, p.xy ).xyz - worldPosition.xyz;
+      I = GBufferPosition( p.xy ) - worldPosition.xyz;
 #else
       I = ssUnproject( p ) - worldPosition.xyz;
 #endif
@@ -273,6 +399,238 @@ float occlusion( vec2 dir )
   return occl / max( 1.0, float( occSteps ) );
 }
 
+//------------------------------------------------------------------------------
+// occlusion function for non degenerate (i.e. lines not paralles to x or y axis) lines:
+// stepped along x
+float occlusion( vec2 dir )
+{
+  return stepOcclusion( sign( dir.x ) * vec2( 1.0, dir.y / dir.x ) );
+}
+
+//------------------------------------------------------------------------------
+// HIZ_LEVELS: min/max depth pyramid; level k texture stores in (x, y) the
+// (min, max) depth of 2^k x 2^k pixel blocks. Rays are marched with a step
+// which doubles (up to 2^HIZ_LEVELS pixels) each time the distance from the
+// shaded point doubles beyond HIZ_NEAR pixels, and at each step the minimum
+// depth of the block is used: the number of fetches grows with the logarithm
+// of the pixel radius.
+#ifdef HIZ_LEVELS
+#ifndef HIZ_NEAR
+#define HIZ_NEAR 4.0
+#endif
+uniform sampler2DRect hiZ1;
+#if HIZ_LEVELS > 1
+uniform sampler2DRect hiZ2;
+#endif
+#if HIZ_LEVELS > 2
+uniform sampler2DRect hiZ3;
+#endif
+#if HIZ_LEVELS > 3
+uniform sampler2DRect hiZ4;
+#endif
+
+// minimum depth of 2^level x 2^level block containing p
+float hiZMin( vec2 p, int level )
+{
+  if( level == 0 )
+  {
+#ifdef MRT_ENABLED
+    return GBufferDepth( p );
+#else
+    return texture2DRect( depthMap, p ).x;
+#endif
+  }
+  vec2 q = p / exp2( float( level ) );
+  if( level == 1 ) return texture2DRect( hiZ1, q ).x;
+#if HIZ_LEVELS > 1
+  if( level == 2 ) return texture2DRect( hiZ2, q ).x;
+#endif
+#if HIZ_LEVELS > 2
+  if( level == 3 ) return texture2DRect( hiZ3, q ).x;
+#endif
+#if HIZ_LEVELS > 3
+  return texture2DRect( hiZ4, q ).x;
+#endif
+  return 1.0;
+}
+
+// occlusion along direction dir up to PR pixels
+float hizOcclusion( vec2 dir )
+{
+  vec2 u = normalize( dir );
+  int occSteps = 0;
+  vec3 p = screenPosition;
+  float occl = 0.0;
+  float prev = 0.;
+  vec3 I;
+  float t = 0.0; // distance from shaded point in pixels
+  for( int i = 0; i != 256; ++i )
+  {
+    int level = int( clamp( floor( log2( max( t, 1.0 ) / HIZ_NEAR ) ), 0.0, float( HIZ_LEVELS ) ) );
+    t += abs( dstep ) * exp2( float( level ) );
+    if( t > PR ) break;
+    p.xy = screenPosition.xy + u * t;
+    float z = hiZMin( p.xy, level );
+    float angCoeff = ( screenPosition.z - z ) / t;
+    if( angCoeff > prev )
+    {
+      p.z = z;
+      prev = angCoeff;
+#ifdef MRT_ENABLED
+      I = GBufferPosition( p.xy ) - worldPosition.xyz;
+#else
+      I = ssUnproject( p ) - worldPosition.xyz;
+#endif
+      float k = dot( normal, normalize( I ) );
+      if( k > minCosAngle )
+      {
+        occl += ( k / ( 1. + B * dot( I, I ) ) );
+        ++occSteps;
+      }
+    }
+  }
+  return occl / max( 1.0, float( occSteps ) );
+}
+
+// all the rays in ComputeOcclusion() are traced through the depth pyramid
+#define occlusion( dir ) hizOcclusion( dir )
+#define hocclusion( ds ) hizOcclusion( vec2( ds, 0.0 ) )
+#define vocclusion( ds ) hizOcclusion( vec2( 0.0, ds ) )
+#endif
+
+//------------------------------------------------------------------------------
+// INTERLEAVED: the direction set is rotated per pixel according to the
+// position of the pixel in a 4x4 block and each pixel of a 2x2 block traces a
+// different quarter of the directions; all the directions and rotations are
+// covered by every 4x4 block and merged by a 4x4 blur pass
+#ifdef INTERLEAVED
+mat2 interleaveRotation = mat2( 1.0 );
+float interleaveSubset = 0.0;
+
+// 2x2 Bayer matrix [ 0 2; 3 1 ]
+float Bayer2( vec2 c )
+{
+  return mod( 2.0 * c.x + 3.0 * c.y, 4.0 );
+}
+
+// hw: half width of the square of ray directions traced by the pixel, after
+// adaptive ray selection
+void SetupInterleave( int hw )
+{
+  vec2 c = mod( floor( gl_FragCoord.xy ), 4.0 );
+  vec2 lo = mod( c, 2.0 );
+  interleaveSubset = Bayer2( lo );
+  // rotation: fraction of the angle between two adjacent directions
+  float a = ( Bayer2( ( c - lo ) * 0.5 ) + 0.5 ) * 0.25 * 6.2831853 / ( 8.0 * float( hw ) - 2.0 );
+  interleaveRotation = mat2( cos( a ), sin( a ), -sin( a ), cos( a ) );
+}
+
+// rotated directions are never parallel to the axes: all the rays are traced
+// as generic lines, stepped along the dominant axis so that the rotated
+// horizontal and vertical rays are sampled as densely as the unrotated ones
+float InterleavedOcclusion( vec2 dir )
+{
+  vec2 d = interleaveRotation * dir;
+#ifdef HIZ_LEVELS
+  return occlusion( d );
+#else
+  return abs( d.x ) >= abs( d.y ) ? stepOcclusion( sign( d.x ) * vec2( 1.0, d.y / d.x ) )
+                                  : stepOcclusion( sign( d.y ) * vec2( d.x / d.y, 1.0 ) );
+#endif
+}
+#undef occlusion
+#undef hocclusion
+#undef vocclusion
+#define occlusion( dir ) InterleavedOcclusion( dir )
+#define hocclusion( ds ) InterleavedOcclusion( vec2( ds, 0.0 ) )
+#define vocclusion( ds ) InterleavedOcclusion( vec2( 0.0, ds ) )
+#endif
+
+//------------------------------------------------------------------------------
+// TEMPORAL_SUBSETS: rays are split into TEMPORAL_SUBSETS interleaved subsets
+// and only the subset selected by frameIndex is traced in the current frame;
+// results are accumulated over frames by TemporalAccumulate()
+#ifdef TEMPORAL_SUBSETS
+uniform float frameIndex; // in [0, TEMPORAL_SUBSETS)
+#endif
+#if defined( TEMPORAL_SUBSETS ) || defined( INTERLEAVED )
+float rayIndex = 0.0;
+float rayCount = 0.0;
+bool NextRay()
+{
+#if defined( TEMPORAL_SUBSETS ) && defined( INTERLEAVED )
+  bool trace = mod( rayIndex, 4.0 * TEMPORAL_SUBSETS ) == interleaveSubset * TEMPORAL_SUBSETS + frameIndex;
+#elif defined( TEMPORAL_SUBSETS )
+  bool trace = mod( rayIndex, TEMPORAL_SUBSETS ) == frameIndex;
+#else
+  bool trace = mod( rayIndex, 4.0 ) == interleaveSubset;
+#endif
+  rayIndex += 1.0;
+  if( trace ) rayCount += 1.0;
+  return trace;
+}
+#define TRACE( r ) ( NextRay() ? r : 0.0 )
+#else
+#define TRACE( r ) r
+#endif
+
+//------------------------------------------------------------------------------
+// ADAPTIVE_RAYS: the number of rays is selected per pixel from the elevation
+// above the tangent plane of a few neighbors at up to the kernel radius:
+// nothing can occlude a pixel whose neighbors are all close to or below its
+// tangent plane (flat or convex regions, background), creases need all the
+// rays. rayThresholds: largest elevation sine below which no rays, 1/4 and
+// 1/2 of the rays are traced
+#ifdef ADAPTIVE_RAYS
+uniform vec3 rayThresholds;
+
+bool TapBackground( vec2 p )
+{
+#ifdef MRT_ENABLED
+  return GBufferBackground( p );
+#else
+  return texture2DRect( depthMap, p ).x >= 1.0;
+#endif
+}
+
+vec3 TapPosition( vec2 p )
+{
+#ifdef MRT_ENABLED
+  return GBufferPosition( p );
+#else
+  return ssUnproject( vec3( p, texture2DRect( depthMap, p ).x ) );
+#endif
+}
+
+// sine of the elevation of the neighbor at 'offset' pixels, 0 if below the
+// tangent plane or not covered by the model
+float TapElevation( vec2 offset )
+{
+  vec2 p = fragCoord.xy + offset;
+  if( TapBackground( p ) ) return 0.0;
+  vec3 d = TapPosition( p ) - worldPosition;
+  float l = length( d );
+  return l > 0.0 ? max( 0.0, dot( d, normal ) ) / l : 0.0;
+}
+
+// half width of the square of ray directions: 0 = no rays
+int AdaptiveHalfWidth( int hw )
+{
+  if( TapBackground( fragCoord.xy ) ) return 0;
+  // axes at kernel radius, diagonals at half kernel radius
+  float r = PR;
+  float h = 0.35355 * PR;
+  float e = max( max( TapElevation( vec2( r, 0.0 ) ), TapElevation( vec2( -r, 0.0 ) ) ),
+                 max( TapElevation( vec2( 0.0, r ) ), TapElevation( vec2( 0.0, -r ) ) ) );
+  e = max( e, max( max( TapElevation( vec2( h, h ) ), TapElevation( vec2( -h, h ) ) ),
+                   max( TapElevation( vec2( h, -h ) ), TapElevation( vec2( -h, -h ) ) ) ) );
+  if( e < rayThresholds.x ) return 0;
+  if( e < rayThresholds.y ) return hw < 4 ? 1 : hw / 4;
+  if( e < rayThresholds.z ) return hw < 2 ? 1 : hw / 2;
+  return hw;
+}
+#endif
+
 //------------------------------------------------------------------------------
 float ComputeOcclusion()
 {
@@ -283,33 +641,161 @@ float ComputeOcclusion()
     // the i and j indices are assumed to be in the range:
     //  [-(numSamples / 4) / 2, +(numSamples / 4) / 2] == [ -numSamples/8,+numSamples/8 ]
     int hw = int( max( 1.0, numSamples / 8.0 ) ); 	
+#ifdef ADAPTIVE_RAYS
+    hw = AdaptiveHalfWidth( hw );
+    if( hw == 0 ) return 0.0;
+#endif
+#ifdef INTERLEAVED
+    SetupInterleave( hw );
+#endif
     // ppos is [x pixel, y pixel, depth (0..1) ]
     float occ = 0.0;
     int i = -hw;
     int j = -hw;
     // vertical edges, j = 0 excluded
-    for( ; j != 0; ++j ) occ += occlusion( vec2( float( i ), float( j ) ) );
-    for( j = 1; j != hw + 1; ++j ) occ += occlusion( vec2( float( i ), float( j ) ) );
+    for( ; j != 0; ++j ) occ += TRACE( occlusion( vec2( float( i ), float( j ) ) ) );
+    for( j = 1; j != hw + 1; ++j ) occ += TRACE( occlusion( vec2( float( i ), float( j ) ) ) );
     i = hw;
-    for( ; j != hw + 1; ++j ) occ += occlusion( vec2( float( i ), float( j ) ) );
-    for( j = 1; j != hw + 1; ++j ) occ += occlusion( vec2( float( i ), float( j ) ) );
+    for( ; j != hw + 1; ++j ) occ += TRACE( occlusion( vec2( float( i ), float( j ) ) ) );
+    for( j = 1; j != hw + 1; ++j ) occ += TRACE( occlusion( vec2( float( i ), float( j ) ) ) );
     // horizontal edges, i = 0 excluded
     j = -hw;
-    for( i = -hw + 1; i != 0; ++i ) occ += occlusion( vec2( float( i ), float( j ) ) );
-    for( i = 1; i != hw; ++i ) occ += occlusion( vec2( float( i ), float( j ) ) );
+    for( i = -hw + 1; i != 0; ++i ) occ += TRACE( occlusion( vec2( float( i ), float( j ) ) ) );
+    for( i = 1; i != hw; ++i ) occ += TRACE( occlusion( vec2( float( i ), float( j ) ) ) );
     j = hw;
-    for( i = -hw + 1; i != 0; ++i ) occ += occlusion( vec2( float( i ), float( j ) ) );
-    for( i = 1; i != hw; ++i ) occ += occlusion( vec2( float( i ), float( j ) ) ); 
+    for( i = -hw + 1; i != 0; ++i ) occ += TRACE( occlusion( vec2( float( i ), float( j ) ) ) );
+    for( i = 1; i != hw; ++i ) occ += TRACE( occlusion( vec2( float( i ), float( j ) ) ) ); 
     // i = 0 and j = 0
-    occ += hocclusion( -dstep );
-    occ += hocclusion( dstep );
-    occ += vocclusion( -dstep );
-    occ += vocclusion( dstep );
+    occ += TRACE( hocclusion( -dstep ) );
+    occ += TRACE( hocclusion( dstep ) );
+    occ += TRACE( vocclusion( -dstep ) );
+    occ += TRACE( vocclusion( dstep ) );
     // divide occlusion by the number of shot rays
+#if defined( TEMPORAL_SUBSETS ) || defined( INTERLEAVED )
+    occ /= max( 1.0, rayCount );
+#else
     occ /= max( 1.0, float( 8 * hw - 2 ) );
+#endif
     return occ;
 }
 
+//------------------------------------------------------------------------------
+// AO_UPSAMPLE: visibility computed at 1/AO_UPSAMPLE resolution and stored in
+// 'aoMap'; the four nearest low resolution samples are combined with bilinear
+// weights scaled by depth (and normal with MRT) similarity with the full
+// resolution fragment (joint bilateral upsampling)
+#if defined( AO_UPSAMPLE ) || defined( AO_MAP )
+uniform sampler2DRect aoMap;
+#endif
+// AO_BAKED: per vertex visibility baked by ssao_bake, no tracing
+#ifdef AO_BAKED
+varying float bakedAO;
+#endif
+#ifdef AO_UPSAMPLE
+
+// eye space z of full resolution pixel
+float EyeZ( vec2 fc )
+{
+#ifdef MRT_ENABLED
+  return GBufferPosition( fc ).z;
+#else
+  return ssUnproject( vec3( fc, texture2DRect( depthMap, fc ).x ) ).z;
+#endif
+}
+
+float UpsampleVisibility()
+{
+  // position of fragment relative to low resolution texel centers
+  vec2 lc = gl_FragCoord.xy / AO_UPSAMPLE - 0.5;
+  vec2 l0 = floor( lc );
+  vec2 f = lc - l0;
+  float z = EyeZ( gl_FragCoord.xy );
+  float v = 0.0;
+  float wsum = 0.0;
+  for( int j = 0; j != 2; ++j )
+  {
+    for( int i = 0; i != 2; ++i )
+    {
+      // low resolution texel center and matching full resolution pixel
+      // used as the starting point of the low resolution rays
+      vec2 l = l0 + vec2( float( i ), float( j ) ) + 0.5;
+      vec2 g = l * AO_UPSAMPLE;
+      float w = ( i == 0 ? 1.0 - f.x : f.x ) * ( j == 0 ? 1.0 - f.y : f.y );
+      float dz = abs( EyeZ( g ) - z ) / max( abs( z ), 1.0e-6 );
+      w /= 1.0e-3 + dz;
+#ifdef MRT_ENABLED
+      w *= pow( max( 0.0, dot( normal, GBufferNormal( g ) ) ), 8.0 );
+#endif
+      v += w * texture2DRect( aoMap, l ).x;
+      wsum += w;
+    }
+  }
+  // no similar sample: nearest one
+  return wsum > 1.0e-6 ? v / wsum : texture2DRect( aoMap, gl_FragCoord.xy / AO_UPSAMPLE ).x;
+}
+#endif
+
+//------------------------------------------------------------------------------
+// Temporal accumulation pass output:
+//   x: visibility, y: accumulated occlusion, z: eye space z,
+//   w: number of accumulated frames and quantized normal x, y packed as
+//      ( count * 1024 + nx ) * 1024 + ny, exactly representable in a float
+//      (24 bit mantissa) only while count < 16.
+// The history buffer is read at the position of the shaded point reprojected
+// in the previous frame and discarded if depth or normal do not match.
+#ifdef TEMPORAL_SUBSETS
+uniform sampler2DRect aoHistory;
+uniform mat4 reprojection;    // current eye space -> previous clip space
+uniform mat4 reprojectionEye; // current eye space -> previous eye space
+uniform int historyValid;
+
+// integer: checked by the preprocessor
+#ifndef TEMPORAL_MAX_FRAMES
+#define TEMPORAL_MAX_FRAMES 15
+#endif
+#if TEMPORAL_MAX_FRAMES > 15
+#error TEMPORAL_MAX_FRAMES > 15: frame count does not fit the packed history
+#endif
+
+vec2 QuantizeNormal( vec3 n )
+{
+  return floor( clamp( n.xy * 0.5 + 0.5, 0.0, 1.0 ) * 1023.0 + 0.5 );
+}
+
+vec4 TemporalAccumulate( float occ )
+{
+  vec2 qn = QuantizeNormal( normal );
+  float count = 1.0;
+  if( historyValid > 0 )
+  {
+    vec4 pc = reprojection * vec4( worldPosition, 1.0 );
+    vec2 hp = ( pc.xy / pc.w * 0.5 + 0.5 ) * viewport;
+#ifdef AO_LOW_RES
+    hp /= AO_LOW_RES;
+    vec2 hsize = floor( viewport / AO_LOW_RES );
+#else
+    vec2 hsize = viewport;
+#endif
+    if( all( greaterThanEqual( hp, vec2( 0.0 ) ) ) && all( lessThan( hp, hsize ) ) )
+    {
+      vec4 h = texture2DRect( aoHistory, hp );
+      float z = ( reprojectionEye * vec4( worldPosition, 1.0 ) ).z;
+      float t = floor( h.w / 1024.0 );
+      vec2 hn = vec2( mod( t, 1024.0 ), mod( h.w, 1024.0 ) );
+      bool depthOk = abs( h.z - z ) < 0.02 * abs( z );
+      bool normalOk = all( lessThan( abs( hn - qn ), vec2( 64.0 ) ) );
+      if( depthOk && normalOk )
+      {
+        count = min( floor( t / 1024.0 ) + 1.0, float( TEMPORAL_MAX_FRAMES ) );
+        occ = h.y + ( occ - h.y ) / count;
+      }
+    }
+  }
+  return vec4( 1.0 - smoothstep( 0.0, 1.0, occ * occlusionFactor ), occ, worldPosition.z,
+               ( count * 1024.0 + qn.x ) * 1024.0 + qn.y );
+}
+#endif
+
 //------------------------------------------------------------------------------
 // Shade with spherical harmonics
 #define VINE_STREET_KITCHEN
@@ -396,19 +882,60 @@ vec3 SphHarmShade()
                       2.0 * C2 * L1m1 * tnorm.y +
                       2.0 * C2 * L10  * tnorm.z;
 
-  DiffuseColor *= scaling * vec3( gl_FrontMaterial.diffuse );
+  DiffuseColor *= scaling * vec3( MaterialDiffuse() );
 
   return /*clamp( vec3( 0., 0., 0. ), vec3( 1., 1., 1. ),*/ DiffuseColor;
 }
 
+//------------------------------------------------------------------------------
+// fragment position: pixel coordinates and depth in the same units as the
+// depth values stored in the G-buffer
+vec3 ScreenPosition()
+{
+#if defined( GBUFFER_COMPACT )
+  return vec3( fragCoord.xy, -worldPosition.z );
+#elif defined( DEFERRED )
+  // the full-screen quad has no depth
+  return vec3( fragCoord.xy, GBufferDepth( fragCoord.xy ) );
+#else
+  return fragCoord;
+#endif
+}
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 void main()
 {
-    ComputeRadiusAndOcclusionAttenuationCoeff();
+#if defined( SPHERE_IMPOSTORS ) && !defined( DEFERRED )
+    ImpostorFragment();
+#endif
+#ifdef DEFERRED
+    if( GBufferBackground( fragCoord.xy ) ) discard;
+#endif
 #ifdef MRT_ENABLED
-    normal = texture2DRect( normals, gl_FragCoord.xy ).xyz;
-    worldPosition = texture2DRect( positions, gl_FragCoord.xy ).xyz;
+    normal = GBufferNormal( fragCoord.xy );
+    worldPosition = GBufferPosition( fragCoord.xy );
+#endif
+#ifdef DEFERRED
+    R = dhwidth * radius;
+    pixelRadius = max( 0.0, ProjectedRadius( worldPosition, R ) );
+#endif
+    ComputeRadiusAndOcclusionAttenuationCoeff();
+#ifdef RAY_STATS
+  // ray count histogram pass: number of rays that would be traced, encoded
+  // as a normalized byte; nothing is traced
+  int hw = int( max( 1.0, numSamples / 8.0 ) );
+#ifdef ADAPTIVE_RAYS
+  hw = AdaptiveHalfWidth( hw );
+#endif
+  gl_FragColor = vec4( hw > 0 ? min( float( 8 * hw - 2 ), 254.0 ) / 255.0 : 0.0 );
+  return;
+#endif
+#ifdef TEMPORAL_SUBSETS
+  // occlusion only pass with temporal accumulation
+  screenPosition = ScreenPosition();
+  gl_FragColor = TemporalAccumulate( ssao > 0 ? ComputeOcclusion() : 0.0 );
+  return;
 #endif
 // screen space occlusion is computed by accumulating the occlusion obtained
 // by intersecting a number of rays with the surrounding geometry;
@@ -424,23 +951,36 @@ void main()
 
     // (i,j) indices are then transformed into angular coefficients assigned to rays 
 #if defined( AO_LAMBERT )  // lambert shading
-  gl_FragColor.rgb = gl_FrontMaterial.diffuse.rgb * dot( normal, -normalize( worldPosition ) );
-  gl_FragColor.a = gl_FrontMaterial.diffuse.a;
+  gl_FragColor.rgb = MaterialDiffuse().rgb * dot( normal, -normalize( worldPosition ) );
+  gl_FragColor.a = MaterialDiffuse().a;
 #elif defined( AO_FLAT ) // color only
-  gl_FragColor = gl_FrontMaterial.diffuse;
+  gl_FragColor = MaterialDiffuse();
 #elif defined( AO_SPHERICAL_HARMONICS )
   gl_FragColor.rgb = SphHarmShade();
-  gl_FragColor.a =  gl_FrontMaterial.diffuse.a;
+  gl_FragColor.a =  MaterialDiffuse().a;
 #else // ambient occlusion only
   gl_FragColor = vec4(1.0);
 #endif
   if( ssao > 0 )
   {
+#if defined( AO_BAKED )
+    gl_FragColor.rgb *= bakedAO;
+#elif defined( AO_UPSAMPLE )
+    gl_FragColor.rgb *= UpsampleVisibility();
+#elif defined( AO_MAP )
+    // visibility computed in a separate full resolution pass
+    gl_FragColor.rgb *= texture2DRect( aoMap, gl_FragCoord.xy ).x;
+#else
     // set screen position for further usage in ambient occlusion computation
-    screenPosition = gl_FragCoord.xyz;
+    screenPosition = ScreenPosition();
     // multiply the color intensity by 1 - occlusion
     gl_FragColor.rgb *= 1.0 - smoothstep( 0.0, 1.0, ComputeOcclusion() * occlusionFactor );   
+#endif
   }
+#ifdef AO_LOW_RES
+  // occlusion pass: eye space z used by depth aware filters
+  gl_FragColor.z = worldPosition.z;
+#endif
 
 #ifdef TEXTURE_ENABLED
   if( textureUnit >= 0 && bool( textureEnabled ) ) gl_FragColor *= texture2D( tex, gl_TexCoord[ textureUnit ].st );
@@ -1,3 +1,4 @@
+#version 120
 // computes average kernel width and step multiplier from passed radius
 
 //#define TEXTURE_ENABLED
@@ -7,6 +8,11 @@
 // IN: numSamples, radius, dhwidth (%radius), maxSteps, ssao, depthMap
 // OUT: occlusion modified gl_Color, normal, position
 #extension GL_ARB_texture_rectangle : enable
+#ifdef SPHERE_IMPOSTORS
+#extension GL_ARB_draw_instanced : enable
+#endif
+// same result as the pre-render programs: depth can be reused with GL_EQUAL
+invariant gl_Position;
 #ifdef MRT_ENABLED
 uniform sampler2DRect positions;
 #endif
@@ -32,10 +38,50 @@ vec3 worldPosition;
 varying float pixelRadius;
 varying float R;
 
+#ifdef AO_BAKED
+// per vertex visibility baked by ssao_bake
+attribute float bakedVisibility;
+varying float bakedAO;
+#endif
+
 uniform vec2 viewport;
 
-float width = viewport.x; 
-float height = viewport.y;
+#ifdef SPHERE_IMPOSTORS
+//------------------------------------------------------------------------------
+// SPHERE_IMPOSTORS: drawables with 'sphereImpostors' set draw one instance of
+// a unit quad per sphere; sphere i has object space center and radius stored
+// in texel ( i % ATOM_TEXTURE_WIDTH, i / ATOM_TEXTURE_WIDTH ) of 'atoms' and
+// color in the same texel of 'atomColors'. The quad is placed through the
+// center perpendicularly to the view direction and covers the cone tangent to
+// the sphere; fragments are ray cast against the sphere.
+uniform bool sphereImpostors;
+uniform sampler2DRect atoms;
+uniform sampler2DRect atomColors;
+varying vec4 impostorSphere; // eye space center and radius
+varying vec3 impostorPosition; // eye space position on the quad
+
+vec2 AtomCoord()
+{
+  float i = float( gl_InstanceIDARB );
+  return vec2( mod( i, ATOM_TEXTURE_WIDTH ), floor( i / ATOM_TEXTURE_WIDTH ) ) + 0.5;
+}
+
+vec4 ImpostorVertex()
+{
+  vec4 a = texture2DRect( atoms, AtomCoord() );
+  vec3 c = ( gl_ModelViewMatrix * vec4( a.xyz, 1.0 ) ).xyz;
+  float r = a.w * length( gl_ModelViewMatrix[ 0 ].xyz );
+  impostorSphere = vec4( c, r );
+  float d = length( c );
+  vec3 z = -c / d;
+  vec3 x = normalize( cross( abs( z.y ) < 0.99 ? vec3( 0.0, 1.0, 0.0 ) : vec3( 1.0, 0.0, 0.0 ), z ) );
+  vec3 y = cross( z, x );
+  // half size of the cross section of the tangent cone
+  float h = r * d / sqrt( max( d * d - r * r, 1.0e-4 * d * d ) );
+  impostorPosition = c + h * ( gl_Vertex.x * x + gl_Vertex.y * y );
+  return vec4( impostorPosition, 1.0 );
+}
+#endif
 
 //------------------------------------------------------------------------------
 vec3 screenSpace( vec3 v )
@@ -46,8 +92,7 @@ vec3 screenSpace( vec3 v )
    //clamp( p.xy, -1.0, 1.0 );
    p.xyz *= 0.5;
    p.xyz += 0.5;
-   p.x *= width;
-   p.y *= height;
+   p.xy *= viewport;
    return p.xyz;   
 }
 
@@ -58,8 +103,7 @@ vec3 ssUnproject( vec3 v )
   return texture2DRect( positions, v.xy ).xyz;
 #else
   vec4 p = vec4( v, 1.0 );
-  p.x /= width;
-  p.y /= height;
+  p.xy /= viewport;
   p.xyz -= 0.5;
   p.xyz *= 2.0;
   p = gl_ProjectionMatrixInverse * p;
@@ -81,7 +125,17 @@ float projectAtPos( vec3 pos, float r )
 //------------------------------------------------------------------------------
 void main()
 {
+#ifdef DEFERRED
+  // full-screen quad: vertices are already in normalized device coordinates,
+  // everything else is read from the G-buffer by the fragment shader
+  gl_Position = vec4( gl_Vertex.xy, 0.0, 1.0 );
+  return;
+#endif
+#ifdef SPHERE_IMPOSTORS
+  vec4 v = sphereImpostors ? ImpostorVertex() : gl_ModelViewMatrix * gl_Vertex;
+#else
   vec4 v = gl_ModelViewMatrix * gl_Vertex;
+#endif
   worldPosition = v.xyz;
   worldPosition /= v.w;
   if( bool( ssao ) )
@@ -90,7 +144,7 @@ void main()
 #ifdef USE_OBJECT_RADIUS    
     pixelRadius = max( 0.0, projectAtPos( worldPosition, R ) );
 #else // USE_VIEW_SIZE
-    pixelRadius = dhwidth * length( vec2( width, height ) );
+    pixelRadius = dhwidth * length( viewport );
     R = length( ssUnproject( vec3( .5 * viewport.x + pixelRadius, .5 * viewport.y, 0. ) ) -
                 ssUnproject( vec3( .5 * viewport.x, .5 * viewport.y, 0. ) ) );     
 #endif
@@ -100,6 +154,12 @@ void main()
   normal = normalize( faceforward( -normal, normal, vec3( 0., 0., 1. ) ) );
 #endif
   color = gl_Color;	
+#ifdef AO_BAKED
+  bakedAO = bakedVisibility;
+#endif
+#ifdef SPHERE_IMPOSTORS
+  if( sphereImpostors ) color = texture2DRect( atomColors, AtomCoord() );
+#endif
   gl_Position = gl_ProjectionMatrix * v;
 #ifdef TEXTURE_ENABLED
   if( textureUnit >= 0 )
@@ -19,6 +19,10 @@ varying vec4 color;
 varying float visibility;
 void main(void)
 {  
+#ifdef AO_CACHE_WRITE
+  gl_FragColor = vec4( visibility, visibility, visibility, 1.0 );
+  return;
+#endif
 #ifdef MRT_ENABLED
  #if defined( AO_FLAT )
    gl_FragColor = color * visibility;
@@ -4,6 +4,19 @@
 //#define TEXTURE_ENABLED
 
 #extension GL_ARB_texture_rectangle : enable
+#if defined( AO_CACHE ) || defined( AO_CACHE_WRITE )
+#extension GL_EXT_gpu_shader4 : enable
+// per vertex occlusion cache: texel of vertex gl_VertexID + aoCacheOffset
+uniform int aoCacheOffset; // aoCacheOffset < 0 => geometry not cached
+uniform vec2 aoCacheSize;
+#endif
+#ifdef AO_CACHE
+uniform sampler2DRect aoCache;
+#endif
+#ifdef AO_BAKED
+// per vertex visibility baked by ssao_bake
+attribute float bakedVisibility;
+#endif
 #ifdef MRT_ENABLED
 uniform sampler2DRect positions;
 uniform sampler2DRect normals; // note that in this case it is better to store the
@@ -338,6 +351,16 @@ float ComputeOcclusion()
     return occ;
 }
 
+#if defined( AO_CACHE ) || defined( AO_CACHE_WRITE )
+//------------------------------------------------------------------------------
+vec2 aoCacheTexel()
+{
+  int i = gl_VertexID + aoCacheOffset;
+  int w = int( aoCacheSize.x );
+  return vec2( float( i % w ), float( i / w ) ) + 0.5;
+}
+#endif
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 void main()
@@ -346,6 +369,12 @@ void main()
   color = gl_Color;
   normal = normalize( gl_NormalMatrix * gl_Normal );
   visibility = 1.0;
+#if defined( AO_BAKED )
+  if( bool( ssao ) ) visibility = bakedVisibility;
+#elif defined( AO_CACHE )
+  // occlusion traced by the cache pass
+  if( bool( ssao ) && aoCacheOffset >= 0 ) visibility = texture2DRect( aoCache, aoCacheTexel() ).x;
+#else
   if( bool( ssao ) )
   {	   
     R = dhwidth * radius;
@@ -356,7 +385,14 @@ void main()
 	
 	visibility = 1.0 - smoothstep( 0.0, 1.0, ComputeOcclusion() * occlusionFactor );	
   }
+#endif
+#ifdef AO_CACHE_WRITE
+  // one point per vertex at its texel of the cache; not cached: clipped
+  if( aoCacheOffset >= 0 ) gl_Position = vec4( 2.0 * aoCacheTexel() / aoCacheSize - 1.0, 0.0, 1.0 );
+  else gl_Position = vec4( 2.0, 2.0, 2.0, 1.0 );
+#else
   gl_Position = gl_ProjectionMatrix * worldPosition;
+#endif
 #ifdef TEXTURE_ENABLED
   if( textureUnit >= 0 )
   {
@@ -3,6 +3,8 @@
 #include <string>
 #include <fstream>
 #include <stdexcept>
+#include <map>
+#include <sstream>
 
 #include <osg/Node>
 #include <osg/StateSet>
@@ -14,6 +16,10 @@
 #include <osgGA/GUIEventAdapter>
 #include <osgGA/GUIActionAdapter>
 
+#include "program_cache.h"
+#include "molecule.h"
+#include "baked_ao.h"
+
 //------------------------------------------------------------------------------
 /// Keyboard event handler for simple SSAO technique parameters.
 class SSAOSimpleKbEventHandler : public osgGA::GUIEventHandler
@@ -347,7 +353,8 @@ osgGA::GUIEventHandler* CreateSSAOUniformsAndHandler( const osg::Node& model,
                                                       const SSAOParameters& ssaoParams,
                                                       osg::TextureRectangle* depth,
                                                       osg::TextureRectangle* positions,
-                                                      osg::TextureRectangle* normals )
+                                                      osg::TextureRectangle* normals,
+                                                      osg::TextureRectangle* aoMap )
 {
     // MRT requested: setup positions and normals/depth
     if( ssaoParams.mrt )
@@ -368,6 +375,12 @@ osgGA::GUIEventHandler* CreateSSAOUniformsAndHandler( const osg::Node& model,
         sset.setTextureAttributeAndModes( ssaoParams.texUnit, depth );
         sset.addUniform( new osg::Uniform( "depthMap", ssaoParams.texUnit ) );
     }
+    // reduced resolution occlusion: third reserved texture unit
+    if( aoMap )
+    {
+        sset.setTextureAttributeAndModes( ssaoParams.texUnit + 2, aoMap );
+        sset.addUniform( new osg::Uniform( "aoMap", ssaoParams.texUnit + 2 ) );
+    }
     osg::ref_ptr< osg::Uniform > ssaoUniform  = new osg::Uniform( "ssao", 1 );
     sset.addUniform( osg::get_pointer( ssaoUniform ) );
     sset.addUniform( new osg::Uniform( "shade", 1 ) );
@@ -405,6 +418,9 @@ osgGA::GUIEventHandler* CreateSSAOUniformsAndHandler( const osg::Node& model,
         sset.addUniform( osg::get_pointer( maxRadiusPixelsUniform ) );
         sset.addUniform( osg::get_pointer( numSamplesUniform ) );
         sset.addUniform( osg::get_pointer( minCosAngleUniform ) );  
+        sset.addUniform( new osg::Uniform( "rayThresholds", osg::Vec3( ssaoParams.rayThresholds[ 0 ],
+                                                                       ssaoParams.rayThresholds[ 1 ],
+                                                                       ssaoParams.rayThresholds[ 2 ] ) ) );
 
         return new SSAOTraceKbEventHandler( 
                     osg::get_pointer( ssaoUniform ),
@@ -441,14 +457,13 @@ std::string ReadTextFile( const std::string& fname )
 }
 
 //------------------------------------------------------------------------------
-/// Return shader source with code prefixed.
-osg::Shader* LoadShaderSource( const std::string& fname,
-                               osg::Shader::Type type,
-                               const std::string& prefix = "" )
+/// Return content of shader file; files are read only once.
+const std::string& ReadShaderFile( const std::string& fname )
 {
-    const std::string shaderSource = ReadTextFile( fname );
-    if( shaderSource.empty() ) return 0;
-    return new osg::Shader( type, prefix + shaderSource );    
+    static std::map< std::string, std::string > sources;
+    std::map< std::string, std::string >::iterator i = sources.find( fname );
+    if( i == sources.end() ) i = sources.insert( std::make_pair( fname, ReadTextFile( fname ) ) ).first;
+    return i->second;
 }
 
 //------------------------------------------------------------------------------
@@ -480,27 +495,202 @@ std::string BuildShaderSourcePrefix( bool mrt,
 
 
 //------------------------------------------------------------------------------
-/// Create shader program.
-osg::Program* CreateSSAOProgram( const SSAOParameters& ssaoParams, const std::string& path )
+/// Enable tracing through the min/max depth pyramid.
+std::string BuildHiZShaderSourcePrefix( int levels )
+{
+    if( levels <= 0 ) return "";
+    std::ostringstream os;
+    os << "#define HIZ_LEVELS " << levels << '\n';
+    return os.str();
+}
+
+//------------------------------------------------------------------------------
+/// Select G-buffer access functions matching the pre-render camera output.
+std::string BuildGBufferShaderSourcePrefix( const SSAOParameters& ssaoParams )
+{
+    if( !ssaoParams.mrt || ssaoParams.gbufferLayout != SSAOParameters::GBUFFER_COMPACT ) return "";
+    return "#define GBUFFER_COMPACT\n";
+}
+
+//------------------------------------------------------------------------------
+/// Select the number of rays per pixel.
+std::string BuildAdaptiveRaysShaderSourcePrefix( const SSAOParameters& ssaoParams )
+{
+    return ssaoParams.adaptiveRays ? "#define ADAPTIVE_RAYS\n" : "";
+}
+
+//------------------------------------------------------------------------------
+/// Enable ray casting of sphere impostors.
+std::string BuildImpostorShaderSourcePrefix( const SSAOParameters& ssaoParams )
+{
+    if( !ssaoParams.sphereImpostors ) return "";
+    std::ostringstream os;
+    os << "#define SPHERE_IMPOSTORS\n#define ATOM_TEXTURE_WIDTH " << ATOM_TEXTURE_WIDTH << ".0\n";
+    return os.str();
+}
+
+//------------------------------------------------------------------------------
+/// Create shader program or return the cached one built from the same sources
+/// and prefix.
+osg::Program* CreateSSAOProgram( const SSAOParameters& ssaoParams, const std::string& /*path*/ )
 {
     if( ssaoParams.vertShader.empty() && ssaoParams.fragShader.empty() ) {
         return 0;
     }
-    const std::string SHADER_SOURCE_PREFIX( 
-        BuildShaderSourcePrefix( ssaoParams.mrt, ssaoParams.shadeStyle, ssaoParams.enableTextures ) );
-    osg::ref_ptr< osg::Shader > vertexShader = 
-        LoadShaderSource( ssaoParams.vertShader, osg::Shader::VERTEX, SHADER_SOURCE_PREFIX  );
-    osg::ref_ptr< osg::Shader > fragmentShader =
-        LoadShaderSource( ssaoParams.fragShader, osg::Shader::FRAGMENT, SHADER_SOURCE_PREFIX );
+    std::string SHADER_SOURCE_PREFIX( 
+        BuildShaderSourcePrefix( ssaoParams.mrt, ssaoParams.shadeStyle, ssaoParams.enableTextures ) +
+        BuildGBufferShaderSourcePrefix( ssaoParams ) +
+        BuildImpostorShaderSourcePrefix( ssaoParams ) +
+        BuildAdaptiveRaysShaderSourcePrefix( ssaoParams ) );
+    // full-screen resolve of the G-buffer
+    if( ssaoParams.deferred ) SHADER_SOURCE_PREFIX += "#define DEFERRED\n";
+    // per vertex occlusion baked offline or read from cache
+    if( ssaoParams.bakedAO ) SHADER_SOURCE_PREFIX += "#define AO_BAKED\n";
+    else if( ssaoParams.aoCache ) SHADER_SOURCE_PREFIX += "#define AO_CACHE\n";
+    else if( ssaoParams.aoResolution != SSAOParameters::AO_FULL_RESOLUTION )
+    {
+        std::ostringstream os;
+        os << "#define AO_UPSAMPLE " << int( ssaoParams.aoResolution ) << ".0\n";
+        SHADER_SOURCE_PREFIX += os.str();
+    }
+    // temporal accumulation or interleaved directions: full resolution
+    // occlusion read from separate pass
+    else if( ssaoParams.temporalSubsets > 1 || ssaoParams.interleaved ) SHADER_SOURCE_PREFIX += "#define AO_MAP\n";
+    else SHADER_SOURCE_PREFIX += BuildHiZShaderSourcePrefix( ssaoParams.hizLevels );
+    const std::string noSource;
+    osg::Program* program = GetDefaultProgramCache().GetProgram( "SSAO",
+        ssaoParams.vertShader.empty() ? noSource : ReadShaderFile( ssaoParams.vertShader ),
+        ssaoParams.fragShader.empty() ? noSource : ReadShaderFile( ssaoParams.fragShader ),
+        SHADER_SOURCE_PREFIX );
+    // binding changes relink the program: set once
+    if( program && ssaoParams.bakedAO &&
+        program->getAttribBindingList().find( "bakedVisibility" ) == program->getAttribBindingList().end() )
+    {
+        program->addBindAttribLocation( "bakedVisibility", BAKED_AO_ATTRIBUTE );
+    }
+    return program;
+}
+
+//------------------------------------------------------------------------------
+/// Create occlusion only program used to render reduced resolution,
+/// temporally accumulated or interleaved occlusion into a texture; textures
+/// and shading are disabled.
+osg::Program* CreateSSAOLowResProgram( const SSAOParameters& ssaoParams, const std::string& /*path*/ )
+{
+    if( ssaoParams.vertShader.empty() && ssaoParams.fragShader.empty() ) {
+        return 0;
+    }
+    std::ostringstream os;
+    os << BuildShaderSourcePrefix( ssaoParams.mrt, SSAOParameters::AMBIENT_OCCLUSION_SHADING )
+       << BuildGBufferShaderSourcePrefix( ssaoParams )
+       << BuildImpostorShaderSourcePrefix( ssaoParams )
+       << BuildAdaptiveRaysShaderSourcePrefix( ssaoParams )
+       << "#define AO_LOW_RES " << int( ssaoParams.aoResolution ) << ".0\n"
+       << BuildHiZShaderSourcePrefix( ssaoParams.hizLevels );
+    if( ssaoParams.temporalSubsets > 1 ) os << "#define TEMPORAL_SUBSETS " << ssaoParams.temporalSubsets << ".0\n";
+    if( ssaoParams.interleaved ) os << "#define INTERLEAVED\n";
+    const std::string noSource;
+    return GetDefaultProgramCache().GetProgram( "SSAO low resolution",
+        ssaoParams.vertShader.empty() ? noSource : ReadShaderFile( ssaoParams.vertShader ),
+        ssaoParams.fragShader.empty() ? noSource : ReadShaderFile( ssaoParams.fragShader ),
+        os.str() );
+}
 
-    osg::ref_ptr< osg::Program > aprogram;
-    if( vertexShader != 0 || fragmentShader != 0 )    
+//------------------------------------------------------------------------------
+/// Create program tracing per vertex occlusion into the cache: one point per
+/// vertex, written to the vertex texel; textures and shading are disabled.
+osg::Program* CreateSSAOCacheProgram( const SSAOParameters& ssaoParams, const std::string& /*path*/ )
+{
+    if( ssaoParams.vertShader.empty() && ssaoParams.fragShader.empty() ) {
+        return 0;
+    }
+    const std::string prefix = BuildShaderSourcePrefix( ssaoParams.mrt, SSAOParameters::AMBIENT_OCCLUSION_SHADING )
+                               + "#define AO_CACHE_WRITE\n";
+    const std::string noSource;
+    return GetDefaultProgramCache().GetProgram( "SSAO cache",
+        ssaoParams.vertShader.empty() ? noSource : ReadShaderFile( ssaoParams.vertShader ),
+        ssaoParams.fragShader.empty() ? noSource : ReadShaderFile( ssaoParams.fragShader ),
+        prefix );
+}
+
+//------------------------------------------------------------------------------
+/// Create program writing the number of rays selected per pixel, at quarter
+/// resolution, instead of tracing them.
+osg::Program* CreateSSAORayStatsProgram( const SSAOParameters& ssaoParams, const std::string& /*path*/ )
+{
+    if( ssaoParams.vertShader.empty() && ssaoParams.fragShader.empty() ) {
+        return 0;
+    }
+    std::ostringstream os;
+    os << BuildShaderSourcePrefix( ssaoParams.mrt, SSAOParameters::AMBIENT_OCCLUSION_SHADING )
+       << BuildGBufferShaderSourcePrefix( ssaoParams )
+       << BuildImpostorShaderSourcePrefix( ssaoParams )
+       << BuildAdaptiveRaysShaderSourcePrefix( ssaoParams )
+       << "#define AO_LOW_RES " << int( SSAOParameters::AO_QUARTER_RESOLUTION ) << ".0\n"
+       << "#define RAY_STATS\n";
+    const std::string noSource;
+    return GetDefaultProgramCache().GetProgram( "SSAO ray statistics",
+        ssaoParams.vertShader.empty() ? noSource : ReadShaderFile( ssaoParams.vertShader ),
+        ssaoParams.fragShader.empty() ? noSource : ReadShaderFile( ssaoParams.fragShader ),
+        os.str() );
+}
+
+//------------------------------------------------------------------------------
+/// Add the permutations of the SSAO program reachable at run time to the
+/// program cache: the AO_* shading styles cycled with the 'c' key; multiple
+/// render targets and textures are fixed by the command line options.
+void CreateSSAOProgramPermutations( const SSAOParameters& ssaoParams, const std::string& path )
+{
+    const SSAOParameters::ShadingStyle styles[] = {
+        SSAOParameters::AMBIENT_OCCLUSION_SHADING,
+        SSAOParameters::AMBIENT_OCCLUSION_FLAT_SHADING,
+        SSAOParameters::AMBIENT_OCCLUSION_LAMBERT_SHADING,
+        SSAOParameters::AMBIENT_OCCLUSION_SPHERICAL_HARMONICS_SHADING };
+    SSAOParameters p( ssaoParams );
+    for( int s = 0; s != sizeof( styles ) / sizeof( styles[ 0 ] ); ++s )
     {
-        aprogram = new osg::Program;
-        aprogram->setName( "SSAO" );
-        if( vertexShader != 0 ) aprogram->addShader( osg::get_pointer( vertexShader ) );
-	    if( fragmentShader != 0 ) aprogram->addShader( osg::get_pointer( fragmentShader ) );
+        p.shadeStyle = styles[ s ];
+        CreateSSAOProgram( p, path );
     }
-    return aprogram.release();
 }
 
+//------------------------------------------------------------------------------
+/// Keyboard handler cycling through shading styles: programs are taken from
+/// the program cache.
+class ShadingStyleKbEventHandler : public osgGA::GUIEventHandler
+{
+public:
+    ShadingStyleKbEventHandler( osg::StateSet* sset, const SSAOParameters& ssaoParams, const std::string& path )
+        : stateSet_( sset ), ssaoParams_( ssaoParams ), path_( path ) {}
+    bool handle( const osgGA::GUIEventAdapter& ea,osgGA::GUIActionAdapter&  )
+    {
+        if( ea.getEventType() != osgGA::GUIEventAdapter::KEYDOWN ) return false;
+        if( ea.getKey() != 'c' && ea.getKey() != 'C' ) return false;
+        SSAOParameters p( ssaoParams_ );
+        p.shadeStyle = SSAOParameters::ShadingStyle( ( p.shadeStyle + 1 ) % 
+                            ( SSAOParameters::AMBIENT_OCCLUSION_SPHERICAL_HARMONICS_SHADING + 1 ) );
+        osg::ref_ptr< osg::Program > program = CreateSSAOProgram( p, path_ );
+        if( program == 0 ) return false;
+        if( GetDefaultProgramCache().IsPending( osg::get_pointer( program ) ) )
+        {
+            std::clog << "Shading style " << p.shadeStyle << " still compiling\n";
+            return true;
+        }
+        ssaoParams_ = p;
+        stateSet_->setAttributeAndModes( osg::get_pointer( program ) );
+        std::clog << "Shading style: " << ssaoParams_.shadeStyle << '\n';
+        return true;
+    }
+private:
+    osg::ref_ptr< osg::StateSet > stateSet_;
+    SSAOParameters ssaoParams_;
+    std::string path_;
+};
+
+//------------------------------------------------------------------------------
+osgGA::GUIEventHandler* CreateShadingStyleHandler( osg::StateSet& sset, 
+                                                   const SSAOParameters& ssaoParams,
+                                                   const std::string& path )
+{
+    return new ShadingStyleKbEventHandler( &sset, ssaoParams, path );
+}
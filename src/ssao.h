@@ -29,6 +29,25 @@ struct SSAOParameters
         AMBIENT_OCCLUSION_LAMBERT_SHADING,
         AMBIENT_OCCLUSION_SPHERICAL_HARMONICS_SHADING
     };
+    /// Resolution of ambient occlusion computation; value is the downsampling
+    /// factor: reduced resolution occlusion is computed in a separate pass and
+    /// upsampled with a depth/normal aware bilateral filter.
+    enum AOResolution
+    {
+        AO_FULL_RESOLUTION = 1,
+        AO_HALF_RESOLUTION = 2,
+        AO_QUARTER_RESOLUTION = 4
+    };
+
+    /// Layout of the G-buffer written by the pre-render camera in MRT mode:
+    /// full: RGBA32F eye space position + RGBA32F normal and depth (32 bytes
+    /// per pixel); compact: R32F linear depth + RG16 octahedral normal (8 bytes
+    /// per pixel), positions are reconstructed from depth.
+    enum GBufferLayout
+    {
+        GBUFFER_FULL,
+        GBUFFER_COMPACT
+    };
 
     SSAOParameters() :
         enableTextures( false ),
@@ -47,8 +66,28 @@ struct SSAOParameters
         maxNumSamples( 8 ),
         mrt( false ),
         shadeStyle( AMBIENT_OCCLUSION_SHADING ),
-        minCosAngle( 0.2f ) // ~78 deg
-        {}
+        minCosAngle( 0.2f ), // ~78 deg
+        aoResolution( AO_FULL_RESOLUTION ),
+        hizLevels( 0 ),
+        temporalSubsets( 0 ),
+        interleaved( false ),
+        gbufferLayout( GBUFFER_FULL ),
+        sphereImpostors( false ),
+        aoCache( false ),
+        aoCacheThreshold( 1e-4f ),
+        bakedAO( false ),
+        deferred( false ),
+        reuseDepth( false ),
+        aoBudget( 0.0f ),
+        minQuality( 0.1f ),
+        adaptiveRays( false ),
+        rayStats( false ),
+        cullBackground( false )
+        {
+            rayThresholds[ 0 ] = 0.1f;
+            rayThresholds[ 1 ] = 0.3f;
+            rayThresholds[ 2 ] = 0.5f;
+        }
 
         bool enableTextures;
         bool simple;
@@ -67,6 +106,53 @@ struct SSAOParameters
         bool mrt;
         ShadingStyle shadeStyle;
         float minCosAngle;
+        AOResolution aoResolution;
+        /// number of min/max depth pyramid levels, 0 = disabled
+        int hizLevels;
+        /// number of frames over which the rays are distributed; occlusion is
+        /// accumulated over frames through reprojection, <= 1 = disabled
+        int temporalSubsets;
+        /// rotate directions per pixel in a 4x4 pattern, trace 1/4 of the
+        /// directions per pixel and blur the occlusion map
+        bool interleaved;
+        GBufferLayout gbufferLayout;
+        /// scene contains sphere impostors (see molecule.h): programs ray cast
+        /// the spheres of drawables with the 'sphereImpostors' uniform set
+        bool sphereImpostors;
+        /// per vertex occlusion traced into a cache only when the view,
+        /// projection, transforms or parameters change (see ao_cache.h)
+        bool aoCache;
+        /// maximum change of a matrix element, relative to the model radius
+        /// for translations, before cached occlusion is traced again
+        float aoCacheThreshold;
+        /// per vertex visibility baked by ssao_bake read from vertex attribute
+        /// BAKED_AO_ATTRIBUTE (see baked_ao.h) instead of being traced
+        bool bakedAO;
+        /// the main camera shades a full-screen quad from the G-buffer, with
+        /// material color in an additional target, instead of drawing the model
+        bool deferred;
+        /// the main camera starts from the depth written by the pre-render
+        /// camera and draws the model with GL_EQUAL depth test and no depth
+        /// writes: the shading program runs once per visible pixel
+        bool reuseDepth;
+        /// GPU time budget in milliseconds of the occlusion and shading passes,
+        /// held by adjusting numSamples, hwMax and dstep (see quality_controller.h);
+        /// maxNumSamples, maxRadius and stepMul are the highest quality; 0 = disabled
+        float aoBudget;
+        /// lowest relative cost the budget controller can select, in (0,1]
+        float minQuality;
+        /// number of rays selected per pixel from the elevation of a few
+        /// neighbors above the tangent plane: none, 1/4, 1/2 or all the rays
+        bool adaptiveRays;
+        /// elevation sines below which none, 1/4 and 1/2 of the rays are traced
+        float rayThresholds[ 3 ];
+        /// render the number of rays per pixel at quarter resolution, read it
+        /// back and periodically print its histogram
+        bool rayStats;
+        /// full-screen passes (deferred resolve, blur) run only on the pixels
+        /// covered by the model through an early depth test against the depth
+        /// written by the camera drawing the model; draggers are not shaded
+        bool cullBackground;
 };
 
 inline std::ostream& operator<<( std::ostream& os, const SSAOParameters& ssaoParams )
@@ -88,19 +174,49 @@ inline std::ostream& operator<<( std::ostream& os, const SSAOParameters& ssaoPar
         << "\n  dRadius:           " << ssaoParams.dRadius
         << "\n  maxNumSamples:     " << ssaoParams.maxNumSamples
         << "\n  mrt:               " << ssaoParams.mrt
-        << "\n  shadeStyle         " << ssaoParams.shadeStyle;
+        << "\n  shadeStyle         " << ssaoParams.shadeStyle
+        << "\n  aoResolution:      1/" << int( ssaoParams.aoResolution )
+        << "\n  hizLevels:         " << ssaoParams.hizLevels
+        << "\n  temporalSubsets:   " << ssaoParams.temporalSubsets
+        << "\n  interleaved:       " << ssaoParams.interleaved
+        << "\n  gbufferLayout:     " << ( ssaoParams.gbufferLayout == SSAOParameters::GBUFFER_COMPACT ? "compact" : "full" )
+        << "\n  sphereImpostors:   " << ssaoParams.sphereImpostors
+        << "\n  aoCache:           " << ssaoParams.aoCache
+        << "\n  aoCacheThreshold:  " << ssaoParams.aoCacheThreshold
+        << "\n  bakedAO:           " << ssaoParams.bakedAO
+        << "\n  deferred:          " << ssaoParams.deferred
+        << "\n  reuseDepth:        " << ssaoParams.reuseDepth
+        << "\n  aoBudget:          " << ssaoParams.aoBudget << " ms"
+        << "\n  minQuality:        " << ssaoParams.minQuality
+        << "\n  adaptiveRays:      " << ssaoParams.adaptiveRays
+        << "\n  rayThresholds:     " << ssaoParams.rayThresholds[ 0 ] << ' '
+                                      << ssaoParams.rayThresholds[ 1 ] << ' '
+                                      << ssaoParams.rayThresholds[ 2 ]
+        << "\n  rayStats:          " << ssaoParams.rayStats
+        << "\n  cullBackground:    " << ssaoParams.cullBackground;
     os << std::endl;
     return os;
 }
 
 osg::Program* CreateSSAOProgram( const SSAOParameters&, const std::string& path );
 
+osg::Program* CreateSSAOLowResProgram( const SSAOParameters&, const std::string& path );
+
+osg::Program* CreateSSAOCacheProgram( const SSAOParameters&, const std::string& path );
+
+osg::Program* CreateSSAORayStatsProgram( const SSAOParameters&, const std::string& path );
+
+void CreateSSAOProgramPermutations( const SSAOParameters&, const std::string& path );
+
+osgGA::GUIEventHandler* CreateShadingStyleHandler( osg::StateSet&, const SSAOParameters&, const std::string& path );
+
 osgGA::GUIEventHandler* CreateSSAOUniformsAndHandler( const  osg::Node&,
                                                       osg::StateSet&,
                                                       const SSAOParameters&,
                                                       osg::TextureRectangle*,
                                                       osg::TextureRectangle*,
-                                                      osg::TextureRectangle* );
+                                                      osg::TextureRectangle*,
+                                                      osg::TextureRectangle* aoMap = 0 );
 
 
 #endif // SSAO_H_
\ No newline at end of file
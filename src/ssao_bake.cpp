@@ -0,0 +1,247 @@
+// Object space ambient occlusion baker for static scenes: renders the depth of
+// the scene from directions evenly distributed on a sphere around the model
+// and accumulates per vertex visibility, cosine weighted by the vertex normal.
+// The result is written to a sidecar file read by ssao -bakedAO, and
+// optionally into the vertex colors of a copy of the model.
+// Scenes are loaded and preprocessed as in ssao: the same model files and
+// loading options (e.g. -normals) must be passed to both executables for the
+// sidecar to match the scene.
+
+#include <osgViewer/Viewer>
+#include <osg/Image>
+#include <osg/ColorMask>
+#include <osgDB/WriteFile>
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+#include "scene_loader.h"
+#include "baked_ao.h"
+#include "batch.h"
+#include "thread_pool.h"
+
+namespace
+{
+//------------------------------------------------------------------------------
+/// 'n' directions evenly distributed on the unit sphere (Fibonacci lattice).
+std::vector< osg::Vec3d > SphereDirections( int n )
+{
+    std::vector< osg::Vec3d > d( n );
+    const double goldenAngle = osg::PI * ( 3.0 - std::sqrt( 5.0 ) );
+    for( int i = 0; i != n; ++i )
+    {
+        const double z = 1.0 - ( 2.0 * i + 1.0 ) / n;
+        const double r = std::sqrt( std::max( 0.0, 1.0 - z * z ) );
+        const double phi = goldenAngle * i;
+        d[ i ] = osg::Vec3d( r * std::cos( phi ), r * std::sin( phi ), z );
+    }
+    return d;
+}
+
+//------------------------------------------------------------------------------
+/// Vertices of all the baked geometries in world space.
+struct BakeVertices
+{
+    std::vector< osg::Vec3d > positions;
+    /// unit length; zero if the geometry has no per vertex normals
+    std::vector< osg::Vec3d > normals;
+    /// first vertex of each geometry
+    std::vector< size_t > offsets;
+    /// false for geometries whose vertices are not Vec3Array: fully visible
+    std::vector< bool > traced;
+};
+
+BakeVertices CollectVertices( osg::Node& model )
+{
+    std::vector< osg::Matrixd > matrices;
+    const std::vector< osg::Geometry* > geometries = CollectBakedAOGeometries( model, &matrices );
+    BakeVertices bv;
+    for( size_t g = 0; g != geometries.size(); ++g )
+    {
+        bv.offsets.push_back( bv.positions.size() );
+        const osg::Array* va = geometries[ g ]->getVertexArray();
+        const osg::Vec3Array* v = dynamic_cast< const osg::Vec3Array* >( va );
+        const osg::Vec3Array* n = dynamic_cast< const osg::Vec3Array* >( geometries[ g ]->getNormalArray() );
+        if( n && ( geometries[ g ]->getNormalBinding() != osg::Geometry::BIND_PER_VERTEX || n->size() != va->getNumElements() ) ) n = 0;
+        bv.traced.push_back( v != 0 );
+        const osg::Matrixd& m = matrices[ g ];
+        const osg::Matrixd normalMatrix = osg::Matrixd::inverse( m );
+        for( unsigned int i = 0; i != va->getNumElements(); ++i )
+        {
+            bv.positions.push_back( v ? osg::Vec3d( ( *v )[ i ] ) * m : osg::Vec3d() );
+            osg::Vec3d normal;
+            if( v && n )
+            {
+                normal = osg::Matrixd::transform3x3( normalMatrix, osg::Vec3d( ( *n )[ i ] ) );
+                normal.normalize();
+            }
+            bv.normals.push_back( normal );
+        }
+    }
+    bv.offsets.push_back( bv.positions.size() );
+    return bv;
+}
+
+//------------------------------------------------------------------------------
+/// Accumulate visibility of the vertices from one direction given the depth
+/// image rendered with an orthographic camera looking along -direction.
+class AccumulateVisibility : public ParallelTask
+{
+public:
+    AccumulateVisibility( const BakeVertices& bv, const osg::Image& depth, const osg::Matrixd& viewProj,
+                          const osg::Vec3d& direction, double texelDepth, std::vector< double >& visibility )
+        : bv_( bv ), depth_( depth ), viewProj_( viewProj ), direction_( direction ),
+          texelDepth_( texelDepth ), visibility_( visibility ) {}
+    static const int CHUNK_SIZE = 4096;
+    void Run( int taskIndex, int )
+    {
+        const size_t begin = size_t( taskIndex ) * CHUNK_SIZE;
+        const size_t end = std::min( begin + CHUNK_SIZE, bv_.positions.size() );
+        const int w = depth_.s();
+        const int h = depth_.t();
+        const float* d = reinterpret_cast< const float* >( depth_.data() );
+        for( size_t i = begin; i != end; ++i )
+        {
+            const osg::Vec3d& n = bv_.normals[ i ];
+            const bool hasNormal = n.length2() > 0.0;
+            const double cosTheta = hasNormal ? n * direction_ : 1.0;
+            if( cosTheta <= 0.0 ) continue;
+            const osg::Vec3d p = bv_.positions[ i ] * viewProj_;
+            const double x = ( 0.5 * p.x() + 0.5 ) * w - 0.5;
+            const double y = ( 0.5 * p.y() + 0.5 ) * h - 0.5;
+            const double z = 0.5 * p.z() + 0.5;
+            // farthest depth of the four texels around the vertex: the
+            // vertex lies on the boundary of the triangles it belongs to
+            const int x0 = std::max( 0, std::min( w - 1, int( std::floor( x ) ) ) );
+            const int y0 = std::max( 0, std::min( h - 1, int( std::floor( y ) ) ) );
+            const int x1 = std::min( w - 1, x0 + 1 );
+            const int y1 = std::min( h - 1, y0 + 1 );
+            const float depth = std::max( std::max( d[ y0 * w + x0 ], d[ y0 * w + x1 ] ),
+                                          std::max( d[ y1 * w + x0 ], d[ y1 * w + x1 ] ) );
+            // slope scaled bias: surfaces at grazing angles span more depth
+            // per texel
+            const double tanTheta = hasNormal ? std::sqrt( std::max( 0.0, 1.0 - cosTheta * cosTheta ) ) / cosTheta : 0.5;
+            const double bias = texelDepth_ * ( 1.5 + std::min( tanTheta, 8.0 ) );
+            if( z <= depth + bias ) visibility_[ i ] += cosTheta;
+        }
+    }
+private:
+    const BakeVertices& bv_;
+    const osg::Image& depth_;
+    osg::Matrixd viewProj_;
+    osg::Vec3d direction_;
+    double texelDepth_;
+    std::vector< double >& visibility_;
+};
+}
+
+//------------------------------------------------------------------------------
+int main( int argc, char** argv )
+{
+    osg::ArgumentParser arguments( &argc, argv );
+    osg::ApplicationUsage* usage = arguments.getApplicationUsage();
+    usage->setCommandLineUsage( arguments.getApplicationName() + " [options] [model files]" );
+    AddSceneLoadUsage( *usage );
+    usage->addCommandLineOption( "-directions", "Number of directions (default 256)" );
+    usage->addCommandLineOption( "-resolution", "Depth image resolution (default 1024)" );
+    usage->addCommandLineOption( "-out", "Baked occlusion file read by ssao -bakedAO (default baked.ao)" );
+    usage->addCommandLineOption( "-outModel", "Also write model with occlusion multiplied into vertex colors" );
+    if( arguments.read( "-h" ) || arguments.read( "--help" ) )
+    {
+        usage->write( std::cout );
+        return 0;
+    }
+    try
+    {
+        // textures do not change the geometry: they are removed
+        const SceneLoadParameters loadParams = ParseSceneLoadParameters( arguments );
+        int numDirections = 256;
+        arguments.read( "-directions", numDirections );
+        int resolution = 1024;
+        arguments.read( "-resolution", resolution );
+        std::string outFile = "baked.ao";
+        arguments.read( "-out", outFile );
+        std::string outModel;
+        arguments.read( "-outModel", outModel );
+        if( numDirections <= 0 || resolution <= 0 ) throw std::runtime_error( "Invalid number of directions or resolution" );
+
+        bool sphereImpostors = false;
+        osg::ref_ptr< osg::Node > model = LoadScene( arguments, loadParams, 0, &sphereImpostors );
+        if( !model.valid() ) throw std::runtime_error( "No model loaded" );
+        if( sphereImpostors ) throw std::runtime_error( "Sphere impostors have no vertices to bake: use -chemPlugin" );
+        const BakeVertices bv = CollectVertices( *model );
+        if( bv.positions.empty() ) throw std::runtime_error( "No vertices to bake" );
+
+        // DEPTH CAMERA //
+        // depth only, both faces: back faces of open meshes occlude too
+        osgViewer::Viewer viewer;
+        osg::Camera* camera = viewer.getCamera();
+        SetupOffscreenCamera( *camera, resolution, resolution );
+        osg::ref_ptr< osg::Image > depth = new osg::Image;
+        depth->allocateImage( resolution, resolution, 1, GL_DEPTH_COMPONENT, GL_FLOAT );
+        camera->setRenderTargetImplementation( osg::Camera::FRAME_BUFFER_OBJECT );
+        camera->attach( osg::Camera::DEPTH_BUFFER, osg::get_pointer( depth ) );
+        camera->setComputeNearFarMode( osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR );
+        camera->setCullingMode( camera->getCullingMode() & ~osg::CullSettings::SMALL_FEATURE_CULLING );
+        camera->setClearMask( GL_DEPTH_BUFFER_BIT );
+        osg::StateSet* ss = camera->getOrCreateStateSet();
+        ss->setAttributeAndModes( new osg::ColorMask( false, false, false, false ), osg::StateAttribute::ON | osg::StateAttribute::OVERRIDE );
+        ss->setMode( GL_CULL_FACE, osg::StateAttribute::OFF | osg::StateAttribute::OVERRIDE );
+        viewer.setSceneData( osg::get_pointer( model ) );
+        viewer.setThreadingModel( osgViewer::Viewer::SingleThreaded );
+        viewer.setReleaseContextAtEndOfFrameHint( false );
+        viewer.realize();
+        if( !viewer.isRealized() ) throw std::runtime_error( "Cannot realize off-screen viewer" );
+
+        // BAKE //
+        const osg::BoundingSphere bs = model->getBound();
+        const double r = std::max( double( bs.radius() ), 1e-6 );
+        camera->setProjectionMatrixAsOrtho( -r, r, -r, r, r, 3.0 * r );
+        // size of a texel in normalized depth units: depth range is 2r
+        const double texelDepth = 1.0 / resolution;
+        const std::vector< osg::Vec3d > directions = SphereDirections( numDirections );
+        std::vector< double > visibility( bv.positions.size(), 0.0 );
+        const int numTasks = int( ( bv.positions.size() + AccumulateVisibility::CHUNK_SIZE - 1 ) / AccumulateVisibility::CHUNK_SIZE );
+        for( int i = 0; i != numDirections; ++i )
+        {
+            const osg::Vec3d& dir = directions[ i ];
+            const osg::Vec3d up = std::fabs( dir.z() ) > 0.99 ? osg::Vec3d( 0, 1, 0 ) : osg::Vec3d( 0, 0, 1 );
+            camera->setViewMatrixAsLookAt( osg::Vec3d( bs.center() ) + dir * 2.0 * r, bs.center(), up );
+            viewer.frame();
+            AccumulateVisibility task( bv, *depth, camera->getViewMatrix() * camera->getProjectionMatrix(),
+                                       dir, texelDepth, visibility );
+            GetDefaultThreadPool().ParallelFor( numTasks, task );
+            if( ( i + 1 ) % 32 == 0 || i + 1 == numDirections ) std::cout << "direction " << ( i + 1 ) << '/' << numDirections << std::endl;
+        }
+
+        // cosine weighted integral over the hemisphere: each direction covers
+        // 4 pi / N steradians, normalized by pi; vertices without normals are
+        // seen from half the directions when unoccluded
+        BakedAO ao( bv.offsets.size() - 1 );
+        for( size_t g = 0; g != ao.size(); ++g )
+        {
+            for( size_t i = bv.offsets[ g ]; i != bv.offsets[ g + 1 ]; ++i )
+            {
+                const double scale = bv.normals[ i ].length2() > 0.0 ? 4.0 : 2.0;
+                ao[ g ].push_back( bv.traced[ g ] ? float( std::min( 1.0, scale * visibility[ i ] / numDirections ) ) : 1.0f );
+            }
+        }
+        WriteBakedAO( outFile, ao );
+        std::cout << bv.positions.size() << " vertices baked to " << outFile << std::endl;
+        if( !outModel.empty() )
+        {
+            ApplyBakedAOToColors( *model, ao );
+            if( !osgDB::writeNodeFile( *model, outModel ) ) throw std::runtime_error( "Cannot write " + outModel );
+        }
+        return 0;
+    }
+    catch( const std::exception& e )
+    {
+        std::cerr << e.what() << std::endl;
+    }
+    return 1;
+}
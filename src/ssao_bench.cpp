@@ -0,0 +1,283 @@
+// Camera path benchmark of the SSAO renderer: runs the ssao executable in
+// off-screen batch mode for every combination of the requested parameter
+// values and resolutions, and reports min/median/99th percentile of the CPU
+// frame time and of the total GPU time as JSON.
+// Each configuration runs in a separate process: programs, render targets and
+// driver state never leak from one configuration to the next.
+
+#include <osg/ArgumentParser>
+#include <osgDB/FileNameUtils>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+#ifndef SSAO_SHADER_DIR
+#define SSAO_SHADER_DIR "shaders"
+#endif
+
+typedef std::vector< std::string > Strings;
+
+//------------------------------------------------------------------------------
+/// Split comma separated list.
+Strings Split( const std::string& s, char sep = ',' )
+{
+    Strings tokens;
+    std::istringstream is( s );
+    std::string t;
+    while( std::getline( is, t, sep ) ) tokens.push_back( t );
+    return tokens;
+}
+
+std::string Quote( const std::string& s )
+{
+    return '"' + s + '"';
+}
+
+//------------------------------------------------------------------------------
+/// Frame time distribution.
+struct Summary
+{
+    Summary() : samples( 0 ), min( 0.0 ), median( 0.0 ), p99( 0.0 ) {}
+    int samples;
+    double min;
+    double median;
+    double p99;
+};
+
+Summary Summarize( std::vector< double > v )
+{
+    Summary s;
+    if( v.empty() ) return s;
+    std::sort( v.begin(), v.end() );
+    const size_t n = v.size();
+    s.samples = int( n );
+    s.min = v.front();
+    s.median = n % 2 ? v[ n / 2 ] : 0.5 * ( v[ n / 2 - 1 ] + v[ n / 2 ] );
+    s.p99 = v[ std::min( n - 1, size_t( std::ceil( 0.99 * n ) ) - 1 ) ];
+    return s;
+}
+
+std::ostream& operator<<( std::ostream& os, const Summary& s )
+{
+    return os << "{\"samples\":" << s.samples << ",\"min\":" << s.min
+              << ",\"median\":" << s.median << ",\"p99\":" << s.p99 << '}';
+}
+
+//------------------------------------------------------------------------------
+/// Read frame profile written by ssao -profile and return per frame CPU time
+/// (sum of traversal times) and GPU time (sum of pass times); the first
+/// 'skip' frames are ignored and GPU time is returned only for the frames in
+/// which every pass was timed.
+void ReadProfile( const std::string& fileName, int skip,
+                  std::vector< double >& cpu, std::vector< double >& gpu )
+{
+    std::ifstream is( fileName.c_str() );
+    if( !is ) throw std::runtime_error( "Cannot open profile " + fileName );
+    std::string line;
+    std::getline( is, line );
+    const Strings header = Split( line );
+    std::vector< bool > isCPU( header.size(), false );
+    std::vector< bool > isGPU( header.size(), false );
+    for( size_t i = 0; i != header.size(); ++i )
+    {
+        const std::string& h = header[ i ];
+        isCPU[ i ] = h == "event_ms" || h == "update_ms" || h == "sync_ms" || h == "render_ms";
+        isGPU[ i ] = h.compare( 0, 4, "gpu_" ) == 0;
+    }
+    const int numGPU = int( std::count( isGPU.begin(), isGPU.end(), true ) );
+    for( int frame = 0; std::getline( is, line ); ++frame )
+    {
+        if( frame < skip ) continue;
+        // keep empty trailing fields
+        const Strings fields = Split( line + ',' );
+        double c = 0.0;
+        double g = 0.0;
+        int gpuFields = 0;
+        for( size_t i = 0; i != std::min( fields.size(), header.size() ); ++i )
+        {
+            if( fields[ i ].empty() ) continue;
+            const double v = std::atof( fields[ i ].c_str() );
+            if( isCPU[ i ] ) c += v;
+            else if( isGPU[ i ] )
+            {
+                g += v;
+                ++gpuFields;
+            }
+        }
+        // late or missing queries: partial sums would bias the statistics
+        const bool gpuValid = gpuFields > 0 && gpuFields == numGPU;
+        cpu.push_back( c );
+        if( gpuValid ) gpu.push_back( g );
+    }
+}
+
+//------------------------------------------------------------------------------
+/// One point of the parameter matrix.
+struct Configuration
+{
+    int width;
+    int height;
+    std::string maxNumSamples;
+    std::string maxRadius;
+    std::string stepMul;
+    bool mrt;
+    std::string shade;
+};
+
+std::ostream& operator<<( std::ostream& os, const Configuration& c )
+{
+    return os << "{\"width\":" << c.width << ",\"height\":" << c.height
+              << ",\"maxNumSamples\":" << c.maxNumSamples << ",\"maxRadius\":" << c.maxRadius
+              << ",\"stepMul\":" << c.stepMul << ",\"mrt\":" << ( c.mrt ? "true" : "false" )
+              << ",\"shade\":\"" << c.shade << "\"}";
+}
+
+//------------------------------------------------------------------------------
+int main( int argc, char** argv )
+{
+    osg::ArgumentParser arguments( &argc, argv );
+    osg::ApplicationUsage* usage = arguments.getApplicationUsage();
+    usage->setCommandLineUsage( arguments.getApplicationName() + " [options] [model files]" );
+    usage->addCommandLineOption( "-ssao", "ssao executable; default: ssao in the same directory" );
+    usage->addCommandLineOption( "-vert", "Vertex shader; default: ssao_trace_per_frag2_optimal.vert" );
+    usage->addCommandLineOption( "-frag", "Fragment shader; default: ssao_trace_per_frag2_optimal.frag" );
+    usage->addCommandLineOption( "-cameraPath", "Camera path file; default: orbit around model" );
+    usage->addCommandLineOption( "-frames", "Frames per configuration (default 120)" );
+    usage->addCommandLineOption( "-warmup", "Frames excluded from statistics (default 10)" );
+    usage->addCommandLineOption( "-resolutions", "Comma separated WxH list (default 1280x720,1920x1080)" );
+    usage->addCommandLineOption( "-maxNumSamples", "Comma separated list (default 8,16)" );
+    usage->addCommandLineOption( "-maxRadius", "Comma separated list (default 32)" );
+    usage->addCommandLineOption( "-stepMul", "Comma separated list (default 1)" );
+    usage->addCommandLineOption( "-mrt", "Comma separated list of 'off', 'on' (default off,on)" );
+    usage->addCommandLineOption( "-shade", "Comma separated list of shading styles (default ao)" );
+    usage->addCommandLineOption( "-args", "Additional arguments passed to every run, e.g. \"-hiz 2\"" );
+    usage->addCommandLineOption( "-out", "JSON report file; default: standard output" );
+    if( arguments.read( "-h" ) || arguments.read( "--help" ) )
+    {
+        usage->write( std::cout );
+        return 0;
+    }
+    try
+    {
+        std::string exe = osgDB::concatPaths( osgDB::getFilePath( argv[ 0 ] ), "ssao" );
+        arguments.read( "-ssao", exe );
+        std::string vert = std::string( SSAO_SHADER_DIR ) + "/ssao_trace_per_frag2_optimal.vert";
+        std::string frag = std::string( SSAO_SHADER_DIR ) + "/ssao_trace_per_frag2_optimal.frag";
+        arguments.read( "-vert", vert );
+        arguments.read( "-frag", frag );
+        std::string cameraPath;
+        arguments.read( "-cameraPath", cameraPath );
+        int frames = 120;
+        arguments.read( "-frames", frames );
+        int warmup = 10;
+        arguments.read( "-warmup", warmup );
+        if( frames <= warmup ) throw std::runtime_error( "Number of frames must be greater than number of warm-up frames" );
+        std::string s = "1280x720,1920x1080";
+        arguments.read( "-resolutions", s );
+        const Strings resolutions = Split( s );
+        s = "8,16";
+        arguments.read( "-maxNumSamples", s );
+        const Strings numSamples = Split( s );
+        s = "32";
+        arguments.read( "-maxRadius", s );
+        const Strings maxRadius = Split( s );
+        s = "1";
+        arguments.read( "-stepMul", s );
+        const Strings stepMul = Split( s );
+        s = "off,on";
+        arguments.read( "-mrt", s );
+        const Strings mrt = Split( s );
+        s = "ao";
+        arguments.read( "-shade", s );
+        const Strings shade = Split( s );
+        std::string extraArgs;
+        arguments.read( "-args", extraArgs );
+        std::string outFile;
+        arguments.read( "-out", outFile );
+        std::string models;
+        for( int i = 1; i < arguments.argc(); ++i )
+        {
+            if( arguments.isOption( i ) ) throw std::runtime_error( std::string( "Unknown option " ) + arguments[ i ] );
+            models += ' ' + Quote( arguments[ i ] );
+        }
+
+        // parameter matrix
+        std::vector< Configuration > configs;
+        for( Strings::const_iterator r = resolutions.begin(); r != resolutions.end(); ++r )
+        {
+            Configuration c;
+            char x = 0;
+            std::istringstream is( *r );
+            if( !( is >> c.width >> x >> c.height ) || x != 'x' ) throw std::runtime_error( "Invalid resolution " + *r );
+            for( size_t a = 0; a != numSamples.size(); ++a )
+            for( size_t b = 0; b != maxRadius.size(); ++b )
+            for( size_t d = 0; d != stepMul.size(); ++d )
+            for( size_t e = 0; e != mrt.size(); ++e )
+            for( size_t f = 0; f != shade.size(); ++f )
+            {
+                c.maxNumSamples = numSamples[ a ];
+                c.maxRadius = maxRadius[ b ];
+                c.stepMul = stepMul[ d ];
+                c.mrt = mrt[ e ] == "on";
+                c.shade = shade[ f ];
+                configs.push_back( c );
+            }
+        }
+
+        const std::string profile = "ssao_bench_profile.csv";
+        std::ostringstream report;
+        report << std::fixed << std::setprecision( 4 ) << "[\n";
+        int failed = 0;
+        bool first = true;
+        for( size_t i = 0; i != configs.size(); ++i )
+        {
+            const Configuration& c = configs[ i ];
+            std::ostringstream cmd;
+            cmd << Quote( exe ) << " -vert " << Quote( vert ) << " -frag " << Quote( frag )
+                << " -batch " << frames << " -outWidth " << c.width << " -outHeight " << c.height
+                << " -outFormat none -profile " << Quote( profile )
+                << " -maxNumSamples " << c.maxNumSamples << " -maxRadius " << c.maxRadius
+                << " -stepMul " << c.stepMul << " -shade " << c.shade << ( c.mrt ? " -mrt" : "" );
+            if( !cameraPath.empty() ) cmd << " -cameraPath " << Quote( cameraPath );
+            if( !extraArgs.empty() ) cmd << ' ' << extraArgs;
+            cmd << models;
+            std::clog << '[' << ( i + 1 ) << '/' << configs.size() << "] " << cmd.str() << std::endl;
+            std::remove( profile.c_str() );
+            std::vector< double > cpu, gpu;
+            if( std::system( cmd.str().c_str() ) != 0 )
+            {
+                std::cerr << "Run failed" << std::endl;
+                ++failed;
+                continue;
+            }
+            // first frame is the batch mode warm-up frame
+            ReadProfile( profile, warmup + 1, cpu, gpu );
+            std::remove( profile.c_str() );
+            report << ( first ? "" : ",\n" ) << "{\"config\":" << c
+                   << ",\"cpu_ms\":" << Summarize( cpu ) << ",\"gpu_ms\":" << Summarize( gpu ) << '}';
+            first = false;
+        }
+        report << "\n]\n";
+        if( outFile.empty() ) std::cout << report.str();
+        else
+        {
+            std::ofstream os( outFile.c_str() );
+            if( !( os << report.str() ) ) throw std::runtime_error( "Cannot write " + outFile );
+        }
+        return failed ? 1 : 0;
+    }
+    catch( const std::exception& e )
+    {
+        std::cerr << e.what() << std::endl;
+    }
+    return 1;
+}
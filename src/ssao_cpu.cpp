@@ -0,0 +1,467 @@
+#include "ssao_cpu.h"
+#include "ssao_cpu_kernel.h"
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#if defined( _MSC_VER )
+#include <intrin.h>
+#elif defined( __i386__ ) || defined( __x86_64__ )
+#include <cpuid.h>
+#endif
+
+namespace
+{
+
+//------------------------------------------------------------------------------
+struct Vec3
+{
+    Vec3() : x( 0.f ), y( 0.f ), z( 0.f ) {}
+    Vec3( float x_, float y_, float z_ ) : x( x_ ), y( y_ ), z( z_ ) {}
+    float x, y, z;
+};
+
+inline Vec3 operator-( const Vec3& a, const Vec3& b ) { return Vec3( a.x - b.x, a.y - b.y, a.z - b.z ); }
+inline float Dot( const Vec3& a, const Vec3& b ) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+inline Vec3 Cross( const Vec3& a, const Vec3& b )
+{
+    return Vec3( a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x );
+}
+inline Vec3 Normalize( const Vec3& v )
+{
+    const float l = std::sqrt( Dot( v, v ) );
+    return Vec3( v.x / l, v.y / l, v.z / l );
+}
+
+//------------------------------------------------------------------------------
+SSAOCpuDirection MakeDirection( SSAOCpuDirection::Type t, float dx, float dy )
+{
+    SSAOCpuDirection d;
+    d.type = t;
+    d.dx = dx;
+    d.dy = dy;
+    return d;
+}
+
+//------------------------------------------------------------------------------
+/// Returns directions in the same order as ComputeOcclusion(); note that
+/// the right edge loop in the shader starts at j = hw + 1 and therefore
+/// never executes: the same (i = hw, j < 0) directions are skipped here.
+void ComputeDirections( float numSamples, float dstep, std::vector< SSAOCpuDirection >& dirs )
+{
+    typedef SSAOCpuDirection D;
+    dirs.clear();
+    const int hw = int( std::max( 1.0f, numSamples / 8.0f ) );
+    int i = -hw;
+    int j = -hw;
+    for( ; j != 0; ++j ) dirs.push_back( MakeDirection( D::LINE, float( i ), float( j ) ) );
+    for( j = 1; j != hw + 1; ++j ) dirs.push_back( MakeDirection( D::LINE, float( i ), float( j ) ) );
+    i = hw;
+    for( ; j != hw + 1; ++j ) dirs.push_back( MakeDirection( D::LINE, float( i ), float( j ) ) );
+    for( j = 1; j != hw + 1; ++j ) dirs.push_back( MakeDirection( D::LINE, float( i ), float( j ) ) );
+    j = -hw;
+    for( i = -hw + 1; i != 0; ++i ) dirs.push_back( MakeDirection( D::LINE, float( i ), float( j ) ) );
+    for( i = 1; i != hw; ++i ) dirs.push_back( MakeDirection( D::LINE, float( i ), float( j ) ) );
+    j = hw;
+    for( i = -hw + 1; i != 0; ++i ) dirs.push_back( MakeDirection( D::LINE, float( i ), float( j ) ) );
+    for( i = 1; i != hw; ++i ) dirs.push_back( MakeDirection( D::LINE, float( i ), float( j ) ) );
+    dirs.push_back( MakeDirection( D::HORIZONTAL, -dstep, 0.f ) );
+    dirs.push_back( MakeDirection( D::HORIZONTAL,  dstep, 0.f ) );
+    dirs.push_back( MakeDirection( D::VERTICAL, 0.f, -dstep ) );
+    dirs.push_back( MakeDirection( D::VERTICAL, 0.f,  dstep ) );
+}
+
+//------------------------------------------------------------------------------
+/// texture2DRect lookup with NEAREST filter and CLAMP_TO_EDGE wrap.
+inline int Texel( const SSAOCpuKernel& k, float px, float py )
+{
+    const int x = std::min( std::max( int( std::floor( px ) ), 0 ), k.width - 1 );
+    const int y = std::min( std::max( int( std::floor( py ) ), 0 ), k.height - 1 );
+    return y * k.width + x;
+}
+
+//------------------------------------------------------------------------------
+/// ssUnproject(): window space to eye space.
+Vec3 Unproject( const SSAOCpuKernel& k, float wx, float wy, float wz )
+{
+    const float v[ 4 ] = { ( wx / k.fwidth - 0.5f ) * 2.0f,
+                           ( wy / k.fheight - 0.5f ) * 2.0f,
+                           ( wz - 0.5f ) * 2.0f,
+                           1.0f };
+    float p[ 4 ];
+    for( int c = 0; c != 4; ++c )
+    {
+        p[ c ] = v[ 0 ] * k.invProj[ c ] + v[ 1 ] * k.invProj[ 4 + c ]
+               + v[ 2 ] * k.invProj[ 8 + c ] + v[ 3 ] * k.invProj[ 12 + c ];
+    }
+    return Vec3( p[ 0 ] / p[ 3 ], p[ 1 ] / p[ 3 ], p[ 2 ] / p[ 3 ] );
+}
+
+//------------------------------------------------------------------------------
+/// screenSpace(): eye space to window space.
+Vec3 Project( const SSAOCpuKernel& k, const Vec3& e )
+{
+    float p[ 4 ];
+    for( int c = 0; c != 4; ++c )
+    {
+        p[ c ] = e.x * k.proj[ c ] + e.y * k.proj[ 4 + c ] + e.z * k.proj[ 8 + c ] + k.proj[ 12 + c ];
+    }
+    return Vec3( ( p[ 0 ] / p[ 3 ] * 0.5f + 0.5f ) * k.fwidth,
+                 ( p[ 1 ] / p[ 3 ] * 0.5f + 0.5f ) * k.fheight,
+                 p[ 2 ] / p[ 3 ] * 0.5f + 0.5f );
+}
+
+inline float Depth( const SSAOCpuKernel& k, int i ) { return k.depth[ i * k.depthStride ]; }
+
+//------------------------------------------------------------------------------
+Vec3 Position( const SSAOCpuKernel& k, int x, int y )
+{
+    if( k.positions )
+    {
+        const float* p = k.positions + 4 * ( y * k.width + x );
+        return Vec3( p[ 0 ], p[ 1 ], p[ 2 ] );
+    }
+    return Unproject( k, x + 0.5f, y + 0.5f, Depth( k, y * k.width + x ) );
+}
+
+//------------------------------------------------------------------------------
+/// Normal from normals buffer or from cross product of the eye space
+/// differences with the neighbours having the smallest depth discontinuity,
+/// oriented towards the viewer.
+Vec3 Normal( const SSAOCpuKernel& k, int x, int y )
+{
+    if( k.normals )
+    {
+        const float* n = k.normals + 4 * ( y * k.width + x );
+        return Vec3( n[ 0 ], n[ 1 ], n[ 2 ] );
+    }
+    const Vec3 c = Position( k, x, y );
+    const int xl = std::max( x - 1, 0 );
+    const int xr = std::min( x + 1, k.width - 1 );
+    const int yb = std::max( y - 1, 0 );
+    const int yt = std::min( y + 1, k.height - 1 );
+    const Vec3 l = Position( k, xl, y );
+    const Vec3 r = Position( k, xr, y );
+    const Vec3 b = Position( k, x, yb );
+    const Vec3 t = Position( k, x, yt );
+    const Vec3 dx = std::fabs( r.z - c.z ) < std::fabs( c.z - l.z ) && xr != x ? r - c : c - l;
+    const Vec3 dy = std::fabs( t.z - c.z ) < std::fabs( c.z - b.z ) && yt != y ? t - c : c - b;
+    Vec3 n = Normalize( Cross( dx, dy ) );
+    if( Dot( n, c ) > 0.f ) n = Vec3( -n.x, -n.y, -n.z );
+    return n;
+}
+
+//------------------------------------------------------------------------------
+/// Computes occlusion and visibility for one image tile.
+class TileTask : public ParallelTask
+{
+public:
+    TileTask( const SSAOCpuKernel& k, SSAOCpuTileFunction f, int tileSize,
+              float* occlusion, float* visibility ) :
+        kernel_( k ), function_( f ), tileSize_( tileSize ),
+        tilesX_( ( k.width + tileSize - 1 ) / tileSize ),
+        occlusion_( occlusion ), visibility_( visibility ) {}
+    int NumTiles() const { return tilesX_ * ( ( kernel_.height + tileSize_ - 1 ) / tileSize_ ); }
+    void Run( int tile, int )
+    {
+        const int x0 = ( tile % tilesX_ ) * tileSize_;
+        const int y0 = ( tile / tilesX_ ) * tileSize_;
+        const int x1 = std::min( x0 + tileSize_, kernel_.width );
+        const int y1 = std::min( y0 + tileSize_, kernel_.height );
+        function_( kernel_, x0, y0, x1, y1, occlusion_, visibility_ );
+    }
+private:
+    const SSAOCpuKernel& kernel_;
+    SSAOCpuTileFunction function_;
+    int tileSize_;
+    int tilesX_;
+    float* occlusion_;
+    float* visibility_;
+};
+
+//------------------------------------------------------------------------------
+void CpuId( int leaf, int subLeaf, unsigned int r[ 4 ] )
+{
+    r[ 0 ] = r[ 1 ] = r[ 2 ] = r[ 3 ] = 0;
+#if defined( _MSC_VER )
+    int regs[ 4 ];
+    __cpuidex( regs, leaf, subLeaf );
+    for( int i = 0; i != 4; ++i ) r[ i ] = ( unsigned int )( regs[ i ] );
+#elif defined( __i386__ ) || defined( __x86_64__ )
+    if( unsigned( leaf ) > __get_cpuid_max( 0, 0 ) ) return;
+    __cpuid_count( leaf, subLeaf, r[ 0 ], r[ 1 ], r[ 2 ], r[ 3 ] );
+#endif
+}
+
+//------------------------------------------------------------------------------
+/// Returns the register state enabled by the OS (XCR0).
+unsigned long long GetXCR0()
+{
+#if defined( _MSC_VER )
+    return _xgetbv( 0 );
+#elif defined( __i386__ ) || defined( __x86_64__ )
+    unsigned int eax = 0;
+    unsigned int edx = 0;
+    __asm__ __volatile__( "xgetbv" : "=a"( eax ), "=d"( edx ) : "c"( 0 ) );
+    return ( ( unsigned long long )( edx ) << 32 ) | eax;
+#else
+    return 0;
+#endif
+}
+
+//------------------------------------------------------------------------------
+bool CpuSupports( SSAOCpuEngine::ISA isa )
+{
+    unsigned int r1[ 4 ];
+    unsigned int r7[ 4 ];
+    CpuId( 1, 0, r1 );
+    CpuId( 7, 0, r7 );
+    const bool sse42 = ( r1[ 2 ] & ( 1u << 20 ) ) != 0;
+    const bool osxsave = ( r1[ 2 ] & ( 1u << 27 ) ) != 0;
+    const bool avx = ( r1[ 2 ] & ( 1u << 28 ) ) != 0;
+    const unsigned long long xcr0 = osxsave ? GetXCR0() : 0;
+    const bool ymm = ( xcr0 & 0x6 ) == 0x6;
+    const bool zmm = ( xcr0 & 0xe6 ) == 0xe6;
+    switch( isa )
+    {
+    case SSAOCpuEngine::ISA_SCALAR: return true;
+    case SSAOCpuEngine::ISA_SSE42: return sse42;
+    case SSAOCpuEngine::ISA_AVX2: return avx && ymm && ( r7[ 1 ] & ( 1u << 5 ) ) != 0;
+    case SSAOCpuEngine::ISA_AVX512: return avx && zmm && ( r7[ 1 ] & ( 1u << 16 ) ) != 0;
+    default: return false;
+    }
+}
+
+//------------------------------------------------------------------------------
+SSAOCpuTileFunction GetTileFunction( SSAOCpuEngine::ISA isa )
+{
+    switch( isa )
+    {
+#ifdef SSAO_CPU_SSE42
+    case SSAOCpuEngine::ISA_SSE42: return ComputeTileSSE42;
+#endif
+#ifdef SSAO_CPU_AVX2
+    case SSAOCpuEngine::ISA_AVX2: return ComputeTileAVX2;
+#endif
+#ifdef SSAO_CPU_AVX512
+    case SSAOCpuEngine::ISA_AVX512: return ComputeTileAVX512;
+#endif
+    case SSAOCpuEngine::ISA_SCALAR: return ComputeTileScalar;
+    default: return 0;
+    }
+}
+
+}
+
+//------------------------------------------------------------------------------
+SSAOCpuKernel::SSAOCpuKernel( const SSAOCpuGBuffer& gb, const SSAOParameters& p )
+{
+    if( gb.width <= 0 || gb.height <= 0 ) throw std::logic_error( "Invalid G-buffer size" );
+    if( !gb.depth && !gb.normals ) throw std::logic_error( "No depth data in G-buffer" );
+    width = gb.width;
+    height = gb.height;
+    fwidth = float( gb.width );
+    fheight = float( gb.height );
+    depth = gb.depth ? gb.depth : gb.normals + 3;
+    depthStride = gb.depth ? 1 : 4;
+    positions = gb.positions;
+    normals = gb.normals;
+    const osg::Matrixd inv = osg::Matrixd::inverse( gb.projection );
+    for( int r = 0; r != 4; ++r )
+    {
+        for( int c = 0; c != 4; ++c )
+        {
+            proj[ 4 * r + c ] = float( gb.projection( r, c ) );
+            invProj[ 4 * r + c ] = float( inv( r, c ) );
+        }
+    }
+    numSamples = p.maxNumSamples;
+    hwMax = p.maxRadius;
+    dstep = p.stepMul;
+    minCosAngle = p.minCosAngle;
+    occlusionFactor = p.occFact;
+    R = p.dRadius * gb.radius;
+    ComputeDirections( numSamples, dstep, dirs_ );
+    dirs = &dirs_[ 0 ];
+    numDirs = int( dirs_.size() );
+    const int hw = int( std::max( 1.0f, numSamples / 8.0f ) );
+    rayNorm = std::max( 1.0f, float( 8 * hw - 2 ) );
+}
+
+//------------------------------------------------------------------------------
+bool SSAOCpuKernel::SetupPixel( int x, int y, SSAOCpuPixel& px ) const
+{
+    const float z = Depth( *this, y * width + x );
+    if( z >= 1.0f ) return false;
+    const Vec3 wp = Position( *this, x, y );
+    const Vec3 n = Normal( *this, x, y );
+    // per-vertex values of the vertex shader evaluated at the fragment
+    Vec3 wpr = wp;
+    wpr.x += R;
+    const Vec3 ab = Project( *this, wpr ) - Project( *this, wp );
+    const float pixelRadius = std::max( 0.f, std::sqrt( Dot( ab, ab ) ) );
+    // ComputeRadiusAndOcclusionAttenuationCoeff()
+    px.PR = std::min( std::max( pixelRadius, 1.0f ), hwMax );
+    const float PRP = R * px.PR / pixelRadius;
+    px.B = ( 1.0f - 0.1f ) / ( PRP * PRP );
+    px.sx = x + 0.5f;
+    px.sy = y + 0.5f;
+    px.sz = z;
+    px.wx = wp.x;
+    px.wy = wp.y;
+    px.wz = wp.z;
+    px.nx = n.x;
+    px.ny = n.y;
+    px.nz = n.z;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+float SSAOCpuKernel::March( const SSAOCpuDirection& d, const SSAOCpuPixel& px ) const
+{
+    float sx = 0.f;
+    float sy = 0.f;
+    int upperI = 0;
+    if( d.type == SSAOCpuDirection::LINE )
+    {
+        const float m = d.dy / d.dx;
+        upperI = int( px.PR * ( 1.0f / std::sqrt( 1.0f + m * m ) ) / std::fabs( dstep ) );
+        sx = ( d.dx > 0.f ? 1.0f : -1.0f ) * dstep;
+        sy = sx * m;
+    }
+    else
+    {
+        const float ds = d.type == SSAOCpuDirection::HORIZONTAL ? d.dx : d.dy;
+        upperI = int( px.PR / std::fabs( ds ) );
+        sx = d.dx;
+        sy = d.dy;
+    }
+    const Vec3 wp( px.wx, px.wy, px.wz );
+    const Vec3 n( px.nx, px.ny, px.nz );
+    int occSteps = 0;
+    float occl = 0.f;
+    float prev = 0.f;
+    float x = px.sx;
+    float y = px.sy;
+    for( int i = 0; i != upperI; ++i )
+    {
+        x += sx;
+        y += sy;
+        const int t = Texel( *this, x, y );
+        const float z = Depth( *this, t );
+        const float dz = px.sz - z;
+        const float ex = x - px.sx;
+        const float ey = y - px.sy;
+        const float angCoeff = dz / std::sqrt( ex * ex + ey * ey );
+        if( angCoeff > prev )
+        {
+            prev = angCoeff;
+            Vec3 I;
+            if( positions )
+            {
+                const float* p = positions + 4 * t;
+                I = Vec3( p[ 0 ], p[ 1 ], p[ 2 ] ) - wp;
+            }
+            else I = Unproject( *this, x, y, z ) - wp;
+            const float k = Dot( n, Normalize( I ) );
+            if( k > minCosAngle )
+            {
+                occl += k / ( 1.f + px.B * Dot( I, I ) );
+                ++occSteps;
+            }
+        }
+    }
+    return occl / std::max( 1.0f, float( occSteps ) );
+}
+
+//------------------------------------------------------------------------------
+float SSAOCpuKernel::Occlusion( int x, int y ) const
+{
+    SSAOCpuPixel px;
+    if( !SetupPixel( x, y, px ) ) return 0.f;
+    float occ = 0.f;
+    for( int d = 0; d != numDirs; ++d ) occ += March( dirs[ d ], px );
+    return occ / rayNorm;
+}
+
+//------------------------------------------------------------------------------
+float SSAOCpuKernel::Visibility( float occlusion ) const
+{
+    const float t = std::min( std::max( occlusion * occlusionFactor, 0.f ), 1.f );
+    return 1.0f - t * t * ( 3.f - 2.f * t );
+}
+
+//------------------------------------------------------------------------------
+void ComputeTileScalar( const SSAOCpuKernel& k, int x0, int y0, int x1, int y1,
+                        float* occlusion, float* visibility )
+{
+    for( int y = y0; y != y1; ++y )
+    {
+        for( int x = x0; x != x1; ++x )
+        {
+            const float occ = k.Occlusion( x, y );
+            if( occlusion  ) occlusion[ y * k.width + x ] = occ;
+            if( visibility ) visibility[ y * k.width + x ] = k.Visibility( occ );
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+SSAOCpuEngine::SSAOCpuEngine( ThreadPool& pool, int tileSize, ISA isa ) :
+    pool_( pool ), tileSize_( std::max( 1, tileSize ) ), isa_( ISA_SCALAR )
+{
+    SetISA( isa );
+}
+
+//------------------------------------------------------------------------------
+void SSAOCpuEngine::SetISA( ISA isa )
+{
+    if( isa == ISA_AUTO ) isa = GetBestISA();
+    if( !IsISASupported( isa ) ) throw std::runtime_error( std::string( "Unsupported instruction set: " ) + GetISAName( isa ) );
+    isa_ = isa;
+}
+
+//------------------------------------------------------------------------------
+bool SSAOCpuEngine::IsISASupported( ISA isa )
+{
+    return GetTileFunction( isa ) != 0 && CpuSupports( isa );
+}
+
+//------------------------------------------------------------------------------
+SSAOCpuEngine::ISA SSAOCpuEngine::GetBestISA()
+{
+    const ISA isas[] = { ISA_AVX512, ISA_AVX2, ISA_SSE42 };
+    for( int i = 0; i != sizeof( isas ) / sizeof( isas[ 0 ] ); ++i )
+    {
+        if( IsISASupported( isas[ i ] ) ) return isas[ i ];
+    }
+    return ISA_SCALAR;
+}
+
+//------------------------------------------------------------------------------
+const char* SSAOCpuEngine::GetISAName( ISA isa )
+{
+    switch( isa )
+    {
+    case ISA_AUTO:   return "auto";
+    case ISA_SCALAR: return "scalar";
+    case ISA_SSE42:  return "sse4.2";
+    case ISA_AVX2:   return "avx2";
+    case ISA_AVX512: return "avx512";
+    default: return "unknown";
+    }
+}
+
+//------------------------------------------------------------------------------
+void SSAOCpuEngine::Compute( const SSAOCpuGBuffer& gb,
+                             const SSAOParameters& ssaoParams,
+                             float* occlusion,
+                             float* visibility ) const
+{
+    if( !occlusion && !visibility ) return;
+    const SSAOCpuKernel kernel( gb, ssaoParams );
+    TileTask task( kernel, GetTileFunction( isa_ ), tileSize_, occlusion, visibility );
+    pool_.ParallelFor( task.NumTiles(), task );
+}
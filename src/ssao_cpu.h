@@ -0,0 +1,87 @@
+#ifndef SSAO_CPU_H_
+#define SSAO_CPU_H_
+
+#include <osg/Matrixd>
+
+#include "ssao.h"
+#include "thread_pool.h"
+
+//------------------------------------------------------------------------------
+/// Buffers generated by the pre-render camera and read back to memory.
+/// Rows are stored bottom to top as returned by glReadPixels: pixel (x,y)
+/// has window coordinates (x + 0.5, y + 0.5) i.e. gl_FragCoord.xy.
+struct SSAOCpuGBuffer
+{
+    SSAOCpuGBuffer() : width( 0 ), height( 0 ), depth( 0 ), positions( 0 ), normals( 0 ), radius( 1.0f ) {}
+    int width;
+    int height;
+    /// window space depth, one float per pixel (GL_DEPTH_COMPONENT);
+    /// if NULL depth is read from the w component of normals
+    const float* depth;
+    /// optional eye space positions, four floats per pixel ('positions' MRT target);
+    /// if NULL positions are unprojected from depth
+    const float* positions;
+    /// optional eye space normals, four floats per pixel, w = depth ('normals' MRT target);
+    /// if NULL normals are computed from the unprojected neighbours: an
+    /// approximation of the interpolated vertex normals used by the shader
+    const float* normals;
+    /// projection matrix used to render the buffers
+    osg::Matrixd projection;
+    /// object radius: value of the SSAOParameters::ssaoRadiusUniform uniform
+    float radius;
+};
+
+//------------------------------------------------------------------------------
+/// CPU implementation of the horizon tracing algorithm in
+/// ssao_trace_per_frag2_optimal.frag: same direction layout, step sequence,
+/// attenuation and accumulation order, evaluated in single precision so that
+/// results can be compared with the GPU output to within float rounding.
+/// Only G-buffers with normals, i.e. read back in MRT mode (-mrt), are a
+/// reference for the shader: without MRT the shader uses interpolated vertex
+/// normals, which are not in the G-buffer and are approximated here from
+/// depth; comparisons must be restricted to MRT mode.
+/// The image is split into square tiles which are processed in parallel by a
+/// work stealing thread pool.
+/// Pixels in a tile row are processed 4, 8 or 16 at a time when the library
+/// is built with SSE4.2, AVX2 or AVX-512 kernels; the kernel is selected at
+/// runtime and all kernels return the same values as the scalar one.
+/// Mapping of SSAOParameters to shader uniforms:
+/// maxNumSamples -> numSamples, maxRadius -> hwMax, stepMul -> dstep,
+/// dRadius -> dhwidth, occFact -> occlusionFactor, minCosAngle -> minCosAngle.
+class SSAOCpuEngine
+{
+public:
+    /// Instruction set used by the tracing kernel.
+    enum ISA
+    {
+        ISA_AUTO,
+        ISA_SCALAR,
+        ISA_SSE42,
+        ISA_AVX2,
+        ISA_AVX512
+    };
+    /// @param isa kernel selection: ISA_AUTO selects the best one available
+    explicit SSAOCpuEngine( ThreadPool& pool = GetDefaultThreadPool(), int tileSize = 32, ISA isa = ISA_AUTO );
+    /// Compute per pixel occlusion (value returned by ComputeOcclusion()) and
+    /// visibility (1 - smoothstep( 0, 1, occlusion * occlusionFactor )).
+    /// Either output can be NULL; background pixels (depth >= 1) get
+    /// occlusion 0 and visibility 1.
+    void Compute( const SSAOCpuGBuffer& gbuffer,
+                  const SSAOParameters& ssaoParams,
+                  float* occlusion,
+                  float* visibility ) const;
+    int GetTileSize() const { return tileSize_; }
+    /// Throws std::runtime_error if the kernel is not built or not supported by the CPU.
+    void SetISA( ISA isa );
+    ISA GetISA() const { return isa_; }
+    /// True if kernel is compiled in and supported by CPU and OS.
+    static bool IsISASupported( ISA isa );
+    static ISA GetBestISA();
+    static const char* GetISAName( ISA isa );
+private:
+    ThreadPool& pool_;
+    int tileSize_;
+    ISA isa_;
+};
+
+#endif // SSAO_CPU_H_
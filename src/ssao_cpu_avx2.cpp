@@ -0,0 +1,56 @@
+// AVX2 horizon marching kernel: 8 pixels per iteration.
+// Compiled with -mavx2 (/arch:AVX2), selected at runtime by SSAOCpuEngine.
+#include <immintrin.h>
+
+#include "ssao_cpu_kernel.h"
+
+namespace
+{
+
+struct AVX2
+{
+    enum { WIDTH = 8 };
+    typedef __m256 F;
+    typedef __m256i I;
+    typedef __m256 M;
+    static F Set1( float f ) { return _mm256_set1_ps( f ); }
+    static F Load( const float* p ) { return _mm256_loadu_ps( p ); }
+    static void Store( float* p, F a ) { _mm256_storeu_ps( p, a ); }
+    static F Add( F a, F b ) { return _mm256_add_ps( a, b ); }
+    static F Sub( F a, F b ) { return _mm256_sub_ps( a, b ); }
+    static F Mul( F a, F b ) { return _mm256_mul_ps( a, b ); }
+    static F Div( F a, F b ) { return _mm256_div_ps( a, b ); }
+    static F Sqrt( F a ) { return _mm256_sqrt_ps( a ); }
+    static F Min( F a, F b ) { return _mm256_min_ps( a, b ); }
+    static F Max( F a, F b ) { return _mm256_max_ps( a, b ); }
+    static M Gt( F a, F b ) { return _mm256_cmp_ps( a, b, _CMP_GT_OQ ); }
+    static M And( M a, M b ) { return _mm256_and_ps( a, b ); }
+    static bool Any( M m ) { return _mm256_movemask_ps( m ) != 0; }
+    static F Select( M m, F a, F b ) { return _mm256_blendv_ps( b, a, m ); }
+    static I Set1I( int i ) { return _mm256_set1_epi32( i ); }
+    static I FloorToInt( F a ) { return _mm256_cvttps_epi32( _mm256_floor_ps( a ) ); }
+    static I TruncToInt( F a ) { return _mm256_cvttps_epi32( a ); }
+    static I ClampI( I a, I lo, I hi ) { return _mm256_min_epi32( _mm256_max_epi32( a, lo ), hi ); }
+    static I MulI( I a, I b ) { return _mm256_mullo_epi32( a, b ); }
+    static I MulAddI( I a, int b, I c ) { return _mm256_add_epi32( _mm256_mullo_epi32( a, _mm256_set1_epi32( b ) ), c ); }
+    static M LtI( I a, I b ) { return _mm256_castsi256_ps( _mm256_cmpgt_epi32( b, a ) ); }
+    static int MaxI( I a )
+    {
+        __m128i m = _mm_max_epi32( _mm256_castsi256_si128( a ), _mm256_extracti128_si256( a, 1 ) );
+        m = _mm_max_epi32( m, _mm_shuffle_epi32( m, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+        m = _mm_max_epi32( m, _mm_shuffle_epi32( m, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+        return _mm_cvtsi128_si32( m );
+    }
+    static F Gather( const float* base, I idx ) { return _mm256_i32gather_ps( base, idx, 4 ); }
+};
+
+#include "ssao_cpu_simd.h"
+
+}
+
+//------------------------------------------------------------------------------
+void ComputeTileAVX2( const SSAOCpuKernel& k, int x0, int y0, int x1, int y1,
+                      float* occlusion, float* visibility )
+{
+    ComputeTileSimd< AVX2 >( k, x0, y0, x1, y1, occlusion, visibility );
+}
@@ -0,0 +1,50 @@
+// AVX-512 horizon marching kernel: 16 pixels per iteration with mask registers.
+// Compiled with -mavx512f (/arch:AVX512), selected at runtime by SSAOCpuEngine.
+#include <immintrin.h>
+
+#include "ssao_cpu_kernel.h"
+
+namespace
+{
+
+struct AVX512
+{
+    enum { WIDTH = 16 };
+    typedef __m512 F;
+    typedef __m512i I;
+    typedef __mmask16 M;
+    static F Set1( float f ) { return _mm512_set1_ps( f ); }
+    static F Load( const float* p ) { return _mm512_loadu_ps( p ); }
+    static void Store( float* p, F a ) { _mm512_storeu_ps( p, a ); }
+    static F Add( F a, F b ) { return _mm512_add_ps( a, b ); }
+    static F Sub( F a, F b ) { return _mm512_sub_ps( a, b ); }
+    static F Mul( F a, F b ) { return _mm512_mul_ps( a, b ); }
+    static F Div( F a, F b ) { return _mm512_div_ps( a, b ); }
+    static F Sqrt( F a ) { return _mm512_sqrt_ps( a ); }
+    static F Min( F a, F b ) { return _mm512_min_ps( a, b ); }
+    static F Max( F a, F b ) { return _mm512_max_ps( a, b ); }
+    static M Gt( F a, F b ) { return _mm512_cmp_ps_mask( a, b, _CMP_GT_OQ ); }
+    static M And( M a, M b ) { return M( a & b ); }
+    static bool Any( M m ) { return m != 0; }
+    static F Select( M m, F a, F b ) { return _mm512_mask_blend_ps( m, b, a ); }
+    static I Set1I( int i ) { return _mm512_set1_epi32( i ); }
+    static I FloorToInt( F a ) { return _mm512_cvttps_epi32( _mm512_roundscale_ps( a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC ) ); }
+    static I TruncToInt( F a ) { return _mm512_cvttps_epi32( a ); }
+    static I ClampI( I a, I lo, I hi ) { return _mm512_min_epi32( _mm512_max_epi32( a, lo ), hi ); }
+    static I MulI( I a, I b ) { return _mm512_mullo_epi32( a, b ); }
+    static I MulAddI( I a, int b, I c ) { return _mm512_add_epi32( _mm512_mullo_epi32( a, _mm512_set1_epi32( b ) ), c ); }
+    static M LtI( I a, I b ) { return _mm512_cmplt_epi32_mask( a, b ); }
+    static int MaxI( I a ) { return _mm512_reduce_max_epi32( a ); }
+    static F Gather( const float* base, I idx ) { return _mm512_i32gather_ps( idx, base, 4 ); }
+};
+
+#include "ssao_cpu_simd.h"
+
+}
+
+//------------------------------------------------------------------------------
+void ComputeTileAVX512( const SSAOCpuKernel& k, int x0, int y0, int x1, int y1,
+                        float* occlusion, float* visibility )
+{
+    ComputeTileSimd< AVX512 >( k, x0, y0, x1, y1, occlusion, visibility );
+}
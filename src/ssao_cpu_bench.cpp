@@ -0,0 +1,171 @@
+// Throughput of the CPU SSAO kernels: renders a synthetic G-buffer
+// (a lattice of spheres above a plane, similar to a molecule scene) and
+// reports time per frame for every instruction set supported by the CPU.
+// Exits with status 1 if any kernel does not return the scalar kernel results:
+// run as a test by ctest.
+
+#include <osg/ArgumentParser>
+#include <osg/Timer>
+#include <osg/Matrixd>
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "ssao_cpu.h"
+
+//------------------------------------------------------------------------------
+/// Ray cast spheres and ground plane; writes depth, eye space positions and
+/// normals (w = depth) as generated by the pre-render camera in MRT mode.
+void GenerateGBuffer( int width, int height, const osg::Matrixd& proj,
+                      std::vector< float >& depth,
+                      std::vector< float >& positions,
+                      std::vector< float >& normals )
+{
+    depth.assign( width * height, 1.0f );
+    positions.assign( 4 * width * height, 0.0f );
+    normals.assign( 4 * width * height, 0.0f );
+    const osg::Matrixd inv = osg::Matrixd::inverse( proj );
+    const int N = 12;
+    const double r = 0.45;
+    for( int y = 0; y != height; ++y )
+    {
+        for( int x = 0; x != width; ++x )
+        {
+            const int i = y * width + x;
+            normals[ 4 * i + 3 ] = 1.0f;
+            // camera at origin: unprojected far plane point is the ray direction
+            osg::Vec3d d = osg::Vec3d( 2.0 * ( x + 0.5 ) / width - 1.0,
+                                       2.0 * ( y + 0.5 ) / height - 1.0,
+                                       1.0 ) * inv;
+            d.normalize();
+            double tmin = 1e30;
+            osg::Vec3d n;
+            for( int a = 0; a != N; ++a )
+            {
+                for( int b = 0; b != N; ++b )
+                {
+                    const osg::Vec3d c( ( a - N / 2 ) * 0.8, ( ( a + b ) % 3 ) * 0.3 - 1.5, -6.0 - b * 0.8 );
+                    const double bb = d * c;
+                    const double disc = bb * bb - ( c * c - r * r );
+                    if( disc <= 0.0 ) continue;
+                    const double t = bb - std::sqrt( disc );
+                    if( t > 0.0 && t < tmin )
+                    {
+                        tmin = t;
+                        n = ( d * t - c ) / r;
+                    }
+                }
+            }
+            // ground plane y = -2
+            if( d.y() < 0.0 && -2.0 / d.y() < tmin )
+            {
+                tmin = -2.0 / d.y();
+                n = osg::Vec3d( 0.0, 1.0, 0.0 );
+            }
+            if( tmin > 1e29 ) continue;
+            const osg::Vec3d p = d * tmin;
+            const osg::Vec4d c = osg::Vec4d( p, 1.0 ) * proj;
+            const float z = float( c.z() / c.w() * 0.5 + 0.5 );
+            if( z >= 1.0f ) continue;
+            depth[ i ] = z;
+            positions[ 4 * i ] = float( p.x() );
+            positions[ 4 * i + 1 ] = float( p.y() );
+            positions[ 4 * i + 2 ] = float( p.z() );
+            positions[ 4 * i + 3 ] = 1.0f;
+            normals[ 4 * i ] = float( n.x() );
+            normals[ 4 * i + 1 ] = float( n.y() );
+            normals[ 4 * i + 2 ] = float( n.z() );
+            normals[ 4 * i + 3 ] = z;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+int main( int argc, char** argv )
+{
+    osg::ArgumentParser arguments( &argc, argv );
+    arguments.getApplicationUsage()->addCommandLineOption( "-width",  "Buffer width (default 2048)" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-height", "Buffer height (default 2048)" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-frames", "Number of timed frames per kernel (default 5)" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-threads", "Number of threads, 0 = number of processors (default 0)" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-maxNumSamples", "Maximum number of rays (default 16)" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-maxRadius", "Max radius size in steps (default 32)" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-mrt", "Read positions and normals instead of unprojecting depth;\n"
+                                                                   "without it normals are reconstructed from depth (kernel timing only)" );
+    if( arguments.read( "-h" ) || arguments.read( "--help" ) )
+    {
+        arguments.getApplicationUsage()->write( std::cout );
+        return 0;
+    }
+    int width = 2048;
+    int height = 2048;
+    int frames = 5;
+    int threads = 0;
+    SSAOParameters p;
+    p.maxNumSamples = 16;
+    p.dRadius = 0.06f;
+    arguments.read( "-width", width );
+    arguments.read( "-height", height );
+    arguments.read( "-frames", frames );
+    arguments.read( "-threads", threads );
+    arguments.read( "-maxNumSamples", p.maxNumSamples );
+    arguments.read( "-maxRadius", p.maxRadius );
+    const bool mrt = arguments.read( "-mrt" );
+
+    std::vector< float > depth;
+    std::vector< float > positions;
+    std::vector< float > normals;
+    SSAOCpuGBuffer gb;
+    gb.width = width;
+    gb.height = height;
+    gb.projection = osg::Matrixd::perspective( 45.0, double( width ) / height, 1.0, 100.0 );
+    gb.radius = 10.0f;
+    GenerateGBuffer( width, height, gb.projection, depth, positions, normals );
+    if( mrt )
+    {
+        gb.positions = &positions[ 0 ];
+        gb.normals = &normals[ 0 ];
+    }
+    else gb.depth = &depth[ 0 ];
+
+    ThreadPool pool( threads );
+    std::vector< float > reference( width * height );
+    std::vector< float > occlusion( width * height );
+    std::cout << width << 'x' << height << "  threads: " << pool.NumThreads()
+              << "  maxNumSamples: " << p.maxNumSamples << "  maxRadius: " << p.maxRadius
+              << "  mrt: " << std::boolalpha << mrt << '\n';
+    std::cout << "isa        ms/frame    Mpixel/s   speedup   identical\n";
+    const SSAOCpuEngine::ISA isas[] = { SSAOCpuEngine::ISA_SCALAR,
+                                        SSAOCpuEngine::ISA_SSE42,
+                                        SSAOCpuEngine::ISA_AVX2,
+                                        SSAOCpuEngine::ISA_AVX512 };
+    double scalarTime = 0.0;
+    bool allIdentical = true;
+    for( int i = 0; i != sizeof( isas ) / sizeof( isas[ 0 ] ); ++i )
+    {
+        if( !SSAOCpuEngine::IsISASupported( isas[ i ] ) )
+        {
+            std::cout << std::setw( 10 ) << std::left << SSAOCpuEngine::GetISAName( isas[ i ] ) << " not available\n";
+            continue;
+        }
+        SSAOCpuEngine engine( pool, 32, isas[ i ] );
+        std::vector< float >& out = i == 0 ? reference : occlusion;
+        // warm up: page in buffers and start threads
+        engine.Compute( gb, p, &out[ 0 ], 0 );
+        const osg::Timer_t start = osg::Timer::instance()->tick();
+        for( int f = 0; f != frames; ++f ) engine.Compute( gb, p, &out[ 0 ], 0 );
+        const double ms = osg::Timer::instance()->delta_m( start, osg::Timer::instance()->tick() ) / std::max( 1, frames );
+        if( i == 0 ) scalarTime = ms;
+        const bool identical = i == 0 || out == reference;
+        allIdentical = allIdentical && identical;
+        std::cout << std::setw( 10 ) << std::left << SSAOCpuEngine::GetISAName( isas[ i ] ) << std::right << std::fixed
+                  << std::setprecision( 2 ) << std::setw( 10 ) << ms
+                  << std::setw( 12 ) << double( width ) * height / ( ms * 1000.0 )
+                  << std::setw( 10 ) << scalarTime / ms
+                  << std::setw( 12 ) << std::boolalpha << identical << '\n';
+    }
+    return allIdentical ? 0 : 1;
+}
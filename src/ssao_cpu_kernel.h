@@ -0,0 +1,100 @@
+#ifndef SSAO_CPU_KERNEL_H_
+#define SSAO_CPU_KERNEL_H_
+
+// Internal header shared by the scalar and the vectorized CPU SSAO kernels.
+// It is included by translation units compiled with ISA specific flags
+// (-mavx2 etc.): keep it free of inline code, otherwise the linker may pick
+// an AVX version of an inline function for the code run on older CPUs; for
+// the same reason it does not include ssao.h or any OpenSceneGraph header.
+
+#include <vector>
+
+struct SSAOCpuGBuffer;
+struct SSAOParameters;
+
+//------------------------------------------------------------------------------
+/// Sampling direction: general line, horizontal (y = y0) or vertical (x = x0) line.
+struct SSAOCpuDirection
+{
+    enum Type { LINE, HORIZONTAL, VERTICAL };
+    Type type;
+    float dx;
+    float dy;
+};
+
+//------------------------------------------------------------------------------
+/// Per pixel values available to ComputeOcclusion() in the shader.
+struct SSAOCpuPixel
+{
+    /// screen position (gl_FragCoord.xyz)
+    float sx, sy, sz;
+    /// eye space position
+    float wx, wy, wz;
+    /// eye space normal
+    float nx, ny, nz;
+    /// clamped pixel radius and attenuation coefficient
+    float PR, B;
+};
+
+//------------------------------------------------------------------------------
+/// Per frame constants and scalar evaluation of the tracing shader.
+class SSAOCpuKernel
+{
+public:
+    SSAOCpuKernel( const SSAOCpuGBuffer& gb, const SSAOParameters& p );
+    /// Compute per pixel values; returns false for background pixels.
+    bool SetupPixel( int x, int y, SSAOCpuPixel& pixel ) const;
+    /// Occlusion along one direction: occlusion(), hocclusion() and vocclusion().
+    float March( const SSAOCpuDirection& d, const SSAOCpuPixel& pixel ) const;
+    /// ComputeOcclusion().
+    float Occlusion( int x, int y ) const;
+    /// 1 - smoothstep( 0, 1, occlusion * occlusionFactor ).
+    float Visibility( float occlusion ) const;
+
+    int width;
+    int height;
+    float fwidth;
+    float fheight;
+    /// depth[ i * depthStride ] is the depth of pixel i
+    const float* depth;
+    int depthStride;
+    /// optional four components eye space positions and normals
+    const float* positions;
+    const float* normals;
+    /// projection and inverse projection, element (r,c) at index 4 * r + c
+    float proj[ 16 ];
+    float invProj[ 16 ];
+    float numSamples;
+    float hwMax;
+    float dstep;
+    float minCosAngle;
+    float occlusionFactor;
+    /// world space radius: dhwidth * radius
+    float R;
+    /// number of rays used to average occlusion: max( 1, 8 * hw - 2 )
+    float rayNorm;
+    const SSAOCpuDirection* dirs;
+    int numDirs;
+
+private:
+    std::vector< SSAOCpuDirection > dirs_;
+};
+
+//------------------------------------------------------------------------------
+/// Compute occlusion and/or visibility for pixels in [x0,x1) x [y0,y1).
+typedef void ( *SSAOCpuTileFunction )( const SSAOCpuKernel&,
+                                       int x0, int y0, int x1, int y1,
+                                       float* occlusion, float* visibility );
+
+void ComputeTileScalar( const SSAOCpuKernel&, int, int, int, int, float*, float* );
+#ifdef SSAO_CPU_SSE42
+void ComputeTileSSE42( const SSAOCpuKernel&, int, int, int, int, float*, float* );
+#endif
+#ifdef SSAO_CPU_AVX2
+void ComputeTileAVX2( const SSAOCpuKernel&, int, int, int, int, float*, float* );
+#endif
+#ifdef SSAO_CPU_AVX512
+void ComputeTileAVX512( const SSAOCpuKernel&, int, int, int, int, float*, float* );
+#endif
+
+#endif // SSAO_CPU_KERNEL_H_
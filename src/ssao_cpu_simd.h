@@ -0,0 +1,189 @@
+#ifndef SSAO_CPU_SIMD_H_
+#define SSAO_CPU_SIMD_H_
+
+// Vectorized horizon marching, included by the ISA specific translation units
+// ssao_cpu_sse42.cpp, ssao_cpu_avx2.cpp and ssao_cpu_avx512.cpp which provide
+// a traits class S wrapping the intrinsics:
+//   S::WIDTH                     number of lanes
+//   S::F, S::I, S::M             float, int and mask vector types
+//   Set1, Load, Store, Add, Sub, Mul, Div, Sqrt, Min, Max   float ops
+//   Gt, And, Any, Select( m, a, b ) ( = m ? a : b )         mask ops
+//   Set1I, FloorToInt, TruncToInt, ClampI, MulI, MulAddI, LtI, MaxI  int ops
+//   Gather( base, idx )          base[ idx ]
+// Every lane is a pixel; lanes march along the same direction with their own
+// number of steps and stop contributing once their step count is reached.
+// Operations are evaluated in the same order as in SSAOCpuKernel::March so
+// that results are identical to the scalar kernel; the translation units are
+// compiled without floating point contraction (no FMA).
+// This header is included inside an anonymous namespace, after the traits
+// class, so that the instantiation stays local to each translation unit:
+// do not call inline functions or templates shared with other translation
+// units from here.
+
+#include "ssao_cpu_kernel.h"
+
+//------------------------------------------------------------------------------
+template < class S >
+void ComputeTileSimd( const SSAOCpuKernel& k, int x0, int y0, int x1, int y1,
+                      float* occlusion, float* visibility )
+{
+    typedef typename S::F F;
+    typedef typename S::I I;
+    typedef typename S::M M;
+    const int W = S::WIDTH;
+    float sx[ W ], sy[ W ], sz[ W ];
+    float wx[ W ], wy[ W ], wz[ W ];
+    float nx[ W ], ny[ W ], nz[ W ];
+    float pr[ W ], bc[ W ];
+    float out[ W ];
+    bool valid[ W ];
+
+    const F zero = S::Set1( 0.f );
+    const F one = S::Set1( 1.f );
+    const F two = S::Set1( 2.f );
+    const F half = S::Set1( 0.5f );
+    const F three = S::Set1( 3.f );
+    const F minCos = S::Set1( k.minCosAngle );
+    const F fwidth = S::Set1( k.fwidth );
+    const F fheight = S::Set1( k.fheight );
+    F invProj[ 16 ];
+    for( int i = 0; i != 16; ++i ) invProj[ i ] = S::Set1( k.invProj[ i ] );
+    const I wmax = S::Set1I( k.width - 1 );
+    const I hmax = S::Set1I( k.height - 1 );
+    const I izero = S::Set1I( 0 );
+    const I depthStride = S::Set1I( k.depthStride );
+    const I four = S::Set1I( 4 );
+
+    for( int y = y0; y != y1; ++y )
+    {
+        for( int x = x0; x < x1; x += W )
+        {
+            // per pixel setup is scalar: its cost is negligible compared to marching
+            bool anyValid = false;
+            for( int l = 0; l != W; ++l )
+            {
+                SSAOCpuPixel p;
+                valid[ l ] = x + l < x1 && k.SetupPixel( x + l, y, p );
+                if( !valid[ l ] )
+                {
+                    // zero radius: no steps taken
+                    p.sx = p.sy = p.sz = p.wx = p.wy = p.wz = p.nx = p.ny = p.nz = 0.f;
+                    p.PR = p.B = 0.f;
+                }
+                anyValid = anyValid || valid[ l ];
+                sx[ l ] = p.sx; sy[ l ] = p.sy; sz[ l ] = p.sz;
+                wx[ l ] = p.wx; wy[ l ] = p.wy; wz[ l ] = p.wz;
+                nx[ l ] = p.nx; ny[ l ] = p.ny; nz[ l ] = p.nz;
+                pr[ l ] = p.PR; bc[ l ] = p.B;
+            }
+            F occ = zero;
+            if( anyValid )
+            {
+                const F SX = S::Load( sx ), SY = S::Load( sy ), SZ = S::Load( sz );
+                const F WX = S::Load( wx ), WY = S::Load( wy ), WZ = S::Load( wz );
+                const F NX = S::Load( nx ), NY = S::Load( ny ), NZ = S::Load( nz );
+                const F PR = S::Load( pr ), B = S::Load( bc );
+                for( int d = 0; d != k.numDirs; ++d )
+                {
+                    const SSAOCpuDirection& dir = k.dirs[ d ];
+                    float stepX = 0.f;
+                    float stepY = 0.f;
+                    I upper;
+                    if( dir.type == SSAOCpuDirection::LINE )
+                    {
+                        const float m = dir.dy / dir.dx;
+                        const float absStep = k.dstep < 0.f ? -k.dstep : k.dstep;
+                        const F invLen = S::Div( one, S::Sqrt( S::Set1( 1.0f + m * m ) ) );
+                        upper = S::TruncToInt( S::Div( S::Mul( PR, invLen ), S::Set1( absStep ) ) );
+                        stepX = ( dir.dx > 0.f ? 1.0f : -1.0f ) * k.dstep;
+                        stepY = stepX * m;
+                    }
+                    else
+                    {
+                        const float ds = dir.type == SSAOCpuDirection::HORIZONTAL ? dir.dx : dir.dy;
+                        upper = S::TruncToInt( S::Div( PR, S::Set1( ds < 0.f ? -ds : ds ) ) );
+                        stepX = dir.dx;
+                        stepY = dir.dy;
+                    }
+                    const int maxUpper = S::MaxI( upper );
+                    const F stx = S::Set1( stepX );
+                    const F sty = S::Set1( stepY );
+                    F px = SX;
+                    F py = SY;
+                    F prev = zero;
+                    F occl = zero;
+                    F occSteps = zero;
+                    for( int i = 0; i < maxUpper; ++i )
+                    {
+                        px = S::Add( px, stx );
+                        py = S::Add( py, sty );
+                        const M active = S::LtI( S::Set1I( i ), upper );
+                        const I tx = S::ClampI( S::FloorToInt( px ), izero, wmax );
+                        const I ty = S::ClampI( S::FloorToInt( py ), izero, hmax );
+                        const I t = S::MulAddI( ty, k.width, tx );
+                        const F z = S::Gather( k.depth, S::MulI( t, depthStride ) );
+                        const F dz = S::Sub( SZ, z );
+                        const F ex = S::Sub( px, SX );
+                        const F ey = S::Sub( py, SY );
+                        const F angCoeff = S::Div( dz, S::Sqrt( S::Add( S::Mul( ex, ex ), S::Mul( ey, ey ) ) ) );
+                        const M hit = S::And( active, S::Gt( angCoeff, prev ) );
+                        if( !S::Any( hit ) ) continue;
+                        prev = S::Select( hit, angCoeff, prev );
+                        F ix, iy, iz;
+                        if( k.positions )
+                        {
+                            const I t4 = S::MulI( t, four );
+                            ix = S::Sub( S::Gather( k.positions, t4 ), WX );
+                            iy = S::Sub( S::Gather( k.positions + 1, t4 ), WY );
+                            iz = S::Sub( S::Gather( k.positions + 2, t4 ), WZ );
+                        }
+                        else
+                        {
+                            // ssUnproject()
+                            const F v0 = S::Mul( S::Sub( S::Div( px, fwidth ), half ), two );
+                            const F v1 = S::Mul( S::Sub( S::Div( py, fheight ), half ), two );
+                            const F v2 = S::Mul( S::Sub( z, half ), two );
+                            F p[ 4 ];
+                            for( int c = 0; c != 4; ++c )
+                            {
+                                p[ c ] = S::Add( S::Add( S::Add( S::Mul( v0, invProj[ c ] ),
+                                                                 S::Mul( v1, invProj[ 4 + c ] ) ),
+                                                         S::Mul( v2, invProj[ 8 + c ] ) ),
+                                                 S::Mul( one, invProj[ 12 + c ] ) );
+                            }
+                            ix = S::Sub( S::Div( p[ 0 ], p[ 3 ] ), WX );
+                            iy = S::Sub( S::Div( p[ 1 ], p[ 3 ] ), WY );
+                            iz = S::Sub( S::Div( p[ 2 ], p[ 3 ] ), WZ );
+                        }
+                        const F dotII = S::Add( S::Add( S::Mul( ix, ix ), S::Mul( iy, iy ) ), S::Mul( iz, iz ) );
+                        const F len = S::Sqrt( dotII );
+                        const F kc = S::Add( S::Add( S::Mul( NX, S::Div( ix, len ) ),
+                                                     S::Mul( NY, S::Div( iy, len ) ) ),
+                                             S::Mul( NZ, S::Div( iz, len ) ) );
+                        const M contrib = S::And( hit, S::Gt( kc, minCos ) );
+                        const F term = S::Div( kc, S::Add( one, S::Mul( B, dotII ) ) );
+                        occl = S::Select( contrib, S::Add( occl, term ), occl );
+                        occSteps = S::Select( contrib, S::Add( occSteps, one ), occSteps );
+                    }
+                    occ = S::Add( occ, S::Div( occl, S::Max( one, occSteps ) ) );
+                }
+                occ = S::Div( occ, S::Set1( k.rayNorm ) );
+            }
+            const int n = x1 - x < W ? x1 - x : W;
+            if( occlusion )
+            {
+                S::Store( out, occ );
+                for( int l = 0; l != n; ++l ) occlusion[ y * k.width + x + l ] = valid[ l ] ? out[ l ] : 0.f;
+            }
+            if( visibility )
+            {
+                // 1 - smoothstep( 0, 1, occlusion * occlusionFactor )
+                const F t = S::Min( S::Max( S::Mul( occ, S::Set1( k.occlusionFactor ) ), zero ), one );
+                S::Store( out, S::Sub( one, S::Mul( S::Mul( t, t ), S::Sub( three, S::Mul( two, t ) ) ) ) );
+                for( int l = 0; l != n; ++l ) visibility[ y * k.width + x + l ] = valid[ l ] ? out[ l ] : 1.f;
+            }
+        }
+    }
+}
+
+#endif // SSAO_CPU_SIMD_H_
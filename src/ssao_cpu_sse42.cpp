@@ -0,0 +1,61 @@
+// SSE4.2 horizon marching kernel: 4 pixels per iteration, gathers are emulated.
+// Compiled with -msse4.2, selected at runtime by SSAOCpuEngine.
+#include <nmmintrin.h>
+
+#include "ssao_cpu_kernel.h"
+
+namespace
+{
+
+struct SSE42
+{
+    enum { WIDTH = 4 };
+    typedef __m128 F;
+    typedef __m128i I;
+    typedef __m128 M;
+    static F Set1( float f ) { return _mm_set1_ps( f ); }
+    static F Load( const float* p ) { return _mm_loadu_ps( p ); }
+    static void Store( float* p, F a ) { _mm_storeu_ps( p, a ); }
+    static F Add( F a, F b ) { return _mm_add_ps( a, b ); }
+    static F Sub( F a, F b ) { return _mm_sub_ps( a, b ); }
+    static F Mul( F a, F b ) { return _mm_mul_ps( a, b ); }
+    static F Div( F a, F b ) { return _mm_div_ps( a, b ); }
+    static F Sqrt( F a ) { return _mm_sqrt_ps( a ); }
+    static F Min( F a, F b ) { return _mm_min_ps( a, b ); }
+    static F Max( F a, F b ) { return _mm_max_ps( a, b ); }
+    static M Gt( F a, F b ) { return _mm_cmpgt_ps( a, b ); }
+    static M And( M a, M b ) { return _mm_and_ps( a, b ); }
+    static bool Any( M m ) { return _mm_movemask_ps( m ) != 0; }
+    static F Select( M m, F a, F b ) { return _mm_blendv_ps( b, a, m ); }
+    static I Set1I( int i ) { return _mm_set1_epi32( i ); }
+    static I FloorToInt( F a ) { return _mm_cvttps_epi32( _mm_floor_ps( a ) ); }
+    static I TruncToInt( F a ) { return _mm_cvttps_epi32( a ); }
+    static I ClampI( I a, I lo, I hi ) { return _mm_min_epi32( _mm_max_epi32( a, lo ), hi ); }
+    static I MulI( I a, I b ) { return _mm_mullo_epi32( a, b ); }
+    static I MulAddI( I a, int b, I c ) { return _mm_add_epi32( _mm_mullo_epi32( a, _mm_set1_epi32( b ) ), c ); }
+    static M LtI( I a, I b ) { return _mm_castsi128_ps( _mm_cmplt_epi32( a, b ) ); }
+    static int MaxI( I a )
+    {
+        I m = _mm_max_epi32( a, _mm_shuffle_epi32( a, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+        m = _mm_max_epi32( m, _mm_shuffle_epi32( m, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+        return _mm_cvtsi128_si32( m );
+    }
+    static F Gather( const float* base, I idx )
+    {
+        return _mm_setr_ps( base[ _mm_cvtsi128_si32( idx ) ],
+                            base[ _mm_extract_epi32( idx, 1 ) ],
+                            base[ _mm_extract_epi32( idx, 2 ) ],
+                            base[ _mm_extract_epi32( idx, 3 ) ] );
+    }
+};
+
+#include "ssao_cpu_simd.h"
+
+}
+
+//------------------------------------------------------------------------------
+void ComputeTileSSE42( const SSAOCpuKernel& k, int x0, int y0, int x1, int y1,
+                       float* occlusion, float* visibility )
+{
+    ComputeTileSimd< SSE42 >( k, x0, y0, x1, y1, occlusion, visibility );
+}
@@ -0,0 +1,159 @@
+#include "thread_pool.h"
+
+#include <OpenThreads/ScopedLock>
+
+typedef OpenThreads::ScopedLock< OpenThreads::Mutex > ScopedLock;
+
+//------------------------------------------------------------------------------
+/// Worker thread: forwards execution to ThreadPool::WorkerLoop.
+class ThreadPool::Worker : public OpenThreads::Thread
+{
+public:
+    Worker( ThreadPool* pool, int threadIndex ) : pool_( pool ), threadIndex_( threadIndex ) {}
+    void run() { pool_->WorkerLoop( threadIndex_ ); }
+private:
+    ThreadPool* pool_;
+    int threadIndex_;
+};
+
+//------------------------------------------------------------------------------
+ThreadPool::ThreadPool( int numThreads ) : task_( 0 ), generation_( 0 ), busyWorkers_( 0 ), quit_( false )
+{
+    if( numThreads <= 0 ) numThreads = OpenThreads::GetNumberOfProcessors();
+    if( numThreads <= 0 ) numThreads = 1;
+    ranges_.resize( numThreads );
+    for( int t = 0; t != numThreads; ++t ) ranges_[ t ] = new Range;
+    // thread 0 is the thread invoking ParallelFor
+    for( int t = 1; t != numThreads; ++t )
+    {
+        workers_.push_back( new Worker( this, t ) );
+        workers_.back()->start();
+    }
+}
+
+//------------------------------------------------------------------------------
+ThreadPool::~ThreadPool()
+{
+    {
+        ScopedLock lock( mutex_ );
+        quit_ = true;
+        jobCondition_.broadcast();
+    }
+    for( std::vector< Worker* >::iterator w = workers_.begin(); w != workers_.end(); ++w )
+    {
+        ( *w )->join();
+        delete *w;
+    }
+    for( std::vector< Range* >::iterator r = ranges_.begin(); r != ranges_.end(); ++r ) delete *r;
+}
+
+//------------------------------------------------------------------------------
+void ThreadPool::ParallelFor( int numTasks, ParallelTask& task )
+{
+    if( numTasks <= 0 ) return;
+    const int n = NumThreads();
+    if( n == 1 || numTasks == 1 )
+    {
+        for( int i = 0; i != numTasks; ++i ) task.Run( i, 0 );
+        return;
+    }
+    // all workers are idle here: ranges can be reset without contention
+    for( int t = 0; t != n; ++t )
+    {
+        ScopedLock lock( ranges_[ t ]->mutex );
+        ranges_[ t ]->begin = int( ( long long )( numTasks ) * t / n );
+        ranges_[ t ]->end   = int( ( long long )( numTasks ) * ( t + 1 ) / n );
+    }
+    {
+        ScopedLock lock( mutex_ );
+        task_ = &task;
+        busyWorkers_ = n - 1;
+        ++generation_;
+        jobCondition_.broadcast();
+    }
+    Execute( 0 );
+    ScopedLock lock( mutex_ );
+    while( busyWorkers_ > 0 ) doneCondition_.wait( &mutex_ );
+    task_ = 0;
+}
+
+//------------------------------------------------------------------------------
+void ThreadPool::WorkerLoop( int threadIndex )
+{
+    unsigned int seenGeneration = 0;
+    while( true )
+    {
+        {
+            ScopedLock lock( mutex_ );
+            while( !quit_ && generation_ == seenGeneration ) jobCondition_.wait( &mutex_ );
+            if( quit_ ) return;
+            seenGeneration = generation_;
+        }
+        Execute( threadIndex );
+        ScopedLock lock( mutex_ );
+        if( --busyWorkers_ == 0 ) doneCondition_.signal();
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Run tasks from own range, then steal from other threads until no work is left.
+void ThreadPool::Execute( int threadIndex )
+{
+    ParallelTask* task = 0;
+    {
+        ScopedLock lock( mutex_ );
+        task = task_;
+    }
+    int taskIndex = 0;
+    do
+    {
+        while( Pop( threadIndex, taskIndex ) ) task->Run( taskIndex, threadIndex );
+    }
+    while( Steal( threadIndex ) );
+}
+
+//------------------------------------------------------------------------------
+bool ThreadPool::Pop( int threadIndex, int& taskIndex )
+{
+    Range& r = *ranges_[ threadIndex ];
+    ScopedLock lock( r.mutex );
+    if( r.begin == r.end ) return false;
+    taskIndex = r.begin++;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+/// Move the upper half of the first non empty range found into the range of
+/// the calling thread; victims are scanned starting from the next thread to
+/// spread thieves across victims.
+bool ThreadPool::Steal( int threadIndex )
+{
+    const int n = NumThreads();
+    for( int i = 1; i != n; ++i )
+    {
+        Range& victim = *ranges_[ ( threadIndex + i ) % n ];
+        int begin = 0;
+        int end = 0;
+        {
+            ScopedLock lock( victim.mutex );
+            const int remaining = victim.end - victim.begin;
+            if( remaining <= 0 ) continue;
+            begin = victim.begin + remaining / 2;
+            end = victim.end;
+            victim.end = begin;
+        }
+        Range& own = *ranges_[ threadIndex ];
+        ScopedLock lock( own.mutex );
+        own.begin = begin;
+        own.end = end;
+        return true;
+    }
+    return false;
+}
+
+//------------------------------------------------------------------------------
+ThreadPool& GetDefaultThreadPool()
+{
+    static ThreadPool pool;
+    return pool;
+}
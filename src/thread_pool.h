@@ -0,0 +1,78 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <vector>
+
+#include <OpenThreads/Thread>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/Condition>
+
+//------------------------------------------------------------------------------
+/// Unit of work executed by ThreadPool::ParallelFor.
+class ParallelTask
+{
+public:
+    /// @param taskIndex index of task in [0, number of tasks)
+    /// @param threadIndex index of executing thread in [0, ThreadPool::NumThreads())
+    virtual void Run( int taskIndex, int threadIndex ) = 0;
+    virtual ~ParallelTask() {}
+};
+
+//------------------------------------------------------------------------------
+/// Persistent pool of worker threads with work stealing.
+/// Each ParallelFor call splits the task index range into one contiguous
+/// chunk per thread; threads consume their own chunk from the front and
+/// when done steal the upper half of the first non empty chunk left in other
+/// threads, scanning from the next thread.
+/// Contiguous chunks preserve locality (e.g. neighbouring image tiles),
+/// stealing keeps all cores busy when task costs are uneven.
+/// The calling thread participates as thread 0.
+class ThreadPool
+{
+public:
+    /// @param numThreads total number of threads including the calling one;
+    ///        if <= 0 the number of processors is used
+    explicit ThreadPool( int numThreads = 0 );
+    ~ThreadPool();
+    int NumThreads() const { return int( ranges_.size() ); }
+    /// Execute task.Run( i, thread ) for every i in [0, numTasks) and wait for completion.
+    /// Not reentrant: ParallelFor must not be invoked from within a task.
+    void ParallelFor( int numTasks, ParallelTask& task );
+
+private:
+    class Worker;
+    friend class Worker;
+
+    /// Range of task indices still to be executed by one thread.
+    struct Range
+    {
+        Range() : begin( 0 ), end( 0 ) {}
+        OpenThreads::Mutex mutex;
+        int begin;
+        int end;
+    };
+
+    void Execute( int threadIndex );
+    bool Pop( int threadIndex, int& taskIndex );
+    bool Steal( int threadIndex );
+    void WorkerLoop( int threadIndex );
+
+    ThreadPool( const ThreadPool& );
+    ThreadPool& operator=( const ThreadPool& );
+
+    std::vector< Range* > ranges_;
+    std::vector< Worker* > workers_;
+    // job state, protected by mutex_
+    OpenThreads::Mutex mutex_;
+    OpenThreads::Condition jobCondition_;
+    OpenThreads::Condition doneCondition_;
+    ParallelTask* task_;
+    unsigned int generation_;
+    int busyWorkers_;
+    bool quit_;
+};
+
+/// Returns process-wide pool sized to the number of processors.
+ThreadPool& GetDefaultThreadPool();
+
+#endif // THREAD_POOL_H_